@@ -38,7 +38,7 @@ gw_group_new (const gchar *group_id)
   self = g_slice_new0 (GwGroup);
   self->group_id = group_id;
   self->ref_count = 1;
-  self->gw = gw_radix_tree_new ();
+  self->gw = gw_radix_tree_new_set ();
 
   return self;
 }
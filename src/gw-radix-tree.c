@@ -16,12 +16,26 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "config.h"
 #include "gw-radix-tree.h"
 
-#include <emmintrin.h>
 #include <stdio.h>
 #include <string.h>
 
+#ifdef GW_RADIX_TREE_COMPRESSED_POINTERS
+#include <errno.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_TARGET 1
+#endif
+
 /**
  * SECTION:gw-radix-tree
  * @short_title:adaptive radix tree designed for general usage
@@ -34,40 +48,119 @@
  *
  * #GwRadixTree supports deleting keys with a destroy function, see gw_radix_tree_new_with_free_func().
  * The free function is called on the data assigned to the key only if it's non-%NULL.
+ *
+ * When libgwords is built with the compressed_pointers option, nodes store their
+ * children as 32-bit offsets instead of pointers, which makes them close to half
+ * as big. All trees of the process then share 4 GiB of memory for their nodes and
+ * keys, and set trees only embed keys of up to 2 bytes.
  */
 
 #define MAX_PREFIX_LEN 8
 
 #define NODE_4         1
 #define NODE_16        2
-#define NODE_48        3
-#define NODE_256       4
+#define NODE_32        3
+#define NODE_48        4
+#define NODE_256       5
 
 #define IS_LEAF(x)     (((guintptr) x & 1))
 #define SET_LEAF(x)    ((gpointer)((guintptr) x | 1))
 #define LEAF_RAW(x)    ((Leaf*)((gpointer)((guintptr) x & ~1)))
 #define LEAF_KEY(x)    (G_STRUCT_MEMBER_P (x, G_STRUCT_OFFSET (Leaf, key)))
 
+/*
+ * Set trees embed short keys without a value in the tagged pointer
+ * itself. The byte holding the tag bits stores the key length, and the
+ * other bytes the key, followed by a NUL, so the key can be read in
+ * place from wherever the pointer is stored. Only the bytes that fit in
+ * a child slot are used, see NodeRef.
+ */
+#define IS_EMBEDDED(x)       (((guintptr) x & 3) == 3)
+#define EMBEDDED_MAX_LEN     ((gint) sizeof (NodeRef) - 2)
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define EMBEDDED_TAG_OFFSET  0
+#define EMBEDDED_KEY_OFFSET  1
+#else
+#define EMBEDDED_TAG_OFFSET  (sizeof (gpointer) - 1)
+#define EMBEDDED_KEY_OFFSET  (sizeof (gpointer) - sizeof (NodeRef))
+#endif
+
+#define EMBEDDED_KEY(ref)    ((const guchar*) (ref) + EMBEDDED_KEY_OFFSET)
+#define EMBEDDED_LEN(x)      ((gint) (((guintptr) x & 0xff) >> 2))
+
 /*
  * This struct is included as part
- * of all the various node sizes
+ * of all the various node sizes. Concurrent
+ * trees keep the version of the node in it,
+ * and counted trees the number of keys below.
  */
 typedef struct
 {
   guint16             type;
   guint16             num_children;
   guint32             partial_len;
+  gint                ref_count;
+  union {
+    gint              version;
+    guint32           n_keys;
+  };
   guchar              partial[MAX_PREFIX_LEN];
 } Node;
 
+/*
+ * Children are stored as a NodeRef, which is a plain pointer unless
+ * the library is built with compressed pointers. Then nodes and leaves
+ * all live in a single reserved address range, the cage, and children
+ * are 32-bit offsets into it, keeping the tag bits of the pointer.
+ * Embedded keys are kept as they are, so they only have 2 bytes there.
+ */
+#ifdef GW_RADIX_TREE_COMPRESSED_POINTERS
+
+typedef guint32 NodeRef;
+
+#define CAGE_SIZE          ((gsize) G_MAXUINT32 + 1)
+
+static guchar *cage_base;
+
+static inline Node*
+cage_deref (NodeRef ref)
+{
+  if (!ref || IS_EMBEDDED (ref))
+    return (Node*) (guintptr) ref;
+
+  return (Node*) (cage_base + ref);
+}
+
+static inline NodeRef
+cage_ref (Node *n)
+{
+  if (!n || IS_EMBEDDED (n))
+    return (NodeRef) (guintptr) n;
+
+  return (NodeRef) ((guchar*) n - cage_base);
+}
+
+#define DEREF(ref)         cage_deref (ref)
+#define REF(n)             cage_ref (n)
+
+#else
+
+typedef Node *NodeRef;
+
+#define DEREF(ref)         (ref)
+#define REF(n)             (n)
+
+#endif
+
 /*
  * Small node with only 4 children
  */
-typedef struct __attribute__ ((packed))
+typedef struct
 {
   Node                n;
   guchar              keys[4];
-  Node               *children[4];
+  NodeRef             children[4];
 } Node4;
 
 /*
@@ -77,9 +170,19 @@ typedef struct
 {
   Node                n;
   guchar              keys[16];
-  Node               *children[16];
+  NodeRef             children[16];
 } Node16;
 
+/*
+ * Node with 32 children
+ */
+typedef struct
+{
+  Node                n;
+  guchar              keys[32];
+  NodeRef             children[32];
+} Node32;
+
 /*
  * Node with 48 children, but
  * a full 256 byte field.
@@ -88,7 +191,7 @@ typedef struct
 {
   Node                n;
   guchar              keys[256];
-  Node               *children[48];
+  NodeRef             children[48];
 } Node48;
 
 /*
@@ -97,33 +200,267 @@ typedef struct
 typedef struct
 {
   Node                n;
-  Node               *children[256];
+  NodeRef             children[256];
 } Node256;
 
 /**
  * Represents a leaf. These are
  * of arbitrary size, as they include the key.
+ * Trees with numeric values keep a number
+ * instead of the value, see
+ * gw_radix_tree_enable_uint64_values().
  */
 typedef struct
 {
-  gpointer            value;
+  union {
+    gpointer          value;
+    guint64           number;
+  };
   guint32             key_len;
+  gint                ref_count;
   guchar              key;
 } Leaf;
 
-G_STATIC_ASSERT (sizeof (Node)    == 16);
-G_STATIC_ASSERT (sizeof (Node4)   == 52);
-G_STATIC_ASSERT (sizeof (Node16)  == 160);
-G_STATIC_ASSERT (sizeof (Node48)  == 656);
-G_STATIC_ASSERT (sizeof (Node256) == 2064);
+/* Room for a leaf holding an embedded key, see leaf_view() */
+typedef union
+{
+  Leaf                leaf;
+  guchar              data[G_STRUCT_OFFSET (Leaf, key) + sizeof (gpointer)];
+} LeafView;
+
+G_STATIC_ASSERT (sizeof (Node)    == 24);
+
+#ifdef GW_RADIX_TREE_COMPRESSED_POINTERS
+G_STATIC_ASSERT (sizeof (Node4)   == 44);
+G_STATIC_ASSERT (sizeof (Node16)  == 104);
+G_STATIC_ASSERT (sizeof (Node32)  == 184);
+G_STATIC_ASSERT (sizeof (Node48)  == 472);
+G_STATIC_ASSERT (sizeof (Node256) == 1048);
+#else
+G_STATIC_ASSERT (sizeof (Node4)   == 64);
+G_STATIC_ASSERT (sizeof (Node16)  == 168);
+G_STATIC_ASSERT (sizeof (Node32)  == 312);
+G_STATIC_ASSERT (sizeof (Node48)  == 664);
+G_STATIC_ASSERT (sizeof (Node256) == 2072);
+#endif
+
+/* Child slots are passed around as plain NodeRef pointers, and accessed atomically */
+G_STATIC_ASSERT (G_STRUCT_OFFSET (Node4, children) % sizeof (NodeRef) == 0);
+G_STATIC_ASSERT (G_STRUCT_OFFSET (Node16, children) % sizeof (NodeRef) == 0);
+G_STATIC_ASSERT (G_STRUCT_OFFSET (Node32, children) % sizeof (NodeRef) == 0);
+G_STATIC_ASSERT (G_STRUCT_OFFSET (Node48, children) % sizeof (NodeRef) == 0);
+G_STATIC_ASSERT (G_STRUCT_OFFSET (Node256, children) % sizeof (NodeRef) == 0);
+
+/* Key bytes and compressed paths are read a word at a time, see bytes_load() */
+G_STATIC_ASSERT (G_STRUCT_OFFSET (Node, partial) % sizeof (guint32) == 0);
+G_STATIC_ASSERT (G_STRUCT_OFFSET (Node4, keys) % sizeof (guint32) == 0);
+G_STATIC_ASSERT (G_STRUCT_OFFSET (Node16, keys) % sizeof (guint32) == 0);
+G_STATIC_ASSERT (G_STRUCT_OFFSET (Node32, keys) % sizeof (guint32) == 0);
+
+/*
+ * Lookups of concurrent trees read nodes while writers modify them, and
+ * only trust what they read once the version of the node is validated.
+ * Each child slot, key byte, child count and compressed path must still
+ * be read whole, so writers store them atomically, in every tree. That's
+ * as cheap as a plain store, since relaxed ordering is enough: versions
+ * order these accesses with the rest.
+ */
+typedef guint32 __attribute__ ((may_alias)) NodeWord;
+
+static inline Node*
+child_load (const NodeRef *slot)
+{
+  return DEREF (__atomic_load_n (slot, __ATOMIC_RELAXED));
+}
+
+static inline void
+child_store (NodeRef *slot,
+             Node    *child)
+{
+  __atomic_store_n (slot, REF (child), __ATOMIC_RELAXED);
+}
+
+static inline void
+byte_store (guchar *dest,
+            guchar  c)
+{
+  __atomic_store_n (dest, c, __ATOMIC_RELAXED);
+}
+
+/* Same as memmove(), with atomic stores */
+static inline void
+bytes_store (guchar       *dest,
+             const guchar *src,
+             gsize         n_bytes)
+{
+  gsize i;
+
+  if (dest < src)
+    {
+      for (i = 0; i < n_bytes; i++)
+        byte_store (dest + i, src[i]);
+    }
+  else
+    {
+      for (i = n_bytes; i > 0; i--)
+        byte_store (dest + i - 1, src[i - 1]);
+    }
+}
+
+/* Copies @n_bytes, a multiple of 4, from the word-aligned @src */
+static inline void
+bytes_load (guchar       *dest,
+            const guchar *src,
+            gsize         n_bytes)
+{
+  gsize i;
+
+  for (i = 0; i < n_bytes; i += sizeof (NodeWord))
+    {
+      NodeWord word = __atomic_load_n ((const NodeWord*) (src + i), __ATOMIC_RELAXED);
+
+      memcpy (dest + i, &word, sizeof (NodeWord));
+    }
+}
+
+static inline void
+num_children_add (Node *n,
+                  gint  delta)
+{
+  __atomic_store_n (&n->num_children, n->num_children + delta, __ATOMIC_RELAXED);
+}
+
+static inline void
+partial_len_add (Node *n,
+                 gint  delta)
+{
+  __atomic_store_n (&n->partial_len, n->partial_len + delta, __ATOMIC_RELAXED);
+}
+
+
+#define ITER_STACK_SIZE 32
+
+/*
+ * The real layout of GwRadixTreeIter. The path from the root to
+ * the current leaf is kept in a ring buffer, so only the deepest
+ * ITER_STACK_SIZE levels are stored; shallower levels are rebuilt
+ * from the root when the iterator climbs above them.
+ */
+typedef struct
+{
+  GwRadixTree        *tree;
+  Node               *leaf;
+  guint               stamp;
+  guint               depth;
+  guint               n_stacked;
+  gboolean            pending;
+  Node               *nodes[ITER_STACK_SIZE];
+  guint8              positions[ITER_STACK_SIZE];
+} RealIter;
+
+G_STATIC_ASSERT (sizeof (RealIter) == sizeof (GwRadixTreeIter));
+
+
+#define ARENA_CHUNK_SIZE   (64 * 1024)
+#define ARENA_ALIGNMENT    8
+#define ARENA_ALIGN(x)     (((x) + ARENA_ALIGNMENT - 1) & ~((gsize) ARENA_ALIGNMENT - 1))
+#define ARENA_N_FREE_LISTS (ARENA_ALIGN (sizeof (Node256)) / ARENA_ALIGNMENT + 1)
+#define ARENA_CHUNK_DATA(c) ((guchar*) (c) + sizeof (ArenaChunk))
+
+#define LEAF_SIZE(key_len) (G_STRUCT_OFFSET (Leaf, key) + ((key_len) + 1) * sizeof (guchar))
+
+typedef struct _ArenaChunk ArenaChunk;
+
+struct _ArenaChunk
+{
+  ArenaChunk         *next;
+  gsize               size;
+};
+
+typedef struct
+{
+  gint                ref_count;
+  GMutex              mutex;
+  ArenaChunk         *chunks;
+  guchar             *cursor;
+  gsize               remaining;
+  gsize               allocated;
+  gpointer            free_lists[ARENA_N_FREE_LISTS];
+} Arena;
+
+
+/*
+ * Concurrent trees use optimistic lock coupling. The version of a node
+ * is bumped by every writer that modifies it, and the two lowest bits
+ * flag a locked node, and a node that was unlinked from the tree.
+ */
+#define VERSION_OBSOLETE   0x1
+#define VERSION_LOCKED     0x2
 
+#define N_READER_SHARDS    16
+
+/* How many blocks a shard retires before trying to advance the epoch */
+#define RETIRE_BATCH       64
+
+/*
+ * Epochs count modulo 6, which keeps both the parity of the reader
+ * counters and the limbo list of each epoch right when they wrap.
+ */
+#define N_EPOCHS           6
+
+typedef struct
+{
+  gpointer            block;
+  gpointer            value;
+} Retired;
+
+/*
+ * Keep the reader counters and limbo lists of each shard in their own
+ * cache line. The mutex only guards the limbo lists.
+ */
+typedef struct
+{
+  gint                counts[2];
+  GMutex              mutex;
+  GArray             *limbo[3];
+  guint               n_retired;
+  guint8              padding[20];
+} ReaderShard;
+
+typedef struct
+{
+  gint                epoch;
+  GMutex              mutex;
+  GArray             *reclaimed;
+  ReaderShard         shards[N_READER_SHARDS];
+} Epochs;
+
+/*
+ * The block of a frozen tree, see gw_radix_tree_freeze(). Vector loads
+ * of key bytes may read up to FROZEN_PADDING bytes past the last item.
+ */
+typedef struct
+{
+  gsize               n_bytes;
+  guint32             root;
+  guint32             padding;
+  guchar              data[];
+} Frozen;
 
 struct _GwRadixTree
 {
   guint               ref_count;
-  Node               *root;
+  guint               stamp;
+  NodeRef             root;
   guint64             size;
   GDestroyNotify      destroy_func;
+  Arena              *arena;
+  Epochs             *epochs;
+  gboolean            embed_keys;
+  gboolean            compact_leaves;
+  gboolean            counted;
+  gboolean            uint64_values;
+  Frozen             *frozen;
 };
 
 G_DEFINE_BOXED_TYPE (GwRadixTree, gw_radix_tree, gw_radix_tree_ref, gw_radix_tree_unref)
@@ -159,1437 +496,10078 @@ get_values_cb (const gchar *key,
   return GW_RADIX_TREE_ITER_CONTINUE;
 }
 
+typedef struct
+{
+  GByteArray         *keys;
+  GArray             *offsets;
+  GPtrArray          *values;
+  gboolean            overflow;
+} PackedExport;
 
-/*
- * Node creation and destruction
- */
-static gpointer
-node_new (guint8 type)
+static gboolean
+export_packed_cb (const gchar *key,
+                  gsize        key_length,
+                  gpointer     value,
+                  gpointer     user_data)
 {
-  Node* n;
+  PackedExport *export = user_data;
+  guint32 offset;
 
-  switch (type)
+  /* Offsets are 32 bits wide, including the one past the last key */
+  if (export->keys->len + key_length + 1 > G_MAXUINT32)
     {
-    case NODE_4:
-      n = g_malloc0 (sizeof (Node4));
-      break;
-
-    case NODE_16:
-      n = g_malloc0 (sizeof (Node16));
-      break;
+      export->overflow = TRUE;
+      return GW_RADIX_TREE_ITER_STOP;
+    }
 
-    case NODE_48:
-      n = g_malloc0 (sizeof (Node48));
-      break;
+  offset = export->keys->len;
 
-    case NODE_256:
-      n = g_malloc0 (sizeof (Node256));
-      break;
+  g_byte_array_append (export->keys, (const guint8*) key, key_length + 1);
 
-    default:
-        g_assert_not_reached ();
-    }
+  if (export->offsets)
+    g_array_append_val (export->offsets, offset);
 
-  n->type = type;
+  if (export->values)
+    g_ptr_array_add (export->values, value);
 
-  return n;
+  return GW_RADIX_TREE_ITER_CONTINUE;
 }
 
-static Leaf*
-leaf_new (const guchar *key,
-          gint          key_len,
-          gpointer      value)
+
+#ifdef GW_RADIX_TREE_COMPRESSED_POINTERS
+
+/*
+ * Cage
+ *
+ * With compressed pointers, all nodes and leaves are allocated from the
+ * cage, whose address range is reserved once per process. It is split
+ * in pages, and a table keeps the size class of each page, so blocks
+ * can be freed without their size. Small blocks are carved out of pages
+ * of their own class, and recycled through a free list per class. Bigger
+ * ones take whole pages, which are given back to the system when freed.
+ *
+ * Each thread keeps a few small blocks of each class at hand, and only
+ * takes the cage mutex to get or give back a batch of them at once.
+ * Pages that were given back are kept sorted by address, and merged with
+ * their neighbours, so big blocks find room without scanning lots of
+ * small runs.
+ */
+#define CAGE_PAGE_SIZE     (64 * 1024)
+#define CAGE_N_PAGES       (CAGE_SIZE / CAGE_PAGE_SIZE)
+#define CAGE_SMALL_MAX     4096
+#define CAGE_N_CLASSES     (CAGE_SMALL_MAX / ARENA_ALIGNMENT + 1)
+
+/* How many blocks, and bytes, a thread moves to or from the cage at once */
+#define CAGE_BATCH_BLOCKS  32
+#define CAGE_BATCH_BYTES   (16 * 1024)
+
+typedef struct
 {
-  Leaf *l;
-  guchar *lkey;
+  guint32             first;
+  guint32             n_pages;
+} CageRun;
 
-  l = (Leaf*) g_malloc (sizeof (Leaf) + key_len * sizeof (guchar));
-  l->value = value;
-  l->key_len = key_len;
+typedef struct
+{
+  GMutex              mutex;
+  guint32            *pages;
+  guint32             top;
+  GArray             *free_runs;
+  guchar             *cursors[CAGE_N_CLASSES];
+  gsize               remaining[CAGE_N_CLASSES];
+  gpointer            free_lists[CAGE_N_CLASSES];
+} Cage;
 
-  lkey = LEAF_KEY (l);
-  lkey[key_len] = '\0';
+typedef struct
+{
+  gpointer            blocks;
+  guint               n_blocks;
+} CageBin;
 
-  memcpy (lkey, key, key_len);
+typedef struct
+{
+  CageBin             bins[CAGE_N_CLASSES];
+} CageCache;
 
-  return l;
-}
+static void cage_cache_free (gpointer data);
 
+static Cage cage;
+static GPrivate cage_cache = G_PRIVATE_INIT (cage_cache_free);
+
+/* Must be called with the cage mutex held */
 static void
-destroy_node_recursive (Node *n)
+cage_init (void)
 {
-  Node **children;
-  guint i;
+  gpointer base;
 
-  if (!n)
-    return;
+  base = mmap (NULL, CAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
 
-  if (IS_LEAF (n))
-    {
-      g_free (LEAF_RAW (n));
-      return;
-    }
+  if (base == MAP_FAILED)
+    g_error ("Failed to reserve memory for radix trees: %s", g_strerror (errno));
 
-  children = NULL;
+  cage.pages = g_new0 (guint32, CAGE_N_PAGES);
+  cage.free_runs = g_array_new (FALSE, FALSE, sizeof (CageRun));
 
-  switch (n->type)
+  /* The first page is never used, so that no block is at offset 0 */
+  cage.top = 1;
+
+  cage_base = base;
+}
+
+/* Must be called with the cage mutex held */
+static guint32
+cage_take_pages (guint32 n_pages)
+{
+  guint32 first;
+  guint i;
+
+  /* Reuse pages that were given back first, lowest address first */
+  for (i = 0; i < cage.free_runs->len; i++)
     {
-    case NODE_4:
-      children = ((Node4*) n)->children;
-      break;
+      CageRun *run = &g_array_index (cage.free_runs, CageRun, i);
 
-    case NODE_16:
-      children = ((Node16*) n)->children;
-      break;
+      if (run->n_pages < n_pages)
+        continue;
 
-    case NODE_48:
-      children = ((Node48*) n)->children;
-      break;
+      first = run->first;
 
-    case NODE_256:
-      children = ((Node256*) n)->children;
-      break;
+      run->first += n_pages;
+      run->n_pages -= n_pages;
 
-    default:
-      g_assert_not_reached ();
+      if (run->n_pages == 0)
+        g_array_remove_index (cage.free_runs, i);
+
+      return first;
     }
 
-  if (children)
+  if (n_pages > CAGE_N_PAGES - cage.top)
+    g_error ("Radix trees ran out of their %" G_GSIZE_FORMAT " bytes of memory", CAGE_SIZE);
+
+  first = cage.top;
+
+  if (mprotect (cage_base + (gsize) first * CAGE_PAGE_SIZE,
+                (gsize) n_pages * CAGE_PAGE_SIZE,
+                PROT_READ | PROT_WRITE) != 0)
     {
-      for (i = 0; i < n->num_children; i++)
-        destroy_node_recursive (children[i]);
+      g_error ("Failed to commit memory for radix trees: %s", g_strerror (errno));
     }
 
-  g_free (n);
+  cage.top += n_pages;
+
+  return first;
 }
 
-/*
- * Auxiliary functions
- */
-static Leaf*
-minimum (const Node *n)
+/* Must be called with the cage mutex held */
+static void
+cage_give_back_pages (guint32 first,
+                      guint32 n_pages)
 {
-  gint i;
+  CageRun *runs;
+  CageRun run;
+  guint low, high;
 
-  if (!n)
-    return NULL;
+  runs = (CageRun*) cage.free_runs->data;
+  low = 0;
+  high = cage.free_runs->len;
 
-  if (IS_LEAF (n))
-    return LEAF_RAW (n);
+  /* Find the first run after the pages */
+  while (low < high)
+    {
+      guint mid = low + (high - low) / 2;
 
-  switch (n->type)
+      if (runs[mid].first < first)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+  if (low > 0 && runs[low - 1].first + runs[low - 1].n_pages == first)
     {
-    case NODE_4:
-      return minimum (((Node4*) n)->children[0]);
+      runs[low - 1].n_pages += n_pages;
 
-    case NODE_16:
-      return minimum (((Node16*) n)->children[0]);
+      if (low < cage.free_runs->len &&
+          runs[low - 1].first + runs[low - 1].n_pages == runs[low].first)
+        {
+          runs[low - 1].n_pages += runs[low].n_pages;
+          g_array_remove_index (cage.free_runs, low);
+        }
 
-    case NODE_48:
-      i = 0;
+      return;
+    }
 
-      while (!((Node48*) n)->keys[i])
-        i++;
+  if (low < cage.free_runs->len && first + n_pages == runs[low].first)
+    {
+      runs[low].first = first;
+      runs[low].n_pages += n_pages;
+      return;
+    }
 
-      i = ((Node48*) n)->keys[i] - 1;
+  run = (CageRun) { first, n_pages };
+  g_array_insert_val (cage.free_runs, low, run);
+}
 
-      return minimum (((Node48*) n)->children[i]);
+/* Must be called with the cage mutex held */
+static gpointer
+cage_carve (gsize class)
+{
+  gpointer block;
+  guint32 first;
 
-    case NODE_256:
-      i = 0;
+  if (cage.free_lists[class])
+    {
+      block = cage.free_lists[class];
+      cage.free_lists[class] = *((gpointer*) block);
 
-      while (!((Node256*) n)->children[i])
-        i++;
+      return block;
+    }
 
-      return minimum (((Node256*) n)->children[i]);
+  if (cage.remaining[class] < class * ARENA_ALIGNMENT)
+    {
+      first = cage_take_pages (1);
 
-    default:
-        g_assert_not_reached ();
+      cage.pages[first] = class;
+      cage.cursors[class] = cage_base + (gsize) first * CAGE_PAGE_SIZE;
+      cage.remaining[class] = CAGE_PAGE_SIZE;
     }
 
-  return NULL;
+  block = cage.cursors[class];
+  cage.cursors[class] += class * ARENA_ALIGNMENT;
+  cage.remaining[class] -= class * ARENA_ALIGNMENT;
+
+  return block;
 }
 
-static Node**
-find_child (Node   *n,
-            guchar  c)
+static inline guint
+cage_batch_size (gsize class)
 {
-  Node256 *n256;
-  Node48 *n48;
-  Node16 *n16;
-  Node4 *n4;
-  __m128i cmp;
-  int i, mask, bitfield;
+  return MIN (CAGE_BATCH_BLOCKS, CAGE_BATCH_BYTES / (class * ARENA_ALIGNMENT));
+}
 
-  switch (n->type)
+/* Gives @n_blocks blocks of @bin back to the free list of @class */
+static void
+cage_bin_flush (CageBin *bin,
+                gsize    class,
+                guint    n_blocks)
+{
+  gpointer block;
+
+  g_mutex_lock (&cage.mutex);
+
+  while (n_blocks-- > 0)
     {
-    case NODE_4:
-        n4 = (Node4*) n;
+      block = bin->blocks;
+      bin->blocks = *((gpointer*) block);
+      bin->n_blocks--;
 
-        for (i = 0; i < n->num_children; i++)
-          {
-            if (n4->keys[i] == c)
-              return &n4->children[i];
-          }
+      *((gpointer*) block) = cage.free_lists[class];
+      cage.free_lists[class] = block;
+    }
 
-        break;
+  g_mutex_unlock (&cage.mutex);
+}
 
-    case NODE_16:
-      n16 = (Node16*) n;
+/* Gives the blocks of a thread back to the cage when the thread exits */
+static void
+cage_cache_free (gpointer data)
+{
+  CageCache *cache = data;
+  gsize class;
 
-      cmp = _mm_cmpeq_epi8 (_mm_set1_epi8 (c), _mm_loadu_si128 ((__m128i*)n16->keys));
-      mask = (1 << n->num_children) - 1;
-      bitfield = _mm_movemask_epi8 (cmp) & mask;
+  for (class = 1; class < CAGE_N_CLASSES; class++)
+    {
+      if (cache->bins[class].n_blocks > 0)
+        cage_bin_flush (&cache->bins[class], class, cache->bins[class].n_blocks);
+    }
 
-      if (bitfield)
-        return &n16->children[__builtin_ctz (bitfield)];
+  g_free (cache);
+}
 
-      break;
+static CageCache*
+cage_get_cache (void)
+{
+  CageCache *cache;
 
-    case NODE_48:
-      n48 = (Node48*) n;
-      i = n48->keys[c];
+  cache = g_private_get (&cage_cache);
 
-      if (i > 0)
-        return &n48->children[i - 1];
+  if (!cache)
+    {
+      cache = g_new0 (CageCache, 1);
+      g_private_set (&cage_cache, cache);
+    }
 
-      break;
+  return cache;
+}
 
-    case NODE_256:
-      n256 = (Node256*) n;
+static gpointer
+cage_alloc (gsize size)
+{
+  CageBin *bin;
+  gpointer block;
+  guint32 first;
+  gsize class;
+  guint i;
 
-      if (n256->children[c])
-        return &n256->children[c];
+  if (size > CAGE_SIZE - CAGE_PAGE_SIZE)
+    g_error ("Radix trees ran out of their %" G_GSIZE_FORMAT " bytes of memory", CAGE_SIZE);
 
-      break;
+  /* Big blocks take whole pages, and the first one records how many */
+  if (size > CAGE_SMALL_MAX)
+    {
+      guint32 n_pages;
 
-    default:
-      g_assert_not_reached ();
-    }
+      n_pages = (size + CAGE_PAGE_SIZE - 1) / CAGE_PAGE_SIZE;
 
-  return NULL;
-}
+      g_mutex_lock (&cage.mutex);
 
-static gboolean
-leaf_matches (const Leaf   *n,
-              const guchar *key,
-              gint          key_len)
-{
-  if (n->key_len != (guint32) key_len)
-    return FALSE;
+      if (!cage_base)
+        cage_init ();
 
-  return memcmp (LEAF_KEY (n), key, key_len) == 0;
-}
+      first = cage_take_pages (n_pages);
+      cage.pages[first] = CAGE_N_CLASSES + n_pages;
 
+      g_mutex_unlock (&cage.mutex);
 
-static gint
-longest_common_prefix (Leaf *l1,
-                       Leaf *l2,
-                       int   depth)
-{
-  gint max_cmp, i;
+      return cage_base + (gsize) first * CAGE_PAGE_SIZE;
+    }
 
-  max_cmp = MIN (l1->key_len, l2->key_len) - depth;
+  class = ARENA_ALIGN (MAX (size, 1)) / ARENA_ALIGNMENT;
+  bin = &cage_get_cache ()->bins[class];
 
-  for (i = 0; i < max_cmp; i++)
+  if (!bin->blocks)
     {
-      guchar *key1 = LEAF_KEY (l1);
-      guchar *key2 = LEAF_KEY (l2);
-      gint k = depth + i;
+      g_mutex_lock (&cage.mutex);
 
-      if (key1[k] != key2[k])
-          return i;
+      if (!cage_base)
+        cage_init ();
+
+      for (i = cage_batch_size (class); i > 0; i--)
+        {
+          block = cage_carve (class);
+          *((gpointer*) block) = bin->blocks;
+          bin->blocks = block;
+          bin->n_blocks++;
+        }
+
+      g_mutex_unlock (&cage.mutex);
     }
 
-  return i;
+  block = bin->blocks;
+  bin->blocks = *((gpointer*) block);
+  bin->n_blocks--;
+
+  return block;
 }
 
-/*
- * Returns the number of prefix characters shared between
- * the key and node.
- */
-static gint
-check_prefix (const Node   *n,
-              const guchar *key,
-              gint          key_len,
-              gint          depth)
+static void
+cage_free (gpointer block)
 {
-  gint max_cmp, i;
+  CageBin *bin;
+  guint32 page, class;
+  guint batch;
 
-  max_cmp = MIN (MIN (MAX_PREFIX_LEN, n->partial_len), key_len - depth);
+  page = ((guchar*) block - cage_base) / CAGE_PAGE_SIZE;
 
-  for (i = 0; i < max_cmp; i++)
+  /* The class of a page never changes while it has blocks in use */
+  class = cage.pages[page];
+
+  if (class < CAGE_N_CLASSES)
     {
-      if (n->partial[i] != key[depth + i])
-        return i;
+      bin = &cage_get_cache ()->bins[class];
+
+      *((gpointer*) block) = bin->blocks;
+      bin->blocks = block;
+      bin->n_blocks++;
+
+      /* Keep one batch at hand, and give the other one back */
+      batch = cage_batch_size (class);
+
+      if (bin->n_blocks >= 2 * batch)
+        cage_bin_flush (bin, class, batch);
+
+      return;
     }
 
-  return i;
+  madvise (block, (gsize) (class - CAGE_N_CLASSES) * CAGE_PAGE_SIZE, MADV_DONTNEED);
+
+  g_mutex_lock (&cage.mutex);
+
+  cage.pages[page] = 0;
+  cage_give_back_pages (page, class - CAGE_N_CLASSES);
+
+  g_mutex_unlock (&cage.mutex);
+}
+
+#endif
+
+/* Nodes, leaves and arena chunks are allocated from the cage, when there is one */
+static inline gpointer
+block_alloc (gsize size)
+{
+#ifdef GW_RADIX_TREE_COMPRESSED_POINTERS
+  return cage_alloc (size);
+#else
+  return g_malloc (size);
+#endif
+}
+
+static inline void
+block_free (gpointer block)
+{
+#ifdef GW_RADIX_TREE_COMPRESSED_POINTERS
+  cage_free (block);
+#else
+  g_free (block);
+#endif
 }
 
 
 /*
- * Calculates the index at which the prefixes mismatch
+ * Arena
+ *
+ * Trees created with gw_radix_tree_new_with_arena() carve their nodes
+ * and leaves out of large chunks instead of calling g_malloc() for each
+ * of them. Freed blocks go to a free list per 8-byte size class, so the
+ * nodes released when growing or shrinking are reused by the next
+ * transition. Blocks larger than the biggest node are not recycled.
+ *
+ * Copies of a tree share its arena, since they share its nodes. Only
+ * then the arena is locked, as the copies may live in other threads.
  */
-static gint
-prefix_mismatch (const Node   *n,
-                 const guchar *key,
-                 gint          key_len,
-                 int           depth)
+static ArenaChunk*
+arena_chunk_new (Arena *arena,
+                 gsize  size)
 {
-  gint max_cmp;
-  gint i;
+  ArenaChunk *chunk;
 
-  max_cmp = MIN (MIN (MAX_PREFIX_LEN, n->partial_len), key_len - depth);
+  chunk = block_alloc (sizeof (ArenaChunk) + size);
+  chunk->size = size;
 
-  for (i = 0; i < max_cmp; i++)
-    {
-      if (n->partial[i] != key[depth + i])
-        return i;
-    }
+  arena->allocated += size;
 
-  /* If the prefix is short we can avoid finding a leaf */
-  if (n->partial_len > MAX_PREFIX_LEN)
-    {
-      Leaf *leaf;
-      guchar *leaf_key;
+  return chunk;
+}
 
-      /* Prefix is longer than what we've checked, find a leaf */
-      leaf = minimum (n);
-      leaf_key = LEAF_KEY (leaf);
-      max_cmp = MIN (leaf->key_len, key_len) - depth;
+static Arena*
+arena_new (void)
+{
+  Arena *arena;
 
-      for (; i < max_cmp; i++)
-        {
-          if (leaf_key[depth + i] != key[depth + i])
-            return i;
-        }
-    }
+  arena = g_new0 (Arena, 1);
+  arena->ref_count = 1;
 
-  return i;
+  g_mutex_init (&arena->mutex);
+
+  return arena;
 }
 
 static void
-copy_header (Node *dest,
-             Node *src)
+arena_reset (Arena *arena)
 {
-  dest->num_children = src->num_children;
-  dest->partial_len = src->partial_len;
+  ArenaChunk *chunk, *next;
 
-  memcpy (dest->partial,
-          src->partial,
-          MIN (MAX_PREFIX_LEN, src->partial_len));
+  for (chunk = arena->chunks; chunk; chunk = next)
+    {
+      next = chunk->next;
+      block_free (chunk);
+    }
+
+  arena->chunks = NULL;
+  arena->cursor = NULL;
+  arena->remaining = 0;
+  arena->allocated = 0;
+
+  memset (arena->free_lists, 0, sizeof (arena->free_lists));
 }
 
-static void
-add_child_256 (Node256   *n,
-               guchar     c,
-               gpointer   child)
+static Arena*
+arena_ref (Arena *arena)
 {
-  n->n.num_children++;
-  n->children[c] = child;
+  g_atomic_int_inc (&arena->ref_count);
+
+  return arena;
 }
 
 static void
-add_child_48 (Node48    *n,
-              Node     **ref,
-              guchar     c,
-              gpointer   child)
+arena_unref (Arena *arena)
 {
-  if (n->n.num_children < 48)
-    {
-      gint pos = 0;
-
-      while (n->children[pos])
-        pos++;
+  if (!g_atomic_int_dec_and_test (&arena->ref_count))
+    return;
 
-      n->children[pos] = child;
-      n->keys[c] = pos + 1;
-      n->n.num_children++;
-    }
-  else
-    {
-      Node256 *new_node;
+  arena_reset (arena);
+  g_mutex_clear (&arena->mutex);
+  g_free (arena);
+}
 
-      new_node = node_new (NODE_256);
+/*
+ * Takes over the only reference on @arena, so that no copy can share it
+ * until arena_release() gives it back. Copies only come from the trees
+ * holding a reference, so none can show up or go away in between.
+ */
+static inline gboolean
+arena_acquire (Arena *arena)
+{
+  return g_atomic_int_compare_and_exchange (&arena->ref_count, 1, 0);
+}
 
-      for (int i=0;i<256;i++)
-        {
-          if (n->keys[i])
-            new_node->children[i] = n->children[n->keys[i] - 1];
-        }
+static inline void
+arena_release (Arena *arena)
+{
+  g_atomic_int_set (&arena->ref_count, 1);
+}
 
-      copy_header ((Node*) new_node, (Node*) n);
+/* Returns whether the arena was locked, to be passed to arena_unlock() */
+static inline gboolean
+arena_lock (Arena *arena)
+{
+  if (g_atomic_int_get (&arena->ref_count) == 1)
+    return FALSE;
 
-      *ref = (Node*) new_node;
+  g_mutex_lock (&arena->mutex);
 
-      add_child_256 (new_node, c, child);
+  return TRUE;
+}
 
-      g_free (n);
-    }
+static inline void
+arena_unlock (Arena    *arena,
+              gboolean  locked)
+{
+  if (locked)
+    g_mutex_unlock (&arena->mutex);
 }
 
-static void
-add_child_16 (Node16    *n,
-              Node     **ref,
-              guchar     c,
-              gpointer   child)
+static gpointer
+arena_alloc_block (Arena *arena,
+                   gsize  size)
 {
-  if (n->n.num_children < 16)
-    {
-      __m128i cmp;
-      guint mask, bitfield, i;
+  ArenaChunk *chunk;
+  gpointer block;
+  gsize slot;
 
-      /* Compare the key to all 16 stored keys */
-      cmp = _mm_cmplt_epi8 (_mm_set1_epi8 (c), _mm_loadu_si128 ((__m128i*) n->keys));
+  size = ARENA_ALIGN (size);
+  slot = size / ARENA_ALIGNMENT;
 
-      /* Use a mask to ignore children that don't exist */
-      mask = (1 << n->n.num_children) - 1;
-      bitfield = _mm_movemask_epi8 (cmp) & mask;
+  /* Reuse a block of the same size class */
+  if (slot < ARENA_N_FREE_LISTS && arena->free_lists[slot])
+    {
+      block = arena->free_lists[slot];
+      arena->free_lists[slot] = *((gpointer*) block);
 
-      if (bitfield)
-        {
-          i = __builtin_ctz (bitfield);
+      return block;
+    }
 
-          memmove (n->keys + i + 1,
-                   n->keys + i,
-                   n->n.num_children - i);
+  /* Huge blocks get a dedicated chunk */
+  if (size > ARENA_CHUNK_SIZE / 4)
+    {
+      chunk = arena_chunk_new (arena, size);
 
-          memmove (n->children + i + 1,
-                   n->children + i,
-                  (n->n.num_children - i) * sizeof (gpointer));
+      if (arena->chunks)
+        {
+          chunk->next = arena->chunks->next;
+          arena->chunks->next = chunk;
         }
       else
         {
-          i = n->n.num_children;
+          chunk->next = NULL;
+          arena->chunks = chunk;
         }
 
-      /* Set the child */
-      n->keys[i] = c;
-      n->children[i] = child;
-      n->n.num_children++;
+      return ARENA_CHUNK_DATA (chunk);
     }
-  else
+
+  if (arena->remaining < size)
     {
-      Node48 *new_node;
-      guint i;
+      chunk = arena_chunk_new (arena, ARENA_CHUNK_SIZE - sizeof (ArenaChunk));
+      chunk->next = arena->chunks;
 
-      new_node = node_new (NODE_48);
+      arena->chunks = chunk;
+      arena->cursor = ARENA_CHUNK_DATA (chunk);
+      arena->remaining = chunk->size;
+    }
 
-      /* Copy the child pointers and populate the key map */
-      memcpy (new_node->children,
-              n->children,
-              n->n.num_children * sizeof (gpointer));
+  block = arena->cursor;
+  arena->cursor += size;
+  arena->remaining -= size;
 
-      for (i = 0; i < n->n.num_children; i++)
-        new_node->keys[n->keys[i]] = i + 1;
+  return block;
+}
 
-      copy_header ((Node*) new_node, (Node*) n);
+static void
+arena_free_block (Arena    *arena,
+                  gpointer  block,
+                  gsize     size)
+{
+  gsize slot;
 
-      *ref = (Node*) new_node;
+  slot = ARENA_ALIGN (size) / ARENA_ALIGNMENT;
 
-      add_child_48 (new_node, ref, c, child);
+  /* Oversized blocks are only given back when the arena is reset */
+  if (slot >= ARENA_N_FREE_LISTS)
+    return;
 
-      g_free (n);
-   }
+  *((gpointer*) block) = arena->free_lists[slot];
+  arena->free_lists[slot] = block;
 }
 
-static void
-add_child_4 (Node4     *n,
-             Node     **ref,
-             guchar     c,
-             gpointer   child)
+
+/*
+ * Epochs
+ *
+ * Readers of a concurrent tree don't lock anything, so a node or leaf
+ * unlinked by a writer may still be in use by them. Instead of freeing
+ * it right away, the writer retires it to the limbo list of the current
+ * epoch. Each reader registers itself on the counter matching the epoch
+ * it started in, and the epoch only advances once no reader from the
+ * previous epoch is left. By then, whatever was retired in the previous
+ * epoch can't be reached by anyone, and is freed.
+ *
+ * Reader counters and limbo lists are spread over a few shards, picked
+ * by thread, so that lookups and removals from different threads don't
+ * keep bouncing the same cache line or lock. The tree-wide mutex is only
+ * taken to advance the epoch, once a shard has retired a batch of blocks.
+ */
+static Epochs*
+epochs_new (void)
 {
-  if (n->n.num_children < 4)
-    {
-      gint i;
+  Epochs *epochs;
+  guint i, j;
 
-      for (i = 0; i < n->n.num_children; i++)
-          if (c < n->keys[i])
-            break;
+  epochs = g_new0 (Epochs, 1);
+  g_mutex_init (&epochs->mutex);
+  epochs->reclaimed = g_array_new (FALSE, FALSE, sizeof (Retired));
 
-      /* Shift to make room */
-      memmove (n->keys + i + 1,
-               n->keys + i,
-               n->n.num_children - i);
+  for (i = 0; i < N_READER_SHARDS; i++)
+    {
+      ReaderShard *shard = &epochs->shards[i];
 
-      memmove (n->children + i + 1,
-               n->children + i,
-              (n->n.num_children - i) * sizeof (gpointer));
+      g_mutex_init (&shard->mutex);
 
-      /* Insert element */
-      n->keys[i] = c;
-      n->children[i] = child;
-      n->n.num_children++;
+      for (j = 0; j < G_N_ELEMENTS (shard->limbo); j++)
+        shard->limbo[j] = g_array_new (FALSE, FALSE, sizeof (Retired));
     }
-  else
+
+  return epochs;
+}
+
+static inline ReaderShard*
+epochs_get_shard (Epochs *epochs)
+{
+  return &epochs->shards[(GPOINTER_TO_SIZE (g_thread_self ()) >> 4) % N_READER_SHARDS];
+}
+
+static void
+epochs_reclaim (GwRadixTree *self,
+                GArray      *limbo)
+{
+  guint i;
+
+  for (i = 0; i < limbo->len; i++)
     {
-      Node16 *new_node;
+      Retired *retired = &g_array_index (limbo, Retired, i);
 
-      new_node = node_new (NODE_16);
+      if (retired->value && self->destroy_func)
+        self->destroy_func (retired->value);
 
-      /* Copy the child pointers and the key map */
-      memcpy (new_node->children,
-              n->children,
-              n->n.num_children * sizeof (gpointer));
+      block_free (retired->block);
+    }
 
-      memcpy (new_node->keys,
-              n->keys,
-              n->n.num_children * sizeof (guchar));
+  g_array_set_size (limbo, 0);
+}
 
-      copy_header ((Node*) new_node, (Node*) n);
+/* Only safe when no other thread uses the tree */
+static void
+epochs_reclaim_all (GwRadixTree *self)
+{
+  guint i, j;
 
-      *ref = (Node*)new_node;
+  for (i = 0; i < N_READER_SHARDS; i++)
+    {
+      ReaderShard *shard = &self->epochs->shards[i];
 
-      add_child_16 (new_node, ref, c, child);
+      for (j = 0; j < G_N_ELEMENTS (shard->limbo); j++)
+        epochs_reclaim (self, shard->limbo[j]);
 
-      g_free (n);
+      shard->n_retired = 0;
     }
 }
 
 static void
-add_child (Node      *n,
-           Node     **ref,
-           guchar     c,
-           gpointer   child)
+epochs_free (GwRadixTree *self)
 {
-  switch (n->type)
-    {
-    case NODE_4:
-      return add_child_4 ((Node4*) n, ref, c, child);
+  Epochs *epochs;
+  guint i, j;
 
-    case NODE_16:
-      return add_child_16 ((Node16*) n, ref, c, child);
+  epochs = self->epochs;
 
-    case NODE_48:
-      return add_child_48 ((Node48*) n, ref, c, child);
+  epochs_reclaim_all (self);
 
-    case NODE_256:
-      return add_child_256 ((Node256*) n, c, child);
+  for (i = 0; i < N_READER_SHARDS; i++)
+    {
+      ReaderShard *shard = &epochs->shards[i];
 
-    default:
-      g_assert_not_reached ();
+      for (j = 0; j < G_N_ELEMENTS (shard->limbo); j++)
+        g_array_unref (shard->limbo[j]);
+
+      g_mutex_clear (&shard->mutex);
     }
+
+  g_array_unref (epochs->reclaimed);
+  g_mutex_clear (&epochs->mutex);
+  g_free (epochs);
+
+  self->epochs = NULL;
 }
 
-static gpointer
-insert_recursive (Node          *n,
-                  Node         **ref,
-                  const guchar  *key,
-                  gint           key_len,
-                  gpointer       value,
-                  gint           depth,
-                  gboolean      *old)
+static gint*
+epochs_enter (Epochs *epochs)
 {
-  Node **child;
-  Leaf *l;
+  ReaderShard *shard;
+  guint epoch;
+  gint *count;
 
-  /* If we are at a NULL node, inject a leaf */
-  if (!n)
-    {
-      *ref = (Node*) SET_LEAF (leaf_new (key, key_len, value));
-      return NULL;
-    }
+  shard = epochs_get_shard (epochs);
 
-  /* If we are at a leaf, we need to replace it with a node */
-  if (IS_LEAF (n))
+  /* Retry if the epoch advanced before we were accounted for */
+  while (TRUE)
     {
-      Node4 *new_node;
-      Leaf *leaf, *new_leaf;
-      gint longest_prefix;
-      guchar *leaf_key;
+      epoch = g_atomic_int_get (&epochs->epoch);
+      count = &shard->counts[epoch & 1];
 
-      leaf = LEAF_RAW (n);
+      g_atomic_int_inc (count);
 
-      /* Check if we are updating an existing value */
-      if (leaf_matches (leaf, key, key_len))
-        {
-          gpointer old_val;
-
-          old_val = leaf->value;
-          leaf->value = value;
-
-          *old = TRUE;
+      if (g_atomic_int_get (&epochs->epoch) == (gint) epoch)
+        break;
 
-          return old_val;
-        }
+      g_atomic_int_add (count, -1);
+    }
 
-      /* we must split the leaf into a Node4 */
-      new_node = node_new (NODE_4);
+  return count;
+}
 
-      /* Create a new leaf */
-      new_leaf = leaf_new (key, key_len, value);
+static inline void
+epochs_leave (gint *count)
+{
+  g_atomic_int_add (count, -1);
+}
 
-      // Determine longest prefix
-      longest_prefix = longest_common_prefix (leaf, new_leaf, depth);
+/*
+ * Advances the epoch if no reader from the previous one is left, unless
+ * another thread is already at it.
+ */
+static void
+epochs_try_advance (GwRadixTree *self)
+{
+  Epochs *epochs;
+  guint epoch, slot, i;
 
-      new_node->n.partial_len = longest_prefix;
+  epochs = self->epochs;
 
-      memcpy(new_node->n.partial,
-             key + depth,
-             MIN (MAX_PREFIX_LEN, longest_prefix));
+  if (!g_mutex_trylock (&epochs->mutex))
+    return;
 
-      /* Add the leafs to the new Node4 */
-      *ref = (Node*) new_node;
+  epoch = g_atomic_int_get (&epochs->epoch);
 
-      leaf_key = LEAF_KEY (leaf);
-      add_child_4 (new_node,
-                   ref,
-                   leaf_key[depth + longest_prefix],
-                   SET_LEAF (leaf));
+  for (i = 0; i < N_READER_SHARDS; i++)
+    {
+      if (g_atomic_int_get (&epochs->shards[i].counts[(epoch - 1) & 1]) > 0)
+        {
+          g_mutex_unlock (&epochs->mutex);
+          return;
+        }
+    }
 
-      leaf_key = LEAF_KEY (new_leaf);
-      add_child_4 (new_node,
-                   ref,
-                   leaf_key[depth + longest_prefix],
-                   SET_LEAF (new_leaf));
+  /*
+   * Nobody can reach what was retired in the previous epoch anymore.
+   * Collect it from every shard first, so that values aren't destroyed
+   * with the lock of a shard held.
+   */
+  slot = (epoch + 2) % 3;
 
-      return NULL;
+  for (i = 0; i < N_READER_SHARDS; i++)
+    {
+      ReaderShard *shard = &epochs->shards[i];
+
+      g_mutex_lock (&shard->mutex);
+      g_array_append_vals (epochs->reclaimed,
+                           shard->limbo[slot]->data,
+                           shard->limbo[slot]->len);
+      g_array_set_size (shard->limbo[slot], 0);
+      g_mutex_unlock (&shard->mutex);
     }
 
-  /* Check if given node has a prefix */
-  if (n->partial_len)
-    {
-      Node4 *new_node;
-      Leaf *new_leaf;
-      gint prefix_diff;
+  g_atomic_int_set (&epochs->epoch, (epoch + 1) % N_EPOCHS);
 
-      /* Determine if the prefixes differ, since we need to split */
-      prefix_diff = prefix_mismatch (n, key, key_len, depth);
+  epochs_reclaim (self, epochs->reclaimed);
 
-      if ((guint32) prefix_diff >= n->partial_len)
-        {
-          depth += n->partial_len;
-          goto recurse;
-        }
+  g_mutex_unlock (&epochs->mutex);
+}
 
-      /* Create a new node */
-      new_node = node_new (NODE_4);
-      new_node->n.partial_len = prefix_diff;
+/*
+ * Frees @block, and destroys @value, once no reader can reach them
+ * anymore. Must be called after @block is unlinked from the tree.
+ */
+static void
+epochs_retire (GwRadixTree *self,
+               gpointer     block,
+               gpointer     value)
+{
+  Retired retired = { block, value };
+  ReaderShard *shard;
+  guint n_retired;
 
-      memcpy (new_node->n.partial,
-              n->partial,
-              MIN (MAX_PREFIX_LEN, prefix_diff));
+  shard = epochs_get_shard (self->epochs);
 
-      *ref = (Node*) new_node;
+  g_mutex_lock (&shard->mutex);
 
-      /* Adjust the prefix of the old node */
-      if (n->partial_len > MAX_PREFIX_LEN)
-        {
-          Leaf *leaf;
-          guchar *leaf_key;
+  g_array_append_val (shard->limbo[g_atomic_int_get (&self->epochs->epoch) % 3], retired);
+  n_retired = ++shard->n_retired;
 
-          n->partial_len -= prefix_diff + 1;
-          leaf = minimum (n);
-          leaf_key = LEAF_KEY (leaf);
+  g_mutex_unlock (&shard->mutex);
 
-          add_child_4 (new_node, ref, leaf_key[depth + prefix_diff], n);
+  if (n_retired % RETIRE_BATCH == 0)
+    epochs_try_advance (self);
+}
 
-          memcpy (n->partial,
-                  leaf_key + depth + prefix_diff + 1,
-                  MIN (MAX_PREFIX_LEN, n->partial_len));
 
-        }
-      else
-        {
-          add_child_4 (new_node, ref, n->partial[prefix_diff], n);
+/*
+ * Node creation and destruction
+ */
+static gsize
+node_size (guint8 type)
+{
+  switch (type)
+    {
+    case NODE_4:
+      return sizeof (Node4);
 
-          n->partial_len -= prefix_diff + 1;
+    case NODE_16:
+      return sizeof (Node16);
 
-          memmove (n->partial,
-                   n->partial + prefix_diff + 1,
-                   MIN (MAX_PREFIX_LEN, n->partial_len));
-        }
+    case NODE_32:
+      return sizeof (Node32);
 
-      /* Insert the new leaf */
-      new_leaf = leaf_new (key, key_len, value);
+    case NODE_48:
+      return sizeof (Node48);
 
-      add_child_4 (new_node, ref, key[depth + prefix_diff], SET_LEAF(new_leaf));
+    case NODE_256:
+      return sizeof (Node256);
 
-      return NULL;
+    default:
+      g_assert_not_reached ();
     }
 
-recurse:
-
-  /* Find a child to recurse to */
-  child = find_child (n, key[depth]);
-
-  if (child)
-    {
-      return insert_recursive (*child,
-                               child,
-                               key,
-                               key_len,
-                               value,
-                               depth + 1,
-                               old);
-    }
+  return 0;
+}
 
+static gpointer
+tree_alloc (GwRadixTree *self,
+            gsize        size)
+{
+  gpointer block;
+  gboolean locked;
 
-  /* No child, node goes within us */
-  l = leaf_new (key, key_len, value);
+  if (!self->arena)
+    return block_alloc (size);
 
-  add_child (n, ref, key[depth], SET_LEAF(l));
+  locked = arena_lock (self->arena);
+  block = arena_alloc_block (self->arena, size);
+  arena_unlock (self->arena, locked);
 
-  return NULL;
+  return block;
 }
 
 static void
-remove_child_256 (Node256  *n,
-                  Node    **ref,
-                  guchar    c)
+tree_free (GwRadixTree *self,
+           gpointer     block,
+           gsize        size)
 {
-  n->children[c] = NULL;
-  n->n.num_children--;
+  gboolean locked;
 
-  /*
-   * Resize to a Node48 on underflow, not immediately to prevent
-   * trashing if we sit on the 48/49 boundary
-   */
-  if (n->n.num_children == 37)
+  if (self->epochs)
     {
-      Node48 *new_node;
-      gint pos, i;
+      epochs_retire (self, block, NULL);
+      return;
+    }
 
-      new_node = node_new (NODE_48);
-      *ref = (Node*) new_node;
+  if (!self->arena)
+    {
+      block_free (block);
+      return;
+    }
 
-      copy_header ((Node*) new_node, (Node*) n);
+  locked = arena_lock (self->arena);
+  arena_free_block (self->arena, block, size);
+  arena_unlock (self->arena, locked);
+}
 
-      pos = 0;
-      for (i = 0; i < 256; i++)
-        {
-          if (n->children[i])
-            {
-              new_node->children[pos] = n->children[i];
-              new_node->keys[i] = pos + 1;
-              pos++;
-            }
-        }
+static gpointer
+node_new (GwRadixTree *self,
+          guint8       type)
+{
+  Node* n;
 
-      g_free(n);
-    }
+  n = tree_alloc (self, node_size (type));
+  memset (n, 0, node_size (type));
+
+  n->type = type;
+  n->ref_count = 1;
+
+  return n;
 }
 
 static void
-remove_child_48 (Node48  *n,
-                 Node   **ref,
-                 guchar   c)
+node_free (GwRadixTree *self,
+           gpointer     n)
 {
-  gint pos;
+  tree_free (self, n, node_size (((Node*) n)->type));
+}
 
-  pos = n->keys[c];
+static Leaf*
+leaf_new (GwRadixTree  *self,
+          const guchar *key,
+          gint          key_len,
+          gpointer      value)
+{
+  Leaf *l;
+  guchar *lkey;
 
-  n->keys[c] = 0;
-  n->children[pos - 1] = NULL;
-  n->n.num_children--;
+  l = tree_alloc (self, LEAF_SIZE (key_len));
+  l->number = 0;
+  l->value = value;
+  l->key_len = key_len;
+  l->ref_count = 1;
 
-  if (n->n.num_children == 12)
-    {
-      Node16 *new_node;
-      gint child, i;
+  lkey = LEAF_KEY (l);
+  lkey[key_len] = '\0';
 
-      new_node = node_new (NODE_16);
-      *ref = (Node*) new_node;
+  memcpy (lkey, key, key_len);
 
-      copy_header ((Node*) new_node, (Node*) n);
+  return l;
+}
 
-      child = 0;
+static Node*
+embed_key (const guchar *key,
+           gint          key_len)
+{
+  guchar data[sizeof (gpointer)] = { 0, };
+  Node *n;
 
-      for (i = 0; i < 256; i++)
-        {
-          pos = n->keys[i];
+  data[EMBEDDED_TAG_OFFSET] = 3 | key_len << 2;
+  memcpy (data + EMBEDDED_KEY_OFFSET, key, key_len);
+  memcpy (&n, data, sizeof (gpointer));
 
-          if (pos)
-            {
-              new_node->keys[child] = i;
-              new_node->children[child] = n->children[pos - 1];
-              child++;
-            }
-        }
+  return n;
+}
 
-      g_free(n);
-    }
+/*
+ * Leaves of compact trees only store the bytes of their key from the
+ * depth they hang at, since the path down to them has the other ones.
+ * A key that ends at a node hangs from its NUL child, past its end.
+ */
+static inline guint32
+leaf_start (gboolean compact,
+            guint32  key_len,
+            gint     depth)
+{
+  return compact ? MIN ((guint32) depth, key_len) : 0;
 }
 
-static void
-remove_child_16 (Node16  *n,
-                 Node   **ref,
-                 Node   **l)
+/*
+ * Creates the tagged pointer of a new leaf at @depth, embedding short
+ * keys in set trees.
+ */
+static Node*
+leaf_node_new (GwRadixTree  *self,
+               const guchar *key,
+               gint          key_len,
+               gint          depth,
+               gpointer      value)
 {
-  gint pos;
+  guint32 start;
+  Leaf *l;
 
-  pos = l - n->children;
+  if (self->embed_keys && !value && key_len <= EMBEDDED_MAX_LEN)
+    return embed_key (key, key_len);
 
-  memmove (n->keys + pos,
-           n->keys + pos + 1,
-           n->n.num_children - 1 - pos);
+  start = leaf_start (self->compact_leaves, key_len, depth);
 
-  memmove (n->children + pos,
-           n->children + pos + 1,
-           (n->n.num_children - 1 - pos) * sizeof (gpointer));
+  l = leaf_new (self, key + start, key_len - start, value);
+  l->key_len = key_len;
 
-  n->n.num_children--;
+  return SET_LEAF (l);
+}
 
-  /* Fall back to a 4-child node */
-  if (n->n.num_children == 3)
-    {
-      Node4 *new_node;
+/*
+ * Moves the leaf @n of a compact tree from @depth to @new_depth, keeping
+ * only the bytes of its key it needs there. Moving up takes the bytes in
+ * between from @path.
+ */
+static Node*
+leaf_move (GwRadixTree  *self,
+           Node         *n,
+           gint          depth,
+           gint          new_depth,
+           const guchar *path)
+{
+  guint32 start, new_start;
+  Leaf *l, *moved;
+  guchar *key;
 
-      new_node = node_new (NODE_4);
-      *ref = (Node*) new_node;
+  if (!self->compact_leaves)
+    return n;
 
-      copy_header ((Node*) new_node, (Node*) n);
+  l = LEAF_RAW (n);
+  start = leaf_start (TRUE, l->key_len, depth);
+  new_start = leaf_start (TRUE, l->key_len, new_depth);
 
-      memcpy (new_node->keys, n->keys, 4);
-      memcpy (new_node->children, n->children, 4 * sizeof (gpointer));
+  if (start == new_start)
+    return n;
+
+  moved = tree_alloc (self, LEAF_SIZE (l->key_len - new_start));
+  moved->number = l->number;
+  moved->key_len = l->key_len;
+  moved->ref_count = 1;
+
+  key = LEAF_KEY (moved);
 
-      g_free(n);
+  if (new_start > start)
+    {
+      memcpy (key, (guchar*) LEAF_KEY (l) + new_start - start, l->key_len - new_start + 1);
+    }
+  else
+    {
+      memcpy (key, path, start - new_start);
+      memcpy (key + start - new_start, LEAF_KEY (l), l->key_len - start + 1);
     }
+
+  tree_free (self, l, LEAF_SIZE (l->key_len - start));
+
+  return SET_LEAF (moved);
 }
 
-static void
-remove_child_4 (Node4  *n,
-                Node  **ref,
-                Node  **l)
+/*
+ * Rebuilds the key of the leaf @l of a compact tree in @path, which holds
+ * the bytes of the path down to it.
+ */
+static const gchar*
+leaf_path_key (GString    *path,
+               const Leaf *l)
 {
-  gint pos;
+  guint32 start;
 
-  pos = l - n->children;
+  start = leaf_start (TRUE, l->key_len, path->len);
 
-  memmove (n->keys + pos,
-           n->keys + pos + 1,
-           n->n.num_children - 1 - pos);
+  g_string_truncate (path, start);
+  g_string_append_len (path, (const gchar*) LEAF_KEY (l), l->key_len - start);
 
-  memmove (n->children + pos,
-           n->children + pos + 1,
-           (n->n.num_children - 1 - pos) * sizeof(gpointer));
-
-  n->n.num_children--;
+  return path->str;
+}
 
-  /* Remove nodes with only a single child */
-  if (n->n.num_children == 1)
-    {
-      Node *child = n->children[0];
+/*
+ * Returns the leaf of the tagged pointer @n. Embedded keys are unpacked
+ * into @view, which must outlive the returned leaf, and have no value.
+ */
+static inline Leaf*
+leaf_view (Node     *n,
+           LeafView *view)
+{
+  gint key_len;
 
-      if (!IS_LEAF (child))
-        {
-          gint prefix;
+  if (!IS_EMBEDDED (n))
+    return LEAF_RAW (n);
 
-          /* Concatenate the prefixes */
-          prefix = n->n.partial_len;
+  key_len = EMBEDDED_LEN (n);
 
-          if (prefix < MAX_PREFIX_LEN)
-            {
-              n->n.partial[prefix] = n->keys[0];
-              prefix++;
-            }
+  view->leaf.value = NULL;
+  view->leaf.key_len = key_len;
+  view->leaf.ref_count = 1;
 
-          if (prefix < MAX_PREFIX_LEN)
-            {
-              gint sub_prefix;
+  memcpy (LEAF_KEY (&view->leaf), EMBEDDED_KEY (&n), key_len + 1);
 
-              sub_prefix = MIN (child->partial_len, MAX_PREFIX_LEN - prefix);
+  return &view->leaf;
+}
 
-              memcpy (n->n.partial + prefix, child->partial, sub_prefix);
+static inline gpointer
+leaf_value (Node *n)
+{
+  return IS_EMBEDDED (n) ? NULL : LEAF_RAW (n)->value;
+}
 
-              prefix += sub_prefix;
-            }
+/*
+ * Nodes and leaves are reference counted, so that copies of a tree
+ * can share them. Shared nodes are never modified; writers copy the
+ * path down to the change instead, see node_make_unique().
+ */
+static void
+leaf_unref (GwRadixTree *self,
+            Leaf        *l,
+            gboolean     destroy_value)
+{
+  if (!g_atomic_int_dec_and_test (&l->ref_count))
+    return;
 
-          /* Store the prefix in the child */
-          memcpy (child->partial, n->n.partial, MIN (prefix, MAX_PREFIX_LEN));
+  /*
+   * Readers of concurrent trees may still be using the value. Numbers
+   * share its slot and keep being updated without a lock, so it's only
+   * read when it will be destroyed.
+   */
+  if (self->epochs)
+    {
+      epochs_retire (self, l, destroy_value && self->destroy_func ? l->value : NULL);
+      return;
+    }
 
-          child->partial_len += n->n.partial_len + 1;
-        }
+  if (destroy_value && self->destroy_func && l->value)
+    self->destroy_func (l->value);
 
-      *ref = child;
-      g_free(n);
-    }
+  /* Compact trees don't use an arena, so the size of their leaves isn't needed */
+  tree_free (self, l, LEAF_SIZE (l->key_len));
 }
 
-static void
-remove_child (Node    *n,
-              Node   **ref,
-              guchar   c,
-              Node   **l)
+static NodeRef*
+node_get_children (Node  *n,
+                   guint *n_slots)
 {
   switch (n->type)
     {
     case NODE_4:
-      return remove_child_4 ((Node4*) n, ref, l);
+      *n_slots = n->num_children;
+      return ((Node4*) n)->children;
 
     case NODE_16:
-      return remove_child_16 ((Node16*) n, ref, l);
+      *n_slots = n->num_children;
+      return ((Node16*) n)->children;
+
+    case NODE_32:
+      *n_slots = n->num_children;
+      return ((Node32*) n)->children;
 
+    /* Node48 may have holes in its children array after removals */
     case NODE_48:
-      return remove_child_48 ((Node48*) n, ref, c);
+      *n_slots = 48;
+      return ((Node48*) n)->children;
 
     case NODE_256:
-      return remove_child_256 ((Node256*) n, ref, c);
+      *n_slots = 256;
+      return ((Node256*) n)->children;
 
     default:
-        g_assert_not_reached ();
+      g_assert_not_reached ();
     }
+
+  return NULL;
 }
 
-static Leaf*
-remove_recursive (Node          *n,
-                  Node         **ref,
-                  const guchar  *key,
-                  gint           key_len,
-                  gint           depth)
+static void
+node_ref (Node *n)
 {
-  Node **child;
-
-  if (!n)
-    return NULL;
+  /* Embedded keys are copied along with their pointer */
+  if (IS_EMBEDDED (n))
+    return;
 
   if (IS_LEAF (n))
+    g_atomic_int_inc (&LEAF_RAW (n)->ref_count);
+  else
+    g_atomic_int_inc (&n->ref_count);
+}
+
+static void
+node_unref (GwRadixTree *self,
+            Node        *n)
+{
+  NodeRef *children;
+  guint i, n_slots;
+
+  if (!n || IS_EMBEDDED (n))
+    return;
+
+  if (IS_LEAF (n))
+    {
+      leaf_unref (self, LEAF_RAW (n), TRUE);
+      return;
+    }
+
+  if (!g_atomic_int_dec_and_test (&n->ref_count))
+    return;
+
+  children = node_get_children (n, &n_slots);
+
+  for (i = 0; i < n_slots; i++)
+    node_unref (self, DEREF (children[i]));
+
+  node_free (self, n);
+}
+
+/*
+ * Makes sure the node at @ref is only referenced by this tree,
+ * copying it if needed, so it can be modified in place.
+ */
+static Node*
+node_make_unique (GwRadixTree  *self,
+                  NodeRef      *ref)
+{
+  NodeRef *children;
+  Node *n, *copy;
+  guint i, n_slots;
+
+  n = DEREF (*ref);
+
+  if (IS_LEAF (n) || g_atomic_int_get (&n->ref_count) == 1)
+    return n;
+
+  /* Other copies of the tree may drop their reference meanwhile, so
+   * the count itself is left out of the copy. */
+  copy = tree_alloc (self, node_size (n->type));
+  memcpy (copy, n, G_STRUCT_OFFSET (Node, ref_count));
+  copy->ref_count = 1;
+  memcpy ((guchar*) copy + G_STRUCT_OFFSET (Node, version),
+          (guchar*) n + G_STRUCT_OFFSET (Node, version),
+          node_size (n->type) - G_STRUCT_OFFSET (Node, version));
+
+  children = node_get_children (copy, &n_slots);
+
+  for (i = 0; i < n_slots; i++)
+    {
+      if (children[i])
+        node_ref (DEREF (children[i]));
+    }
+
+  *ref = REF (copy);
+
+  node_unref (self, n);
+
+  return copy;
+}
+
+/*
+ * Child search
+ *
+ * Node4, Node16 and Node32 keep their key bytes in sorted arrays. With
+ * SSE2, which every x86-64 CPU has, the keys are compared 16 at a time.
+ * Node32 compares all of its keys at once with AVX2, but that isn't part
+ * of the base instruction set, so it's only used when the CPU supports
+ * it. Other architectures scan the keys one by one.
+ *
+ * Vector loads are rounded up to 16 bytes, which only ever reads past
+ * the keys of a Node4, and into its children array.
+ */
+static inline gint
+search_keys_scalar (const guchar *keys,
+                    guint         n_keys,
+                    guchar        c)
+{
+  guint i;
+
+  for (i = 0; i < n_keys; i++)
+    {
+      if (keys[i] == c)
+        return i;
+    }
+
+  return -1;
+}
+
+/* Returns the index of the first key >= @c, or @n_keys */
+static inline guint
+lower_bound_keys_scalar (const guchar *keys,
+                         guint         n_keys,
+                         guchar        c)
+{
+  guint i;
+
+  for (i = 0; i < n_keys; i++)
+    {
+      if (keys[i] >= c)
+        break;
+    }
+
+  return i;
+}
+
+#ifdef __SSE2__
+
+/* Masks out the bits of a 16-byte comparison past the last key */
+static inline guint
+valid_keys_mask (guint n_keys)
+{
+  return n_keys >= 16 ? 0xFFFF : (1u << n_keys) - 1;
+}
+
+static inline gint
+search_keys (const guchar *keys,
+             guint         n_keys,
+             guchar        c)
+{
+  __m128i needle;
+  guint i;
+
+  needle = _mm_set1_epi8 (c);
+
+  for (i = 0; i < n_keys; i += 16)
+    {
+      guint bitfield;
+
+      bitfield = _mm_movemask_epi8 (_mm_cmpeq_epi8 (needle, _mm_loadu_si128 ((const __m128i*) (keys + i))));
+      bitfield &= valid_keys_mask (n_keys - i);
+
+      if (bitfield)
+        return i + __builtin_ctz (bitfield);
+    }
+
+  return -1;
+}
+
+static inline guint
+lower_bound_keys (const guchar *keys,
+                  guint         n_keys,
+                  guchar        c)
+{
+  __m128i needle, sign;
+  guint i;
+
+  /*
+   * SSE2 only has signed comparisons, so flip the sign bit of both
+   * sides to compare the unsigned byte values.
+   */
+  sign = _mm_set1_epi8 ((gchar) 0x80);
+  needle = _mm_set1_epi8 (c ^ 0x80);
+
+  for (i = 0; i < n_keys; i += 16)
+    {
+      __m128i chunk;
+      guint bitfield;
+
+      chunk = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i*) (keys + i)), sign);
+      bitfield = ~_mm_movemask_epi8 (_mm_cmplt_epi8 (chunk, needle));
+      bitfield &= valid_keys_mask (n_keys - i);
+
+      if (bitfield)
+        return i + __builtin_ctz (bitfield);
+    }
+
+  return n_keys;
+}
+
+#else
+
+#define search_keys      search_keys_scalar
+#define lower_bound_keys lower_bound_keys_scalar
+
+#endif
+
+#ifdef HAVE_AVX2_TARGET
+
+__attribute__ ((target ("avx2")))
+static gint
+search_keys_avx2 (const guchar *keys,
+                  guint         n_keys,
+                  guchar        c)
+{
+  __m256i cmp;
+  guint bitfield;
+
+  cmp = _mm256_cmpeq_epi8 (_mm256_set1_epi8 (c), _mm256_loadu_si256 ((const __m256i*) keys));
+  bitfield = _mm256_movemask_epi8 (cmp);
+
+  if (n_keys < 32)
+    bitfield &= (1u << n_keys) - 1;
+
+  return bitfield ? __builtin_ctz (bitfield) : -1;
+}
+
+static gboolean
+cpu_has_avx2 (void)
+{
+  static gsize has_avx2 = 0;
+
+  if (g_once_init_enter (&has_avx2))
+    {
+      __builtin_cpu_init ();
+      g_once_init_leave (&has_avx2, __builtin_cpu_supports ("avx2") ? 2 : 1);
+    }
+
+  return has_avx2 == 2;
+}
+
+#endif
+
+static inline gint
+search_keys_32 (const guchar *keys,
+                guint         n_keys,
+                guchar        c)
+{
+#ifdef HAVE_AVX2_TARGET
+  if (cpu_has_avx2 ())
+    return search_keys_avx2 (keys, n_keys, c);
+#endif
+
+  return search_keys (keys, n_keys, c);
+}
+
+/*
+ * Auxiliary functions
+ */
+
+/*
+ * Only used to read compressed paths longer than MAX_PREFIX_LEN, so the
+ * keys below are too long to be embedded.
+ */
+static Leaf*
+minimum (const Node *n)
+{
+  gint i;
+
+  if (!n)
+    return NULL;
+
+  if (IS_LEAF (n))
+    return LEAF_RAW (n);
+
+  switch (n->type)
+    {
+    case NODE_4:
+      return minimum (DEREF (((Node4*) n)->children[0]));
+
+    case NODE_16:
+      return minimum (DEREF (((Node16*) n)->children[0]));
+
+    case NODE_32:
+      return minimum (DEREF (((Node32*) n)->children[0]));
+
+    case NODE_48:
+      i = 0;
+
+      while (!((Node48*) n)->keys[i])
+        i++;
+
+      i = ((Node48*) n)->keys[i] - 1;
+
+      return minimum (DEREF (((Node48*) n)->children[i]));
+
+    case NODE_256:
+      i = 0;
+
+      while (!((Node256*) n)->children[i])
+        i++;
+
+      return minimum (DEREF (((Node256*) n)->children[i]));
+
+    default:
+        g_assert_not_reached ();
+    }
+
+  return NULL;
+}
+
+/* Byte @i of the compressed path of @n, which starts at @depth */
+static guchar
+prefix_byte (Node    *n,
+             gint     depth,
+             guint32  i)
+{
+  if (i < MAX_PREFIX_LEN)
+    return n->partial[i];
+
+  return ((const guchar*) LEAF_KEY (minimum (n)))[depth + i];
+}
+
+static NodeRef*
+find_child (Node   *n,
+            guchar  c)
+{
+  Node256 *n256;
+  Node48 *n48;
+  Node32 *n32;
+  Node16 *n16;
+  Node4 *n4;
+  gint i;
+
+  switch (n->type)
+    {
+    case NODE_4:
+      n4 = (Node4*) n;
+      i = search_keys (n4->keys, n->num_children, c);
+
+      if (i >= 0)
+        return &n4->children[i];
+
+      break;
+
+    case NODE_16:
+      n16 = (Node16*) n;
+      i = search_keys (n16->keys, n->num_children, c);
+
+      if (i >= 0)
+        return &n16->children[i];
+
+      break;
+
+    case NODE_32:
+      n32 = (Node32*) n;
+      i = search_keys_32 (n32->keys, n->num_children, c);
+
+      if (i >= 0)
+        return &n32->children[i];
+
+      break;
+
+    case NODE_48:
+      n48 = (Node48*) n;
+      i = n48->keys[c];
+
+      if (i > 0)
+        return &n48->children[i - 1];
+
+      break;
+
+    case NODE_256:
+      n256 = (Node256*) n;
+
+      if (n256->children[c])
+        return &n256->children[c];
+
+      break;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  return NULL;
+}
+
+/* Leaves store their key from @start on, see leaf_start() */
+static gboolean
+leaf_matches (const Leaf   *n,
+              const guchar *key,
+              gint          key_len,
+              guint32       start)
+{
+  if (n->key_len != (guint32) key_len)
+    return FALSE;
+
+  return memcmp (LEAF_KEY (n), key + start, key_len - start) == 0;
+}
+
+static inline gboolean
+leaf_is_prefix_of (const Leaf   *l,
+                   const guchar *key,
+                   gint          key_len,
+                   guint32       start)
+{
+  if (l->key_len > (guint32) key_len)
+    return FALSE;
+
+  return memcmp (LEAF_KEY (l), key + start, l->key_len - start) == 0;
+}
+
+/* Keys are implicitly terminated by a NUL byte */
+static inline guchar
+key_byte (const guchar *key,
+          gint          key_len,
+          gint          depth)
+{
+  return depth < key_len ? key[depth] : '\0';
+}
+
+
+/* Compares @key from @depth on with the leaf @l, which stores its key from @start on */
+static gint
+longest_common_prefix (const Leaf   *l,
+                       guint32       start,
+                       const guchar *key,
+                       gint          key_len,
+                       gint          depth)
+{
+  const guchar *leaf_key;
+  gint max_cmp, i;
+
+  leaf_key = LEAF_KEY (l);
+  max_cmp = MIN ((gint) l->key_len, key_len) - depth;
+
+  for (i = 0; i < max_cmp; i++)
+    {
+      gint k = depth + i;
+
+      if (leaf_key[k - start] != key[k])
+          return i;
+    }
+
+  return i;
+}
+
+/*
+ * Returns the number of prefix characters shared between
+ * the key and node.
+ */
+static gint
+check_prefix (const Node   *n,
+              const guchar *key,
+              gint          key_len,
+              gint          depth)
+{
+  gint max_cmp, i;
+
+  max_cmp = MIN (MIN (MAX_PREFIX_LEN, n->partial_len), key_len - depth);
+
+  for (i = 0; i < max_cmp; i++)
+    {
+      if (n->partial[i] != key[depth + i])
+        return i;
+    }
+
+  return i;
+}
+
+
+/*
+ * Calculates the index at which the prefixes mismatch
+ */
+static gint
+prefix_mismatch (const Node   *n,
+                 const guchar *key,
+                 gint          key_len,
+                 int           depth)
+{
+  gint max_cmp;
+  gint i;
+
+  max_cmp = MIN (MIN (MAX_PREFIX_LEN, n->partial_len), key_len - depth);
+
+  for (i = 0; i < max_cmp; i++)
+    {
+      if (n->partial[i] != key[depth + i])
+        return i;
+    }
+
+  /* If the prefix is short we can avoid finding a leaf */
+  if (n->partial_len > MAX_PREFIX_LEN)
+    {
+      Leaf *leaf;
+      guchar *leaf_key;
+
+      /* Prefix is longer than what we've checked, find a leaf */
+      leaf = minimum (n);
+      leaf_key = LEAF_KEY (leaf);
+      max_cmp = MIN (leaf->key_len, key_len) - depth;
+
+      for (; i < max_cmp; i++)
+        {
+          if (leaf_key[depth + i] != key[depth + i])
+            return i;
+        }
+    }
+
+  return i;
+}
+
+/* The number of keys below @n, which counted trees keep in each node */
+static inline guint32
+subtree_keys (Node *n)
+{
+  return IS_LEAF (n) ? 1 : n->n_keys;
+}
+
+static void
+copy_header (GwRadixTree *self,
+             Node        *dest,
+             Node        *src)
+{
+  dest->num_children = src->num_children;
+  dest->partial_len = src->partial_len;
+
+  /* Concurrent trees start new nodes with a clean version instead */
+  if (self->counted)
+    dest->n_keys = src->n_keys;
+
+  memcpy (dest->partial,
+          src->partial,
+          MIN (MAX_PREFIX_LEN, src->partial_len));
+}
+
+static void
+add_child_256 (GwRadixTree *self,
+               Node256     *n,
+               guchar       c,
+               gpointer     child)
+{
+  child_store (&n->children[c], child);
+  num_children_add (&n->n, 1);
+
+  if (self->counted)
+    n->n.n_keys += subtree_keys (child);
+}
+
+static void
+add_child_48 (GwRadixTree  *self,
+              Node48       *n,
+              NodeRef      *ref,
+              guchar        c,
+              gpointer      child)
+{
+  if (n->n.num_children < 48)
+    {
+      gint pos = 0;
+
+      while (n->children[pos])
+        pos++;
+
+      child_store (&n->children[pos], child);
+      byte_store (&n->keys[c], pos + 1);
+      num_children_add (&n->n, 1);
+
+      if (self->counted)
+        n->n.n_keys += subtree_keys (child);
+    }
+  else
+    {
+      Node256 *new_node;
+
+      new_node = node_new (self, NODE_256);
+
+      for (int i=0;i<256;i++)
+        {
+          if (n->keys[i])
+            new_node->children[i] = n->children[n->keys[i] - 1];
+        }
+
+      copy_header (self, (Node*) new_node, (Node*) n);
+
+      child_store (ref, (Node*) new_node);
+
+      add_child_256 (self, new_node, c, child);
+
+      node_free (self, n);
+    }
+}
+
+/* Inserts @c and @child in the sorted arrays of a Node4, Node16 or Node32 */
+static void
+insert_sorted (guchar    *keys,
+               NodeRef   *children,
+               guint      n_children,
+               guchar     c,
+               gpointer   child)
+{
+  guint i;
+
+  guint j;
+
+  i = lower_bound_keys (keys, n_children, c);
+
+  /* Shift to make room */
+  bytes_store (keys + i + 1, keys + i, n_children - i);
+
+  for (j = n_children; j > i; j--)
+    child_store (&children[j], DEREF (children[j - 1]));
+
+  byte_store (&keys[i], c);
+  child_store (&children[i], child);
+}
+
+static void
+add_child_32 (GwRadixTree  *self,
+              Node32       *n,
+              NodeRef      *ref,
+              guchar        c,
+              gpointer      child)
+{
+  if (n->n.num_children < 32)
+    {
+      insert_sorted (n->keys, n->children, n->n.num_children, c, child);
+      num_children_add (&n->n, 1);
+
+      if (self->counted)
+        n->n.n_keys += subtree_keys (child);
+    }
+  else
+    {
+      Node48 *new_node;
+      guint i;
+
+      new_node = node_new (self, NODE_48);
+
+      /* Copy the child pointers and populate the key map */
+      memcpy (new_node->children,
+              n->children,
+              n->n.num_children * sizeof (NodeRef));
+
+      for (i = 0; i < n->n.num_children; i++)
+        new_node->keys[n->keys[i]] = i + 1;
+
+      copy_header (self, (Node*) new_node, (Node*) n);
+
+      child_store (ref, (Node*) new_node);
+
+      add_child_48 (self, new_node, ref, c, child);
+
+      node_free (self, n);
+   }
+}
+
+static void
+add_child_16 (GwRadixTree  *self,
+              Node16       *n,
+              NodeRef      *ref,
+              guchar        c,
+              gpointer      child)
+{
+  if (n->n.num_children < 16)
+    {
+      insert_sorted (n->keys, n->children, n->n.num_children, c, child);
+      num_children_add (&n->n, 1);
+
+      if (self->counted)
+        n->n.n_keys += subtree_keys (child);
+    }
+  else
+    {
+      Node32 *new_node;
+
+      new_node = node_new (self, NODE_32);
+
+      /* Keys are sorted in both, so they can be copied as is */
+      memcpy (new_node->children,
+              n->children,
+              n->n.num_children * sizeof (NodeRef));
+
+      memcpy (new_node->keys,
+              n->keys,
+              n->n.num_children * sizeof (guchar));
+
+      copy_header (self, (Node*) new_node, (Node*) n);
+
+      child_store (ref, (Node*) new_node);
+
+      add_child_32 (self, new_node, ref, c, child);
+
+      node_free (self, n);
+   }
+}
+
+static void
+add_child_4 (GwRadixTree  *self,
+             Node4        *n,
+             NodeRef      *ref,
+             guchar        c,
+             gpointer      child)
+{
+  if (n->n.num_children < 4)
+    {
+      insert_sorted (n->keys, n->children, n->n.num_children, c, child);
+      num_children_add (&n->n, 1);
+
+      if (self->counted)
+        n->n.n_keys += subtree_keys (child);
+    }
+  else
+    {
+      Node16 *new_node;
+
+      new_node = node_new (self, NODE_16);
+
+      /* Copy the child pointers and the key map */
+      memcpy (new_node->children,
+              n->children,
+              n->n.num_children * sizeof (NodeRef));
+
+      memcpy (new_node->keys,
+              n->keys,
+              n->n.num_children * sizeof (guchar));
+
+      copy_header (self, (Node*) new_node, (Node*) n);
+
+      child_store (ref, (Node*) new_node);
+
+      add_child_16 (self, new_node, ref, c, child);
+
+      node_free (self, n);
+    }
+}
+
+static void
+add_child (GwRadixTree  *self,
+           Node         *n,
+           NodeRef      *ref,
+           guchar        c,
+           gpointer      child)
+{
+  switch (n->type)
+    {
+    case NODE_4:
+      return add_child_4 (self, (Node4*) n, ref, c, child);
+
+    case NODE_16:
+      return add_child_16 (self, (Node16*) n, ref, c, child);
+
+    case NODE_32:
+      return add_child_32 (self, (Node32*) n, ref, c, child);
+
+    case NODE_48:
+      return add_child_48 (self, (Node48*) n, ref, c, child);
+
+    case NODE_256:
+      return add_child_256 (self, (Node256*) n, c, child);
+
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+/*
+ * Writers either store the given value, or let @update compute it from
+ * the current one, see gw_radix_tree_upsert(). @value is then the user
+ * data of @update.
+ */
+static inline gpointer
+updated_value (RadixTreeUpdateCb update,
+               gpointer          value,
+               gpointer          old_value,
+               gboolean          found)
+{
+  return update ? update (old_value, found, value) : value;
+}
+
+static gpointer
+insert_recursive (GwRadixTree        *self,
+                  Node               *n,
+                  NodeRef            *ref,
+                  const guchar       *key,
+                  gint                key_len,
+                  RadixTreeUpdateCb   update,
+                  gpointer            value,
+                  gint                depth,
+                  gboolean           *old)
+{
+  NodeRef *child;
+
+  /* If we are at a NULL node, inject a leaf */
+  if (!n)
+    {
+      *ref = REF (leaf_node_new (self, key, key_len, depth, updated_value (update, value, NULL, FALSE)));
+      return NULL;
+    }
+
+  /* If we are at a leaf, we need to replace it with a node */
+  if (IS_LEAF (n))
+    {
+      LeafView view;
+      Node4 *new_node;
+      Leaf *leaf;
+      Node *new_child;
+      gint longest_prefix;
+      guint32 start;
+      guchar c;
+
+      leaf = leaf_view (n, &view);
+      start = leaf_start (self->compact_leaves, leaf->key_len, depth);
+
+      /* Check if we are updating an existing value */
+      if (leaf_matches (leaf, key, key_len, start))
+        {
+          gpointer old_val, new_val;
+
+          old_val = leaf->value;
+          new_val = updated_value (update, value, old_val, TRUE);
+
+          /* Other trees still see the old value, and embedded keys have none */
+          if (IS_EMBEDDED (n) || g_atomic_int_get (&leaf->ref_count) > 1)
+            {
+              *ref = REF (leaf_node_new (self, key, key_len, depth, new_val));
+
+              /* Numbers may not fit in the value, and are never replaced here */
+              if (self->uint64_values)
+                LEAF_RAW (DEREF (*ref))->number = leaf->number;
+
+              if (!IS_EMBEDDED (n))
+                leaf_unref (self, leaf, FALSE);
+            }
+          else
+            {
+              leaf->value = new_val;
+            }
+
+          *old = TRUE;
+
+          return old_val;
+        }
+
+      // Determine longest prefix
+      longest_prefix = longest_common_prefix (leaf, start, key, key_len, depth);
+
+      /* Compact trees keep whole compressed paths in the nodes, chaining long ones */
+      if (self->compact_leaves && longest_prefix > MAX_PREFIX_LEN)
+        {
+          new_node = node_new (self, NODE_4);
+          new_node->n.partial_len = MAX_PREFIX_LEN;
+
+          memcpy (new_node->n.partial, key + depth, MAX_PREFIX_LEN);
+
+          *ref = REF ((Node*) new_node);
+
+          add_child_4 (self,
+                       new_node,
+                       ref,
+                       key[depth + MAX_PREFIX_LEN],
+                       leaf_move (self, n, depth, depth + MAX_PREFIX_LEN + 1, NULL));
+
+          insert_recursive (self,
+                            DEREF (new_node->children[0]),
+                            &new_node->children[0],
+                            key,
+                            key_len,
+                            update,
+                            value,
+                            depth + MAX_PREFIX_LEN + 1,
+                            old);
+
+          /* The keys differ, so the new one was added below */
+          if (self->counted)
+            new_node->n.n_keys++;
+
+          return NULL;
+        }
+
+      /* we must split the leaf into a Node4 */
+      new_node = node_new (self, NODE_4);
+      new_node->n.partial_len = longest_prefix;
+
+      memcpy(new_node->n.partial,
+             key + depth,
+             MIN (MAX_PREFIX_LEN, longest_prefix));
+
+      /* Add the leafs to the new Node4 */
+      *ref = REF ((Node*) new_node);
+
+      c = ((guchar*) LEAF_KEY (leaf))[depth + longest_prefix - start];
+
+      add_child_4 (self,
+                   new_node,
+                   ref,
+                   c,
+                   leaf_move (self, n, depth, depth + longest_prefix + 1, NULL));
+
+      /* Create a new leaf */
+      new_child = leaf_node_new (self,
+                                 key,
+                                 key_len,
+                                 depth + longest_prefix + 1,
+                                 updated_value (update, value, NULL, FALSE));
+
+      add_child_4 (self,
+                   new_node,
+                   ref,
+                   key_byte (key, key_len, depth + longest_prefix),
+                   new_child);
+
+      return NULL;
+    }
+
+  n = node_make_unique (self, ref);
+
+  /* Check if given node has a prefix */
+  if (n->partial_len)
+    {
+      Node4 *new_node;
+      Node *new_leaf;
+      gint prefix_diff;
+
+      /* Determine if the prefixes differ, since we need to split */
+      prefix_diff = prefix_mismatch (n, key, key_len, depth);
+
+      if ((guint32) prefix_diff >= n->partial_len)
+        {
+          depth += n->partial_len;
+          goto recurse;
+        }
+
+      /* Create a new node */
+      new_node = node_new (self, NODE_4);
+      new_node->n.partial_len = prefix_diff;
+
+      memcpy (new_node->n.partial,
+              n->partial,
+              MIN (MAX_PREFIX_LEN, prefix_diff));
+
+      *ref = REF ((Node*) new_node);
+
+      /* Adjust the prefix of the old node */
+      if (n->partial_len > MAX_PREFIX_LEN)
+        {
+          Leaf *leaf;
+          guchar *leaf_key;
+
+          n->partial_len -= prefix_diff + 1;
+          leaf = minimum (n);
+          leaf_key = LEAF_KEY (leaf);
+
+          add_child_4 (self, new_node, ref, leaf_key[depth + prefix_diff], n);
+
+          memcpy (n->partial,
+                  leaf_key + depth + prefix_diff + 1,
+                  MIN (MAX_PREFIX_LEN, n->partial_len));
+
+        }
+      else
+        {
+          add_child_4 (self, new_node, ref, n->partial[prefix_diff], n);
+
+          n->partial_len -= prefix_diff + 1;
+
+          memmove (n->partial,
+                   n->partial + prefix_diff + 1,
+                   MIN (MAX_PREFIX_LEN, n->partial_len));
+        }
+
+      /* Insert the new leaf */
+      new_leaf = leaf_node_new (self,
+                                key,
+                                key_len,
+                                depth + prefix_diff + 1,
+                                updated_value (update, value, NULL, FALSE));
+
+      add_child_4 (self, new_node, ref, key_byte (key, key_len, depth + prefix_diff), new_leaf);
+
+      return NULL;
+    }
+
+recurse:
+
+  /* Find a child to recurse to */
+  child = find_child (n, key_byte (key, key_len, depth));
+
+  if (child)
+    {
+      gpointer old_val;
+
+      old_val = insert_recursive (self,
+                                  DEREF (*child),
+                                  child,
+                                  key,
+                                  key_len,
+                                  update,
+                                  value,
+                                  depth + 1,
+                                  old);
+
+      if (!*old && self->counted)
+        n->n_keys++;
+
+      return old_val;
+    }
+
+
+  /* No child, node goes within us */
+  add_child (self,
+             n,
+             ref,
+             key_byte (key, key_len, depth),
+             leaf_node_new (self, key, key_len, depth + 1, updated_value (update, value, NULL, FALSE)));
+
+  return NULL;
+}
+
+static void
+remove_child_256 (GwRadixTree  *self,
+                  Node256      *n,
+                  NodeRef      *ref,
+                  guchar        c)
+{
+  child_store (&n->children[c], NULL);
+  num_children_add (&n->n, -1);
+
+  /*
+   * Resize to a Node48 on underflow, not immediately to prevent
+   * trashing if we sit on the 48/49 boundary
+   */
+  if (n->n.num_children == 37)
+    {
+      Node48 *new_node;
+      gint pos, i;
+
+      new_node = node_new (self, NODE_48);
+
+      copy_header (self, (Node*) new_node, (Node*) n);
+
+      pos = 0;
+      for (i = 0; i < 256; i++)
+        {
+          if (n->children[i])
+            {
+              new_node->children[pos] = n->children[i];
+              new_node->keys[i] = pos + 1;
+              pos++;
+            }
+        }
+
+      child_store (ref, (Node*) new_node);
+
+      node_free (self, n);
+    }
+}
+
+static void
+remove_child_48 (GwRadixTree  *self,
+                 Node48       *n,
+                 NodeRef      *ref,
+                 guchar        c)
+{
+  gint pos;
+
+  pos = n->keys[c];
+
+  byte_store (&n->keys[c], 0);
+  child_store (&n->children[pos - 1], NULL);
+  num_children_add (&n->n, -1);
+
+  if (n->n.num_children == 24)
+    {
+      Node32 *new_node;
+      gint child, i;
+
+      new_node = node_new (self, NODE_32);
+
+      copy_header (self, (Node*) new_node, (Node*) n);
+
+      child = 0;
+
+      for (i = 0; i < 256; i++)
+        {
+          pos = n->keys[i];
+
+          if (pos)
+            {
+              new_node->keys[child] = i;
+              new_node->children[child] = n->children[pos - 1];
+              child++;
+            }
+        }
+
+      child_store (ref, (Node*) new_node);
+
+      node_free (self, n);
+    }
+}
+
+/* Removes the child at @pos from the sorted arrays of a Node4, Node16 or Node32 */
+static void
+remove_sorted (guchar  *keys,
+               NodeRef *children,
+               guint    n_children,
+               guint    pos)
+{
+  guint i;
+
+  bytes_store (keys + pos, keys + pos + 1, n_children - 1 - pos);
+
+  for (i = pos; i + 1 < n_children; i++)
+    child_store (&children[i], DEREF (children[i + 1]));
+}
+
+static void
+remove_child_32 (GwRadixTree  *self,
+                 Node32       *n,
+                 NodeRef      *ref,
+                 NodeRef      *l)
+{
+  remove_sorted (n->keys, n->children, n->n.num_children, l - n->children);
+
+  num_children_add (&n->n, -1);
+
+  if (n->n.num_children == 12)
+    {
+      Node16 *new_node;
+
+      new_node = node_new (self, NODE_16);
+
+      copy_header (self, (Node*) new_node, (Node*) n);
+
+      memcpy (new_node->keys, n->keys, 12);
+      memcpy (new_node->children, n->children, 12 * sizeof (NodeRef));
+
+      child_store (ref, (Node*) new_node);
+
+      node_free (self, n);
+    }
+}
+
+static void
+remove_child_16 (GwRadixTree  *self,
+                 Node16       *n,
+                 NodeRef      *ref,
+                 NodeRef      *l)
+{
+  remove_sorted (n->keys, n->children, n->n.num_children, l - n->children);
+
+  num_children_add (&n->n, -1);
+
+  /* Fall back to a 4-child node */
+  if (n->n.num_children == 3)
+    {
+      Node4 *new_node;
+
+      new_node = node_new (self, NODE_4);
+
+      copy_header (self, (Node*) new_node, (Node*) n);
+
+      memcpy (new_node->keys, n->keys, 4);
+      memcpy (new_node->children, n->children, 4 * sizeof (NodeRef));
+
+      child_store (ref, (Node*) new_node);
+
+      node_free (self, n);
+    }
+}
+
+static void
+remove_child_4 (GwRadixTree  *self,
+                Node4        *n,
+                NodeRef      *ref,
+                NodeRef      *l)
+{
+  remove_sorted (n->keys, n->children, n->n.num_children, l - n->children);
+
+  num_children_add (&n->n, -1);
+
+  /* Compact trees do this on the way back up, see merge_single_child() */
+  if (self->compact_leaves)
+    return;
+
+  /* Remove nodes with only a single child */
+  if (n->n.num_children == 1)
+    {
+      Node *child = node_make_unique (self, &n->children[0]);
+
+      if (!IS_LEAF (child))
+        {
+          gint prefix;
+
+          /* Concatenate the prefixes */
+          prefix = n->n.partial_len;
+
+          if (prefix < MAX_PREFIX_LEN)
+            {
+              byte_store (&n->n.partial[prefix], n->keys[0]);
+              prefix++;
+            }
+
+          if (prefix < MAX_PREFIX_LEN)
+            {
+              gint sub_prefix;
+
+              sub_prefix = MIN (child->partial_len, MAX_PREFIX_LEN - prefix);
+
+              bytes_store (n->n.partial + prefix, child->partial, sub_prefix);
+
+              prefix += sub_prefix;
+            }
+
+          /* Store the prefix in the child */
+          bytes_store (child->partial, n->n.partial, MIN (prefix, MAX_PREFIX_LEN));
+
+          partial_len_add (child, n->n.partial_len + 1);
+        }
+
+      child_store (ref, child);
+      node_free (self, n);
+    }
+}
+
+static void
+remove_child (GwRadixTree  *self,
+              Node         *n,
+              NodeRef      *ref,
+              guchar        c,
+              NodeRef      *l)
+{
+  if (self->counted)
+    n->n_keys -= subtree_keys (DEREF (*l));
+
+  switch (n->type)
+    {
+    case NODE_4:
+      return remove_child_4 (self, (Node4*) n, ref, l);
+
+    case NODE_16:
+      return remove_child_16 (self, (Node16*) n, ref, l);
+
+    case NODE_32:
+      return remove_child_32 (self, (Node32*) n, ref, l);
+
+    case NODE_48:
+      return remove_child_48 (self, (Node48*) n, ref, c);
+
+    case NODE_256:
+      return remove_child_256 (self, (Node256*) n, ref, c);
+
+    default:
+        g_assert_not_reached ();
+    }
+}
+
+/*
+ * Merges a Node4 of a compact tree at @depth that was left with a single
+ * child into it. Its leaf moves up, and takes the bytes of the path it
+ * skips, and a node only takes the compressed path if it still fits.
+ */
+static void
+merge_single_child (GwRadixTree  *self,
+                    NodeRef      *ref,
+                    gint          depth)
+{
+  guchar path[MAX_PREFIX_LEN + 1];
+  Node *n, *child;
+  guint32 path_len;
+
+  n = DEREF (*ref);
+
+  if (IS_LEAF (n) || n->type != NODE_4 || n->num_children != 1)
+    return;
+
+  child = DEREF (((Node4*) n)->children[0]);
+  path_len = n->partial_len + 1;
+
+  memcpy (path, n->partial, n->partial_len);
+  path[n->partial_len] = ((Node4*) n)->keys[0];
+
+  if (IS_LEAF (child))
+    {
+      *ref = REF (leaf_move (self, child, depth + path_len, depth, path));
+    }
+  else
+    {
+      if (path_len + child->partial_len > MAX_PREFIX_LEN)
+        return;
+
+      memmove (child->partial + path_len, child->partial, child->partial_len);
+      memcpy (child->partial, path, path_len);
+
+      child->partial_len += path_len;
+      *ref = REF (child);
+    }
+
+  node_free (self, n);
+}
+
+/*
+ * Looks @key up below @n, whose key bytes before @depth match @key, and
+ * returns the tagged pointer of its leaf. @compact tells whether @n is
+ * part of a compact tree.
+ */
+static Node*
+lookup_leaf (Node         *n,
+             const guchar *key,
+             gint          key_len,
+             gint          depth,
+             gboolean      compact)
+{
+  LeafView view;
+  NodeRef *child;
+
+  while (n)
+    {
+      if (IS_LEAF (n))
+        {
+          Leaf *l = leaf_view (n, &view);
+
+          if (!leaf_matches (l, key, key_len, leaf_start (compact, l->key_len, depth)))
+            return NULL;
+
+          return n;
+        }
+
+      /* Bail if the prefix does not match */
+      if (n->partial_len)
+        {
+          gint prefix_len;
+
+          prefix_len = check_prefix (n, key, key_len, depth);
+
+          if (prefix_len != MIN (MAX_PREFIX_LEN, n->partial_len))
+            return NULL;
+
+          depth = depth + n->partial_len;
+        }
+
+      /* Recursively search */
+      child = find_child (n, key_byte (key, key_len, depth));
+      n = child ? DEREF (*child) : NULL;
+      depth++;
+    }
+
+  return NULL;
+}
+
+/* Returns the tagged pointer of the removed leaf */
+static Node*
+remove_recursive (GwRadixTree   *self,
+                  Node          *n,
+                  NodeRef       *ref,
+                  const guchar  *key,
+                  gint           key_len,
+                  gint           depth,
+                  gboolean       found)
+{
+  LeafView view;
+  NodeRef *child;
+  Node *removed;
+  gint n_depth;
+
+  if (!n)
+    return NULL;
+
+  if (IS_LEAF (n))
+    {
+      Leaf *l = leaf_view (n, &view);
+
+      if (leaf_matches (l, key, key_len, leaf_start (self->compact_leaves, l->key_len, depth)))
+        {
+          *ref = REF (NULL);
+          return n;
+        }
+
+      return NULL;
+    }
+
+  /* Shared nodes are only copied once the key is known to be there */
+  if (!found && g_atomic_int_get (&n->ref_count) > 1)
+    {
+      if (!lookup_leaf (n, key, key_len, depth, self->compact_leaves))
+        return NULL;
+
+      found = TRUE;
+    }
+
+  n = node_make_unique (self, ref);
+  n_depth = depth;
+
+  /* Bail if the prefix does not match */
+  if (n->partial_len)
+    {
+      gint prefix_len;
+
+      prefix_len = check_prefix (n, key, key_len, depth);
+
+      if (prefix_len != MIN (MAX_PREFIX_LEN, n->partial_len))
+        return NULL;
+
+      depth = depth + n->partial_len;
+    }
+
+  /* Find child node */
+  child = find_child (n, key_byte (key, key_len, depth));
+
+  if (!child)
+    return NULL;
+
+  /* If the child is leaf, delete from this node */
+  if (IS_LEAF (*child))
+    {
+      Leaf *l;
+
+      removed = DEREF (*child);
+      l = leaf_view (removed, &view);
+
+      if (!leaf_matches (l, key, key_len, leaf_start (self->compact_leaves, l->key_len, depth + 1)))
+        return NULL;
+
+      remove_child (self, n, ref, key_byte (key, key_len, depth), child);
+    }
+  else
+    {
+      removed = remove_recursive (self, DEREF (*child), child, key, key_len, depth + 1, found);
+
+      if (removed && self->counted)
+        n->n_keys--;
+    }
+
+  if (removed && self->compact_leaves)
+    merge_single_child (self, ref, n_depth);
+
+  return removed;
+}
+
+/*
+ * Batched lookups
+ *
+ * Each step of a descent depends on the node loaded by the previous
+ * one, so a single lookup spends most of its time waiting for memory.
+ * Batched lookups keep several descents in flight, and advance them in
+ * turns: when a descent reaches a node, it prefetches it and lets the
+ * others run, so the node is in cache by the time it's its turn again.
+ */
+#define LOOKUP_GROUP_SIZE 8
+
+typedef struct
+{
+  Node               *n;
+  gsize               index;
+  const guchar       *key;
+  gint                key_len;
+  gint                depth;
+  gboolean            compact;
+} LookupState;
+
+static inline void
+prefetch_node (Node *n)
+{
+  if (IS_EMBEDDED (n))
+    return;
+
+  if (IS_LEAF (n))
+    __builtin_prefetch (LEAF_RAW (n));
+  else
+    __builtin_prefetch (n);
+}
+
+/* Returns %TRUE when the descent is over, leaving its leaf in @result */
+static inline gboolean
+lookup_step (LookupState  *state,
+             Node        **result)
+{
+  LeafView view;
+  NodeRef *child;
+  Node *n;
+
+  n = state->n;
+  *result = NULL;
+
+  if (!n)
+    return TRUE;
+
+  if (IS_LEAF (n))
+    {
+      Leaf *l = leaf_view (n, &view);
+
+      if (leaf_matches (l, state->key, state->key_len, leaf_start (state->compact, l->key_len, state->depth)))
+        *result = n;
+
+      return TRUE;
+    }
+
+  /* Bail if the prefix does not match */
+  if (n->partial_len)
+    {
+      gint prefix_len;
+
+      prefix_len = check_prefix (n, state->key, state->key_len, state->depth);
+
+      if (prefix_len != MIN (MAX_PREFIX_LEN, n->partial_len))
+        return TRUE;
+
+      state->depth += n->partial_len;
+    }
+
+  child = find_child (n, key_byte (state->key, state->key_len, state->depth));
+
+  state->n = child ? DEREF (*child) : NULL;
+  state->depth++;
+
+  if (state->n)
+    prefetch_node (state->n);
+
+  return FALSE;
+}
+
+/*
+ * Bulk loading
+ *
+ * Sorted keys sharing a prefix are contiguous, so the tree can be built
+ * top-down one range at a time: the prefix common to a whole range is
+ * the one shared by its first and last keys, and the range is split by
+ * the byte that follows it. Each node is created with its final type,
+ * and every key is only scanned once per level.
+ */
+typedef struct
+{
+  GwRadixTree         *tree;
+  const gchar * const *keys;
+  const gsize         *key_lengths;
+  gpointer            *values;
+  Node               **leaves;
+} BulkLoad;
+
+static inline guchar
+bulk_key_byte (BulkLoad *load,
+               gsize     i,
+               gint      depth)
+{
+  if (load->key_lengths)
+    return key_byte ((const guchar*) load->keys[i], load->key_lengths[i], depth);
+
+  /* Keys are NUL-terminated, and as long as the prefix of their range */
+  return load->keys[i][depth];
+}
+
+/*
+ * Keys with explicit lengths can end where the others go on with NUL
+ * bytes, and both then map to the same byte. Like insert_recursive()
+ * does, a key that ends is kept as a child of its own rather than
+ * grouped with the keys that go on.
+ */
+static inline gboolean
+bulk_key_ends (BulkLoad *load,
+               gsize     i,
+               gint      depth)
+{
+  return load->key_lengths && load->key_lengths[i] <= (gsize) depth;
+}
+
+/* Only sorted nodes can have several children for the same byte */
+#define BULK_MAX_NUL_CHILDREN 32
+
+static Node*
+build_sorted (BulkLoad *load,
+              gsize     start,
+              gsize     end,
+              gint      depth)
+{
+  Node *nul_children[BULK_MAX_NUL_CHILDREN];
+  Node *n;
+  gsize i, group_start;
+  guint n_groups, n_nul_groups, n_nul_split, n_nul_children;
+  gint prefix_len, max_prefix_len, last_byte;
+
+  if (end - start == 1)
+    {
+      const gchar *key = load->keys[start];
+
+      /* Leaves of the keys, when given, are taken over */
+      if (load->leaves)
+        return load->leaves[start];
+
+      return leaf_node_new (load->tree,
+                            (const guchar*) key,
+                            load->key_lengths ? load->key_lengths[start] : strlen (key),
+                            depth,
+                            load->values ? load->values[start] : NULL);
+    }
+
+  /* NUL-terminated keys differ at the latest where the shorter one ends */
+  max_prefix_len = G_MAXINT;
+
+  if (load->key_lengths)
+    {
+      gsize len = MIN (load->key_lengths[start], load->key_lengths[end - 1]);
+
+      max_prefix_len = len > (gsize) depth ? (gint) (len - depth) : 0;
+    }
+
+  prefix_len = 0;
+
+  while (prefix_len < max_prefix_len &&
+         bulk_key_byte (load, start, depth + prefix_len) ==
+         bulk_key_byte (load, end - 1, depth + prefix_len))
+    {
+      prefix_len++;
+    }
+
+  depth += prefix_len;
+
+  /* Count the children to pick the node type upfront */
+  n_groups = 0;
+  n_nul_groups = 0;
+  last_byte = -1;
+
+  for (i = start; i < end; i++)
+    {
+      guchar c = bulk_key_byte (load, i, depth);
+
+      if (c != last_byte || bulk_key_ends (load, i - 1, depth))
+        {
+          last_byte = c;
+          n_groups++;
+
+          if (c == '\0')
+            n_nul_groups++;
+        }
+    }
+
+  /*
+   * Past what a Node32 holds, the last children for the NUL byte are
+   * built as a subtree of their own one level deeper instead.
+   */
+  n_nul_split = n_nul_groups;
+
+  if (n_nul_groups > 1 && n_groups > BULK_MAX_NUL_CHILDREN)
+    {
+      guint n_others = n_groups - n_nul_groups;
+
+      n_nul_split = n_others < BULK_MAX_NUL_CHILDREN - 1 ? BULK_MAX_NUL_CHILDREN - 1 - n_others : 0;
+      n_groups = n_others + n_nul_split + 1;
+    }
+
+  if (n_groups <= 4)
+    n = node_new (load->tree, NODE_4);
+  else if (n_groups <= 16)
+    n = node_new (load->tree, NODE_16);
+  else if (n_groups <= 32)
+    n = node_new (load->tree, NODE_32);
+  else if (n_groups <= 48)
+    n = node_new (load->tree, NODE_48);
+  else
+    n = node_new (load->tree, NODE_256);
+
+  n->partial_len = prefix_len;
+
+  memcpy (n->partial,
+          load->keys[start] + depth - prefix_len,
+          MIN (MAX_PREFIX_LEN, prefix_len));
+
+  /* Children come in order, and always fit */
+  group_start = start;
+  n_nul_children = 0;
+
+  for (i = start + 1; i <= end; i++)
+    {
+      guchar c = bulk_key_byte (load, group_start, depth);
+      Node *child;
+
+      if (i < end && bulk_key_byte (load, i, depth) == c)
+        {
+          /* The NUL children past the split all go to the last one */
+          if (c == '\0' && n_nul_children >= n_nul_split)
+            continue;
+
+          if (!bulk_key_ends (load, i - 1, depth))
+            continue;
+        }
+
+      child = build_sorted (load, group_start, i, depth + 1);
+      group_start = i;
+
+      if (c == '\0' && n_nul_groups > 1)
+        {
+          nul_children[n_nul_children++] = child;
+          continue;
+        }
+
+      /*
+       * The NUL children sort first, so they're all built by now. They're
+       * added last to first, as add_child() inserts before the same byte.
+       */
+      while (n_nul_children > 0)
+        add_child (load->tree, n, NULL, '\0', nul_children[--n_nul_children]);
+
+      add_child (load->tree, n, NULL, c, child);
+    }
+
+  while (n_nul_children > 0)
+    add_child (load->tree, n, NULL, '\0', nul_children[--n_nul_children]);
+
+  return n;
+}
+
+static gboolean
+keys_are_sorted (const gchar * const *keys,
+                 const gsize         *key_lengths,
+                 gsize                n_keys)
+{
+  gsize i;
+
+  for (i = 1; i < n_keys; i++)
+    {
+      gint res;
+
+      if (key_lengths)
+        {
+          res = memcmp (keys[i - 1], keys[i], MIN (key_lengths[i - 1], key_lengths[i]));
+
+          if (res == 0)
+            res = key_lengths[i - 1] < key_lengths[i] ? -1 : (key_lengths[i - 1] > key_lengths[i]);
+        }
+      else
+        {
+          res = strcmp (keys[i - 1], keys[i]);
+        }
+
+      if (res >= 0)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * Parallel bulk loading
+ *
+ * Keys are partitioned by their first byte, and each partition is
+ * sorted and built into the subtree below that byte on a thread pool.
+ * The subtrees are independent, so they only have to be attached to
+ * the root once all of them are built.
+ */
+#define BULK_PARALLEL_THRESHOLD 4096
+
+typedef struct
+{
+  BulkLoad            load;
+  gsize              *order;
+  gsize               n_keys;
+  gint                depth;
+  guchar              byte;
+  Node               *root;
+} BulkPartition;
+
+static gint
+compare_partition_sizes (gconstpointer a,
+                         gconstpointer b,
+                         gpointer      user_data)
+{
+  const BulkPartition *pa = *(BulkPartition * const *) a;
+  const BulkPartition *pb = *(BulkPartition * const *) b;
+
+  return pa->n_keys < pb->n_keys ? 1 : -(pa->n_keys > pb->n_keys);
+}
+
+static gint
+compare_bulk_keys (gconstpointer a,
+                   gconstpointer b,
+                   gpointer      user_data)
+{
+  BulkLoad *load = user_data;
+  gsize i = *(const gsize*) a;
+  gsize j = *(const gsize*) b;
+  gsize len_i, len_j;
+  gint res;
+
+  if (!load->key_lengths)
+    return strcmp (load->keys[i], load->keys[j]);
+
+  len_i = load->key_lengths[i];
+  len_j = load->key_lengths[j];
+
+  res = memcmp (load->keys[i], load->keys[j], MIN (len_i, len_j));
+
+  if (res != 0)
+    return res;
+
+  return len_i < len_j ? -1 : len_i > len_j;
+}
+
+static void
+build_partition (gpointer data,
+                 gpointer user_data)
+{
+  BulkPartition *partition = data;
+  BulkLoad *load = &partition->load;
+  BulkLoad sorted;
+  const gchar **keys;
+  gpointer *values;
+  gsize *key_lengths;
+  gsize i, n_keys;
+
+  /* Word lists are often sorted already */
+  for (i = 1; i < partition->n_keys; i++)
+    {
+      if (compare_bulk_keys (&partition->order[i - 1], &partition->order[i], load) > 0)
+        break;
+    }
+
+  /* The sort is stable, so the last duplicate of a key wins */
+  if (i < partition->n_keys)
+    {
+      g_qsort_with_data (partition->order,
+                         partition->n_keys,
+                         sizeof (gsize),
+                         compare_bulk_keys,
+                         load);
+    }
+
+  keys = g_new (const gchar*, partition->n_keys);
+  key_lengths = load->key_lengths ? g_new (gsize, partition->n_keys) : NULL;
+  values = load->values ? g_new (gpointer, partition->n_keys) : NULL;
+  n_keys = 0;
+
+  for (i = 0; i < partition->n_keys; i++)
+    {
+      gsize index = partition->order[i];
+
+      if (i + 1 < partition->n_keys &&
+          compare_bulk_keys (&partition->order[i], &partition->order[i + 1], load) == 0)
+        {
+          continue;
+        }
+
+      keys[n_keys] = load->keys[index];
+
+      if (key_lengths)
+        key_lengths[n_keys] = load->key_lengths[index];
+
+      if (values)
+        values[n_keys] = load->values[index];
+
+      n_keys++;
+    }
+
+  sorted = (BulkLoad) { load->tree, keys, key_lengths, values };
+
+  partition->root = build_sorted (&sorted, 0, n_keys, partition->depth);
+  partition->n_keys = n_keys;
+
+  g_free (keys);
+  g_free (key_lengths);
+  g_free (values);
+}
+
+/*
+ * Concurrent trees
+ *
+ * Readers validate the version of every node they went through before
+ * trusting what they read from it, and start over from the root if a
+ * writer changed it in the meantime. Writers descend the same way, and
+ * only lock the nodes they modify by upgrading the version they read:
+ * the node itself, plus its parent when the node is replaced. The root
+ * is a Node256 that is never replaced, so there's always a parent.
+ *
+ * Nothing read from a node can be trusted before validating it, so the
+ * helpers below clamp whatever they use as an index.
+ */
+static inline gboolean
+version_read (Node  *n,
+              guint *version)
+{
+  *version = g_atomic_int_get (&n->version);
+
+  return (*version & (VERSION_LOCKED | VERSION_OBSOLETE)) == 0;
+}
+
+static inline gboolean
+version_check (Node  *n,
+               guint  version)
+{
+  /* Make sure the contents of the node are read before its version */
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+  return (guint) g_atomic_int_get (&n->version) == version;
+}
+
+static inline gboolean
+version_upgrade (Node  *n,
+                 guint  version)
+{
+  if (!g_atomic_int_compare_and_exchange (&n->version,
+                                          (gint) version,
+                                          (gint) (version + VERSION_LOCKED)))
+    {
+      return FALSE;
+    }
+
+  /* Readers that see any store to the node then see it locked */
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+
+  return TRUE;
+}
+
+static inline void
+version_unlock (Node *n)
+{
+  g_atomic_int_add (&n->version, VERSION_LOCKED);
+}
+
+static inline void
+version_unlock_obsolete (Node *n)
+{
+  g_atomic_int_add (&n->version, VERSION_LOCKED | VERSION_OBSOLETE);
+}
+
+/* Concurrent counterpart of check_prefix(), for the @partial_len read before */
+static gint
+check_prefix_optimistic (const Node   *n,
+                         guint32       partial_len,
+                         const guchar *key,
+                         gint          key_len,
+                         gint          depth)
+{
+  guchar partial[MAX_PREFIX_LEN];
+  gint max_cmp, i;
+
+  bytes_load (partial, n->partial, MAX_PREFIX_LEN);
+
+  max_cmp = MIN (MIN (MAX_PREFIX_LEN, partial_len), key_len - depth);
+
+  for (i = 0; i < max_cmp; i++)
+    {
+      if (partial[i] != key[depth + i])
+        return i;
+    }
+
+  return i;
+}
+
+static Node*
+find_child_optimistic (Node   *n,
+                       guchar  c)
+{
+  guchar keys[32] __attribute__ ((aligned (16)));
+  Node48 *n48;
+  Node32 *n32;
+  Node16 *n16;
+  Node4 *n4;
+  guint num_children;
+  gint i;
+
+  num_children = __atomic_load_n (&n->num_children, __ATOMIC_RELAXED);
+
+  /* Keys are searched in a copy, since vector loads aren't atomic */
+  switch (n->type)
+    {
+    case NODE_4:
+      n4 = (Node4*) n;
+      bytes_load (keys, n4->keys, 4);
+      i = search_keys (keys, MIN (num_children, 4), c);
+
+      if (i >= 0)
+        return child_load (&n4->children[i]);
+
+      break;
+
+    case NODE_16:
+      n16 = (Node16*) n;
+      bytes_load (keys, n16->keys, 16);
+      i = search_keys (keys, MIN (num_children, 16), c);
+
+      if (i >= 0)
+        return child_load (&n16->children[i]);
+
+      break;
+
+    case NODE_32:
+      n32 = (Node32*) n;
+      bytes_load (keys, n32->keys, 32);
+      i = search_keys_32 (keys, MIN (num_children, 32), c);
+
+      if (i >= 0)
+        return child_load (&n32->children[i]);
+
+      break;
+
+    case NODE_48:
+      n48 = (Node48*) n;
+      i = __atomic_load_n (&n48->keys[c], __ATOMIC_RELAXED);
+
+      if (i > 0 && i <= 48)
+        return child_load (&n48->children[i - 1]);
+
+      break;
+
+    case NODE_256:
+      return child_load (&((Node256*) n)->children[c]);
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  return NULL;
+}
+
+static Node*
+first_child_optimistic (Node *n)
+{
+  Node48 *n48;
+  guint i;
+
+  switch (n->type)
+    {
+    case NODE_4:
+      return child_load (&((Node4*) n)->children[0]);
+
+    case NODE_16:
+      return child_load (&((Node16*) n)->children[0]);
+
+    case NODE_32:
+      return child_load (&((Node32*) n)->children[0]);
+
+    case NODE_48:
+      n48 = (Node48*) n;
+
+      for (i = 0; i < 256; i++)
+        {
+          guint pos = __atomic_load_n (&n48->keys[i], __ATOMIC_RELAXED);
+
+          if (pos > 0 && pos <= 48)
+            return child_load (&n48->children[pos - 1]);
+        }
+
+      break;
+
+    case NODE_256:
+      for (i = 0; i < 256; i++)
+        {
+          Node *child = child_load (&((Node256*) n)->children[i]);
+
+          if (child)
+            return child;
+        }
+
+      break;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  return NULL;
+}
+
+/*
+ * Concurrent counterpart of minimum(), used to read prefixes longer
+ * than MAX_PREFIX_LEN. Returns %NULL if the caller must restart.
+ */
+static Leaf*
+any_leaf_optimistic (Node  *n,
+                     guint  version)
+{
+  while (TRUE)
+    {
+      Node *child;
+
+      child = first_child_optimistic (n);
+
+      if (!version_check (n, version) || !child)
+        return NULL;
+
+      if (IS_LEAF (child))
+        return LEAF_RAW (child);
+
+      if (!version_read (child, &version))
+        return NULL;
+
+      n = child;
+    }
+}
+
+static gboolean
+node_is_full (Node *n)
+{
+  guint num_children = __atomic_load_n (&n->num_children, __ATOMIC_RELAXED);
+
+  switch (n->type)
+    {
+    case NODE_4:
+      return num_children == 4;
+
+    case NODE_16:
+      return num_children == 16;
+
+    case NODE_32:
+      return num_children == 32;
+
+    case NODE_48:
+      return num_children == 48;
+
+    default:
+      return FALSE;
+    }
+}
+
+/* Whether removing a child replaces @n, see remove_child() */
+static gboolean
+node_will_shrink (Node *n)
+{
+  guint num_children = __atomic_load_n (&n->num_children, __ATOMIC_RELAXED);
+
+  switch (n->type)
+    {
+    case NODE_4:
+      return num_children == 2;
+
+    case NODE_16:
+      return num_children == 4;
+
+    case NODE_32:
+      return num_children == 13;
+
+    case NODE_48:
+      return num_children == 25;
+
+    case NODE_256:
+      return num_children == 38;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  return FALSE;
+}
+
+static Leaf*
+lookup_concurrent (GwRadixTree  *self,
+                   const guchar *key,
+                   gint          key_len)
+{
+  Node *n, *child;
+  guint version;
+  gint depth;
+
+restart:
+  n = DEREF (self->root);
+  depth = 0;
+
+  if (!version_read (n, &version))
+    goto restart;
+
+  while (TRUE)
+    {
+      guint32 partial_len = __atomic_load_n (&n->partial_len, __ATOMIC_RELAXED);
+
+      /* Bail if the prefix does not match */
+      if (partial_len)
+        {
+          gint prefix_len;
+
+          prefix_len = check_prefix_optimistic (n, partial_len, key, key_len, depth);
+
+          if (!version_check (n, version))
+            goto restart;
+
+          if (prefix_len != MIN (MAX_PREFIX_LEN, partial_len))
+            return NULL;
+
+          depth += partial_len;
+        }
+
+      child = find_child_optimistic (n, key_byte (key, key_len, depth));
+
+      if (!version_check (n, version))
+        goto restart;
+
+      if (!child)
+        return NULL;
+
+      /* Leaves never change their keys */
+      if (IS_LEAF (child))
+        return leaf_matches (LEAF_RAW (child), key, key_len, 0) ? LEAF_RAW (child) : NULL;
+
+      n = child;
+      depth++;
+
+      if (!version_read (n, &version))
+        goto restart;
+    }
+}
+
+/* Concurrent counterpart of iter_prefixes_of(), only keeping the last key */
+static Leaf*
+longest_prefix_concurrent (GwRadixTree  *self,
+                           const guchar *key,
+                           gint          key_len)
+{
+  Node *n, *child;
+  Leaf *longest;
+  guint version;
+  gint depth;
+
+restart:
+  longest = NULL;
+  n = DEREF (self->root);
+  depth = 0;
+
+  if (!version_read (n, &version))
+    goto restart;
+
+  while (TRUE)
+    {
+      guint32 partial_len = __atomic_load_n (&n->partial_len, __ATOMIC_RELAXED);
+
+      if (partial_len)
+        {
+          gint prefix_len;
+
+          prefix_len = check_prefix_optimistic (n, partial_len, key, key_len, depth);
+
+          if (!version_check (n, version))
+            goto restart;
+
+          if (prefix_len != MIN (MAX_PREFIX_LEN, partial_len))
+            return longest;
+
+          depth += partial_len;
+
+          if (depth > key_len)
+            return longest;
+        }
+
+      child = find_child_optimistic (n, '\0');
+
+      if (!version_check (n, version))
+        goto restart;
+
+      if (child && IS_LEAF (child) && leaf_is_prefix_of (LEAF_RAW (child), key, key_len, 0))
+        longest = LEAF_RAW (child);
+
+      if (depth >= key_len)
+        return longest;
+
+      child = find_child_optimistic (n, key[depth]);
+
+      if (!version_check (n, version))
+        goto restart;
+
+      if (!child)
+        return longest;
+
+      if (IS_LEAF (child))
+        return leaf_is_prefix_of (LEAF_RAW (child), key, key_len, 0) ? LEAF_RAW (child) : longest;
+
+      n = child;
+      depth++;
+
+      if (!version_read (n, &version))
+        goto restart;
+    }
+}
+
+/*
+ * Returns %TRUE if a new key was added, %FALSE if the value of an
+ * existing key was replaced.
+ */
+static gboolean
+insert_concurrent (GwRadixTree       *self,
+                   const guchar      *key,
+                   gint               key_len,
+                   RadixTreeUpdateCb  update,
+                   gpointer           value)
+{
+  Node *parent, *n, *child;
+  guint parent_version, version;
+  guchar parent_key, c;
+  gint depth;
+
+restart:
+  parent = NULL;
+  parent_version = 0;
+  parent_key = 0;
+  n = DEREF (self->root);
+  depth = 0;
+
+  if (!version_read (n, &version))
+    goto restart;
+
+  while (TRUE)
+    {
+      guint32 partial_len = __atomic_load_n (&n->partial_len, __ATOMIC_RELAXED);
+
+      if (partial_len)
+        {
+          const guchar *prefix;
+          Node4 *new_node;
+          Leaf *leaf;
+          gint prefix_diff;
+
+          leaf = NULL;
+          prefix_diff = check_prefix_optimistic (n, partial_len, key, key_len, depth);
+
+          /* Prefix is longer than what we've checked, find a leaf */
+          if (partial_len > MAX_PREFIX_LEN)
+            {
+              leaf = any_leaf_optimistic (n, version);
+
+              if (!leaf)
+                goto restart;
+
+              if (prefix_diff == MAX_PREFIX_LEN)
+                {
+                  guchar *leaf_key = LEAF_KEY (leaf);
+                  gint max_cmp = MIN (leaf->key_len, (guint32) key_len) - depth;
+
+                  while (prefix_diff < max_cmp &&
+                         leaf_key[depth + prefix_diff] == key[depth + prefix_diff])
+                    {
+                      prefix_diff++;
+                    }
+                }
+            }
+
+          if (!version_check (n, version))
+            goto restart;
+
+          if ((guint32) prefix_diff >= partial_len)
+            {
+              depth += partial_len;
+              goto find_child;
+            }
+
+          /* Split the prefix, replacing @n in its parent */
+          if (!version_upgrade (parent, parent_version))
+            goto restart;
+
+          if (!version_upgrade (n, version))
+            {
+              version_unlock (parent);
+              goto restart;
+            }
+
+          new_node = node_new (self, NODE_4);
+          new_node->n.partial_len = prefix_diff;
+
+          memcpy (new_node->n.partial,
+                  n->partial,
+                  MIN (MAX_PREFIX_LEN, prefix_diff));
+
+          prefix = leaf ? (guchar*) LEAF_KEY (leaf) + depth : n->partial;
+
+          add_child_4 (self, new_node, NULL, prefix[prefix_diff], n);
+
+          partial_len_add (n, -(prefix_diff + 1));
+
+          bytes_store (n->partial,
+                       prefix + prefix_diff + 1,
+                       MIN (MAX_PREFIX_LEN, n->partial_len));
+
+          add_child_4 (self,
+                       new_node,
+                       NULL,
+                       key_byte (key, key_len, depth + prefix_diff),
+                       SET_LEAF (leaf_new (self, key, key_len, updated_value (update, value, NULL, FALSE))));
+
+          child_store (find_child (parent, parent_key), (Node*) new_node);
+
+          version_unlock (n);
+          version_unlock (parent);
+
+          return TRUE;
+        }
+
+find_child:
+      c = key_byte (key, key_len, depth);
+      child = find_child_optimistic (n, c);
+
+      if (!version_check (n, version))
+        goto restart;
+
+      /* No child, the leaf goes within @n */
+      if (!child)
+        {
+          if (node_is_full (n))
+            {
+              /* Growing replaces @n in its parent */
+              if (!version_upgrade (parent, parent_version))
+                goto restart;
+
+              if (!version_upgrade (n, version))
+                {
+                  version_unlock (parent);
+                  goto restart;
+                }
+
+              add_child (self,
+                         n,
+                         find_child (parent, parent_key),
+                         c,
+                         SET_LEAF (leaf_new (self, key, key_len, updated_value (update, value, NULL, FALSE))));
+
+              version_unlock_obsolete (n);
+              version_unlock (parent);
+            }
+          else
+            {
+              if (!version_upgrade (n, version))
+                goto restart;
+
+              add_child (self,
+                         n,
+                         NULL,
+                         c,
+                         SET_LEAF (leaf_new (self, key, key_len, updated_value (update, value, NULL, FALSE))));
+
+              version_unlock (n);
+            }
+
+          return TRUE;
+        }
+
+      if (IS_LEAF (child))
+        {
+          Node4 *new_node;
+          Leaf *leaf, *new_leaf;
+          gint longest_prefix;
+          guchar *leaf_key;
+
+          leaf = LEAF_RAW (child);
+
+          if (!version_upgrade (n, version))
+            goto restart;
+
+          /* Check if we are updating an existing value */
+          if (leaf_matches (leaf, key, key_len, 0))
+            {
+              /* Numbers are updated in place without locking, see uint64_leaf() */
+              if (!self->uint64_values)
+                g_atomic_pointer_set (&leaf->value, updated_value (update, value, leaf->value, TRUE));
+
+              version_unlock (n);
+
+              return FALSE;
+            }
+
+          /* Split the leaf into a Node4 */
+          new_node = node_new (self, NODE_4);
+          new_leaf = leaf_new (self, key, key_len, updated_value (update, value, NULL, FALSE));
+
+          longest_prefix = longest_common_prefix (leaf, 0, key, key_len, depth + 1);
+
+          new_node->n.partial_len = longest_prefix;
+
+          memcpy (new_node->n.partial,
+                  key + depth + 1,
+                  MIN (MAX_PREFIX_LEN, longest_prefix));
+
+          leaf_key = LEAF_KEY (leaf);
+          add_child_4 (self,
+                       new_node,
+                       NULL,
+                       leaf_key[depth + 1 + longest_prefix],
+                       child);
+
+          leaf_key = LEAF_KEY (new_leaf);
+          add_child_4 (self,
+                       new_node,
+                       NULL,
+                       leaf_key[depth + 1 + longest_prefix],
+                       SET_LEAF (new_leaf));
+
+          child_store (find_child (n, c), (Node*) new_node);
+
+          version_unlock (n);
+
+          return TRUE;
+        }
+
+      parent = n;
+      parent_version = version;
+      parent_key = c;
+
+      n = child;
+      depth++;
+
+      if (!version_read (n, &version))
+        goto restart;
+    }
+}
+
+static Leaf*
+remove_concurrent (GwRadixTree  *self,
+                   const guchar *key,
+                   gint          key_len)
+{
+  Node *parent, *n, *child;
+  guint parent_version, version;
+  guchar parent_key, c;
+  gint depth;
+
+restart:
+  parent = NULL;
+  parent_version = 0;
+  parent_key = 0;
+  n = DEREF (self->root);
+  depth = 0;
+
+  if (!version_read (n, &version))
+    goto restart;
+
+  while (TRUE)
+    {
+      guint32 partial_len = __atomic_load_n (&n->partial_len, __ATOMIC_RELAXED);
+
+      /* Bail if the prefix does not match */
+      if (partial_len)
+        {
+          gint prefix_len;
+
+          prefix_len = check_prefix_optimistic (n, partial_len, key, key_len, depth);
+
+          if (!version_check (n, version))
+            goto restart;
+
+          if (prefix_len != MIN (MAX_PREFIX_LEN, partial_len))
+            return NULL;
+
+          depth += partial_len;
+        }
+
+      c = key_byte (key, key_len, depth);
+      child = find_child_optimistic (n, c);
+
+      if (!version_check (n, version))
+        goto restart;
+
+      if (!child)
+        return NULL;
+
+      if (IS_LEAF (child))
+        {
+          Leaf *leaf = LEAF_RAW (child);
+
+          if (!leaf_matches (leaf, key, key_len, 0))
+            return NULL;
+
+          if (n == DEREF (self->root))
+            {
+              /* The root is never shrunk */
+              if (!version_upgrade (n, version))
+                goto restart;
+
+              child_store (&((Node256*) n)->children[c], NULL);
+              num_children_add (n, -1);
+
+              version_unlock (n);
+            }
+          else if (node_will_shrink (n))
+            {
+              Node *sibling = NULL;
+              guint sibling_version;
+
+              if (!version_upgrade (parent, parent_version))
+                goto restart;
+
+              if (!version_upgrade (n, version))
+                {
+                  version_unlock (parent);
+                  goto restart;
+                }
+
+              /* A Node4 is merged into its last child, changing its prefix */
+              if (n->type == NODE_4)
+                {
+                  Node4 *n4 = (Node4*) n;
+
+                  sibling = DEREF (n4->children[n4->keys[0] == c ? 1 : 0]);
+
+                  if (IS_LEAF (sibling))
+                    {
+                      sibling = NULL;
+                    }
+                  else if (!version_read (sibling, &sibling_version) ||
+                           !version_upgrade (sibling, sibling_version))
+                    {
+                      version_unlock (n);
+                      version_unlock (parent);
+                      goto restart;
+                    }
+                }
+
+              remove_child (self, n, find_child (parent, parent_key), c, find_child (n, c));
+
+              if (sibling)
+                version_unlock (sibling);
+
+              version_unlock_obsolete (n);
+              version_unlock (parent);
+            }
+          else
+            {
+              if (!version_upgrade (n, version))
+                goto restart;
+
+              remove_child (self, n, NULL, c, find_child (n, c));
+
+              version_unlock (n);
+            }
+
+          return leaf;
+        }
+
+      parent = n;
+      parent_version = version;
+      parent_key = c;
+
+      n = child;
+      depth++;
+
+      if (!version_read (n, &version))
+        goto restart;
+    }
+}
+
+static gboolean iter_recursive (Node        *n,
+                                GString     *path,
+                                RadixTreeCb  cb,
+                                gpointer     user_data);
+
+/* Keys of compact trees are rebuilt in @path, which is %NULL otherwise */
+static inline gboolean
+iter_child (Node        *child,
+            guchar       c,
+            GString     *path,
+            gsize        path_len,
+            RadixTreeCb  cb,
+            gpointer     user_data)
+{
+  if (path)
+    {
+      g_string_truncate (path, path_len);
+      g_string_append_c (path, c);
+    }
+
+  return iter_recursive (child, path, cb, user_data);
+}
+
+static gboolean
+iter_recursive (Node        *n,
+                GString     *path,
+                RadixTreeCb  cb,
+                gpointer     user_data)
+{
+  gsize path_len;
+  gint res, i;
+
+  if (!n)
+    return GW_RADIX_TREE_ITER_CONTINUE;
+
+  if (IS_LEAF (n))
+    {
+      LeafView view;
+      Leaf *l = leaf_view (n, &view);
+
+      if (path)
+        return cb (leaf_path_key (path, l), l->key_len, l->value, user_data);
+
+      return cb (LEAF_KEY (l), l->key_len, l->value, user_data);
+    }
+
+  path_len = 0;
+
+  if (path)
+    {
+      g_string_append_len (path, (const gchar*) n->partial, n->partial_len);
+      path_len = path->len;
+    }
+
+  switch (n->type)
+    {
+    case NODE_4:
+        for (i = 0; i < n->num_children; i++)
+          {
+            res = iter_child (DEREF (((Node4*) n)->children[i]), ((Node4*) n)->keys[i], path, path_len, cb, user_data);
+
+            if (res)
+              return res;
+          }
+        break;
+
+    case NODE_16:
+        for (i = 0; i < n->num_children; i++)
+          {
+            res = iter_child (DEREF (((Node16*) n)->children[i]), ((Node16*) n)->keys[i], path, path_len, cb, user_data);
+
+            if (res)
+              return res;
+          }
+        break;
+
+    case NODE_32:
+        for (i = 0; i < n->num_children; i++)
+          {
+            res = iter_child (DEREF (((Node32*) n)->children[i]), ((Node32*) n)->keys[i], path, path_len, cb, user_data);
+
+            if (res)
+              return res;
+          }
+        break;
+
+    case NODE_48:
+        for (i = 0; i < 256; i++)
+          {
+            gint idx;
+
+            idx = ((Node48*) n)->keys[i];
+
+            if (idx == 0)
+              continue;
+
+            res = iter_child (DEREF (((Node48*) n)->children[idx - 1]), i, path, path_len, cb, user_data);
+
+            if (res)
+              return res;
+          }
+        break;
+
+    case NODE_256:
+        for (i = 0; i < 256; i++)
+          {
+            if (!((Node256*) n)->children[i])
+              continue;
+
+            res = iter_child (DEREF (((Node256*) n)->children[i]), i, path, path_len, cb, user_data);
+
+            if (res)
+              return res;
+          }
+        break;
+
+    default:
+        g_assert_not_reached ();
+    }
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+/*
+ * Iterates over the subtree @n, whose keys start with the first @depth
+ * bytes of @key. Keys of compact trees are rebuilt from those.
+ */
+static gboolean
+iter_subtree (Node         *n,
+              const guchar *key,
+              gint          depth,
+              gboolean      compact,
+              RadixTreeCb   cb,
+              gpointer      user_data)
+{
+  GString *path;
+  gboolean res;
+
+  if (!compact)
+    return iter_recursive (n, NULL, cb, user_data);
+
+  path = g_string_new_len ((const gchar*) key, depth);
+  res = iter_recursive (n, path, cb, user_data);
+  g_string_free (path, TRUE);
+
+  return res;
+}
+
+/*
+ * Checks whether the key stored in @l, from @start on, starts with @prefix.
+ */
+static gboolean
+leaf_prefix_matches (const Leaf   *l,
+                     const guchar *prefix,
+                     gint          prefix_len,
+                     guint32       start)
+{
+  if (l->key_len < (guint32) prefix_len)
+    return FALSE;
+
+  return memcmp (LEAF_KEY (l), prefix + start, prefix_len - start) == 0;
+}
+
+static gboolean
+iter_prefix (Node         *n,
+             const guchar *prefix,
+             gint          prefix_len,
+             gboolean      compact,
+             RadixTreeCb   cb,
+             gpointer      user_data)
+{
+  NodeRef *child;
+  gint depth;
+
+  depth = 0;
+
+  while (n)
+    {
+      /* A leaf is only reached when its key wasn't fully checked yet */
+      if (IS_LEAF (n))
+        {
+          LeafView view;
+          Leaf *l = leaf_view (n, &view);
+
+          if (leaf_prefix_matches (l, prefix, prefix_len, leaf_start (compact, l->key_len, depth)))
+            return iter_subtree (n, prefix, depth, compact, cb, user_data);
+
+          return GW_RADIX_TREE_ITER_CONTINUE;
+        }
+
+      /* The whole prefix was consumed, everything below matches */
+      if (depth == prefix_len)
+        return iter_subtree (n, prefix, depth, compact, cb, user_data);
+
+      if (n->partial_len)
+        {
+          guint32 prefix_diff;
+
+          /*
+           * Unlike lookups, the comparison must be exact here since
+           * the subtree is handed to the callback without checking
+           * the leaves. prefix_mismatch() compares against the minimum
+           * leaf when the compressed path is longer than MAX_PREFIX_LEN.
+           */
+          prefix_diff = prefix_mismatch (n, prefix, prefix_len, depth);
+          prefix_diff = MIN (prefix_diff, n->partial_len);
+
+          /* The prefix ends within the compressed path */
+          if (depth + prefix_diff == (guint32) prefix_len)
+            return iter_subtree (n, prefix, depth, compact, cb, user_data);
+
+          if (prefix_diff < n->partial_len)
+            return GW_RADIX_TREE_ITER_CONTINUE;
+
+          depth += n->partial_len;
+
+          if (depth == prefix_len)
+            return iter_subtree (n, prefix, depth - n->partial_len, compact, cb, user_data);
+        }
+
+      child = find_child (n, prefix[depth]);
+      n = child ? DEREF (*child) : NULL;
+      depth++;
+    }
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+/*
+ * Visits the keys that are prefixes of @key, shortest first. A key that
+ * ends at a node hangs from its NUL child, so that's the only extra child
+ * checked on the way down. Compressed paths are only partially checked,
+ * but the leaves are compared in full.
+ */
+static gboolean
+iter_prefixes_of (Node         *n,
+                  const guchar *key,
+                  gint          key_len,
+                  gboolean      compact,
+                  RadixTreeCb   cb,
+                  gpointer      user_data)
+{
+  NodeRef *child;
+  gint depth;
+
+  depth = 0;
+
+  while (n)
+    {
+      LeafView view;
+      Leaf *l;
+
+      if (IS_LEAF (n))
+        {
+          l = leaf_view (n, &view);
+
+          if (leaf_is_prefix_of (l, key, key_len, leaf_start (compact, l->key_len, depth)))
+            return iter_subtree (n, key, depth, compact, cb, user_data);
+
+          return GW_RADIX_TREE_ITER_CONTINUE;
+        }
+
+      if (n->partial_len)
+        {
+          if (check_prefix (n, key, key_len, depth) != MIN (MAX_PREFIX_LEN, n->partial_len))
+            return GW_RADIX_TREE_ITER_CONTINUE;
+
+          depth += n->partial_len;
+
+          if (depth > key_len)
+            return GW_RADIX_TREE_ITER_CONTINUE;
+        }
+
+      child = find_child (n, '\0');
+
+      if (child && IS_LEAF (*child))
+        {
+          l = leaf_view (DEREF (*child), &view);
+
+          /* The key ends here, so there's no byte of @key for the edge */
+          if (leaf_is_prefix_of (l, key, key_len, leaf_start (compact, l->key_len, depth + 1)) &&
+              iter_subtree (DEREF (*child), key, depth, compact, cb, user_data))
+            {
+              return GW_RADIX_TREE_ITER_STOP;
+            }
+        }
+
+      if (depth >= key_len)
+        break;
+
+      child = find_child (n, key[depth]);
+      n = child ? DEREF (*child) : NULL;
+      depth++;
+    }
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+typedef struct
+{
+  gboolean            found;
+  gsize               key_length;
+  gpointer            value;
+} LongestPrefix;
+
+static gboolean
+longest_prefix_cb (const gchar *key,
+                   gsize        key_length,
+                   gpointer     value,
+                   gpointer     user_data)
+{
+  LongestPrefix *longest = user_data;
+
+  longest->found = TRUE;
+  longest->key_length = key_length;
+  longest->value = value;
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+/*
+ * Cursor helpers
+ *
+ * Positions are indexes into the children array for Node4, Node16 and
+ * Node32, and the key byte itself for Node48 and Node256.
+ */
+static gint
+leaf_compare (const Leaf   *l,
+              const guchar *key,
+              gint          key_len)
+{
+  gint res;
+
+  res = memcmp (LEAF_KEY (l), key, MIN (l->key_len, (guint32) key_len));
+
+  if (res != 0)
+    return res;
+
+  return (gint) l->key_len - key_len;
+}
+
+/* Compares the key of @l with @key, whose first @start bytes are already known to match */
+static gint
+leaf_compare_from (const Leaf   *l,
+                   const guchar *key,
+                   gint          key_len,
+                   guint32       start)
+{
+  gint res;
+
+  res = memcmp (LEAF_KEY (l), key + start, MIN (l->key_len, (guint32) key_len) - start);
+
+  if (res != 0)
+    return res;
+
+  return (gint) l->key_len - key_len;
+}
+
+static Node*
+child_at (Node  *n,
+          guint  pos)
+{
+  switch (n->type)
+    {
+    case NODE_4:
+      return DEREF (((Node4*) n)->children[pos]);
+
+    case NODE_16:
+      return DEREF (((Node16*) n)->children[pos]);
+
+    case NODE_32:
+      return DEREF (((Node32*) n)->children[pos]);
+
+    case NODE_48:
+      return DEREF (((Node48*) n)->children[((Node48*) n)->keys[pos] - 1]);
+
+    case NODE_256:
+      return DEREF (((Node256*) n)->children[pos]);
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  return NULL;
+}
+
+static guchar
+key_at (Node  *n,
+        guint  pos)
+{
+  switch (n->type)
+    {
+    case NODE_4:
+      return ((Node4*) n)->keys[pos];
+
+    case NODE_16:
+      return ((Node16*) n)->keys[pos];
+
+    case NODE_32:
+      return ((Node32*) n)->keys[pos];
+
+    case NODE_48:
+    case NODE_256:
+      return pos;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  return 0;
+}
+
+static gboolean
+has_child_at (Node *n,
+              gint  pos)
+{
+  switch (n->type)
+    {
+    case NODE_4:
+    case NODE_16:
+    case NODE_32:
+      return pos < n->num_children;
+
+    case NODE_48:
+      return ((Node48*) n)->keys[pos] != 0;
+
+    case NODE_256:
+      return ((Node256*) n)->children[pos] != REF (NULL);
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  return FALSE;
+}
+
+/*
+ * Finds the first position after (or before, when @step is -1)
+ * @pos that holds a child. Pass -1 or 256 as @pos to start from
+ * either end of the node.
+ */
+static gboolean
+step_position (Node  *n,
+               gint   pos,
+               gint   step,
+               guint *out_pos)
+{
+  gint last;
+
+  last = (n->type == NODE_48 || n->type == NODE_256) ? 256 : n->num_children;
+
+  pos = step > 0 ? pos + 1 : MIN (pos - 1, last - 1);
+
+  for (; pos >= 0 && pos < last; pos += step)
+    {
+      if (has_child_at (n, pos))
+        {
+          *out_pos = pos;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+/* Finds the position of the smallest child whose key byte is >= @c */
+static gboolean
+lower_bound_position (Node   *n,
+                      guchar  c,
+                      guint  *out_pos)
+{
+  switch (n->type)
+    {
+    case NODE_4:
+      *out_pos = lower_bound_keys (((Node4*) n)->keys, n->num_children, c);
+      return *out_pos < n->num_children;
+
+    case NODE_16:
+      *out_pos = lower_bound_keys (((Node16*) n)->keys, n->num_children, c);
+      return *out_pos < n->num_children;
+
+    case NODE_32:
+      *out_pos = lower_bound_keys (((Node32*) n)->keys, n->num_children, c);
+      return *out_pos < n->num_children;
+
+    case NODE_48:
+    case NODE_256:
+      return step_position (n, (gint) c - 1, 1, out_pos);
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  return FALSE;
+}
+
+static inline void
+cursor_push (RealIter *ri,
+             Node     *n,
+             guint     pos)
+{
+  guint slot = ri->depth % ITER_STACK_SIZE;
+
+  ri->nodes[slot] = n;
+  ri->positions[slot] = pos;
+  ri->depth++;
+  ri->n_stacked = MIN (ri->n_stacked + 1, ITER_STACK_SIZE);
+}
+
+/*
+ * Refills the stack by walking from the root along @key until
+ * @target_depth levels are known. Only needed when the path is
+ * deeper than ITER_STACK_SIZE and older levels were overwritten.
+ */
+static void
+cursor_rebuild (RealIter     *ri,
+                const guchar *key,
+                gint          key_len,
+                guint         target_depth)
+{
+  Node *n;
+  gint depth;
+
+  ri->depth = 0;
+  ri->n_stacked = 0;
+
+  n = DEREF (ri->tree->root);
+  depth = 0;
+
+  while (ri->depth < target_depth)
+    {
+      NodeRef *child;
+      guint pos;
+
+      g_assert (n && !IS_LEAF (n));
+
+      depth += n->partial_len;
+      child = find_child (n, key_byte (key, key_len, depth));
+
+      g_assert (child != NULL);
+
+      if (n->type == NODE_4)
+        pos = child - ((Node4*) n)->children;
+      else if (n->type == NODE_16)
+        pos = child - ((Node16*) n)->children;
+      else if (n->type == NODE_32)
+        pos = child - ((Node32*) n)->children;
+      else
+        pos = key_byte (key, key_len, depth);
+
+      cursor_push (ri, n, pos);
+
+      n = DEREF (*child);
+      depth++;
+    }
+}
+
+/* Walks down to the smallest (@step == 1) or largest (@step == -1) leaf */
+static Node*
+cursor_descend (RealIter *ri,
+                Node     *n,
+                gint      step)
+{
+  while (!IS_LEAF (n))
+    {
+      guint pos;
+
+      /* Only the root of a concurrent tree can be empty */
+      if (!step_position (n, step > 0 ? -1 : 256, step, &pos))
+        return NULL;
+
+      cursor_push (ri, n, pos);
+
+      n = child_at (n, pos);
+    }
+
+  return n;
+}
+
+/*
+ * Climbs the stack until a sibling in the direction of @step exists,
+ * and descends into it. @key is used to rebuild levels that fell out
+ * of the ring buffer.
+ */
+static Node*
+cursor_step (RealIter     *ri,
+             const guchar *key,
+             gint          key_len,
+             gint          step)
+{
+  while (ri->depth > 0)
+    {
+      guint slot, pos;
+      Node *n;
+
+      if (ri->n_stacked == 0)
+        cursor_rebuild (ri, key, key_len, ri->depth);
+
+      slot = (ri->depth - 1) % ITER_STACK_SIZE;
+      n = ri->nodes[slot];
+
+      if (step_position (n, ri->positions[slot], step, &pos))
+        {
+          ri->positions[slot] = pos;
+          return cursor_descend (ri, child_at (n, pos), step);
+        }
+
+      ri->depth--;
+      ri->n_stacked--;
+    }
+
+  return NULL;
+}
+
+/* Positions the cursor at the first key >= @key */
+static Node*
+cursor_lower_bound (RealIter     *ri,
+                    const guchar *key,
+                    gint          key_len)
+{
+  LeafView view;
+  Node *n;
+  gint depth;
+
+  n = DEREF (ri->tree->root);
+  depth = 0;
+
+  if (!n)
+    return NULL;
+
+  while (!IS_LEAF (n))
+    {
+      guint pos;
+
+      if (n->partial_len)
+        {
+          const guchar *partial;
+          guint32 i;
+
+          /* Long compressed paths are only fully stored in the leaves */
+          if (n->partial_len > MAX_PREFIX_LEN)
+            partial = LEAF_KEY (minimum (n)) + depth;
+          else
+            partial = n->partial;
+
+          for (i = 0; i < n->partial_len; i++)
+            {
+              guchar c = key_byte (key, key_len, depth + i);
+
+              /* The whole subtree sorts after the key */
+              if (partial[i] > c)
+                return cursor_descend (ri, n, 1);
+
+              /* The whole subtree sorts before the key */
+              if (partial[i] < c)
+                return cursor_step (ri, key, key_len, 1);
+            }
+
+          depth += n->partial_len;
+        }
+
+      if (!lower_bound_position (n, key_byte (key, key_len, depth), &pos))
+        return cursor_step (ri, key, key_len, 1);
+
+      cursor_push (ri, n, pos);
+
+      /* The child sorts after the key, so does its whole subtree */
+      if (key_at (n, pos) != key_byte (key, key_len, depth))
+        return cursor_descend (ri, child_at (n, pos), 1);
+
+      n = child_at (n, pos);
+      depth++;
+    }
+
+  if (leaf_compare (leaf_view (n, &view), key, key_len) >= 0)
+    return n;
+
+  return cursor_step (ri, key, key_len, 1);
+}
+
+static gboolean
+cursor_move (RealIter     *ri,
+             gint          step,
+             const gchar **key,
+             gsize        *key_length,
+             gpointer     *value)
+{
+  LeafView view;
+  Leaf *current;
+  Node *leaf;
+
+  g_return_val_if_fail (ri->stamp == ri->tree->stamp, FALSE);
+
+  leaf = NULL;
+  current = ri->leaf ? leaf_view (ri->leaf, &view) : NULL;
+
+  if (ri->pending)
+    {
+      /* A seek left the cursor right before its leaf, or past the end */
+      ri->pending = FALSE;
+
+      if (step > 0)
+        leaf = ri->leaf;
+      else if (current)
+        leaf = cursor_step (ri, LEAF_KEY (current), current->key_len, step);
+      else if (ri->tree->root)
+        leaf = cursor_descend (ri, DEREF (ri->tree->root), step);
+    }
+  else if (current)
+    {
+      leaf = cursor_step (ri, LEAF_KEY (current), current->key_len, step);
+    }
+  else if (ri->tree->root)
+    {
+      leaf = cursor_descend (ri, DEREF (ri->tree->root), step);
+    }
+
+  ri->leaf = leaf;
+
+  if (!leaf)
+    {
+      ri->depth = 0;
+      ri->n_stacked = 0;
+      return FALSE;
+    }
+
+  /* Embedded keys are returned from the copy of their pointer in the iterator */
+  if (IS_EMBEDDED (leaf))
+    {
+      if (key)
+        *key = (const gchar*) EMBEDDED_KEY (&ri->leaf);
+
+      if (key_length)
+        *key_length = EMBEDDED_LEN (leaf);
+
+      if (value)
+        *value = NULL;
+
+      return TRUE;
+    }
+
+  if (key)
+    *key = (const gchar*) LEAF_KEY (LEAF_RAW (leaf));
+
+  if (key_length)
+    *key_length = LEAF_RAW (leaf)->key_len;
+
+  if (value)
+    *value = LEAF_RAW (leaf)->value;
+
+  return TRUE;
+}
+
+/*
+ * Reverse iteration
+ *
+ * The same depth first walk as iter_recursive(), visiting the children
+ * of each node from the largest key byte to the smallest. Scans bounded
+ * from above follow the path of the bound down the tree: children that
+ * sort after it are skipped, children that sort before it are visited
+ * whole, and only the child on the path is descended further.
+ */
+static gboolean
+iter_reverse_recursive (Node        *n,
+                        GString     *path,
+                        RadixTreeCb  cb,
+                        gpointer     user_data)
+{
+  gsize path_len;
+  gint pos_start;
+  guint pos;
+
+  if (IS_LEAF (n))
+    {
+      LeafView view;
+      Leaf *l = leaf_view (n, &view);
+
+      if (path)
+        return cb (leaf_path_key (path, l), l->key_len, l->value, user_data);
+
+      return cb (LEAF_KEY (l), l->key_len, l->value, user_data);
+    }
+
+  path_len = 0;
+
+  if (path)
+    {
+      g_string_append_len (path, (const gchar*) n->partial, n->partial_len);
+      path_len = path->len;
+    }
+
+  for (pos_start = 256; step_position (n, pos_start, -1, &pos); pos_start = pos)
+    {
+      if (path)
+        {
+          g_string_truncate (path, path_len);
+          g_string_append_c (path, key_at (n, pos));
+        }
+
+      if (iter_reverse_recursive (child_at (n, pos), path, cb, user_data))
+        return GW_RADIX_TREE_ITER_STOP;
+    }
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+/* Visits the keys of @n up to @key, whose first @depth bytes are the path to @n */
+static gboolean
+iter_reverse_upto (Node         *n,
+                   const guchar *key,
+                   gint          key_len,
+                   gint          depth,
+                   GString      *path,
+                   RadixTreeCb   cb,
+                   gpointer      user_data)
+{
+  gsize path_len;
+  gint pos_start;
+  guint pos;
+  guchar c;
+
+  if (IS_LEAF (n))
+    {
+      LeafView view;
+      Leaf *l = leaf_view (n, &view);
+
+      /* Past the end of @key, only @key itself can be visited */
+      if (depth > key_len)
+        {
+          if (l->key_len != (guint32) key_len)
+            return GW_RADIX_TREE_ITER_CONTINUE;
+        }
+      else if (leaf_compare_from (l, key, key_len, leaf_start (path != NULL, l->key_len, depth)) > 0)
+        {
+          return GW_RADIX_TREE_ITER_CONTINUE;
+        }
+
+      if (path)
+        return cb (leaf_path_key (path, l), l->key_len, l->value, user_data);
+
+      return cb (LEAF_KEY (l), l->key_len, l->value, user_data);
+    }
+
+  if (depth > key_len)
+    return GW_RADIX_TREE_ITER_CONTINUE;
+
+  if (n->partial_len)
+    {
+      const guchar *partial;
+      guint32 i;
+
+      /* Long compressed paths are only fully stored in the leaves */
+      if (n->partial_len > MAX_PREFIX_LEN)
+        partial = LEAF_KEY (minimum (n)) + depth;
+      else
+        partial = n->partial;
+
+      for (i = 0; i < n->partial_len; i++)
+        {
+          c = key_byte (key, key_len, depth + i);
+
+          /* The whole subtree sorts before @key */
+          if (partial[i] < c)
+            return iter_reverse_recursive (n, path, cb, user_data);
+
+          /* The whole subtree sorts after @key */
+          if (partial[i] > c)
+            return GW_RADIX_TREE_ITER_CONTINUE;
+        }
+
+      depth += n->partial_len;
+    }
+
+  path_len = 0;
+
+  if (path)
+    {
+      g_string_append_len (path, (const gchar*) n->partial, n->partial_len);
+      path_len = path->len;
+    }
+
+  c = key_byte (key, key_len, depth);
+
+  /* Children of Node48 and Node256 are at their key byte, so the larger ones are skipped right away */
+  pos_start = (n->type == NODE_48 || n->type == NODE_256) ? c + 1 : 256;
+
+  for (; step_position (n, pos_start, -1, &pos); pos_start = pos)
+    {
+      guchar k = key_at (n, pos);
+      gboolean res;
+
+      if (k > c)
+        continue;
+
+      if (path)
+        {
+          g_string_truncate (path, path_len);
+          g_string_append_c (path, k);
+        }
+
+      if (k == c)
+        res = iter_reverse_upto (child_at (n, pos), key, key_len, depth + 1, path, cb, user_data);
+      else
+        res = iter_reverse_recursive (child_at (n, pos), path, cb, user_data);
+
+      if (res)
+        return GW_RADIX_TREE_ITER_STOP;
+    }
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+/*
+ * Fuzzy search
+ *
+ * Keys sharing a prefix share the rows of the Levenshtein matrix for
+ * that prefix, so the tree is walked depth first keeping one row per
+ * character of the current path. A subtree is skipped as soon as every
+ * entry of the last row exceeds the maximum distance, since appending
+ * characters can't make the distance shrink.
+ *
+ * Distances are counted in UTF-8 characters, like
+ * gw_string_comparator_get_distance() does, so the key bytes are decoded
+ * on the way down and rows are only computed for whole characters.
+ */
+typedef struct
+{
+  RadixTreeCb         cb;
+  gpointer            user_data;
+  gunichar           *word;
+  glong               word_len;
+  guint               max_distance;
+  GArray             *rows;
+  GString            *path;
+} FuzzySearch;
+
+typedef struct
+{
+  guint               n_chars;
+  guint               n_missing;
+  gunichar            pending;
+} FuzzyState;
+
+/* Returns %FALSE if no key continuing the path can be within the distance */
+static gboolean
+fuzzy_push_char (FuzzySearch *search,
+                 FuzzyState  *state,
+                 gunichar     c)
+{
+  gint *prev, *row;
+  gint min;
+  glong j;
+
+  state->n_chars++;
+
+  if (search->rows->len < (state->n_chars + 1) * (search->word_len + 1))
+    g_array_set_size (search->rows, (state->n_chars + 1) * (search->word_len + 1));
+
+  row = &g_array_index (search->rows, gint, state->n_chars * (search->word_len + 1));
+  prev = row - (search->word_len + 1);
+
+  row[0] = min = prev[0] + 1;
+
+  for (j = 1; j <= search->word_len; j++)
+    {
+      gint cost = search->word[j - 1] == c ? 0 : 1;
+
+      row[j] = MIN (MIN (row[j - 1], prev[j]) + 1, prev[j - 1] + cost);
+      min = MIN (min, row[j]);
+    }
+
+  return min <= (gint) search->max_distance;
+}
+
+/*
+ * Decodes UTF-8 keys one byte at a time, returning the number of
+ * characters that @b completes in @chars. What was read of a truncated
+ * sequence counts as a character, and stray bytes are decoded as
+ * (gunichar) -1, which can't match any character of a valid word.
+ */
+static guint
+utf8_push_byte (guint    *n_missing,
+                gunichar *pending,
+                guchar    b,
+                gunichar  chars[2])
+{
+  guint n_chars;
+
+  n_chars = 0;
+
+  if (*n_missing > 0)
+    {
+      if ((b & 0xC0) == 0x80)
+        {
+          *pending = (*pending << 6) | (b & 0x3F);
+
+          if (--*n_missing > 0)
+            return 0;
+
+          chars[0] = *pending;
+          return 1;
+        }
+
+      *n_missing = 0;
+      chars[n_chars++] = *pending;
+    }
+
+  if (b < 0x80)
+    {
+      chars[n_chars++] = b;
+    }
+  else if ((b & 0xE0) == 0xC0)
+    {
+      *pending = b & 0x1F;
+      *n_missing = 1;
+    }
+  else if ((b & 0xF0) == 0xE0)
+    {
+      *pending = b & 0x0F;
+      *n_missing = 2;
+    }
+  else if ((b & 0xF8) == 0xF0)
+    {
+      *pending = b & 0x07;
+      *n_missing = 3;
+    }
+  else
+    {
+      chars[n_chars++] = (gunichar) -1;
+    }
+
+  return n_chars;
+}
+
+static gboolean
+fuzzy_push_byte (FuzzySearch *search,
+                 FuzzyState  *state,
+                 guchar       b)
+{
+  gunichar chars[2];
+  guint i, n_chars;
+
+  n_chars = utf8_push_byte (&state->n_missing, &state->pending, b, chars);
+
+  for (i = 0; i < n_chars; i++)
+    {
+      if (!fuzzy_push_char (search, state, chars[i]))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+fuzzy_leaf (FuzzySearch *search,
+            FuzzyState   state,
+            Leaf        *l,
+            guint32      depth)
+{
+  const guchar *key;
+  gint distance;
+  guint32 i;
+
+  /* Keys of compact trees are rebuilt from the path first */
+  if (search->path)
+    key = (const guchar*) leaf_path_key (search->path, l);
+  else
+    key = LEAF_KEY (l);
+
+  for (i = depth; i < l->key_len; i++)
+    {
+      if (!fuzzy_push_byte (search, &state, key[i]))
+        return GW_RADIX_TREE_ITER_CONTINUE;
+    }
+
+  if (state.n_missing > 0 && !fuzzy_push_char (search, &state, state.pending))
+    return GW_RADIX_TREE_ITER_CONTINUE;
+
+  distance = g_array_index (search->rows,
+                            gint,
+                            state.n_chars * (search->word_len + 1) + search->word_len);
+
+  if (distance > (gint) search->max_distance)
+    return GW_RADIX_TREE_ITER_CONTINUE;
+
+  return search->cb ((const gchar*) key, l->key_len, l->value, search->user_data);
+}
+
+static gboolean
+fuzzy_recursive (FuzzySearch *search,
+                 Node        *n,
+                 guint32      depth,
+                 FuzzyState   state)
+{
+  LeafView view;
+  gsize path_len;
+  guint pos;
+  gint pos_start;
+
+  if (IS_LEAF (n))
+    return fuzzy_leaf (search, state, leaf_view (n, &view), depth);
+
+  if (n->partial_len)
+    {
+      const guchar *partial;
+      guint32 i;
+
+      /* Compressed paths longer than MAX_PREFIX_LEN are only stored in the leaves */
+      if (n->partial_len <= MAX_PREFIX_LEN)
+        partial = n->partial;
+      else
+        partial = (const guchar*) LEAF_KEY (minimum (n)) + depth;
+
+      for (i = 0; i < n->partial_len; i++)
+        {
+          if (!fuzzy_push_byte (search, &state, partial[i]))
+            return GW_RADIX_TREE_ITER_CONTINUE;
+        }
+
+      depth += n->partial_len;
+    }
+
+  path_len = 0;
+
+  if (search->path)
+    {
+      g_string_append_len (search->path, (const gchar*) n->partial, n->partial_len);
+      path_len = search->path->len;
+    }
+
+  for (pos_start = -1; step_position (n, pos_start, 1, &pos); pos_start = pos)
+    {
+      FuzzyState child_state;
+      Node *child;
+      gboolean res;
+
+      child = child_at (n, pos);
+      child_state = state;
+
+      if (search->path)
+        {
+          g_string_truncate (search->path, path_len);
+          g_string_append_c (search->path, key_at (n, pos));
+        }
+
+      /* The whole key of a leaf, rebuilt in compact trees, includes the byte of this edge */
+      if (IS_LEAF (child))
+        res = fuzzy_leaf (search, child_state, leaf_view (child, &view), depth);
+      else if (fuzzy_push_byte (search, &child_state, key_at (n, pos)))
+        res = fuzzy_recursive (search, child, depth + 1, child_state);
+      else
+        res = GW_RADIX_TREE_ITER_CONTINUE;
+
+      if (res)
+        return res;
+    }
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+/*
+ * Pattern matching
+ *
+ * Patterns are compiled to a list of tokens, and matched like a
+ * nondeterministic automaton whose states are the positions in that
+ * list. As with fuzzy searches, the tree is walked depth first keeping
+ * the set of positions reached after each character of the current path,
+ * and a subtree is skipped as soon as that set is empty.
+ */
+typedef enum
+{
+  PATTERN_CHAR,
+  PATTERN_ANY,
+  PATTERN_STAR,
+  PATTERN_CLASS,
+} PatternTokenType;
+
+typedef struct
+{
+  PatternTokenType    type;
+  gunichar            c;
+  gboolean            negated;
+  guint               first_range;
+  guint               n_ranges;
+} PatternToken;
+
+typedef struct
+{
+  RadixTreeCb         cb;
+  gpointer            user_data;
+  GArray             *tokens;
+  GArray             *ranges;
+  GArray             *rows;
+  GString            *path;
+} PatternSearch;
+
+typedef struct
+{
+  guint               n_chars;
+  guint               n_missing;
+  gunichar            pending;
+} PatternState;
+
+/* Returns %FALSE if the class starting at @p isn't closed */
+static gboolean
+pattern_compile_class (PatternSearch  *search,
+                       PatternToken   *token,
+                       const gchar   **p,
+                       const gchar    *end)
+{
+  const gchar *s;
+  gboolean first;
+
+  s = *p;
+
+  token->type = PATTERN_CLASS;
+  token->first_range = search->ranges->len / 2;
+  token->negated = s < end && (*s == '!' || *s == '^');
+
+  if (token->negated)
+    s++;
+
+  /* A ']' right after the opening bracket is part of the class */
+  for (first = TRUE; s < end && (*s != ']' || first); first = FALSE)
+    {
+      gunichar range[2];
+
+      range[0] = range[1] = g_utf8_get_char (s);
+      s = g_utf8_next_char (s);
+
+      if (s + 1 < end && *s == '-' && s[1] != ']')
+        {
+          range[1] = g_utf8_get_char (s + 1);
+          s = g_utf8_next_char (s + 1);
+        }
+
+      g_array_append_vals (search->ranges, range, 2);
+    }
+
+  if (s >= end)
+    {
+      g_array_set_size (search->ranges, token->first_range * 2);
+      return FALSE;
+    }
+
+  token->n_ranges = search->ranges->len / 2 - token->first_range;
+  *p = s + 1;
+
+  return TRUE;
+}
+
+static void
+pattern_compile (PatternSearch *search,
+                 const gchar   *pattern,
+                 gsize          pattern_length)
+{
+  const gchar *end, *p;
+
+  end = pattern + pattern_length;
+
+  for (p = pattern; p < end;)
+    {
+      PatternToken token = { 0, };
+      gunichar c;
+
+      c = g_utf8_get_char (p);
+      p = g_utf8_next_char (p);
+
+      if (c == '?')
+        {
+          token.type = PATTERN_ANY;
+        }
+      else if (c == '*')
+        {
+          /* Consecutive stars match the same as a single one */
+          if (search->tokens->len > 0 &&
+              g_array_index (search->tokens, PatternToken, search->tokens->len - 1).type == PATTERN_STAR)
+            {
+              continue;
+            }
+
+          token.type = PATTERN_STAR;
+        }
+      else if (c != '[' || !pattern_compile_class (search, &token, &p, end))
+        {
+          /* Unclosed classes are taken literally */
+          if (c == '\\' && p < end)
+            {
+              c = g_utf8_get_char (p);
+              p = g_utf8_next_char (p);
+            }
+
+          token.type = PATTERN_CHAR;
+          token.c = c;
+        }
+
+      g_array_append_val (search->tokens, token);
+    }
+}
+
+static gboolean
+pattern_token_matches (PatternSearch      *search,
+                       const PatternToken *token,
+                       gunichar            c)
+{
+  const gunichar *ranges;
+  guint i;
+
+  switch (token->type)
+    {
+    case PATTERN_CHAR:
+      return token->c == c;
+
+    case PATTERN_ANY:
+    case PATTERN_STAR:
+      return TRUE;
+
+    case PATTERN_CLASS:
+      ranges = &g_array_index (search->ranges, gunichar, token->first_range * 2);
+
+      for (i = 0; i < token->n_ranges; i++)
+        {
+          if (c >= ranges[i * 2] && c <= ranges[i * 2 + 1])
+            return !token->negated;
+        }
+
+      return token->negated;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  return FALSE;
+}
+
+/* Adds the positions after stars, which can match no characters, and returns %FALSE if there are none */
+static gboolean
+pattern_close_row (PatternSearch *search,
+                   guint8        *row)
+{
+  gboolean alive;
+  guint i;
+
+  alive = FALSE;
+
+  for (i = 0; i < search->tokens->len; i++)
+    {
+      if (row[i] && g_array_index (search->tokens, PatternToken, i).type == PATTERN_STAR)
+        row[i + 1] = TRUE;
+
+      alive |= row[i];
+    }
+
+  return alive || row[search->tokens->len];
+}
+
+/* Returns %FALSE if no key continuing the path can match */
+static gboolean
+pattern_push_char (PatternSearch *search,
+                   PatternState  *state,
+                   gunichar       c)
+{
+  guint8 *prev, *row;
+  guint n_positions;
+  guint i;
+
+  n_positions = search->tokens->len + 1;
+
+  state->n_chars++;
+
+  if (search->rows->len < (state->n_chars + 1) * n_positions)
+    g_array_set_size (search->rows, (state->n_chars + 1) * n_positions);
+
+  row = &g_array_index (search->rows, guint8, state->n_chars * n_positions);
+  prev = row - n_positions;
+
+  memset (row, 0, n_positions);
+
+  for (i = 0; i < search->tokens->len; i++)
+    {
+      const PatternToken *token = &g_array_index (search->tokens, PatternToken, i);
+
+      if (!prev[i] || !pattern_token_matches (search, token, c))
+        continue;
+
+      /* Stars stay in place to match more characters */
+      if (token->type == PATTERN_STAR)
+        row[i] = TRUE;
+      else
+        row[i + 1] = TRUE;
+    }
+
+  return pattern_close_row (search, row);
+}
+
+static gboolean
+pattern_push_byte (PatternSearch *search,
+                   PatternState  *state,
+                   guchar         b)
+{
+  gunichar chars[2];
+  guint i, n_chars;
+
+  n_chars = utf8_push_byte (&state->n_missing, &state->pending, b, chars);
+
+  for (i = 0; i < n_chars; i++)
+    {
+      if (!pattern_push_char (search, state, chars[i]))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+pattern_leaf (PatternSearch *search,
+              PatternState   state,
+              Leaf          *l,
+              guint32        depth)
+{
+  const guchar *key;
+  guint n_positions;
+  guint32 i;
+
+  /* Keys of compact trees are rebuilt from the path first */
+  if (search->path)
+    key = (const guchar*) leaf_path_key (search->path, l);
+  else
+    key = LEAF_KEY (l);
+
+  for (i = depth; i < l->key_len; i++)
+    {
+      if (!pattern_push_byte (search, &state, key[i]))
+        return GW_RADIX_TREE_ITER_CONTINUE;
+    }
+
+  if (state.n_missing > 0 && !pattern_push_char (search, &state, state.pending))
+    return GW_RADIX_TREE_ITER_CONTINUE;
+
+  n_positions = search->tokens->len + 1;
+
+  if (!g_array_index (search->rows, guint8, state.n_chars * n_positions + n_positions - 1))
+    return GW_RADIX_TREE_ITER_CONTINUE;
+
+  return search->cb ((const gchar*) key, l->key_len, l->value, search->user_data);
+}
+
+static gboolean
+pattern_recursive (PatternSearch *search,
+                   Node          *n,
+                   guint32        depth,
+                   PatternState   state)
+{
+  LeafView view;
+  gsize path_len;
+  guint pos;
+  gint pos_start;
+
+  if (IS_LEAF (n))
+    return pattern_leaf (search, state, leaf_view (n, &view), depth);
+
+  if (n->partial_len)
+    {
+      const guchar *partial;
+      guint32 i;
+
+      /* Compressed paths longer than MAX_PREFIX_LEN are only stored in the leaves */
+      if (n->partial_len <= MAX_PREFIX_LEN)
+        partial = n->partial;
+      else
+        partial = (const guchar*) LEAF_KEY (minimum (n)) + depth;
+
+      for (i = 0; i < n->partial_len; i++)
+        {
+          if (!pattern_push_byte (search, &state, partial[i]))
+            return GW_RADIX_TREE_ITER_CONTINUE;
+        }
+
+      depth += n->partial_len;
+    }
+
+  path_len = 0;
+
+  if (search->path)
+    {
+      g_string_append_len (search->path, (const gchar*) n->partial, n->partial_len);
+      path_len = search->path->len;
+    }
+
+  for (pos_start = -1; step_position (n, pos_start, 1, &pos); pos_start = pos)
+    {
+      PatternState child_state;
+      Node *child;
+      gboolean res;
+
+      child = child_at (n, pos);
+      child_state = state;
+
+      if (search->path)
+        {
+          g_string_truncate (search->path, path_len);
+          g_string_append_c (search->path, key_at (n, pos));
+        }
+
+      /* The whole key of a leaf, rebuilt in compact trees, includes the byte of this edge */
+      if (IS_LEAF (child))
+        res = pattern_leaf (search, child_state, leaf_view (child, &view), depth);
+      else if (pattern_push_byte (search, &child_state, key_at (n, pos)))
+        res = pattern_recursive (search, child, depth + 1, child_state);
+      else
+        res = GW_RADIX_TREE_ITER_CONTINUE;
+
+      if (res)
+        return res;
+    }
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+/*
+ * Numeric values
+ *
+ * Trees with numeric values keep a guint64 in the value slot of each
+ * leaf. Once a leaf exists and isn't shared with a copy, its number is
+ * only updated with atomic operations, so threads can update the values
+ * of existing keys without locking. Adding a key is a regular insertion
+ * of a zero value, after which the number is updated like any other.
+ */
+
+/* Keeps the current value, and starts new keys at zero */
+static gpointer
+uint64_keep_cb (gpointer old_value,
+                gboolean found,
+                gpointer user_data)
+{
+  return old_value;
+}
+
+/*
+ * Like lookup_leaf(), but misses leaves that are shared with copies, as
+ * well as those below a shared node.
+ */
+static Leaf*
+uint64_lookup_unshared (GwRadixTree  *self,
+                        const guchar *key,
+                        gint          key_len)
+{
+  NodeRef *child;
+  Node *n;
+  gint depth;
+
+  n = DEREF (self->root);
+  depth = 0;
+
+  while (n)
+    {
+      if (IS_LEAF (n))
+        {
+          Leaf *l = LEAF_RAW (n);
+
+          if (g_atomic_int_get (&l->ref_count) > 1 ||
+              !leaf_matches (l, key, key_len, leaf_start (self->compact_leaves, l->key_len, depth)))
+            {
+              return NULL;
+            }
+
+          return l;
+        }
+
+      if (g_atomic_int_get (&n->ref_count) > 1)
+        return NULL;
+
+      if (n->partial_len)
+        {
+          gint prefix_len;
+
+          prefix_len = check_prefix (n, key, key_len, depth);
+
+          if (prefix_len != MIN (MAX_PREFIX_LEN, n->partial_len))
+            return NULL;
+
+          depth = depth + n->partial_len;
+        }
+
+      child = find_child (n, key_byte (key, key_len, depth));
+      n = child ? DEREF (*child) : NULL;
+      depth++;
+    }
+
+  return NULL;
+}
+
+/*
+ * Returns the leaf of @key, adding the key with a zero value first if
+ * @create is set, or %NULL. The leaf isn't shared, so its number can be
+ * updated in place. Concurrent trees must be within an epoch.
+ */
+static Leaf*
+uint64_leaf (GwRadixTree  *self,
+             const guchar *key,
+             gint          key_len,
+             gboolean      create,
+             gboolean     *added)
+{
+  gboolean old;
+  Leaf *l;
+
+  *added = FALSE;
+
+  if (self->epochs)
+    {
+      /* A concurrent removal may take the key away again */
+      while (!(l = lookup_concurrent (self, key, key_len)) && create)
+        {
+          if (insert_concurrent (self, key, key_len, uint64_keep_cb, NULL))
+            {
+              __atomic_add_fetch (&self->size, 1, __ATOMIC_RELAXED);
+              g_atomic_int_inc (&self->stamp);
+              *added = TRUE;
+            }
+        }
+
+      return l;
+    }
+
+  l = uint64_lookup_unshared (self, key, key_len);
+
+  if (l)
+    return l;
+
+  if (!create && !lookup_leaf (DEREF (self->root), key, key_len, 0, self->compact_leaves))
+    return NULL;
+
+  /* Copies the path to a shared leaf, or adds the missing key */
+  old = FALSE;
+
+  insert_recursive (self,
+                    DEREF (self->root),
+                    &self->root,
+                    key,
+                    key_len,
+                    uint64_keep_cb,
+                    NULL,
+                    0,
+                    &old);
+
+  if (!old)
+    {
+      self->stamp++;
+      self->size++;
+      *added = TRUE;
+    }
+
+  return LEAF_RAW (lookup_leaf (DEREF (self->root), key, key_len, 0, self->compact_leaves));
+}
+
+/*
+ * Range removal
+ *
+ * The bounds are followed down the tree for as long as the path matches
+ * them. Subtrees that sort entirely within the range are unlinked from
+ * their parent and freed whole, and only the subtrees along the path of
+ * each bound are descended further.
+ */
+typedef enum
+{
+  RANGE_OUT,
+  RANGE_IN,
+  RANGE_PARTIAL,
+} RangeClass;
+
+typedef struct
+{
+  const guchar       *from;
+  gint                from_len;
+  const guchar       *to;
+  gint                to_len;
+} KeyRange;
+
+/*
+ * Compares the byte @c at @depth with the bounds that the path still
+ * matches, clearing @from_active and @to_active once the keys below sort
+ * after @from or before @to.
+ */
+static RangeClass
+range_step (const KeyRange *range,
+            gint            depth,
+            guchar          c,
+            gboolean       *from_active,
+            gboolean       *to_active)
+{
+  if (*from_active)
+    {
+      /* Keys that start with the whole lower bound sort after it */
+      if (depth >= range->from_len || c > range->from[depth])
+        *from_active = FALSE;
+      else if (c < range->from[depth])
+        return RANGE_OUT;
+    }
+
+  if (*to_active)
+    {
+      /* And the upper bound is excluded */
+      if (depth >= range->to_len || c > range->to[depth])
+        return RANGE_OUT;
+      else if (c < range->to[depth])
+        *to_active = FALSE;
+    }
+
+  return *from_active || *to_active ? RANGE_PARTIAL : RANGE_IN;
+}
+
+/* Classifies @n, below an edge that ends at @depth, by its compressed path or key */
+static RangeClass
+range_classify (const KeyRange *range,
+                Node           *n,
+                gint            depth,
+                gboolean        compact,
+                gboolean       *from_active,
+                gboolean       *to_active)
+{
+  guint32 i;
+
+  if (!*from_active && !*to_active)
+    return RANGE_IN;
+
+  if (IS_LEAF (n))
+    {
+      LeafView view;
+      guint32 start;
+      Leaf *l;
+
+      l = leaf_view (n, &view);
+      start = leaf_start (compact, l->key_len, depth);
+
+      if (*from_active && leaf_compare_from (l, range->from, range->from_len, start) < 0)
+        return RANGE_OUT;
+
+      if (*to_active && leaf_compare_from (l, range->to, range->to_len, start) >= 0)
+        return RANGE_OUT;
+
+      return RANGE_IN;
+    }
+
+  for (i = 0; i < n->partial_len; i++)
+    {
+      RangeClass class;
+
+      class = range_step (range, depth + i, prefix_byte (n, depth, i), from_active, to_active);
+
+      if (class != RANGE_PARTIAL)
+        return class;
+    }
+
+  return RANGE_PARTIAL;
+}
+
+/* The number of keys below @n, only kept in the nodes of counted trees */
+static guint64
+subtree_size (GwRadixTree *self,
+              Node        *n)
+{
+  NodeRef *children;
+  guint64 size;
+  guint i, n_slots;
+
+  if (IS_LEAF (n))
+    return 1;
+
+  if (self->counted)
+    return n->n_keys;
+
+  children = node_get_children (n, &n_slots);
+  size = 0;
+
+  for (i = 0; i < n_slots; i++)
+    {
+      if (children[i])
+        size += subtree_size (self, DEREF (children[i]));
+    }
+
+  return size;
+}
+
+/*
+ * Returns whether any key below @n, under the same conditions as for
+ * remove_range_recursive(), is within @range.
+ */
+static gboolean
+range_has_keys (GwRadixTree    *self,
+                Node           *n,
+                gint            depth,
+                const KeyRange *range,
+                gboolean        from_active,
+                gboolean        to_active)
+{
+  gint pos_start, child_depth;
+  guint pos;
+
+  child_depth = depth + n->partial_len;
+
+  for (pos_start = -1; step_position (n, pos_start, 1, &pos); pos_start = pos)
+    {
+      gboolean child_from, child_to;
+      RangeClass class;
+      Node *child;
+
+      child = child_at (n, pos);
+      child_from = from_active;
+      child_to = to_active;
+
+      class = range_step (range, child_depth, key_at (n, pos), &child_from, &child_to);
+
+      if (class == RANGE_PARTIAL)
+        {
+          class = range_classify (range,
+                                  child,
+                                  child_depth + 1,
+                                  self->compact_leaves,
+                                  &child_from,
+                                  &child_to);
+        }
+
+      if (class == RANGE_IN)
+        return TRUE;
+
+      if (class == RANGE_PARTIAL &&
+          range_has_keys (self, child, child_depth + 1, range, child_from, child_to))
+        {
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+/*
+ * Removes the keys within @range below the node at @ref, which hangs from
+ * an edge that ends at @depth, and whose compressed path didn't settle
+ * where its keys sort. If all of them turn out to be within @range, sets
+ * @all_in instead, leaving it to the caller to unlink the whole node.
+ * Returns the number of keys removed.
+ */
+static guint64
+remove_range_recursive (GwRadixTree    *self,
+                        NodeRef        *ref,
+                        gint            depth,
+                        const KeyRange *range,
+                        gboolean        from_active,
+                        gboolean        to_active,
+                        gboolean       *all_in)
+{
+  guchar unlinked[256];
+  guint64 removed;
+  guint i, n_unlinked;
+  gint pos_start, child_depth;
+  guint pos;
+  Node *n;
+
+  n = DEREF (*ref);
+
+  /* Shared nodes are only copied once some of their keys are known to go */
+  if (g_atomic_int_get (&n->ref_count) > 1 &&
+      !range_has_keys (self, n, depth, range, from_active, to_active))
+    {
+      return 0;
+    }
+
+  n = node_make_unique (self, ref);
+  child_depth = depth + n->partial_len;
+  n_unlinked = 0;
+  removed = 0;
+
+  for (pos_start = -1; step_position (n, pos_start, 1, &pos); pos_start = pos)
+    {
+      gboolean child_from, child_to, child_all_in;
+      RangeClass class;
+      guchar c;
+
+      c = key_at (n, pos);
+      child_from = from_active;
+      child_to = to_active;
+
+      class = range_step (range, child_depth, c, &child_from, &child_to);
+
+      if (class == RANGE_PARTIAL)
+        {
+          class = range_classify (range,
+                                  child_at (n, pos),
+                                  child_depth + 1,
+                                  self->compact_leaves,
+                                  &child_from,
+                                  &child_to);
+        }
+
+      if (class == RANGE_PARTIAL)
+        {
+          guint64 child_removed;
+
+          child_all_in = FALSE;
+          child_removed = remove_range_recursive (self,
+                                                  find_child (n, c),
+                                                  child_depth + 1,
+                                                  range,
+                                                  child_from,
+                                                  child_to,
+                                                  &child_all_in);
+
+          if (child_all_in)
+            class = RANGE_IN;
+
+          if (self->counted)
+            n->n_keys -= child_removed;
+
+          removed += child_removed;
+        }
+
+      if (class == RANGE_IN)
+        unlinked[n_unlinked++] = c;
+    }
+
+  /* Nothing was removed below, and the parent unlinks this node instead */
+  if (n_unlinked == n->num_children)
+    {
+      *all_in = TRUE;
+      return 0;
+    }
+
+  /*
+   * At least one child stays, so the node can only be merged into its
+   * last child, after the last removal.
+   */
+  for (i = 0; i < n_unlinked; i++)
+    {
+      NodeRef *child;
+      Node *unlinked_child;
+
+      n = DEREF (*ref);
+      child = find_child (n, unlinked[i]);
+      unlinked_child = DEREF (*child);
+
+      removed += subtree_size (self, unlinked_child);
+
+      remove_child (self, n, ref, unlinked[i], child);
+      node_unref (self, unlinked_child);
+    }
+
+  if (n_unlinked > 0 && self->compact_leaves)
+    merge_single_child (self, ref, depth);
+
+  return removed;
+}
+
+static guint64
+remove_range (GwRadixTree    *self,
+              const KeyRange *range)
+{
+  gboolean from_active, to_active, all_in;
+  RangeClass class;
+  guint64 removed;
+  Node *root;
+
+  root = DEREF (self->root);
+
+  if (!root)
+    return 0;
+
+  from_active = TRUE;
+  to_active = range->to != NULL;
+  all_in = FALSE;
+  removed = 0;
+
+  class = range_classify (range, root, 0, self->compact_leaves, &from_active, &to_active);
+
+  if (class == RANGE_PARTIAL)
+    removed = remove_range_recursive (self, &self->root, 0, range, from_active, to_active, &all_in);
+
+  /* The root may have been copied on the way */
+  if (class == RANGE_IN || all_in)
+    {
+      root = DEREF (self->root);
+      removed = subtree_size (self, root);
+
+      self->root = REF (NULL);
+      node_unref (self, root);
+    }
+
+  if (removed > 0)
+    {
+      self->size -= removed;
+      self->stamp++;
+    }
+
+  return removed;
+}
+
+/*
+ * Statistics
+ */
+typedef struct
+{
+  GwRadixTreeStats   *stats;
+  guint64             n_children[NODE_256 + 1];
+  guint64             depth_sum;
+  gboolean            compact;
+} StatsCollector;
+
+/* @key_depth is the number of key bytes above @n, and @depth the number of nodes */
+static void
+stats_recursive (StatsCollector *collector,
+                 Node           *n,
+                 guint           depth,
+                 guint32         key_depth)
+{
+  GwRadixTreeStats *stats;
+  gint pos_start;
+  guint pos;
+
+  stats = collector->stats;
+
+  if (IS_LEAF (n))
+    {
+      stats->n_leaves++;
+
+      /* Embedded keys take no memory of their own */
+      if (IS_EMBEDDED (n))
+        stats->n_embedded++;
+      else
+        {
+          Leaf *l = LEAF_RAW (n);
+
+          stats->total_bytes += LEAF_SIZE (l->key_len - leaf_start (collector->compact, l->key_len, key_depth));
+        }
+
+      stats->max_depth = MAX (stats->max_depth, depth);
+      collector->depth_sum += depth;
+      return;
+    }
+
+  switch (n->type)
+    {
+    case NODE_4:
+      stats->n_node4++;
+      break;
+
+    case NODE_16:
+      stats->n_node16++;
+      break;
+
+    case NODE_32:
+      stats->n_node32++;
+      break;
+
+    case NODE_48:
+      stats->n_node48++;
+      break;
+
+    case NODE_256:
+      stats->n_node256++;
+      break;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  stats->total_bytes += node_size (n->type);
+  collector->n_children[n->type] += n->num_children;
+
+  if (n->partial_len > 0)
+    stats->n_compressed++;
+
+  if (n->partial_len > MAX_PREFIX_LEN)
+    stats->n_prefix_overflows++;
+
+  for (pos_start = -1; step_position (n, pos_start, 1, &pos); pos_start = pos)
+    stats_recursive (collector, child_at (n, pos), depth + 1, key_depth + n->partial_len + 1);
+}
+
+static gdouble
+fill_ratio (guint64 n_children,
+            guint64 n_nodes,
+            guint   capacity)
+{
+  if (n_nodes == 0)
+    return 0.0;
+
+  return (gdouble) n_children / (n_nodes * capacity);
+}
+
+/*
+ * Key counts
+ *
+ * Counted trees keep the number of keys below each node, updated on the
+ * way back up by every insertion and removal. Counting the keys with a
+ * prefix is then a single descent, and so are finding the position of a
+ * key in the sorted order and the key at a given position, adding up the
+ * counts of the children that come before the path taken at each node.
+ */
+static guint32
+count_keys_recursive (GwRadixTree *self,
+                      NodeRef     *ref)
+{
+  NodeRef *children;
+  Node *n;
+  guint i, n_slots;
+
+  if (IS_LEAF (*ref))
+    return 1;
+
+  /* Counts are written to the nodes, so they can't be shared */
+  n = node_make_unique (self, ref);
+  n->n_keys = 0;
+
+  children = node_get_children (n, &n_slots);
+
+  for (i = 0; i < n_slots; i++)
+    {
+      if (children[i])
+        n->n_keys += count_keys_recursive (self, &children[i]);
+    }
+
+  return n->n_keys;
+}
+
+static guint64
+count_prefix (Node         *n,
+              const guchar *prefix,
+              gint          prefix_len,
+              gboolean      compact)
+{
+  NodeRef *child;
+  gint depth;
+
+  depth = 0;
+
+  while (n)
+    {
+      if (IS_LEAF (n))
+        {
+          LeafView view;
+          Leaf *l = leaf_view (n, &view);
+
+          return leaf_prefix_matches (l, prefix, prefix_len, leaf_start (compact, l->key_len, depth)) ? 1 : 0;
+        }
+
+      if (depth == prefix_len)
+        return n->n_keys;
+
+      if (n->partial_len)
+        {
+          guint32 prefix_diff;
+
+          prefix_diff = prefix_mismatch (n, prefix, prefix_len, depth);
+          prefix_diff = MIN (prefix_diff, n->partial_len);
+
+          /* The prefix ends within the compressed path */
+          if (depth + prefix_diff == (guint32) prefix_len)
+            return n->n_keys;
+
+          if (prefix_diff < n->partial_len)
+            return 0;
+
+          depth += n->partial_len;
+
+          if (depth == prefix_len)
+            return n->n_keys;
+        }
+
+      child = find_child (n, prefix[depth]);
+      n = child ? DEREF (*child) : NULL;
+      depth++;
+    }
+
+  return 0;
+}
+
+/* Counts the keys that sort before @key */
+static guint64
+count_keys_before (Node         *n,
+                   const guchar *key,
+                   gint          key_len,
+                   gboolean      compact)
+{
+  NodeRef *child;
+  guint64 rank;
+  gint depth;
+
+  rank = 0;
+  depth = 0;
+
+  while (n)
+    {
+      const guchar *path;
+      gint pos_start;
+      guint32 i;
+      guint pos;
+
+      if (IS_LEAF (n))
+        {
+          LeafView view;
+          Leaf *l = leaf_view (n, &view);
+
+          if (leaf_compare_from (l, key, key_len, leaf_start (compact, l->key_len, depth)) < 0)
+            rank++;
+
+          return rank;
+        }
+
+      /* The whole subtree sorts on the same side of @key once its path differs */
+      path = n->partial_len > MAX_PREFIX_LEN ? LEAF_KEY (minimum (n)) + depth : n->partial;
+
+      for (i = 0; i < n->partial_len; i++)
+        {
+          if (depth + i == (guint32) key_len)
+            return rank;
+
+          if (path[i] != key[depth + i])
+            return path[i] < key[depth + i] ? rank + n->n_keys : rank;
+        }
+
+      depth += n->partial_len;
+
+      /* Keys ending here are equal to @key, and the others are longer */
+      if (depth == key_len)
+        return rank;
+
+      for (pos_start = -1; step_position (n, pos_start, 1, &pos); pos_start = pos)
+        {
+          if (key_at (n, pos) >= key[depth])
+            break;
+
+          rank += subtree_keys (child_at (n, pos));
+        }
+
+      child = find_child (n, key[depth]);
+      n = child ? DEREF (*child) : NULL;
+      depth++;
+    }
+
+  return rank;
+}
+
+/*
+ * Finds the leaf of the key at @index in the sorted order, appending the
+ * path down to it to @path for compact trees.
+ */
+static Node*
+select_leaf (Node    *n,
+             guint64  index,
+             GString *path)
+{
+  while (!IS_LEAF (n))
+    {
+      gint pos_start;
+      Node *child;
+      guint pos;
+
+      child = NULL;
+
+      for (pos_start = -1; step_position (n, pos_start, 1, &pos); pos_start = pos)
+        {
+          child = child_at (n, pos);
+
+          if (index < subtree_keys (child))
+            break;
+
+          index -= subtree_keys (child);
+        }
+
+      if (path)
+        {
+          g_string_append_len (path, (const gchar*) n->partial, n->partial_len);
+          g_string_append_c (path, key_at (n, pos));
+        }
+
+      n = child;
+    }
+
+  return n;
+}
+
+/*
+ * Parallel traversal
+ *
+ * The tree is split into subtrees in key order, expanding every node
+ * into its children one level at a time until there are enough of them
+ * to keep all threads busy. The threads of the pool take the next
+ * subtree as soon as they finish the previous one, so a few big
+ * subtrees don't hold the others back.
+ */
+#define PARALLEL_UNITS_PER_THREAD 16
+#define PARALLEL_MAX_SPLITS       4
+
+typedef struct
+{
+  RadixTreeCb         callback;
+  RadixTreeMapCb      map;
+  gpointer            user_data;
+  gint                stop;
+} ParallelWalk;
+
+/* Keys of compact trees are rebuilt from @path, which has those above @n */
+typedef struct
+{
+  ParallelWalk       *walk;
+  Node               *n;
+  GString            *path;
+  GPtrArray          *results;
+} ParallelUnit;
+
+static GArray*
+split_subtrees (Node     *root,
+                guint     n_units,
+                gboolean  compact)
+{
+  GArray *units, *next;
+  ParallelUnit unit;
+  guint split;
+
+  units = g_array_new (FALSE, FALSE, sizeof (ParallelUnit));
+  next = g_array_new (FALSE, FALSE, sizeof (ParallelUnit));
+
+  unit = (ParallelUnit) {
+    .n = root,
+    .path = compact ? g_string_new (NULL) : NULL,
+  };
+
+  g_array_append_val (units, unit);
+
+  for (split = 0; split < PARALLEL_MAX_SPLITS && units->len < n_units; split++)
+    {
+      gboolean expanded;
+      guint i;
+
+      expanded = FALSE;
+      g_array_set_size (next, 0);
+
+      for (i = 0; i < units->len; i++)
+        {
+          ParallelUnit *parent = &g_array_index (units, ParallelUnit, i);
+          Node *n = parent->n;
+          gint pos_start;
+          guint pos;
+
+          if (IS_LEAF (n))
+            {
+              g_array_append_val (next, *parent);
+              continue;
+            }
+
+          for (pos_start = -1; step_position (n, pos_start, 1, &pos); pos_start = pos)
+            {
+              ParallelUnit child = { .n = child_at (n, pos) };
+
+              if (parent->path)
+                {
+                  child.path = g_string_new_len (parent->path->str, parent->path->len);
+                  g_string_append_len (child.path, (const gchar*) n->partial, n->partial_len);
+                  g_string_append_c (child.path, key_at (n, pos));
+                }
+
+              g_array_append_val (next, child);
+            }
+
+          if (parent->path)
+            g_string_free (parent->path, TRUE);
+
+          expanded = TRUE;
+        }
+
+      if (!expanded)
+        break;
+
+      /* Swap them around */
+      {
+        GArray *tmp = units;
+        units = next;
+        next = tmp;
+      }
+    }
+
+  g_array_free (next, TRUE);
+
+  return units;
+}
+
+static gboolean
+parallel_walk_cb (const gchar *key,
+                  gsize        key_length,
+                  gpointer     value,
+                  gpointer     user_data)
+{
+  ParallelUnit *unit = user_data;
+  ParallelWalk *walk = unit->walk;
+
+  if (walk->map)
+    {
+      g_ptr_array_add (unit->results, walk->map (key, key_length, value, walk->user_data));
+      return GW_RADIX_TREE_ITER_CONTINUE;
+    }
+
+  if (g_atomic_int_get (&walk->stop))
+    return GW_RADIX_TREE_ITER_STOP;
+
+  if (walk->callback (key, key_length, value, walk->user_data))
+    {
+      g_atomic_int_set (&walk->stop, TRUE);
+      return GW_RADIX_TREE_ITER_STOP;
+    }
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+static void
+parallel_walk_unit (gpointer data,
+                    gpointer user_data)
+{
+  ParallelUnit *unit = data;
+
+  iter_recursive (unit->n, unit->path, parallel_walk_cb, unit);
+}
+
+/*
+ * Calls the callback or map function of @walk on every key below @root.
+ * Results of the map function are collected in key order, each unit in
+ * its own array, and appended to @results once all units are done.
+ */
+static void
+parallel_walk (ParallelWalk *walk,
+               Node         *root,
+               gboolean      compact,
+               GPtrArray    *results)
+{
+  ParallelUnit *units;
+  GThreadPool *pool;
+  GArray *subtrees;
+  guint n_threads;
+  guint i, j;
+
+  if (!root)
+    return;
+
+  n_threads = g_get_num_processors ();
+  subtrees = split_subtrees (root, n_threads * PARALLEL_UNITS_PER_THREAD, compact);
+  units = (ParallelUnit*) subtrees->data;
+
+  for (i = 0; i < subtrees->len; i++)
+    {
+      units[i].walk = walk;
+      units[i].results = walk->map ? g_ptr_array_new () : NULL;
+    }
+
+  /* Nothing to share with other threads */
+  if (n_threads == 1 || subtrees->len == 1)
+    {
+      for (i = 0; i < subtrees->len; i++)
+        parallel_walk_unit (&units[i], NULL);
+    }
+  else
+    {
+      pool = g_thread_pool_new (parallel_walk_unit, NULL, n_threads, FALSE, NULL);
+
+      for (i = 0; i < subtrees->len; i++)
+        g_thread_pool_push (pool, &units[i], NULL);
+
+      g_thread_pool_free (pool, FALSE, TRUE);
+    }
+
+  for (i = 0; i < subtrees->len; i++)
+    {
+      if (units[i].path)
+        g_string_free (units[i].path, TRUE);
+
+      if (!walk->map)
+        continue;
+
+      for (j = 0; j < units[i].results->len; j++)
+        g_ptr_array_add (results, g_ptr_array_index (units[i].results, j));
+
+      g_ptr_array_free (units[i].results, TRUE);
+    }
+
+  g_array_free (subtrees, TRUE);
+}
+
+/*
+ * Frozen trees
+ *
+ * gw_radix_tree_freeze() rewrites the tree into a single block, with the
+ * nodes in breadth-first order so that the top levels, which every lookup
+ * goes through, share a few cache lines. Nodes only take the room their
+ * children need: a FrozenNode header, the whole compressed path, the key
+ * bytes, and 32-bit offsets to the children relative to the node itself.
+ * Key bytes are kept sorted for up to FROZEN_MAX_SORTED children, in a
+ * 256-byte index for more, and left out when all 256 bytes have a child.
+ *
+ * Offsets have the lowest bit set for leaves, which keep the layout of
+ * Leaf and their whole key, and an offset of 0 means there is no child.
+ */
+#define FROZEN_MAX_SORTED  32
+#define FROZEN_PADDING     16
+#define FROZEN_ALIGN(x, a) (((x) + (a) - 1) & ~((gsize) (a) - 1))
+
+#define FROZEN_IS_LEAF(ref)       ((ref) & 1)
+#define FROZEN_AT(base, ref)      ((guchar*) (base) + ((ref) & ~1))
+
+typedef struct
+{
+  guint32             partial_len;
+  guint16             num_children;
+  guint16             padding;
+} FrozenNode;
+
+typedef struct
+{
+  Node               *n;
+  guint32             depth;
+  gsize               offset;
+  guint               first_child;
+} FreezeItem;
+
+static inline guint
+frozen_keys_size (guint num_children)
+{
+  if (num_children <= FROZEN_MAX_SORTED)
+    return num_children;
+
+  return num_children < 256 ? 256 : 0;
+}
+
+static inline guchar*
+frozen_partial (FrozenNode *n)
+{
+  return (guchar*) (n + 1);
+}
+
+static inline guchar*
+frozen_keys (FrozenNode *n)
+{
+  return frozen_partial (n) + n->partial_len;
+}
+
+static inline guint32*
+frozen_children (FrozenNode *n)
+{
+  gsize offset;
+
+  offset = FROZEN_ALIGN (sizeof (FrozenNode) + n->partial_len + frozen_keys_size (n->num_children), 4);
+
+  return (guint32*) ((guchar*) n + offset);
+}
+
+static gsize
+frozen_node_size (guint    num_children,
+                  guint32  partial_len)
+{
+  gsize size;
+
+  size = FROZEN_ALIGN (sizeof (FrozenNode) + partial_len + frozen_keys_size (num_children), 4);
+
+  return size + num_children * sizeof (guint32);
+}
+
+/* Returns the offset of the child of @n for @c, or 0 */
+static inline guint32
+frozen_find_child (FrozenNode *n,
+                   guchar      c)
+{
+  guchar *keys;
+  gint i;
+
+  keys = frozen_keys (n);
+
+  if (n->num_children <= FROZEN_MAX_SORTED)
+    {
+      i = search_keys (keys, n->num_children, c);
+
+      return i >= 0 ? frozen_children (n)[i] : 0;
+    }
+
+  if (n->num_children < 256)
+    return keys[c] ? frozen_children (n)[keys[c] - 1] : 0;
+
+  return frozen_children (n)[c];
+}
+
+/* Moves @pos, which starts at -1, to the next child of @n in key order */
+static inline gboolean
+frozen_step (FrozenNode *n,
+             gint       *pos,
+             guchar     *c,
+             guint32    *child)
+{
+  guchar *keys;
+
+  keys = frozen_keys (n);
+
+  if (n->num_children <= FROZEN_MAX_SORTED)
+    {
+      if (++*pos >= n->num_children)
+        return FALSE;
+
+      *c = keys[*pos];
+      *child = frozen_children (n)[*pos];
+
+      return TRUE;
+    }
+
+  while (++*pos < 256)
+    {
+      if (n->num_children == 256)
+        {
+          *c = *pos;
+          *child = frozen_children (n)[*pos];
+
+          return TRUE;
+        }
+
+      if (keys[*pos])
+        {
+          *c = *pos;
+          *child = frozen_children (n)[keys[*pos] - 1];
+
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+/* Moves @pos, which starts at 256, to the previous child of @n in key order */
+static inline gboolean
+frozen_step_back (FrozenNode *n,
+                  gint       *pos,
+                  guchar     *c,
+                  guint32    *child)
+{
+  guchar *keys;
+
+  keys = frozen_keys (n);
+
+  if (n->num_children <= FROZEN_MAX_SORTED)
+    {
+      *pos = MIN (*pos, (gint) n->num_children) - 1;
+
+      if (*pos < 0)
+        return FALSE;
+
+      *c = keys[*pos];
+      *child = frozen_children (n)[*pos];
+
+      return TRUE;
+    }
+
+  while (--*pos >= 0)
+    {
+      if (n->num_children == 256)
+        {
+          *c = *pos;
+          *child = frozen_children (n)[*pos];
+
+          return TRUE;
+        }
+
+      if (keys[*pos])
+        {
+          *c = *pos;
+          *child = frozen_children (n)[keys[*pos] - 1];
+
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+/* Whole compressed path of @n, which starts at @depth */
+static const guchar*
+freeze_partial (Node    *n,
+                guint32  depth)
+{
+  if (n->partial_len <= MAX_PREFIX_LEN)
+    return n->partial;
+
+  return (const guchar*) LEAF_KEY (minimum (n)) + depth;
+}
+
+/*
+ * Lays out the items below @root in breadth-first order. Returns %FALSE
+ * if a node or leaf is shared with a copy of the tree, or if the block
+ * wouldn't be addressable with 32-bit offsets.
+ */
+static gboolean
+freeze_layout (Node   *root,
+               GArray *items,
+               gsize  *n_bytes)
+{
+  FreezeItem root_item = { root, 0, 0, 0 };
+  gsize offset;
+  guint i;
+
+  g_array_append_val (items, root_item);
+  offset = 0;
+
+  for (i = 0; i < items->len; i++)
+    {
+      FreezeItem *item = &g_array_index (items, FreezeItem, i);
+      Node *n = item->n;
+      guint32 depth;
+      gint pos_start;
+      guint pos;
+
+      item->offset = offset;
+
+      if (IS_LEAF (n))
+        {
+          LeafView view;
+          Leaf *l = leaf_view (n, &view);
+
+          if (!IS_EMBEDDED (n) && g_atomic_int_get (&l->ref_count) > 1)
+            return FALSE;
+
+          offset += FROZEN_ALIGN (LEAF_SIZE (l->key_len), 8);
+        }
+      else
+        {
+          if (g_atomic_int_get (&n->ref_count) > 1)
+            return FALSE;
+
+          offset += FROZEN_ALIGN (frozen_node_size (n->num_children, n->partial_len), 8);
+
+          item->first_child = items->len;
+          depth = item->depth + n->partial_len + 1;
+
+          for (pos_start = -1; step_position (n, pos_start, 1, &pos); pos_start = pos)
+            {
+              FreezeItem child = { child_at (n, pos), depth, 0, 0 };
+
+              g_array_append_val (items, child);
+            }
+        }
+
+      if (offset > G_MAXUINT32)
+        return FALSE;
+    }
+
+  *n_bytes = offset;
+
+  return TRUE;
+}
+
+static void
+freeze_node (Frozen     *frozen,
+             GArray     *items,
+             FreezeItem *item)
+{
+  FrozenNode *fn;
+  guint32 *children;
+  guchar *keys;
+  Node *n;
+  gint pos_start;
+  guint pos, i;
+
+  n = item->n;
+  fn = (FrozenNode*) (frozen->data + item->offset);
+
+  *fn = (FrozenNode) {
+    .partial_len = n->partial_len,
+    .num_children = n->num_children,
+  };
+
+  memcpy (frozen_partial (fn), freeze_partial (n, item->depth), n->partial_len);
+
+  keys = frozen_keys (fn);
+  children = frozen_children (fn);
+
+  if (frozen_keys_size (n->num_children) == 256)
+    memset (keys, 0, 256);
+
+  i = 0;
+
+  for (pos_start = -1; step_position (n, pos_start, 1, &pos); pos_start = pos)
+    {
+      FreezeItem *child = &g_array_index (items, FreezeItem, item->first_child + i);
+      guint32 ref = child->offset - item->offset;
+      guchar c = key_at (n, pos);
+
+      if (IS_LEAF (child->n))
+        ref |= 1;
+
+      if (n->num_children <= FROZEN_MAX_SORTED)
+        {
+          keys[i] = c;
+          children[i] = ref;
+        }
+      else if (n->num_children < 256)
+        {
+          keys[c] = i + 1;
+          children[i] = ref;
+        }
+      else
+        {
+          children[c] = ref;
+        }
+
+      i++;
+    }
+}
+
+/* Returns %NULL if @root can't be frozen, see freeze_layout() */
+static Frozen*
+frozen_new (Node *root)
+{
+  Frozen *frozen;
+  GArray *items;
+  gsize n_bytes;
+  guint i;
+
+  n_bytes = 0;
+  items = g_array_new (FALSE, FALSE, sizeof (FreezeItem));
+
+  if (root && !freeze_layout (root, items, &n_bytes))
+    {
+      g_array_free (items, TRUE);
+      return NULL;
+    }
+
+  frozen = g_malloc0 (sizeof (Frozen) + n_bytes + FROZEN_PADDING);
+  frozen->n_bytes = n_bytes;
+  frozen->root = root && IS_LEAF (root) ? 1 : 0;
+
+  for (i = 0; root && i < items->len; i++)
+    {
+      FreezeItem *item = &g_array_index (items, FreezeItem, i);
+
+      if (IS_LEAF (item->n))
+        {
+          LeafView view;
+          Leaf *l = leaf_view (item->n, &view);
+
+          memcpy (frozen->data + item->offset, l, LEAF_SIZE (l->key_len));
+          ((Leaf*) (frozen->data + item->offset))->ref_count = 1;
+        }
+      else
+        {
+          freeze_node (frozen, items, item);
+        }
+    }
+
+  g_array_free (items, TRUE);
+
+  return frozen;
+}
+
+static Leaf*
+frozen_lookup (Frozen       *frozen,
+               const guchar *key,
+               gint          key_len)
+{
+  guchar *base;
+  guint32 ref;
+  gint depth;
+  Leaf *l;
+
+  if (frozen->n_bytes == 0)
+    return NULL;
+
+  base = frozen->data;
+  ref = frozen->root;
+  depth = 0;
+
+  while (!FROZEN_IS_LEAF (ref))
+    {
+      FrozenNode *n = (FrozenNode*) FROZEN_AT (base, ref);
+
+      /* Whole compressed paths are stored, so they are checked exactly */
+      if (n->partial_len)
+        {
+          if (depth + n->partial_len > (guint32) key_len ||
+              memcmp (frozen_partial (n), key + depth, n->partial_len) != 0)
+            {
+              return NULL;
+            }
+
+          depth += n->partial_len;
+        }
+
+      ref = frozen_find_child (n, key_byte (key, key_len, depth));
+
+      if (!ref)
+        return NULL;
+
+      base = (guchar*) n;
+      depth++;
+    }
+
+  l = (Leaf*) FROZEN_AT (base, ref);
+
+  /* Only the bytes below the last node are left to compare */
+  depth = MIN (depth, key_len);
+
+  if (l->key_len != (guint32) key_len || memcmp (LEAF_KEY (l) + depth, key + depth, key_len - depth) != 0)
+    return NULL;
+
+  return l;
+}
+
+static gboolean
+frozen_iter_recursive (guchar      *base,
+                       guint32      ref,
+                       RadixTreeCb  cb,
+                       gpointer     user_data)
+{
+  FrozenNode *n;
+  guint32 child;
+  guchar c;
+  gint pos;
+
+  if (FROZEN_IS_LEAF (ref))
+    {
+      Leaf *l = (Leaf*) FROZEN_AT (base, ref);
+
+      return cb (LEAF_KEY (l), l->key_len, l->value, user_data);
+    }
+
+  n = (FrozenNode*) FROZEN_AT (base, ref);
+
+  for (pos = -1; frozen_step (n, &pos, &c, &child);)
+    {
+      if (frozen_iter_recursive ((guchar*) n, child, cb, user_data))
+        return GW_RADIX_TREE_ITER_STOP;
+    }
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+static gboolean
+frozen_iter (Frozen      *frozen,
+             RadixTreeCb  cb,
+             gpointer     user_data)
+{
+  if (frozen->n_bytes == 0)
+    return GW_RADIX_TREE_ITER_CONTINUE;
+
+  return frozen_iter_recursive (frozen->data, frozen->root, cb, user_data);
+}
+
+static gboolean
+frozen_iter_reverse_recursive (guchar      *base,
+                               guint32      ref,
+                               RadixTreeCb  cb,
+                               gpointer     user_data)
+{
+  FrozenNode *n;
+  guint32 child;
+  guchar c;
+  gint pos;
+
+  if (FROZEN_IS_LEAF (ref))
+    {
+      Leaf *l = (Leaf*) FROZEN_AT (base, ref);
+
+      return cb (LEAF_KEY (l), l->key_len, l->value, user_data);
+    }
+
+  n = (FrozenNode*) FROZEN_AT (base, ref);
+
+  for (pos = 256; frozen_step_back (n, &pos, &c, &child);)
+    {
+      if (frozen_iter_reverse_recursive ((guchar*) n, child, cb, user_data))
+        return GW_RADIX_TREE_ITER_STOP;
+    }
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+/* Same as iter_reverse_upto(), with whole compressed paths stored in the nodes */
+static gboolean
+frozen_iter_reverse_upto (guchar       *base,
+                          guint32       ref,
+                          const guchar *key,
+                          gint          key_len,
+                          gint          depth,
+                          RadixTreeCb   cb,
+                          gpointer      user_data)
+{
+  FrozenNode *n;
+  guint32 child, i;
+  guchar c, k;
+  gint pos;
+
+  if (FROZEN_IS_LEAF (ref))
+    {
+      Leaf *l = (Leaf*) FROZEN_AT (base, ref);
+
+      if (leaf_compare (l, key, key_len) > 0)
+        return GW_RADIX_TREE_ITER_CONTINUE;
+
+      return cb (LEAF_KEY (l), l->key_len, l->value, user_data);
+    }
+
+  if (depth > key_len)
+    return GW_RADIX_TREE_ITER_CONTINUE;
+
+  n = (FrozenNode*) FROZEN_AT (base, ref);
+
+  for (i = 0; i < n->partial_len; i++)
+    {
+      c = key_byte (key, key_len, depth + i);
+
+      if (frozen_partial (n)[i] < c)
+        return frozen_iter_reverse_recursive (base, ref, cb, user_data);
+
+      if (frozen_partial (n)[i] > c)
+        return GW_RADIX_TREE_ITER_CONTINUE;
+    }
+
+  depth += n->partial_len;
+  c = key_byte (key, key_len, depth);
+
+  for (pos = 256; frozen_step_back (n, &pos, &k, &child);)
+    {
+      gboolean res;
+
+      if (k > c)
+        continue;
+
+      if (k == c)
+        res = frozen_iter_reverse_upto ((guchar*) n, child, key, key_len, depth + 1, cb, user_data);
+      else
+        res = frozen_iter_reverse_recursive ((guchar*) n, child, cb, user_data);
+
+      if (res)
+        return GW_RADIX_TREE_ITER_STOP;
+    }
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+static gboolean
+frozen_iter_prefix (Frozen       *frozen,
+                    const guchar *prefix,
+                    gint          prefix_len,
+                    RadixTreeCb   cb,
+                    gpointer      user_data)
+{
+  guchar *base;
+  guint32 ref;
+  gint depth;
+
+  if (frozen->n_bytes == 0)
+    return GW_RADIX_TREE_ITER_CONTINUE;
+
+  base = frozen->data;
+  ref = frozen->root;
+  depth = 0;
+
+  while (!FROZEN_IS_LEAF (ref))
+    {
+      FrozenNode *n = (FrozenNode*) FROZEN_AT (base, ref);
+
+      if (depth == prefix_len)
+        return frozen_iter_recursive (base, ref, cb, user_data);
+
+      if (n->partial_len)
+        {
+          guint32 len = MIN (n->partial_len, (guint32) (prefix_len - depth));
+
+          if (memcmp (frozen_partial (n), prefix + depth, len) != 0)
+            return GW_RADIX_TREE_ITER_CONTINUE;
+
+          /* The prefix ends within the compressed path */
+          if (depth + n->partial_len >= (guint32) prefix_len)
+            return frozen_iter_recursive (base, ref, cb, user_data);
+
+          depth += n->partial_len;
+        }
+
+      ref = frozen_find_child (n, prefix[depth]);
+
+      if (!ref)
+        return GW_RADIX_TREE_ITER_CONTINUE;
+
+      base = (guchar*) n;
+      depth++;
+    }
+
+  if (!leaf_prefix_matches ((Leaf*) FROZEN_AT (base, ref), prefix, prefix_len, 0))
+    return GW_RADIX_TREE_ITER_CONTINUE;
+
+  return frozen_iter_recursive (base, ref, cb, user_data);
+}
+
+static gboolean
+frozen_iter_prefixes_of (Frozen       *frozen,
+                         const guchar *key,
+                         gint          key_len,
+                         RadixTreeCb   cb,
+                         gpointer      user_data)
+{
+  guchar *base;
+  guint32 ref;
+  gint depth;
+  Leaf *l;
+
+  if (frozen->n_bytes == 0)
+    return GW_RADIX_TREE_ITER_CONTINUE;
+
+  base = frozen->data;
+  ref = frozen->root;
+  depth = 0;
+
+  while (!FROZEN_IS_LEAF (ref))
+    {
+      FrozenNode *n = (FrozenNode*) FROZEN_AT (base, ref);
+      guint32 child;
+
+      if (n->partial_len)
+        {
+          if (depth + n->partial_len > (guint32) key_len ||
+              memcmp (frozen_partial (n), key + depth, n->partial_len) != 0)
+            {
+              return GW_RADIX_TREE_ITER_CONTINUE;
+            }
+
+          depth += n->partial_len;
+        }
+
+      /* The path was compared exactly, so a key ending here is a prefix */
+      child = frozen_find_child (n, '\0');
+
+      if (child && FROZEN_IS_LEAF (child))
+        {
+          l = (Leaf*) FROZEN_AT (n, child);
+
+          if (cb (LEAF_KEY (l), l->key_len, l->value, user_data))
+            return GW_RADIX_TREE_ITER_STOP;
+        }
+
+      if (depth >= key_len)
+        return GW_RADIX_TREE_ITER_CONTINUE;
+
+      ref = frozen_find_child (n, key[depth]);
+
+      if (!ref)
+        return GW_RADIX_TREE_ITER_CONTINUE;
+
+      base = (guchar*) n;
+      depth++;
+    }
+
+  l = (Leaf*) FROZEN_AT (base, ref);
+
+  if (!leaf_is_prefix_of (l, key, key_len, 0))
+    return GW_RADIX_TREE_ITER_CONTINUE;
+
+  return cb (LEAF_KEY (l), l->key_len, l->value, user_data);
+}
+
+static gboolean
+frozen_fuzzy_recursive (FuzzySearch *search,
+                        FrozenNode  *n,
+                        guint32      depth,
+                        FuzzyState   state)
+{
+  guint32 child, i;
+  guchar c;
+  gint pos;
+
+  for (i = 0; i < n->partial_len; i++)
+    {
+      if (!fuzzy_push_byte (search, &state, frozen_partial (n)[i]))
+        return GW_RADIX_TREE_ITER_CONTINUE;
+    }
+
+  depth += n->partial_len;
+
+  for (pos = -1; frozen_step (n, &pos, &c, &child);)
+    {
+      FuzzyState child_state = state;
+      gboolean res;
+
+      if (FROZEN_IS_LEAF (child))
+        res = fuzzy_leaf (search, child_state, (Leaf*) FROZEN_AT (n, child), depth);
+      else if (fuzzy_push_byte (search, &child_state, c))
+        res = frozen_fuzzy_recursive (search, (FrozenNode*) FROZEN_AT (n, child), depth + 1, child_state);
+      else
+        res = GW_RADIX_TREE_ITER_CONTINUE;
+
+      if (res)
+        return res;
+    }
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+static gboolean
+frozen_pattern_recursive (PatternSearch *search,
+                          FrozenNode    *n,
+                          guint32        depth,
+                          PatternState   state)
+{
+  guint32 child, i;
+  guchar c;
+  gint pos;
+
+  for (i = 0; i < n->partial_len; i++)
+    {
+      if (!pattern_push_byte (search, &state, frozen_partial (n)[i]))
+        return GW_RADIX_TREE_ITER_CONTINUE;
+    }
+
+  depth += n->partial_len;
+
+  for (pos = -1; frozen_step (n, &pos, &c, &child);)
+    {
+      PatternState child_state = state;
+      gboolean res;
+
+      if (FROZEN_IS_LEAF (child))
+        res = pattern_leaf (search, child_state, (Leaf*) FROZEN_AT (n, child), depth);
+      else if (pattern_push_byte (search, &child_state, c))
+        res = frozen_pattern_recursive (search, (FrozenNode*) FROZEN_AT (n, child), depth + 1, child_state);
+      else
+        res = GW_RADIX_TREE_ITER_CONTINUE;
+
+      if (res)
+        return res;
+    }
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+/* Nodes are counted by the kind of mutable node that would hold their children */
+static void
+frozen_stats_recursive (StatsCollector *collector,
+                        guchar         *base,
+                        guint32         ref,
+                        guint           depth)
+{
+  GwRadixTreeStats *stats;
+  FrozenNode *n;
+  guint32 child;
+  guchar c;
+  gint pos;
+
+  stats = collector->stats;
+
+  if (FROZEN_IS_LEAF (ref))
+    {
+      stats->n_leaves++;
+      stats->max_depth = MAX (stats->max_depth, depth);
+      collector->depth_sum += depth;
+      return;
+    }
+
+  n = (FrozenNode*) FROZEN_AT (base, ref);
+
+  if (n->num_children <= 4)
+    {
+      stats->n_node4++;
+      collector->n_children[NODE_4] += n->num_children;
+    }
+  else if (n->num_children <= 16)
+    {
+      stats->n_node16++;
+      collector->n_children[NODE_16] += n->num_children;
+    }
+  else if (n->num_children <= 32)
+    {
+      stats->n_node32++;
+      collector->n_children[NODE_32] += n->num_children;
+    }
+  else if (n->num_children <= 48)
+    {
+      stats->n_node48++;
+      collector->n_children[NODE_48] += n->num_children;
+    }
+  else
+    {
+      stats->n_node256++;
+      collector->n_children[NODE_256] += n->num_children;
+    }
+
+  if (n->partial_len > 0)
+    stats->n_compressed++;
+
+  for (pos = -1; frozen_step (n, &pos, &c, &child);)
+    frozen_stats_recursive (collector, (guchar*) n, child, depth + 1);
+}
+
+/*
+ * Set operations
+ *
+ * Both trees are walked together, one byte of the key space at a time.
+ * A subtree below a byte that only one of the trees has is either taken
+ * or skipped whole, and only subtrees that both trees have are descended
+ * further. Leaves of the result come out sorted, so the new tree is bulk
+ * loaded from them, and shares them with the inputs like a copy would.
+ * Leaves are kept as tagged pointers, since embedded keys have no other
+ * storage.
+ */
+typedef enum
+{
+  SET_UNION,
+  SET_INTERSECTION,
+  SET_DIFFERENCE,
+} SetOperation;
+
+typedef struct
+{
+  GwRadixTree        *result;
+  SetOperation        op;
+  gboolean            copy_b;
+  GPtrArray          *leaves;
+} SetMerge;
+
+/* Leaves of the second tree are copied when they can't be shared */
+static Node*
+set_take_leaf (SetMerge *merge,
+               Node     *n,
+               gboolean  from_b)
+{
+  Leaf *l;
+
+  if (IS_EMBEDDED (n))
+    return n;
+
+  l = LEAF_RAW (n);
+
+  if (from_b && merge->copy_b)
+    {
+      Leaf *copy = leaf_new (merge->result, LEAF_KEY (l), l->key_len, l->value);
+
+      copy->number = l->number;
+
+      return SET_LEAF (copy);
+    }
+
+  g_atomic_int_inc (&l->ref_count);
+
+  return n;
+}
+
+static void
+set_emit_leaf (SetMerge *merge,
+               Node     *l,
+               gboolean  from_b)
+{
+  g_ptr_array_add (merge->leaves, set_take_leaf (merge, l, from_b));
+}
+
+static void
+set_emit_subtree (SetMerge *merge,
+                  Node     *n,
+                  gboolean  from_b)
+{
+  gint pos_start;
+  guint pos;
+
+  if (IS_LEAF (n))
+    {
+      set_emit_leaf (merge, n, from_b);
+      return;
+    }
+
+  for (pos_start = -1; step_position (n, pos_start, 1, &pos); pos_start = pos)
+    set_emit_subtree (merge, child_at (n, pos), from_b);
+}
+
+/* A subtree that only one of the trees has */
+static void
+set_merge_one (SetMerge *merge,
+               Node     *n,
+               gboolean  from_b)
+{
+  if (merge->op == SET_UNION || (merge->op == SET_DIFFERENCE && !from_b))
+    set_emit_subtree (merge, n, from_b);
+}
+
+/* Merges the only key of one tree, @l, with the subtree @n of the other */
+static void
+set_merge_leaf (SetMerge *merge,
+                Node     *l,
+                gboolean  l_from_b,
+                Node     *n,
+                gint      n_depth)
+{
+  LeafView view, other_view;
+  Leaf *leaf;
+  Node *match;
+  guint i;
+
+  leaf = leaf_view (l, &view);
+  match = lookup_leaf (n, LEAF_KEY (leaf), leaf->key_len, n_depth, FALSE);
+
+  /* Values always come from the first tree */
+  if (merge->op == SET_INTERSECTION)
+    {
+      if (match)
+        set_emit_leaf (merge, l_from_b ? match : l, FALSE);
+
+      return;
+    }
+
+  if (merge->op == SET_DIFFERENCE && !l_from_b)
+    {
+      if (!match)
+        set_emit_leaf (merge, l, FALSE);
+
+      return;
+    }
+
+  /* Otherwise all of @n is taken, and @l is added to or removed from it */
+  i = merge->leaves->len;
+
+  set_emit_subtree (merge, n, !l_from_b);
+
+  /* The first tree already has its own value for the key */
+  if (l_from_b && match && merge->op == SET_UNION)
+    return;
+
+  /* Nothing of the first tree to leave out */
+  if (l_from_b && !match && merge->op == SET_DIFFERENCE)
+    return;
+
+  while (i < merge->leaves->len &&
+         leaf_compare (leaf_view (g_ptr_array_index (merge->leaves, i), &other_view),
+                       LEAF_KEY (leaf),
+                       leaf->key_len) < 0)
+    {
+      i++;
+    }
+
+  if (match)
+    {
+      Node *removed = g_ptr_array_remove_index (merge->leaves, i);
+
+      if (!IS_EMBEDDED (removed))
+        leaf_unref (merge->result, LEAF_RAW (removed), FALSE);
+    }
+
+  if (merge->op == SET_UNION)
+    g_ptr_array_insert (merge->leaves, i, set_take_leaf (merge, l, l_from_b));
+}
+
+static void set_merge (SetMerge *merge,
+                       Node     *a,
+                       guint32   a_skip,
+                       Node     *b,
+                       guint32   b_skip,
+                       gint      depth);
+
+/*
+ * Merges the children of @n with @other, which is still within its
+ * compressed path, and thus only goes on below one of them.
+ */
+static void
+set_merge_path (SetMerge *merge,
+                Node     *n,
+                gboolean  n_from_b,
+                Node     *other,
+                guint32   other_skip,
+                gint      depth)
+{
+  gboolean merged;
+  gint pos_start;
+  guint pos;
+  guchar c;
+
+  c = prefix_byte (other, depth - other_skip, other_skip);
+  merged = FALSE;
+
+  for (pos_start = -1; step_position (n, pos_start, 1, &pos); pos_start = pos)
+    {
+      guchar k = key_at (n, pos);
+
+      if (!merged && k > c)
+        {
+          set_merge_one (merge, other, !n_from_b);
+          merged = TRUE;
+        }
+
+      if (k != c)
+        {
+          set_merge_one (merge, child_at (n, pos), n_from_b);
+          continue;
+        }
+
+      if (n_from_b)
+        set_merge (merge, other, other_skip + 1, child_at (n, pos), 0, depth + 1);
+      else
+        set_merge (merge, child_at (n, pos), 0, other, other_skip + 1, depth + 1);
+
+      merged = TRUE;
+    }
+
+  if (!merged)
+    set_merge_one (merge, other, !n_from_b);
+}
+
+static void
+set_merge_children (SetMerge *merge,
+                    Node     *a,
+                    Node     *b,
+                    gint      depth)
+{
+  gboolean has_a, has_b;
+  guint a_pos, b_pos;
+
+  has_a = step_position (a, -1, 1, &a_pos);
+  has_b = step_position (b, -1, 1, &b_pos);
+
+  while (has_a || has_b)
+    {
+      gint ka, kb;
+
+      ka = has_a ? key_at (a, a_pos) : 256;
+      kb = has_b ? key_at (b, b_pos) : 256;
+
+      if (ka == kb)
+        set_merge (merge, child_at (a, a_pos), 0, child_at (b, b_pos), 0, depth + 1);
+      else if (ka < kb)
+        set_merge_one (merge, child_at (a, a_pos), FALSE);
+      else
+        set_merge_one (merge, child_at (b, b_pos), TRUE);
+
+      if (ka <= kb)
+        has_a = step_position (a, a_pos, 1, &a_pos);
+
+      if (kb <= ka)
+        has_b = step_position (b, b_pos, 1, &b_pos);
+    }
+}
+
+/*
+ * Merges the subtrees @a and @b, whose keys share the same first @depth
+ * bytes. @a_skip and @b_skip are the bytes of their compressed paths
+ * that are already part of those.
+ */
+static void
+set_merge (SetMerge *merge,
+           Node     *a,
+           guint32   a_skip,
+           Node     *b,
+           guint32   b_skip,
+           gint      depth)
+{
+  while (TRUE)
+    {
+      gboolean a_in_path, b_in_path;
+      guchar ca, cb;
+
+      if (IS_LEAF (a))
+        {
+          set_merge_leaf (merge, a, FALSE, b, depth - b_skip);
+          return;
+        }
+
+      if (IS_LEAF (b))
+        {
+          set_merge_leaf (merge, b, TRUE, a, depth - a_skip);
+          return;
+        }
+
+      a_in_path = a_skip < a->partial_len;
+      b_in_path = b_skip < b->partial_len;
+
+      if (!a_in_path && !b_in_path)
+        {
+          set_merge_children (merge, a, b, depth);
+          return;
+        }
+
+      if (!a_in_path)
+        {
+          set_merge_path (merge, a, FALSE, b, b_skip, depth);
+          return;
+        }
+
+      if (!b_in_path)
+        {
+          set_merge_path (merge, b, TRUE, a, a_skip, depth);
+          return;
+        }
+
+      /* Both compressed paths go on, and the subtrees are disjoint once they differ */
+      ca = prefix_byte (a, depth - a_skip, a_skip);
+      cb = prefix_byte (b, depth - b_skip, b_skip);
+
+      if (ca != cb)
+        {
+          if (ca < cb)
+            {
+              set_merge_one (merge, a, FALSE);
+              set_merge_one (merge, b, TRUE);
+            }
+          else
+            {
+              set_merge_one (merge, b, TRUE);
+              set_merge_one (merge, a, FALSE);
+            }
+
+          return;
+        }
+
+      a_skip++;
+      b_skip++;
+      depth++;
+    }
+}
+
+static GwRadixTree*
+set_operation (GwRadixTree  *a,
+               GwRadixTree  *b,
+               SetOperation  op)
+{
+  GwRadixTree *result;
+  SetMerge merge;
+
+  result = gw_radix_tree_new_with_free_func (a->destroy_func);
+  result->embed_keys = a->embed_keys;
+  result->counted = a->counted;
+  result->uint64_values = a->uint64_values;
+
+  /* Leaves of @a are freed by the result, so it takes the same memory */
+  if (a->arena)
+    result->arena = arena_ref (a->arena);
+
+  merge = (SetMerge) {
+    .result = result,
+    .op = op,
+    .copy_b = a->arena != b->arena,
+    .leaves = g_ptr_array_new (),
+  };
+
+  if (a->root && b->root)
+    set_merge (&merge, DEREF (a->root), 0, DEREF (b->root), 0, 0);
+  else if (a->root)
+    set_merge_one (&merge, DEREF (a->root), FALSE);
+  else if (b->root)
+    set_merge_one (&merge, DEREF (b->root), TRUE);
+
+  if (merge.leaves->len > 0)
+    {
+      const gchar **keys;
+      BulkLoad load;
+      gsize *key_lengths;
+      guint i;
+
+      keys = g_new (const gchar*, merge.leaves->len);
+      key_lengths = g_new (gsize, merge.leaves->len);
+
+      for (i = 0; i < merge.leaves->len; i++)
+        {
+          Node *n = g_ptr_array_index (merge.leaves, i);
+
+          /* Embedded keys are read from the array itself */
+          if (IS_EMBEDDED (n))
+            {
+              keys[i] = (const gchar*) EMBEDDED_KEY (&merge.leaves->pdata[i]);
+              key_lengths[i] = EMBEDDED_LEN (n);
+            }
+          else
+            {
+              keys[i] = (const gchar*) LEAF_KEY (LEAF_RAW (n));
+              key_lengths[i] = LEAF_RAW (n)->key_len;
+            }
+        }
+
+      load = (BulkLoad) { result, keys, key_lengths, NULL, (Node**) merge.leaves->pdata };
+
+      result->root = REF (build_sorted (&load, 0, merge.leaves->len, 0));
+      result->size = merge.leaves->len;
+
+      g_free (key_lengths);
+      g_free (keys);
+    }
+
+  g_ptr_array_free (merge.leaves, TRUE);
+
+  return result;
+}
+
+/* Unlinks the leaf of @key, leaving its tagged pointer to the caller */
+static Node*
+remove_key (GwRadixTree *self,
+            const gchar *key,
+            gsize        key_length)
+{
+  Node *removed;
+  Leaf *l;
+  gint *reader;
+
+  if (key_length == -1)
+    key_length = strlen (key);
+
+  if (!self->epochs)
+    {
+      removed = remove_recursive (self,
+                                  DEREF (self->root),
+                                  &self->root,
+                                  (const guchar*) key,
+                                  key_length,
+                                  0,
+                                  FALSE);
+
+      if (removed)
+        {
+          self->size--;
+          self->stamp++;
+        }
+
+      return removed;
+    }
+
+  reader = epochs_enter (self->epochs);
+  l = remove_concurrent (self, (const guchar*) key, key_length);
+  epochs_leave (reader);
+
+  if (!l)
+    return NULL;
+
+  __atomic_sub_fetch (&self->size, 1, __ATOMIC_RELAXED);
+  g_atomic_int_inc (&self->stamp);
+
+  return SET_LEAF (l);
+}
+
+static gboolean
+destroy_value_cb (const gchar *key,
+                  gsize        key_length,
+                  gpointer     value,
+                  gpointer     user_data)
+{
+  GwRadixTree *self = user_data;
+
+  if (value)
+    self->destroy_func (value);
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+static void
+destroy_nodes (GwRadixTree *self)
+{
+  if (self->frozen)
+    {
+      if (self->destroy_func)
+        frozen_iter (self->frozen, destroy_value_cb, self);
+
+      g_clear_pointer (&self->frozen, g_free);
+      return;
+    }
+
+  /*
+   * Arena-backed trees don't need to free each node, only to
+   * release the values before dropping the chunks altogether.
+   * That's only possible when no copy shares the nodes, which
+   * acquiring the arena checks and guarantees at once.
+   */
+  if (self->arena && arena_acquire (self->arena))
+    {
+      if (self->destroy_func)
+        iter_recursive (DEREF (self->root), NULL, destroy_value_cb, self);
+
+      arena_reset (self->arena);
+      arena_release (self->arena);
+    }
+  else if (self->epochs)
+    {
+      Epochs *epochs;
+
+      /* No reader is left, so don't retire the nodes */
+      epochs_reclaim_all (self);
+
+      epochs = g_steal_pointer (&self->epochs);
+      node_unref (self, DEREF (self->root));
+      self->epochs = epochs;
+    }
+  else
+    {
+      node_unref (self, DEREF (self->root));
+    }
+
+  self->root = REF (NULL);
+}
+
+static void
+gw_radix_tree_free (GwRadixTree *self)
+{
+  g_assert (self);
+  g_assert_cmpint (self->ref_count, ==, 0);
+
+  destroy_nodes (self);
+
+  g_clear_pointer (&self->arena, arena_unref);
+
+  if (self->epochs)
+    epochs_free (self);
+
+  g_slice_free (GwRadixTree, self);
+}
+
+/**
+ * gw_radix_tree_new:
+ *
+ * Creates a new #GwRadixTree.
+ *
+ * Returns: (transfer full): a new #GwRadixTree.
+ *
+ * Since: 0.1.0
+ */
+GwRadixTree *
+gw_radix_tree_new (void)
+{
+  GwRadixTree *self;
+
+  self = g_slice_new0 (GwRadixTree);
+  self->ref_count = 1;
+
+  return self;
+}
+
+/**
+ * gw_radix_tree_new_set:
+ *
+ * Creates a new #GwRadixTree meant to be used as a set of keys, where
+ * keys are inserted with a %NULL value.
+ *
+ * Keys of up to 6 bytes (2 bytes on 32-bit systems) that have no value
+ * are stored in the pointer to their leaf, instead of in a leaf of their
+ * own, so most short words take no memory besides their slot in a node.
+ * Keys with a value are stored as usual.
+ *
+ * Returns: (transfer full): a new #GwRadixTree.
+ *
+ * Since: 0.1.0
+ */
+GwRadixTree*
+gw_radix_tree_new_set (void)
+{
+  GwRadixTree *self;
+
+  self = gw_radix_tree_new ();
+  self->embed_keys = TRUE;
+
+  return self;
+}
+
+/**
+ * gw_radix_tree_copy:
+ * @self: a #GwRadixTree
+ *
+ * Creates a copy of @self, with the same keys, values and destroy
+ * function. The copy is independent of @self: changes to either tree
+ * are not visible in the other one.
+ *
+ * This is a constant time operation, as both trees share their nodes
+ * until they are modified. Modifying a tree only copies the nodes on
+ * the path to the change, so the copy can be used as a consistent
+ * snapshot of @self, even from another thread, while @self is updated.
+ *
+ * Values are shared between the trees, and the destroy function is
+ * called once the last tree holding a value drops it.
+ *
+ * Trees created with gw_radix_tree_new_concurrent() or
+ * gw_radix_tree_new_compact(), and frozen trees, can't be copied.
+ *
+ * Returns: (transfer full): a new #GwRadixTree
+ *
+ * Since: 0.1
+ */
+GwRadixTree*
+gw_radix_tree_copy (GwRadixTree *self)
+{
+  GwRadixTree *copy;
+
+  g_return_val_if_fail (self, NULL);
+  g_return_val_if_fail (self->ref_count, NULL);
+  g_return_val_if_fail (!self->epochs, NULL);
+  g_return_val_if_fail (!self->compact_leaves, NULL);
+  g_return_val_if_fail (!self->frozen, NULL);
+
+  copy = gw_radix_tree_new_with_free_func (self->destroy_func);
+  copy->size = self->size;
+  copy->embed_keys = self->embed_keys;
+  copy->counted = self->counted;
+  copy->uint64_values = self->uint64_values;
+
+  if (self->arena)
+    copy->arena = arena_ref (self->arena);
+
+  if (self->root)
+    {
+      node_ref (DEREF (self->root));
+      copy->root = self->root;
+    }
+
+  return copy;
+}
+
+/**
+ * gw_radix_tree_union:
+ * @a: a #GwRadixTree
+ * @b: a #GwRadixTree
+ *
+ * Creates a new #GwRadixTree with the keys that are in @a, in @b, or in
+ * both. Keys in both trees keep their value in @a.
+ *
+ * Both trees are traversed together, and a subtree that only one of them
+ * has is taken as a whole, without looking its keys up in the other tree.
+ * Values are shared with @a and @b like gw_radix_tree_copy() does, and
+ * the new tree has the destroy function of @a.
+ *
+ * When the trees have a destroy function, it must be the same, and they
+ * must either share their arena or not use one. Both trees must hold
+ * numbers, see gw_radix_tree_enable_uint64_values(), or neither. Trees
+ * created with gw_radix_tree_new_concurrent() or
+ * gw_radix_tree_new_compact(), and frozen trees, can't be merged.
+ *
+ * Returns: (transfer full): a new #GwRadixTree
+ *
+ * Since: 0.1.0
+ */
+GwRadixTree*
+gw_radix_tree_union (GwRadixTree *a,
+                     GwRadixTree *b)
+{
+  g_return_val_if_fail (a, NULL);
+  g_return_val_if_fail (b, NULL);
+  g_return_val_if_fail (!a->epochs && !b->epochs, NULL);
+  g_return_val_if_fail (!a->compact_leaves && !b->compact_leaves, NULL);
+  g_return_val_if_fail (!a->frozen && !b->frozen, NULL);
+  g_return_val_if_fail (a->destroy_func == b->destroy_func, NULL);
+  g_return_val_if_fail (a->uint64_values == b->uint64_values, NULL);
+  g_return_val_if_fail (!a->destroy_func || a->arena == b->arena, NULL);
+
+  return set_operation (a, b, SET_UNION);
+}
+
+/**
+ * gw_radix_tree_intersect:
+ * @a: a #GwRadixTree
+ * @b: a #GwRadixTree
+ *
+ * Creates a new #GwRadixTree with the keys that are both in @a and in @b,
+ * with their values in @a.
+ *
+ * Both trees are traversed together, and subtrees that only one of them
+ * has are skipped as a whole, so the cost depends on how much the trees
+ * overlap rather than on their sizes. Values are shared with @a like
+ * gw_radix_tree_copy() does, and the new tree has the destroy function
+ * of @a.
+ *
+ * Trees created with gw_radix_tree_new_concurrent() or
+ * gw_radix_tree_new_compact(), and frozen trees, can't be intersected.
+ *
+ * Returns: (transfer full): a new #GwRadixTree
+ *
+ * Since: 0.1.0
+ */
+GwRadixTree*
+gw_radix_tree_intersect (GwRadixTree *a,
+                         GwRadixTree *b)
+{
+  g_return_val_if_fail (a, NULL);
+  g_return_val_if_fail (b, NULL);
+  g_return_val_if_fail (!a->epochs && !b->epochs, NULL);
+  g_return_val_if_fail (!a->compact_leaves && !b->compact_leaves, NULL);
+  g_return_val_if_fail (!a->frozen && !b->frozen, NULL);
+
+  return set_operation (a, b, SET_INTERSECTION);
+}
+
+/**
+ * gw_radix_tree_difference:
+ * @a: a #GwRadixTree
+ * @b: a #GwRadixTree
+ *
+ * Creates a new #GwRadixTree with the keys of @a that are not in @b, with
+ * their values in @a.
+ *
+ * Both trees are traversed together. Subtrees of @a that @b doesn't have
+ * are taken as a whole, and subtrees of @b that @a doesn't have are
+ * skipped. Values are shared with @a like gw_radix_tree_copy() does, and
+ * the new tree has the destroy function of @a.
+ *
+ * Trees created with gw_radix_tree_new_concurrent() or
+ * gw_radix_tree_new_compact(), and frozen trees, can't be subtracted.
+ *
+ * Returns: (transfer full): a new #GwRadixTree
+ *
+ * Since: 0.1.0
+ */
+GwRadixTree*
+gw_radix_tree_difference (GwRadixTree *a,
+                          GwRadixTree *b)
+{
+  g_return_val_if_fail (a, NULL);
+  g_return_val_if_fail (b, NULL);
+  g_return_val_if_fail (!a->epochs && !b->epochs, NULL);
+  g_return_val_if_fail (!a->compact_leaves && !b->compact_leaves, NULL);
+  g_return_val_if_fail (!a->frozen && !b->frozen, NULL);
+
+  return set_operation (a, b, SET_DIFFERENCE);
+}
+
+GwRadixTree*
+gw_radix_tree_ref (GwRadixTree *self)
+{
+  g_return_val_if_fail (self, NULL);
+  g_return_val_if_fail (self->ref_count, NULL);
+
+  g_atomic_int_inc (&self->ref_count);
+
+  return self;
+}
+
+void
+gw_radix_tree_unref (GwRadixTree *self)
+{
+  g_return_if_fail (self);
+  g_return_if_fail (self->ref_count);
+
+  if (g_atomic_int_dec_and_test (&self->ref_count))
+    gw_radix_tree_free (self);
+}
+
+/**
+ * gw_radix_tree_new_with_free_func:
+ * @destroy_func: (nullable): A function to free the data elements, or %NULL.
+ *
+ * Creates a new #GwRadixTree with @destroy_func.
+ *
+ * Returns: (transfer full): a new #GwRadixTree.
+ *
+ * Since: 0.1.0
+ */
+GwRadixTree*
+gw_radix_tree_new_with_free_func (GDestroyNotify destroy_func)
+{
+  GwRadixTree *self;
+
+  self = g_slice_new0 (GwRadixTree);
+  self->ref_count = 1;
+  self->destroy_func = destroy_func;
+
+  return self;
+}
+
+/**
+ * gw_radix_tree_new_with_arena:
+ * @destroy_func: (nullable): A function to free the data elements, or %NULL.
+ *
+ * Creates a new #GwRadixTree that allocates its nodes and keys from an
+ * internal arena. This avoids one allocation per node and per key when
+ * loading large sets of keys, and gw_radix_tree_clear() or dropping the
+ * last reference only frees a handful of memory chunks.
+ *
+ * Memory of removed keys is reused by later insertions, but only given
+ * back to the system when the tree is cleared or destroyed.
+ *
+ * Returns: (transfer full): a new #GwRadixTree.
+ *
+ * Since: 0.1.0
+ */
+GwRadixTree*
+gw_radix_tree_new_with_arena (GDestroyNotify destroy_func)
+{
+  GwRadixTree *self;
+
+  self = gw_radix_tree_new_with_free_func (destroy_func);
+  self->arena = arena_new ();
+
+  return self;
+}
+
+/**
+ * gw_radix_tree_new_compact:
+ * @destroy_func: (nullable): A function to free the data elements, or %NULL.
+ *
+ * Creates a new #GwRadixTree whose leaves only store the bytes of their
+ * keys below the node they hang from, instead of whole keys, since the
+ * nodes above them already hold the rest. Keys handed to callbacks are
+ * rebuilt from the path down to their leaf, and are only valid until the
+ * callback returns. This takes considerably less memory for dictionaries
+ * of long words, which share long prefixes.
+ *
+ * In exchange, the whole compressed path of every node is kept in the
+ * node itself, so long ones take a chain of nodes, and compact trees
+ * can't be copied, merged with gw_radix_tree_union() and friends, nor
+ * traversed with a #GwRadixTreeIter.
+ *
+ * Returns: (transfer full): a new #GwRadixTree.
+ *
+ * Since: 0.1.0
+ */
+GwRadixTree*
+gw_radix_tree_new_compact (GDestroyNotify destroy_func)
+{
+  GwRadixTree *self;
+
+  self = gw_radix_tree_new_with_free_func (destroy_func);
+  self->compact_leaves = TRUE;
+
+  return self;
+}
+
+/**
+ * gw_radix_tree_new_from_sorted:
+ * @keys: (array length=n_keys): the keys, in ascending byte order
+ * @key_lengths: (nullable) (array length=n_keys): the lengths of @keys, or
+ *   %NULL if they are NUL-terminated
+ * @values: (nullable) (array length=n_keys): the values of @keys, or %NULL
+ * @n_keys: the number of keys
+ * @destroy_func: (nullable): A function to free the data elements, or %NULL.
+ *
+ * Creates a new #GwRadixTree holding @keys. The keys must be sorted in
+ * ascending byte order, as strcmp() would sort them, and must be unique.
+ *
+ * This is much faster than inserting the keys one by one, since the tree
+ * is built in a single pass over the keys, and each node is created with
+ * its final size instead of growing as keys are added.
+ *
+ * Returns: (transfer full): a new #GwRadixTree, or %NULL if @keys are not
+ * sorted.
+ *
+ * Since: 0.1.0
+ */
+GwRadixTree*
+gw_radix_tree_new_from_sorted (const gchar * const *keys,
+                               const gsize         *key_lengths,
+                               gpointer            *values,
+                               gsize                n_keys,
+                               GDestroyNotify       destroy_func)
+{
+  GwRadixTree *self;
+
+  g_return_val_if_fail (keys || n_keys == 0, NULL);
+  g_return_val_if_fail (keys_are_sorted (keys, key_lengths, n_keys), NULL);
+
+  self = gw_radix_tree_new_with_free_func (destroy_func);
+
+  if (n_keys > 0)
+    {
+      BulkLoad load = { self, keys, key_lengths, values };
+
+      self->root = REF (build_sorted (&load, 0, n_keys, 0));
+      self->size = n_keys;
+    }
+
+  return self;
+}
+
+/**
+ * gw_radix_tree_new_from_keys:
+ * @keys: (array length=n_keys): the keys, in any order
+ * @key_lengths: (nullable) (array length=n_keys): the lengths of @keys, or
+ *   %NULL if they are NUL-terminated
+ * @values: (nullable) (array length=n_keys): the values of @keys, or %NULL
+ * @n_keys: the number of keys
+ * @destroy_func: (nullable): A function to free the data elements, or %NULL.
+ *
+ * Creates a new #GwRadixTree holding @keys. If a key is repeated, the
+ * last of its values is kept, just like inserting the keys one by one.
+ *
+ * Large sets of keys are split by their first byte, and each part is
+ * sorted and built into its own subtree in a thread pool, so building
+ * the tree takes a fraction of the time on machines with many cores.
+ * On a single core, the keys are sorted as a whole and built like
+ * gw_radix_tree_new_from_sorted() does instead.
+ *
+ * Returns: (transfer full): a new #GwRadixTree.
+ *
+ * Since: 0.1.0
+ */
+GwRadixTree*
+gw_radix_tree_new_from_keys (const gchar * const *keys,
+                             const gsize         *key_lengths,
+                             gpointer            *values,
+                             gsize                n_keys,
+                             GDestroyNotify       destroy_func)
+{
+  BulkPartition partitions[256];
+  BulkPartition *queue[256];
+  GThreadPool *pool;
+  GwRadixTree *self;
+  BulkLoad load;
+  gsize offsets[257] = { 0, };
+  gsize cursors[256];
+  gsize *order;
+  gsize i;
+  guint n_partitions, p;
+  gboolean parallel;
+
+  g_return_val_if_fail (keys || n_keys == 0, NULL);
+
+  self = gw_radix_tree_new_with_free_func (destroy_func);
+
+  if (n_keys == 0)
+    return self;
+
+  load = (BulkLoad) { self, keys, key_lengths, values };
+  order = g_new (gsize, n_keys);
+  n_partitions = 0;
+
+  /* Small sets and single cores aren't worth the threads */
+  parallel = n_keys >= BULK_PARALLEL_THRESHOLD && g_get_num_processors () > 1;
+
+  if (!parallel)
+    {
+      for (i = 0; i < n_keys; i++)
+        order[i] = i;
+    }
+  else
+    {
+      /* Counting sort by the first byte, keeping the input order */
+      for (i = 0; i < n_keys; i++)
+        offsets[bulk_key_byte (&load, i, 0) + 1]++;
+
+      for (p = 1; p < G_N_ELEMENTS (offsets); p++)
+        offsets[p] += offsets[p - 1];
+
+      memcpy (cursors, offsets, sizeof (cursors));
+
+      for (i = 0; i < n_keys; i++)
+        order[cursors[bulk_key_byte (&load, i, 0)]++] = i;
+
+      for (p = 0; p < 256; p++)
+        {
+          if (offsets[p + 1] == offsets[p])
+            continue;
+
+          partitions[n_partitions] = (BulkPartition) {
+            .load = load,
+            .order = order + offsets[p],
+            .n_keys = offsets[p + 1] - offsets[p],
+            .depth = 1,
+            .byte = p,
+          };
+
+          queue[n_partitions] = &partitions[n_partitions];
+          n_partitions++;
+        }
+    }
+
+  /* A single partition is the whole tree */
+  if (!parallel || n_partitions == 1)
+    {
+      partitions[0] = (BulkPartition) {
+        .load = load,
+        .order = order,
+        .n_keys = n_keys,
+        .depth = 0,
+      };
+
+      build_partition (&partitions[0], NULL);
+
+      self->root = REF (partitions[0].root);
+      self->size = partitions[0].n_keys;
+
+      g_free (order);
+
+      return self;
+    }
+
+  pool = g_thread_pool_new (build_partition, NULL, g_get_num_processors (), FALSE, NULL);
+
+  /* Start with the biggest partitions, to even out the load */
+  g_qsort_with_data (queue, n_partitions, sizeof (BulkPartition*), compare_partition_sizes, NULL);
+
+  for (p = 0; p < n_partitions; p++)
+    g_thread_pool_push (pool, queue[p], NULL);
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  /* Stitch the subtrees together */
+  if (n_partitions <= 4)
+    self->root = REF (node_new (self, NODE_4));
+  else if (n_partitions <= 16)
+    self->root = REF (node_new (self, NODE_16));
+  else if (n_partitions <= 32)
+    self->root = REF (node_new (self, NODE_32));
+  else if (n_partitions <= 48)
+    self->root = REF (node_new (self, NODE_48));
+  else
+    self->root = REF (node_new (self, NODE_256));
+
+  for (p = 0; p < n_partitions; p++)
+    {
+      add_child (self, DEREF (self->root), NULL, partitions[p].byte, partitions[p].root);
+      self->size += partitions[p].n_keys;
+    }
+
+  g_free (order);
+
+  return self;
+}
+
+/**
+ * gw_radix_tree_new_concurrent:
+ * @destroy_func: (nullable): A function to free the data elements, or %NULL.
+ *
+ * Creates a new #GwRadixTree that can be used from multiple threads at
+ * once without any external locking, as long as only gw_radix_tree_lookup(),
+ * gw_radix_tree_contains(), gw_radix_tree_insert(), gw_radix_tree_remove(),
+ * gw_radix_tree_steal() and gw_radix_tree_get_size() are called.
+ *
+ * Lookups never lock and never block, so they scale with the number of
+ * threads reading the tree. Insertions and removals only lock the one or
+ * two nodes they modify, and proceed concurrently with lookups and with
+ * each other.
+ *
+ * Removed keys and their values are only freed once no lookup that
+ * started before the removal is running. However, a value returned by
+ * gw_radix_tree_lookup() can be destroyed by a concurrent removal at any
+ * time after the lookup returns, so values that outlive their keys must
+ * be reference counted by the caller.
+ *
+ * Iterating, clearing or dropping the last reference to the tree still
+ * require that no other thread is using it. Concurrent trees can't be
+ * copied with gw_radix_tree_copy().
+ *
+ * Returns: (transfer full): a new #GwRadixTree.
+ *
+ * Since: 0.1.0
+ */
+GwRadixTree*
+gw_radix_tree_new_concurrent (GDestroyNotify destroy_func)
+{
+  GwRadixTree *self;
+
+  self = gw_radix_tree_new_with_free_func (destroy_func);
+  self->epochs = epochs_new ();
+  self->root = REF (node_new (self, NODE_256));
+
+  return self;
+}
+
+/**
+ * gw_radix_tree_contains:
+ * @self: a #GwRadixTree
+ * @key: the key to search for.
+ * @key_length: the length of @key, or -1
+ *
+ * Checks if @self contains @key.
+ *
+ * Returns: %TRUE if @key is in @self, %FALSE otherwise.
+ *
+ * Since: 0.1.0
+ */
+gboolean
+gw_radix_tree_contains (GwRadixTree *self,
+                        const gchar *key,
+                        gsize        key_length)
+{
+  gboolean found;
+
+  g_return_val_if_fail (self, FALSE);
+
+  gw_radix_tree_lookup (self, key, key_length, &found);
+
+  return found;
+}
+
+/**
+ * gw_radix_tree_lookup:
+ * @tree: a #GwRadixTree
+ * @key: the key to look for
+ * @key_length: the length of @key, or -1
+ * @found: whether the value was found or not
+ *
+ * Look for the given key on the tree, and return it's associated value.
+ * It'll return NULL when the value is not found. Use the @found argument
+ * to differentiate between saved NULL values.
+ *
+ * Returns: the associated value of the key, or NULL.
+ *
+ * Since: 0.1.0
+ */
+gpointer
+gw_radix_tree_lookup (GwRadixTree *self,
+                      const gchar *key,
+                      gsize        key_length,
+                      gboolean    *found)
+{
+  Node *leaf;
+
+  g_return_val_if_fail (self, NULL);
+
+  if (key_length == -1)
+    key_length = strlen (key);
+
+  if (self->epochs)
+    {
+      gpointer value = NULL;
+      gint *reader;
+      Leaf *l;
+
+      reader = epochs_enter (self->epochs);
+
+      l = lookup_concurrent (self, (const guchar*) key, key_length);
+
+      if (l)
+        value = g_atomic_pointer_get (&l->value);
+
+      epochs_leave (reader);
+
+      if (found)
+        *found = l != NULL;
+
+      return value;
+    }
+
+  if (self->frozen)
+    {
+      Leaf *l = frozen_lookup (self->frozen, (const guchar*) key, key_length);
+
+      if (found)
+        *found = l != NULL;
+
+      return l ? l->value : NULL;
+    }
+
+  leaf = lookup_leaf (DEREF (self->root), (const guchar*) key, key_length, 0, self->compact_leaves);
+
+  if (found)
+    *found = leaf != NULL;
+
+  return leaf ? leaf_value (leaf) : NULL;
+}
+
+/**
+ * gw_radix_tree_lookup_many:
+ * @tree: a #GwRadixTree
+ * @keys: (array length=n_keys): the keys to look for
+ * @key_lengths: (nullable) (array length=n_keys): the lengths of @keys, or
+ *   %NULL if they are NUL-terminated
+ * @n_keys: the number of keys
+ * @values: (out caller-allocates) (array length=n_keys) (nullable): return
+ *   location for the values of @keys, or %NULL
+ * @found: (out caller-allocates) (array length=n_keys) (nullable): return
+ *   location for whether each key was found, or %NULL
+ *
+ * Looks up all of @keys, just like calling gw_radix_tree_lookup() on each
+ * of them, storing the results at the same positions of @values and @found.
+ * The value of a key that isn't in @tree is %NULL.
+ *
+ * Several lookups are carried out at the same time, so that the memory
+ * accesses of one overlap with the others. This is considerably faster
+ * than looking the keys up one by one when @tree doesn't fit in cache.
+ *
+ * Since: 0.1.0
+ */
+void
+gw_radix_tree_lookup_many (GwRadixTree         *self,
+                           const gchar * const *keys,
+                           const gsize         *key_lengths,
+                           gsize                n_keys,
+                           gpointer            *values,
+                           gboolean            *found)
+{
+  LookupState states[LOOKUP_GROUP_SIZE];
+  gsize next;
+  guint i, n_active;
+
+  g_return_if_fail (self);
+  g_return_if_fail (keys || n_keys == 0);
+
+  /*
+   * Concurrent trees validate every step, so there's little to overlap,
+   * and frozen trees keep the nodes of their top levels close together.
+   */
+  if (self->epochs || self->frozen)
+    {
+      gsize j;
+
+      for (j = 0; j < n_keys; j++)
+        {
+          gpointer value;
+          gboolean key_found;
+
+          value = gw_radix_tree_lookup (self,
+                                        keys[j],
+                                        key_lengths ? key_lengths[j] : -1,
+                                        &key_found);
+
+          if (values)
+            values[j] = value;
+
+          if (found)
+            found[j] = key_found;
+        }
+
+      return;
+    }
+
+  next = 0;
+  n_active = 0;
+
+  /* Lookups are assigned to free slots as the previous ones finish */
+  for (i = 0; i < LOOKUP_GROUP_SIZE && next < n_keys; i++)
+    {
+      states[i] = (LookupState) {
+        .n = DEREF (self->root),
+        .index = next,
+        .key = (const guchar*) keys[next],
+        .key_len = key_lengths ? key_lengths[next] : strlen (keys[next]),
+        .compact = self->compact_leaves,
+      };
+
+      next++;
+      n_active++;
+    }
+
+  while (n_active > 0)
+    {
+      for (i = 0; i < n_active; i++)
+        {
+          LookupState *state = &states[i];
+          Node *l;
+
+          if (!lookup_step (state, &l))
+            continue;
+
+          if (values)
+            values[state->index] = l ? leaf_value (l) : NULL;
+
+          if (found)
+            found[state->index] = l != NULL;
+
+          if (next < n_keys)
+            {
+              *state = (LookupState) {
+                .n = DEREF (self->root),
+                .index = next,
+                .key = (const guchar*) keys[next],
+                .key_len = key_lengths ? key_lengths[next] : strlen (keys[next]),
+                .compact = self->compact_leaves,
+              };
+
+              next++;
+            }
+          else
+            {
+              /* Compact the group, and visit the moved lookup now */
+              states[i--] = states[--n_active];
+            }
+        }
+    }
+}
+
+/**
+ * gw_radix_tree_longest_prefix:
+ * @tree: a #GwRadixTree
+ * @key: the key to look for
+ * @key_length: the length of @key, or -1
+ * @prefix_length: (out) (optional): return location for the length of the
+ *   longest prefix
+ * @value: (out) (optional): return location for the value of the longest
+ *   prefix
+ *
+ * Looks for the longest key of @tree that is a prefix of @key, including
+ * @key itself. This takes a single descent of @tree, instead of a lookup
+ * for each prefix of @key.
+ *
+ * Returns: %TRUE if a key of @tree is a prefix of @key, %FALSE otherwise.
+ *
+ * Since: 0.1.0
+ */
+gboolean
+gw_radix_tree_longest_prefix (GwRadixTree *self,
+                              const gchar *key,
+                              gsize        key_length,
+                              gsize       *prefix_length,
+                              gpointer    *value)
+{
+  LongestPrefix longest = { FALSE, 0, NULL };
+
+  g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (key, FALSE);
+
+  if (key_length == -1)
+    key_length = strlen (key);
+
+  if (self->epochs)
+    {
+      gint *reader;
+      Leaf *l;
+
+      reader = epochs_enter (self->epochs);
+
+      l = longest_prefix_concurrent (self, (const guchar*) key, key_length);
+
+      if (l)
+        longest = (LongestPrefix) { TRUE, l->key_len, g_atomic_pointer_get (&l->value) };
+
+      epochs_leave (reader);
+    }
+  else if (self->frozen)
+    {
+      frozen_iter_prefixes_of (self->frozen, (const guchar*) key, key_length, longest_prefix_cb, &longest);
+    }
+  else
+    {
+      iter_prefixes_of (DEREF (self->root),
+                        (const guchar*) key,
+                        key_length,
+                        self->compact_leaves,
+                        longest_prefix_cb,
+                        &longest);
+    }
+
+  if (prefix_length)
+    *prefix_length = longest.key_length;
+
+  if (value)
+    *value = longest.value;
+
+  return longest.found;
+}
+
+/**
+ * gw_radix_tree_iter_prefixes_of:
+ * @tree: the #GwRadixTree to be traversed
+ * @key: the key whose prefixes are visited
+ * @key_length: the length of @key, or -1
+ * @callback: user-defined function to call on each value
+ * @user_data: user data for @callback
+ *
+ * Traverse the keys of @tree that are prefixes of @key, including @key
+ * itself, from the shortest to the longest, calling @callback on each of
+ * them. They are all found in a single descent of @tree.
+ *
+ * It iterates until @callback returns %GW_RADIX_TREE_ITER_STOP.
+ *
+ * Returns: the same result as @callback.
+ *
+ * Since: 0.1.0
+ */
+gboolean
+gw_radix_tree_iter_prefixes_of (GwRadixTree *self,
+                                const gchar *key,
+                                gsize        key_length,
+                                RadixTreeCb  callback,
+                                gpointer     user_data)
+{
+  g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (key, FALSE);
+  g_return_val_if_fail (callback, FALSE);
+
+  if (key_length == -1)
+    key_length = strlen (key);
+
+  if (self->frozen)
+    return frozen_iter_prefixes_of (self->frozen, (const guchar*) key, key_length, callback, user_data);
+
+  return iter_prefixes_of (DEREF (self->root),
+                           (const guchar*) key,
+                           key_length,
+                           self->compact_leaves,
+                           callback,
+                           user_data);
+}
+
+/**
+ * gw_radix_tree_iter_reverse:
+ * @tree: the #GwRadixTree to be traversed
+ * @callback: user-defined function to call on each value
+ * @user_data: user data for @callback
+ *
+ * Traverse the keys of @tree from the largest to the smallest, calling
+ * @callback on each of them. Keys are compared byte by byte, so this is
+ * the reverse of the order of gw_radix_tree_iter().
+ *
+ * It iterates until @callback returns %GW_RADIX_TREE_ITER_STOP.
+ *
+ * Returns: the same result as @callback.
+ *
+ * Since: 0.1.0
+ */
+gboolean
+gw_radix_tree_iter_reverse (GwRadixTree *self,
+                            RadixTreeCb  callback,
+                            gpointer     user_data)
+{
+  GString *path;
+  gboolean res;
+
+  g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (callback, FALSE);
+
+  if (self->frozen)
+    {
+      if (self->frozen->n_bytes == 0)
+        return GW_RADIX_TREE_ITER_CONTINUE;
+
+      return frozen_iter_reverse_recursive (self->frozen->data, self->frozen->root, callback, user_data);
+    }
+
+  if (!self->root)
+    return GW_RADIX_TREE_ITER_CONTINUE;
+
+  path = self->compact_leaves ? g_string_new (NULL) : NULL;
+  res = iter_reverse_recursive (DEREF (self->root), path, callback, user_data);
+
+  if (path)
+    g_string_free (path, TRUE);
+
+  return res;
+}
+
+/**
+ * gw_radix_tree_iter_reverse_from:
+ * @tree: the #GwRadixTree to be traversed
+ * @key: the largest key to visit
+ * @key_length: the length of @key, or -1
+ * @callback: user-defined function to call on each value
+ * @user_data: user data for @callback
+ *
+ * Traverse the keys of @tree that are smaller than or equal to @key,
+ * from the largest to the smallest, calling @callback on each of them.
+ * @key doesn't need to be in @tree. A lower bound is set by returning
+ * %GW_RADIX_TREE_ITER_STOP from @callback once it gets past it.
+ *
+ * Only the path of @key is descended to find where to start, and the
+ * subtrees that sort after it are skipped without being visited.
+ *
+ * It iterates until @callback returns %GW_RADIX_TREE_ITER_STOP.
+ *
+ * Returns: the same result as @callback.
+ *
+ * Since: 0.1.0
+ */
+gboolean
+gw_radix_tree_iter_reverse_from (GwRadixTree *self,
+                                 const gchar *key,
+                                 gsize        key_length,
+                                 RadixTreeCb  callback,
+                                 gpointer     user_data)
+{
+  GString *path;
+  gboolean res;
+
+  g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (key, FALSE);
+  g_return_val_if_fail (callback, FALSE);
+
+  if (key_length == -1)
+    key_length = strlen (key);
+
+  if (self->frozen)
+    {
+      if (self->frozen->n_bytes == 0)
+        return GW_RADIX_TREE_ITER_CONTINUE;
+
+      return frozen_iter_reverse_upto (self->frozen->data,
+                                       self->frozen->root,
+                                       (const guchar*) key,
+                                       key_length,
+                                       0,
+                                       callback,
+                                       user_data);
+    }
+
+  if (!self->root)
+    return GW_RADIX_TREE_ITER_CONTINUE;
+
+  path = self->compact_leaves ? g_string_new (NULL) : NULL;
+
+  res = iter_reverse_upto (DEREF (self->root),
+                           (const guchar*) key,
+                           key_length,
+                           0,
+                           path,
+                           callback,
+                           user_data);
+
+  if (path)
+    g_string_free (path, TRUE);
+
+  return res;
+}
+
+/**
+ * gw_radix_tree_insert:
+ * @tree: the #GwRadixTree to add to
+ * @key: string user as identifier of the value. Must be a UTF-8 valid string.
+ * @key_length: the length of @key, or -1
+ * @value: (nullable): user data to be stored. Can be %NULL.
+ *
+ * Inserts a new value in the @tree. If the key is already in the tree, @value
+ * will be overwritten.
+ *
+ * Returns: %TRUE if a new node was added, %FALSE otherwise.
+ *
+ * Since: 0.1.0
+ */
+gboolean
+gw_radix_tree_insert (GwRadixTree *self,
+                      const gchar *key,
+                      gsize        key_length,
+                      gpointer     value)
+{
+  gboolean old;
+
+  g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (!self->frozen, FALSE);
+  g_return_val_if_fail (!self->uint64_values, FALSE);
+
+  if (key_length == -1)
+    key_length = strlen (key);
+
+  if (self->epochs)
     {
-      Leaf *l = LEAF_RAW (n);
+      gboolean added;
+      gint *reader;
 
-      if (leaf_matches (l, key, key_len))
+      reader = epochs_enter (self->epochs);
+      added = insert_concurrent (self, (const guchar*) key, key_length, NULL, value);
+      epochs_leave (reader);
+
+      if (added)
         {
-          *ref = NULL;
-          return l;
+          __atomic_add_fetch (&self->size, 1, __ATOMIC_RELAXED);
+          g_atomic_int_inc (&self->stamp);
+        }
+
+      return added;
+    }
+
+  old = FALSE;
+
+  insert_recursive (self,
+                    DEREF (self->root),
+                    &self->root,
+                    (const guchar*) key,
+                    key_length,
+                    NULL,
+                    value,
+                    0,
+                    &old);
+
+  /* Keys already in @self may have had a %NULL value */
+  if (!old)
+    {
+      self->stamp++;
+      self->size++;
+    }
+
+  return !old;
+}
+
+/**
+ * gw_radix_tree_upsert:
+ * @tree: the #GwRadixTree to add to
+ * @key: string user as identifier of the value. Must be a UTF-8 valid string.
+ * @key_length: the length of @key, or -1
+ * @update: (scope call): function computing the new value of @key
+ * @user_data: (closure): user data for @update
+ *
+ * Sets the value of @key to the one returned by @update. When @key is
+ * already in @tree, @update receives its current value. Otherwise, it
+ * receives %NULL, and @key is added.
+ *
+ * This only descends @tree once, unlike a gw_radix_tree_lookup() followed
+ * by gw_radix_tree_insert(). For example, words can be counted by having
+ * @update return its value plus one, using GUINT_TO_POINTER() to store the
+ * counters in the values themselves.
+ *
+ * The value replaced by @update is not destroyed. On trees created with
+ * gw_radix_tree_new_concurrent(), concurrent updates of the same key are
+ * serialized, and @update must not use @tree.
+ *
+ * Returns: %TRUE if @key was added, %FALSE if it was already in @tree.
+ *
+ * Since: 0.1.0
+ */
+gboolean
+gw_radix_tree_upsert (GwRadixTree       *self,
+                      const gchar       *key,
+                      gsize              key_length,
+                      RadixTreeUpdateCb  update,
+                      gpointer           user_data)
+{
+  gboolean old;
+
+  g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (update, FALSE);
+  g_return_val_if_fail (!self->frozen, FALSE);
+  g_return_val_if_fail (!self->uint64_values, FALSE);
+
+  if (key_length == -1)
+    key_length = strlen (key);
+
+  if (self->epochs)
+    {
+      gboolean added;
+      gint *reader;
+
+      reader = epochs_enter (self->epochs);
+      added = insert_concurrent (self, (const guchar*) key, key_length, update, user_data);
+      epochs_leave (reader);
+
+      if (added)
+        {
+          __atomic_add_fetch (&self->size, 1, __ATOMIC_RELAXED);
+          g_atomic_int_inc (&self->stamp);
         }
 
-      return NULL;
-    }
+      return added;
+    }
+
+  old = FALSE;
+
+  insert_recursive (self,
+                    DEREF (self->root),
+                    &self->root,
+                    (const guchar*) key,
+                    key_length,
+                    update,
+                    user_data,
+                    0,
+                    &old);
+
+  if (!old)
+    {
+      self->stamp++;
+      self->size++;
+    }
+
+  return !old;
+}
+
+/**
+ * gw_radix_tree_insert_uint64:
+ * @tree: a #GwRadixTree with numeric values
+ * @key: the key to set. Must be a UTF-8 valid string.
+ * @key_length: the length of @key, or -1
+ * @value: the number to store
+ *
+ * Sets the number of @key to @value, adding @key if it isn't in @tree.
+ * See gw_radix_tree_enable_uint64_values().
+ *
+ * Returns: %TRUE if @key was added, %FALSE if it was already in @tree.
+ *
+ * Since: 0.1.0
+ */
+gboolean
+gw_radix_tree_insert_uint64 (GwRadixTree *self,
+                             const gchar *key,
+                             gsize        key_length,
+                             guint64      value)
+{
+  gboolean added;
+  gint *reader;
+  Leaf *l;
+
+  g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (self->uint64_values, FALSE);
+  g_return_val_if_fail (!self->frozen, FALSE);
+
+  if (key_length == -1)
+    key_length = strlen (key);
+
+  reader = self->epochs ? epochs_enter (self->epochs) : NULL;
+
+  l = uint64_leaf (self, (const guchar*) key, key_length, TRUE, &added);
+  __atomic_store_n (&l->number, value, __ATOMIC_SEQ_CST);
+
+  if (reader)
+    epochs_leave (reader);
+
+  return added;
+}
+
+/**
+ * gw_radix_tree_lookup_uint64:
+ * @tree: a #GwRadixTree with numeric values
+ * @key: the key to look for
+ * @key_length: the length of @key, or -1
+ * @found: (out) (optional): return location for whether @key was found
+ *
+ * Looks the number of @key up. See gw_radix_tree_enable_uint64_values().
+ *
+ * Returns: the number of @key, or 0 if it isn't in @tree
+ *
+ * Since: 0.1.0
+ */
+guint64
+gw_radix_tree_lookup_uint64 (GwRadixTree *self,
+                             const gchar *key,
+                             gsize        key_length,
+                             gboolean    *found)
+{
+  guint64 value;
+  gint *reader;
+  Leaf *l;
+
+  g_return_val_if_fail (self, 0);
+  g_return_val_if_fail (self->uint64_values, 0);
+
+  if (key_length == -1)
+    key_length = strlen (key);
+
+  if (self->frozen)
+    {
+      l = frozen_lookup (self->frozen, (const guchar*) key, key_length);
+
+      if (found)
+        *found = l != NULL;
+
+      return l ? l->number : 0;
+    }
+
+  reader = self->epochs ? epochs_enter (self->epochs) : NULL;
+
+  if (self->epochs)
+    l = lookup_concurrent (self, (const guchar*) key, key_length);
+  else
+    l = LEAF_RAW (lookup_leaf (DEREF (self->root), (const guchar*) key, key_length, 0, self->compact_leaves));
+
+  value = l ? __atomic_load_n (&l->number, __ATOMIC_SEQ_CST) : 0;
+
+  if (reader)
+    epochs_leave (reader);
+
+  if (found)
+    *found = l != NULL;
+
+  return value;
+}
+
+/**
+ * gw_radix_tree_add_uint64:
+ * @tree: a #GwRadixTree with numeric values
+ * @key: the key to update. Must be a UTF-8 valid string.
+ * @key_length: the length of @key, or -1
+ * @delta: the number to add, which wraps around like unsigned arithmetic
+ *   does, so that G_MAXUINT64 subtracts one
+ *
+ * Atomically adds @delta to the number of @key, adding @key with @delta
+ * if it isn't in @tree. For example, words can be counted by adding one
+ * for each occurrence. See gw_radix_tree_enable_uint64_values() for when
+ * this can be called from several threads at once.
+ *
+ * Returns: the new number of @key
+ *
+ * Since: 0.1.0
+ */
+guint64
+gw_radix_tree_add_uint64 (GwRadixTree *self,
+                          const gchar *key,
+                          gsize        key_length,
+                          guint64      delta)
+{
+  gboolean added;
+  guint64 value;
+  gint *reader;
+  Leaf *l;
+
+  g_return_val_if_fail (self, 0);
+  g_return_val_if_fail (self->uint64_values, 0);
+  g_return_val_if_fail (!self->frozen, 0);
+
+  if (key_length == -1)
+    key_length = strlen (key);
+
+  reader = self->epochs ? epochs_enter (self->epochs) : NULL;
+
+  l = uint64_leaf (self, (const guchar*) key, key_length, TRUE, &added);
+  value = __atomic_add_fetch (&l->number, delta, __ATOMIC_SEQ_CST);
+
+  if (reader)
+    epochs_leave (reader);
+
+  return value;
+}
+
+/**
+ * gw_radix_tree_compare_exchange_uint64:
+ * @tree: a #GwRadixTree with numeric values
+ * @key: the key to update. Must be a UTF-8 valid string.
+ * @key_length: the length of @key, or -1
+ * @expected: (inout): the number @key is expected to have
+ * @desired: the new number of @key
+ *
+ * Atomically sets the number of @key to @desired if it's @expected.
+ * Otherwise, the current number of @key is stored in @expected, so the
+ * caller can compute @desired again and retry. Keys that aren't in @tree
+ * count as zero, and are added when @expected is zero. See
+ * gw_radix_tree_enable_uint64_values() for when this can be called from
+ * several threads at once.
+ *
+ * Returns: %TRUE if the number of @key was set to @desired
+ *
+ * Since: 0.1.0
+ */
+gboolean
+gw_radix_tree_compare_exchange_uint64 (GwRadixTree *self,
+                                       const gchar *key,
+                                       gsize        key_length,
+                                       guint64     *expected,
+                                       guint64      desired)
+{
+  gboolean added, exchanged;
+  gint *reader;
+  Leaf *l;
+
+  g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (expected, FALSE);
+  g_return_val_if_fail (self->uint64_values, FALSE);
+  g_return_val_if_fail (!self->frozen, FALSE);
+
+  if (key_length == -1)
+    key_length = strlen (key);
+
+  reader = self->epochs ? epochs_enter (self->epochs) : NULL;
+
+  l = uint64_leaf (self, (const guchar*) key, key_length, *expected == 0, &added);
+
+  if (l)
+    {
+      exchanged = __atomic_compare_exchange_n (&l->number,
+                                               expected,
+                                               desired,
+                                               FALSE,
+                                               __ATOMIC_SEQ_CST,
+                                               __ATOMIC_SEQ_CST);
+    }
+  else
+    {
+      *expected = 0;
+      exchanged = FALSE;
+    }
+
+  if (reader)
+    epochs_leave (reader);
+
+  return exchanged;
+}
+
+/**
+ * gw_radix_tree_get_keys:
+ * @tree: a #GwRadixTree
+ *
+ * Retrieve all keys from the tree
+ *
+ * Returns: (transfer-full): a newly-allocated #GList with the keys.
+ *
+ * Since: 0.1.0
+ */
+GStrv
+gw_radix_tree_get_keys (GwRadixTree *self)
+{
+  GPtrArray *result;
+
+  g_return_val_if_fail (self, NULL);
+
+  result = g_ptr_array_new ();
+
+  gw_radix_tree_iter (self, get_keys_cb, result);
+
+  /* Tail NULL */
+  g_ptr_array_add (result, NULL);
+
+  return (GStrv) g_ptr_array_free (result, FALSE);
+}
+
+/**
+ * gw_radix_tree_get_values:
+ * @tree: a #GwRadixTree
+ *
+ * Retrieve all values from the tree
+ *
+ * Returns: (transfer-full): a newly-allocated #GList with the values.
+ *
+ * Since: 0.1.0
+ */
+GPtrArray*
+gw_radix_tree_get_values (GwRadixTree *self)
+{
+  GPtrArray *result;
+
+  g_return_val_if_fail (self, NULL);
+
+  result = g_ptr_array_new ();
+
+  gw_radix_tree_iter (self, get_values_cb, result);
+
+  return result;
+}
+
+/**
+ * gw_radix_tree_export_packed:
+ * @tree: a #GwRadixTree
+ * @offsets: (out) (optional) (transfer full) (array): return location
+ *   for the offsets of the keys
+ * @values: (out) (optional) (transfer full) (array): return location
+ *   for the values of the keys
+ *
+ * Exports all keys of @tree, in order, to a single buffer where each of
+ * them is followed by a NUL byte. Unlike gw_radix_tree_get_keys(), this
+ * doesn't allocate each key separately, so the keys can be hashed,
+ * written or handed to another component as one block of memory.
+ *
+ * @offsets receives gw_radix_tree_get_size() + 1 offsets into the buffer.
+ * The first ones are where each key starts, and the last one is the size
+ * of the buffer, so key i is @offsets[i + 1] - @offsets[i] - 1 bytes
+ * long. @values receives the value of each key, in the same order. Free
+ * both with g_free().
+ *
+ * Returns: (transfer full) (nullable): a #GBytes with the keys, or %NULL
+ * if they don't fit in 4 GiB
+ *
+ * Since: 0.1.0
+ */
+GBytes*
+gw_radix_tree_export_packed (GwRadixTree  *self,
+                             guint32     **offsets,
+                             gpointer    **values)
+{
+  PackedExport export;
+  guint32 end;
+  guint size;
+
+  g_return_val_if_fail (self, NULL);
+
+  size = gw_radix_tree_get_size (self);
+
+  /* Dictionary words are about this long, and the buffer grows for longer keys */
+  export = (PackedExport) {
+    .keys = g_byte_array_sized_new (MIN ((guint64) size * 10, G_MAXUINT32)),
+    .offsets = offsets ? g_array_sized_new (FALSE, FALSE, sizeof (guint32), size + 1) : NULL,
+    .values = values ? g_ptr_array_sized_new (size) : NULL,
+    .overflow = FALSE,
+  };
+
+  gw_radix_tree_iter (self, export_packed_cb, &export);
+
+  if (export.overflow)
+    {
+      g_byte_array_free (export.keys, TRUE);
+
+      if (export.offsets)
+        g_array_free (export.offsets, TRUE);
+
+      if (export.values)
+        g_ptr_array_free (export.values, TRUE);
+
+      return NULL;
+    }
+
+  if (offsets)
+    {
+      end = export.keys->len;
+      g_array_append_val (export.offsets, end);
+
+      *offsets = (guint32*) g_array_free (export.offsets, FALSE);
+    }
+
+  if (values)
+    *values = g_ptr_array_free (export.values, FALSE);
+
+  return g_byte_array_free_to_bytes (export.keys);
+}
+
+/**
+ * gw_radix_tree_iter:
+ * @tree: the #GwRadixTree to be traversed
+ * @callback: user-defined function to call on each value
+ * @user_data:
+ *
+ * Traverse the tree calling @callback on each saved value.
+ *
+ * It iterates until @callback returns TR
+ *
+ * Returns: the same result as @callback.
+ *
+ * Since: 0.1.0
+ */
+gboolean
+gw_radix_tree_iter (GwRadixTree *self,
+                    RadixTreeCb  callback,
+                    gpointer     user_data)
+{
+  g_return_val_if_fail (self, FALSE);
+
+  if (self->frozen)
+    return frozen_iter (self->frozen, callback, user_data);
 
-  /* Bail if the prefix does not match */
-  if (n->partial_len)
-    {
-      gint prefix_len;
+  return iter_subtree (DEREF (self->root), NULL, 0, self->compact_leaves, callback, user_data);
+}
 
-      prefix_len = check_prefix (n, key, key_len, depth);
+/**
+ * gw_radix_tree_iter_prefix:
+ * @tree: the #GwRadixTree to be traversed
+ * @prefix: the prefix of the keys to visit
+ * @prefix_length: the length of @prefix, or -1
+ * @callback: user-defined function to call on each value
+ * @user_data: user data for @callback
+ *
+ * Traverse the keys of @tree that start with @prefix, calling @callback
+ * on each of them. Only the subtree below @prefix is visited, so the cost
+ * is proportional to the number of matching keys rather than the size of
+ * the tree.
+ *
+ * It iterates until @callback returns %GW_RADIX_TREE_ITER_STOP.
+ *
+ * Returns: the same result as @callback.
+ *
+ * Since: 0.1.0
+ */
+gboolean
+gw_radix_tree_iter_prefix (GwRadixTree *self,
+                           const gchar *prefix,
+                           gsize        prefix_length,
+                           RadixTreeCb  callback,
+                           gpointer     user_data)
+{
+  g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (prefix, FALSE);
+  g_return_val_if_fail (callback, FALSE);
 
-      if (prefix_len != MIN (MAX_PREFIX_LEN, n->partial_len))
-        return NULL;
+  if (prefix_length == -1)
+    prefix_length = strlen (prefix);
 
-      depth = depth + n->partial_len;
-    }
+  if (self->frozen)
+    return frozen_iter_prefix (self->frozen, (const guchar*) prefix, prefix_length, callback, user_data);
 
-  /* Find child node */
-  child = find_child (n, key[depth]);
+  return iter_prefix (DEREF (self->root),
+                      (const guchar*) prefix,
+                      prefix_length,
+                      self->compact_leaves,
+                      callback,
+                      user_data);
+}
 
-  if (!child)
-    return NULL;
+/**
+ * gw_radix_tree_foreach_parallel:
+ * @tree: the #GwRadixTree to be traversed
+ * @callback: user-defined function to call on each value
+ * @user_data: user data for @callback
+ *
+ * Traverse the tree calling @callback on each saved value, from several
+ * threads at once. The tree is split into subtrees, which are visited
+ * on a thread pool, so @callback is called concurrently and in no
+ * particular order. See gw_radix_tree_map_parallel() to get results in
+ * key order.
+ *
+ * Once @callback returns %GW_RADIX_TREE_ITER_STOP, no new calls are made,
+ * but calls already running in other threads still finish.
+ *
+ * The tree must not be modified until this function returns.
+ *
+ * Returns: %GW_RADIX_TREE_ITER_STOP if @callback stopped the traversal.
+ *
+ * Since: 0.1.0
+ */
+gboolean
+gw_radix_tree_foreach_parallel (GwRadixTree *self,
+                                RadixTreeCb  callback,
+                                gpointer     user_data)
+{
+  ParallelWalk walk;
 
-  /* If the child is leaf, delete from this node */
-  if (IS_LEAF (*child))
-    {
-      Leaf *l;
+  g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (callback, FALSE);
 
-      l = LEAF_RAW(*child);
+  walk = (ParallelWalk) {
+    .callback = callback,
+    .user_data = user_data,
+  };
 
-      if (leaf_matches (l, key, key_len))
-        {
-          remove_child (n, ref, key[depth], child);
-          return l;
-        }
+  if (self->frozen)
+    {
+      ParallelUnit unit = { .walk = &walk };
 
-      return NULL;
+      frozen_iter (self->frozen, parallel_walk_cb, &unit);
     }
   else
     {
-      return remove_recursive (*child, child, key, key_len, depth + 1);
+      parallel_walk (&walk, DEREF (self->root), self->compact_leaves, NULL);
     }
+
+  return walk.stop;
 }
 
-static gboolean
-iter_recursive (Node        *n,
-                RadixTreeCb  cb,
-                gpointer     user_data)
+/**
+ * gw_radix_tree_map_parallel:
+ * @tree: the #GwRadixTree to be traversed
+ * @map: user-defined function to call on each value
+ * @user_data: user data for @map
+ *
+ * Calls @map on each saved value from several threads at once, just like
+ * gw_radix_tree_foreach_parallel(), and collects what it returns. Each
+ * thread gathers the results of its own subtrees, and they are merged in
+ * key order at the end.
+ *
+ * The tree must not be modified until this function returns.
+ *
+ * Returns: (transfer container): a #GPtrArray with the result of @map
+ * for each key, in the same order as gw_radix_tree_iter() visits them.
+ *
+ * Since: 0.1.0
+ */
+GPtrArray*
+gw_radix_tree_map_parallel (GwRadixTree    *self,
+                            RadixTreeMapCb  map,
+                            gpointer        user_data)
 {
-  gint res, i;
+  ParallelWalk walk;
+  GPtrArray *results;
 
-  if (!n)
-    return GW_RADIX_TREE_ITER_CONTINUE;
+  g_return_val_if_fail (self, NULL);
+  g_return_val_if_fail (map, NULL);
 
-  if (IS_LEAF (n))
+  walk = (ParallelWalk) {
+    .map = map,
+    .user_data = user_data,
+  };
+
+  results = g_ptr_array_sized_new (self->size);
+
+  if (self->frozen)
     {
-      Leaf *l = LEAF_RAW (n);
-      return cb (LEAF_KEY (l), l->key_len, l->value, user_data);
-    }
+      ParallelUnit unit = { .walk = &walk, .results = results };
 
-  switch (n->type)
+      frozen_iter (self->frozen, parallel_walk_cb, &unit);
+    }
+  else
     {
-    case NODE_4:
-        for (i = 0; i < n->num_children; i++)
-          {
-            res = iter_recursive (((Node4*) n)->children[i], cb, user_data);
+      parallel_walk (&walk, DEREF (self->root), self->compact_leaves, results);
+    }
 
-            if (res)
-              return res;
-          }
-        break;
+  return results;
+}
 
-    case NODE_16:
-        for (i = 0; i < n->num_children; i++)
-          {
-            res = iter_recursive (((Node16*) n)->children[i], cb, user_data);
+/**
+ * gw_radix_tree_get_keys_with_prefix:
+ * @tree: a #GwRadixTree
+ * @prefix: the prefix of the keys to retrieve
+ * @prefix_length: the length of @prefix, or -1
+ *
+ * Retrieve all keys from the tree that start with @prefix.
+ *
+ * Returns: (transfer full): a %NULL-terminated array with the keys. Free
+ * with g_strfreev().
+ *
+ * Since: 0.1.0
+ */
+GStrv
+gw_radix_tree_get_keys_with_prefix (GwRadixTree *self,
+                                    const gchar *prefix,
+                                    gsize        prefix_length)
+{
+  GPtrArray *result;
 
-            if (res)
-              return res;
-          }
-        break;
+  g_return_val_if_fail (self, NULL);
+  g_return_val_if_fail (prefix, NULL);
 
-    case NODE_48:
-        for (i = 0; i < 256; i++)
-          {
-            gint idx;
+  result = g_ptr_array_new ();
 
-            idx = ((Node48*) n)->keys[i];
+  gw_radix_tree_iter_prefix (self, prefix, prefix_length, get_keys_cb, result);
 
-            if (idx == 0)
-              continue;
+  /* Tail NULL */
+  g_ptr_array_add (result, NULL);
 
-            res = iter_recursive (((Node48*) n)->children[idx - 1], cb, user_data);
+  return (GStrv) g_ptr_array_free (result, FALSE);
+}
 
-            if (res)
-              return res;
-          }
-        break;
+/**
+ * gw_radix_tree_fuzzy_search:
+ * @tree: the #GwRadixTree to be searched
+ * @word: the word to look for. Must be UTF-8 valid.
+ * @word_length: the length of @word, or -1
+ * @max_distance: the maximum Levenshtein distance between @word and a key
+ * @callback: user-defined function to call on each matching key
+ * @user_data: user data for @callback
+ *
+ * Calls @callback on every key of @tree that can be turned into @word with
+ * at most @max_distance character insertions, deletions or substitutions,
+ * in the order of the keys.
+ *
+ * Subtrees are skipped as soon as none of their keys can be within
+ * @max_distance, so only a small part of the tree is visited for
+ * small distances.
+ *
+ * It iterates until @callback returns %GW_RADIX_TREE_ITER_STOP.
+ *
+ * Returns: the same result as @callback.
+ *
+ * Since: 0.1.0
+ */
+gboolean
+gw_radix_tree_fuzzy_search (GwRadixTree *self,
+                            const gchar *word,
+                            gsize        word_length,
+                            guint        max_distance,
+                            RadixTreeCb  callback,
+                            gpointer     user_data)
+{
+  FuzzySearch search;
+  FuzzyState state;
+  gunichar *ucs4_word;
+  gboolean res;
+  glong word_len;
+  glong j;
 
-    case NODE_256:
-        for (i = 0; i < 256; i++)
-          {
-            if (!((Node256*) n)->children[i])
-              continue;
+  g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (word, FALSE);
+  g_return_val_if_fail (callback, FALSE);
 
-            res = iter_recursive (((Node256*) n)->children[i], cb, user_data);
+  if (!self->root && (!self->frozen || self->frozen->n_bytes == 0))
+    return GW_RADIX_TREE_ITER_CONTINUE;
 
-            if (res)
-              return res;
-          }
-        break;
+  ucs4_word = g_utf8_to_ucs4_fast (word, word_length, &word_len);
 
-    default:
-        g_assert_not_reached ();
-    }
+  search = (FuzzySearch) {
+    .cb = callback,
+    .user_data = user_data,
+    .word = ucs4_word,
+    .word_len = word_len,
+    .max_distance = max_distance,
+    .path = self->compact_leaves ? g_string_new (NULL) : NULL,
+  };
 
-  return GW_RADIX_TREE_ITER_CONTINUE;
-}
+  search.rows = g_array_sized_new (FALSE, FALSE, sizeof (gint), 32 * (search.word_len + 1));
+  g_array_set_size (search.rows, search.word_len + 1);
 
-static void
-gw_radix_tree_free (GwRadixTree *self)
-{
-  g_assert (self);
-  g_assert_cmpint (self->ref_count, ==, 0);
+  /* The first row is the distance to the empty key */
+  for (j = 0; j <= search.word_len; j++)
+    g_array_index (search.rows, gint, j) = j;
 
-  destroy_node_recursive (self->root);
+  state = (FuzzyState) { 0, };
 
-  g_slice_free (GwRadixTree, self);
+  if (!self->frozen)
+    res = fuzzy_recursive (&search, DEREF (self->root), 0, state);
+  else if (FROZEN_IS_LEAF (self->frozen->root))
+    res = fuzzy_leaf (&search, state, (Leaf*) FROZEN_AT (self->frozen->data, self->frozen->root), 0);
+  else
+    res = frozen_fuzzy_recursive (&search, (FrozenNode*) self->frozen->data, 0, state);
+
+  g_array_unref (search.rows);
+  g_free (ucs4_word);
+
+  if (search.path)
+    g_string_free (search.path, TRUE);
+
+  return res;
 }
 
 /**
- * gw_radix_tree_new:
+ * gw_radix_tree_match_pattern:
+ * @tree: the #GwRadixTree to be searched
+ * @pattern: the pattern to match. Must be UTF-8 valid.
+ * @pattern_length: the length of @pattern, or -1
+ * @callback: user-defined function to call on each matching key
+ * @user_data: user data for @callback
  *
- * Creates a new #GwRadixTree.
+ * Calls @callback on every key of @tree that matches @pattern as a whole,
+ * in the order of the keys. In @pattern, '?' matches any character, '*'
+ * matches any number of characters, and a class like "[aeiou]", "[a-z]"
+ * or "[!0-9]" matches one character that is, or isn't, in the class. Any
+ * other character, or one escaped with a backslash, matches itself.
+ * Characters are UTF-8 characters, not bytes, so "c?o" matches "cão".
  *
- * Returns: (transfer full): a new #GwRadixTree.
+ * Subtrees are skipped as soon as the path leading to them can't match
+ * @pattern, so patterns starting with a few fixed characters only visit
+ * a small part of the tree. Patterns starting with '*' still have to
+ * visit every key.
+ *
+ * It iterates until @callback returns %GW_RADIX_TREE_ITER_STOP.
+ *
+ * Returns: the same result as @callback.
  *
  * Since: 0.1.0
  */
-GwRadixTree *
-gw_radix_tree_new (void)
+gboolean
+gw_radix_tree_match_pattern (GwRadixTree *self,
+                             const gchar *pattern,
+                             gsize        pattern_length,
+                             RadixTreeCb  callback,
+                             gpointer     user_data)
 {
-  GwRadixTree *self;
+  PatternSearch search;
+  PatternState state;
+  gboolean res;
 
-  self = g_slice_new0 (GwRadixTree);
-  self->ref_count = 1;
+  g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (pattern, FALSE);
+  g_return_val_if_fail (callback, FALSE);
 
-  return self;
-}
+  if (!self->root && (!self->frozen || self->frozen->n_bytes == 0))
+    return GW_RADIX_TREE_ITER_CONTINUE;
 
-/**
- * gw_radix_tree_copy:
- * @self: a #GwRadixTree
- *
- * Creates a deep copy of @self.
- *
- * Returns: (transfer full): a new #GwRadixTree
- *
- * Since: 0.1
- */
-GwRadixTree*
-gw_radix_tree_copy (GwRadixTree *self)
-{
-  GwRadixTree *copy;
+  if (pattern_length == -1)
+    pattern_length = strlen (pattern);
 
-  g_return_val_if_fail (self, NULL);
-  g_return_val_if_fail (self->ref_count, NULL);
+  search = (PatternSearch) {
+    .cb = callback,
+    .user_data = user_data,
+    .tokens = g_array_new (FALSE, FALSE, sizeof (PatternToken)),
+    .ranges = g_array_new (FALSE, FALSE, sizeof (gunichar)),
+    .path = self->compact_leaves ? g_string_new (NULL) : NULL,
+  };
 
-  copy = gw_radix_tree_new ();
+  pattern_compile (&search, pattern, pattern_length);
 
-  return copy;
-}
+  search.rows = g_array_sized_new (FALSE, TRUE, sizeof (guint8), 32 * (search.tokens->len + 1));
+  g_array_set_size (search.rows, search.tokens->len + 1);
 
-GwRadixTree*
-gw_radix_tree_ref (GwRadixTree *self)
-{
-  g_return_val_if_fail (self, NULL);
-  g_return_val_if_fail (self->ref_count, NULL);
+  /* The first row holds the positions matching the empty key */
+  g_array_index (search.rows, guint8, 0) = TRUE;
+  pattern_close_row (&search, (guint8*) search.rows->data);
 
-  g_atomic_int_inc (&self->ref_count);
+  state = (PatternState) { 0, };
 
-  return self;
-}
+  if (!self->frozen)
+    res = pattern_recursive (&search, DEREF (self->root), 0, state);
+  else if (FROZEN_IS_LEAF (self->frozen->root))
+    res = pattern_leaf (&search, state, (Leaf*) FROZEN_AT (self->frozen->data, self->frozen->root), 0);
+  else
+    res = frozen_pattern_recursive (&search, (FrozenNode*) self->frozen->data, 0, state);
 
-void
-gw_radix_tree_unref (GwRadixTree *self)
-{
-  g_return_if_fail (self);
-  g_return_if_fail (self->ref_count);
+  g_array_unref (search.rows);
+  g_array_unref (search.ranges);
+  g_array_unref (search.tokens);
 
-  if (g_atomic_int_dec_and_test (&self->ref_count))
-    gw_radix_tree_free (self);
+  if (search.path)
+    g_string_free (search.path, TRUE);
+
+  return res;
 }
 
 /**
- * gw_radix_tree_new_with_free_func:
- * @destroy_func: (nullable): A function to free the data elements, or %NULL.
- *
- * Creates a new #GwRadixTree with @destroy_func.
+ * gw_radix_tree_remove:
+ * @tree: the #GwRadixTree
+ * @key: the key to be removed. Must be UTF-8 valid.
+ * @key_length: the length of @key, or -1
  *
- * Returns: (transfer full): a new #GwRadixTree.
+ * Removes the given key from the tree. The key must be
+ * a UTF-8 validated string.
  *
  * Since: 0.1.0
  */
-GwRadixTree*
-gw_radix_tree_new_with_free_func (GDestroyNotify destroy_func)
+void
+gw_radix_tree_remove (GwRadixTree *self,
+                      const gchar *key,
+                      gsize        key_length)
 {
-  GwRadixTree *self;
+  Node *removed;
 
-  self = g_slice_new0 (GwRadixTree);
-  self->ref_count = 1;
-  self->destroy_func = destroy_func;
+  g_return_if_fail (self);
+  g_return_if_fail (!self->frozen);
 
-  return self;
+  removed = remove_key (self, key, key_length);
+
+  if (removed)
+    node_unref (self, removed);
 }
 
 /**
- * gw_radix_tree_contains:
- * @self: a #GwRadixTree
- * @key: the key to search for.
+ * gw_radix_tree_steal:
+ * @tree: the #GwRadixTree
+ * @key: the key to be removed. Must be UTF-8 valid.
  * @key_length: the length of @key, or -1
  *
- * Checks if @self contains @key.
- *
- * Returns: %TRUE if @key is in @self, %FALSE otherwise.
+ * Removes the given key from the tree without calling the destroy
+ * function if any.
  *
  * Since: 0.1.0
  */
-gboolean
-gw_radix_tree_contains (GwRadixTree *self,
-                        const gchar *key,
-                        gsize        key_length)
+void
+gw_radix_tree_steal (GwRadixTree *self,
+                     const gchar *key,
+                     gsize        key_length)
 {
-  gboolean found;
+  Node *removed;
 
-  g_return_val_if_fail (self, FALSE);
+  g_return_if_fail (self);
+  g_return_if_fail (!self->frozen);
 
-  gw_radix_tree_lookup (self, key, key_length, &found);
+  removed = remove_key (self, key, key_length);
 
-  return found;
+  if (removed && !IS_EMBEDDED (removed))
+    leaf_unref (self, LEAF_RAW (removed), FALSE);
 }
 
 /**
- * gw_radix_tree_lookup:
- * @tree: a #GwRadixTree
- * @key: the key to look for
- * @key_length: the length of @key, or -1
- * @found: whether the value was found or not
+ * gw_radix_tree_remove_prefix:
+ * @tree: the #GwRadixTree
+ * @prefix: the prefix of the keys to be removed. Must be UTF-8 valid.
+ * @prefix_length: the length of @prefix, or -1
  *
- * Look for the given key on the tree, and return it's associated value.
- * It'll return NULL when the value is not found. Use the @found argument
- * to differentiate between saved NULL values.
+ * Removes every key that starts with @prefix, including @prefix itself.
+ * Subtrees whose keys all start with @prefix are unlinked and freed
+ * whole, instead of removing their keys one by one. The destroy
+ * function, if any, is called on every non-%NULL value removed.
  *
- * Returns: the associated value of the key, or NULL.
+ * Trees created with gw_radix_tree_new_concurrent() don't support
+ * removing several keys at once.
+ *
+ * Returns: the number of keys removed
  *
  * Since: 0.1.0
  */
-gpointer
-gw_radix_tree_lookup (GwRadixTree *self,
-                      const gchar *key,
-                      gsize        key_length,
-                      gboolean    *found)
+guint64
+gw_radix_tree_remove_prefix (GwRadixTree *self,
+                             const gchar *prefix,
+                             gsize        prefix_length)
 {
-  Node **child;
-  Node *n;
-  Leaf *l;
-  gint depth;
+  KeyRange range;
+  guchar *to;
+  guint64 removed;
+  gsize to_length;
 
-  g_return_val_if_fail (self, NULL);
+  g_return_val_if_fail (self, 0);
+  g_return_val_if_fail (prefix, 0);
+  g_return_val_if_fail (!self->frozen, 0);
+  g_return_val_if_fail (!self->epochs, 0);
 
-  n = self->root;
-  depth = 0;
+  if (prefix_length == -1)
+    prefix_length = strlen (prefix);
 
-  if (key_length == -1)
-    key_length = strlen (key);
+  /* The keys with @prefix are the ones before its successor */
+  to_length = prefix_length;
 
-  l = NULL;
+  while (to_length > 0 && (guchar) prefix[to_length - 1] == 0xff)
+    to_length--;
 
-  while (n)
+  to = NULL;
+
+  if (to_length > 0)
     {
-      if (IS_LEAF (n))
-        {
-          n = (Node*) LEAF_RAW (n);
+      to = g_malloc (to_length);
+      memcpy (to, prefix, to_length);
+      to[to_length - 1]++;
+    }
 
-          if (leaf_matches ((Leaf*) n, (guchar*) key, key_length))
-            l = (Leaf*) n;
+  range = (KeyRange) {
+    .from = (const guchar*) prefix,
+    .from_len = prefix_length,
+    .to = to,
+    .to_len = to_length,
+  };
 
-          break;
-        }
+  removed = remove_range (self, &range);
 
-      /* Bail if the prefix does not match */
-      if (n->partial_len)
-        {
-          gint prefix_len;
+  g_free (to);
 
-          prefix_len = check_prefix (n, (guchar*) key, key_length, depth);
+  return removed;
+}
 
-          if (prefix_len != MIN (MAX_PREFIX_LEN, n->partial_len))
-            {
-              l = NULL;
-              break;
-            }
+/**
+ * gw_radix_tree_remove_range:
+ * @tree: the #GwRadixTree
+ * @from: (nullable): the first key to be removed, or %NULL to start
+ *   with the first key of the tree. Must be UTF-8 valid.
+ * @from_length: the length of @from, or -1
+ * @to: (nullable): the key to stop at, which isn't removed, or %NULL to
+ *   remove up to the last key of the tree. Must be UTF-8 valid.
+ * @to_length: the length of @to, or -1
+ *
+ * Removes every key that sorts between @from, included, and @to,
+ * excluded. Keys sort like gw_radix_tree_iter() visits them. Subtrees
+ * whose keys all sort within the range are unlinked and freed whole, so
+ * only the paths of @from and @to are descended. The destroy function,
+ * if any, is called on every non-%NULL value removed.
+ *
+ * Trees created with gw_radix_tree_new_concurrent() don't support
+ * removing several keys at once.
+ *
+ * Returns: the number of keys removed
+ *
+ * Since: 0.1.0
+ */
+guint64
+gw_radix_tree_remove_range (GwRadixTree *self,
+                            const gchar *from,
+                            gsize        from_length,
+                            const gchar *to,
+                            gsize        to_length)
+{
+  KeyRange range;
 
-          depth = depth + n->partial_len;
-        }
+  g_return_val_if_fail (self, 0);
+  g_return_val_if_fail (!self->frozen, 0);
+  g_return_val_if_fail (!self->epochs, 0);
 
-      /* Recursively search */
-      child = find_child (n, key[depth]);
-      n = child ? *child : NULL;
-      depth++;
+  if (!from)
+    {
+      from = "";
+      from_length = 0;
+    }
+  else if (from_length == -1)
+    {
+      from_length = strlen (from);
     }
 
+  if (to && to_length == -1)
+    to_length = strlen (to);
 
-  if (found)
-    *found = l != NULL;
+  range = (KeyRange) {
+    .from = (const guchar*) from,
+    .from_len = from_length,
+    .to = (const guchar*) to,
+    .to_len = to ? to_length : 0,
+  };
 
-  return l ? l->value : NULL;
+  return remove_range (self, &range);
 }
 
 /**
- * gw_radix_tree_insert:
- * @tree: the #GwRadixTree to add to
- * @key: string user as identifier of the value. Must be a UTF-8 valid string.
- * @key_length: the length of @key, or -1
- * @value: (nullable): user data to be stored. Can be %NULL.
+ * gw_radix_tree_clear:
+ * @self: the #GwRadixTree to be cleared.
  *
- * Inserts a new value in the @tree. If the key is already in the tree, @value
- * will be overwritten.
+ * Clear out the nodes from the tree. The destroy function, if any, is
+ * called on every non-%NULL value.
  *
- * Returns: %TRUE if a new node was added, %FALSE otherwise.
+ * Since: 0.1.0
+ */
+void
+gw_radix_tree_clear (GwRadixTree *self)
+{
+  g_return_if_fail (self);
+
+  destroy_nodes (self);
+  self->size = 0;
+  self->stamp++;
+
+  if (self->epochs)
+    self->root = REF (node_new (self, NODE_256));
+}
+
+/**
+ * gw_radix_tree_freeze:
+ * @self: a #GwRadixTree
+ *
+ * Turns @self into a read-only tree, rewriting its nodes into a single
+ * contiguous block. Nodes are laid out breadth first and only take the
+ * room their children need, with 32-bit offsets instead of pointers, so
+ * a frozen tree takes considerably less memory, and lookups touch fewer
+ * cache lines. This is meant for trees that are built once and then only
+ * read, like dictionaries.
+ *
+ * Lookups, prefix searches, fuzzy searches and iterations work as usual,
+ * and keys passed to callbacks point into the block. Adding, removing,
+ * copying, set operations and #GwRadixTreeIter aren't supported on frozen
+ * trees, and gw_radix_tree_foreach_parallel() and
+ * gw_radix_tree_map_parallel() visit the keys from the calling thread.
+ * gw_radix_tree_clear() leaves an empty tree that can be modified again.
+ *
+ * Trees created with gw_radix_tree_new_concurrent() or
+ * gw_radix_tree_new_compact(), and trees with counts, see
+ * gw_radix_tree_enable_counts(), can't be frozen.
+ *
+ * Returns: %TRUE if @self is frozen, %FALSE if it shares nodes with a
+ * copy, or is too large, in which case it's left untouched.
  *
  * Since: 0.1.0
  */
 gboolean
-gw_radix_tree_insert (GwRadixTree *self,
-                      const gchar *key,
-                      gsize        key_length,
-                      gpointer     value)
+gw_radix_tree_freeze (GwRadixTree *self)
 {
-  gpointer old_val;
-  gboolean old;
+  GDestroyNotify destroy_func;
+  Frozen *frozen;
 
   g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (!self->epochs, FALSE);
+  g_return_val_if_fail (!self->compact_leaves, FALSE);
+  g_return_val_if_fail (!self->counted, FALSE);
 
-  old = FALSE;
+  if (self->frozen)
+    return TRUE;
+
+  frozen = frozen_new (DEREF (self->root));
+
+  if (!frozen)
+    return FALSE;
 
-  old_val = insert_recursive (self->root,
-                              &self->root,
-                              (const guchar*) key,
-                              key_length == -1 ? strlen (key) : key_length,
-                              value,
-                              0,
-                              &old);
+  /* The values now belong to the frozen block */
+  destroy_func = g_steal_pointer (&self->destroy_func);
+  destroy_nodes (self);
+  self->destroy_func = destroy_func;
 
-  if (!old_val)
-    self->size++;
+  self->frozen = frozen;
+  self->stamp++;
 
-  return !old_val;
+  return TRUE;
 }
 
 /**
- * gw_radix_tree_get_keys:
- * @tree: a #GwRadixTree
+ * gw_radix_tree_get_size:
+ * @self: the #GwRadixTree to count.
  *
- * Retrieve all keys from the tree
+ * Retrieves the number of elements of @tree.
  *
- * Returns: (transfer-full): a newly-allocated #GList with the keys.
+ * Returns: the number of elements.
  *
  * Since: 0.1.0
  */
-GStrv
-gw_radix_tree_get_keys (GwRadixTree *self)
+gint
+gw_radix_tree_get_size (GwRadixTree *self)
 {
-  GPtrArray *result;
+  g_return_val_if_fail (self, -1);
 
-  g_return_val_if_fail (self, NULL);
+  return self->size;
+}
 
-  result = g_ptr_array_new ();
+/**
+ * gw_radix_tree_enable_counts:
+ * @self: a #GwRadixTree
+ *
+ * Makes @self keep the number of keys below each of its nodes, so that
+ * gw_radix_tree_count_prefix(), gw_radix_tree_rank() and
+ * gw_radix_tree_select() take a single descent instead of visiting the
+ * keys. The counts of the current keys are computed right away, which
+ * takes as long as iterating the tree, and are then kept up to date by
+ * insertions and removals, at a small cost for each of them.
+ *
+ * Counts are stored in the nodes, so nodes that @self shares with copies
+ * are copied. Copies of a counted tree, and the results of set operations
+ * on it, are counted as well.
+ *
+ * Trees created with gw_radix_tree_new_concurrent(), and frozen trees,
+ * can't be counted.
+ *
+ * Since: 0.1.0
+ */
+void
+gw_radix_tree_enable_counts (GwRadixTree *self)
+{
+  g_return_if_fail (self);
+  g_return_if_fail (!self->epochs);
+  g_return_if_fail (!self->frozen);
 
-  gw_radix_tree_iter (self, get_keys_cb, result);
+  if (self->counted)
+    return;
 
-  /* Tail NULL */
-  g_ptr_array_add (result, NULL);
+  self->counted = TRUE;
 
-  return (GStrv) g_ptr_array_free (result, FALSE);
+  if (self->root)
+    count_keys_recursive (self, &self->root);
 }
 
 /**
- * gw_radix_tree_get_values:
- * @tree: a #GwRadixTree
+ * gw_radix_tree_enable_uint64_values:
+ * @self: an empty #GwRadixTree
  *
- * Retrieve all values from the tree
+ * Makes @self store a #guint64 in each leaf instead of a pointer, so that
+ * small numbers like frequencies, identifiers or flags can be kept
+ * without a pointer cast on 64-bit systems, or an allocation on 32-bit
+ * ones. Numbers are set with gw_radix_tree_insert_uint64(), read with
+ * gw_radix_tree_lookup_uint64(), and updated atomically with
+ * gw_radix_tree_add_uint64() and gw_radix_tree_compare_exchange_uint64().
+ * Keys that aren't in @self count as zero.
  *
- * Returns: (transfer-full): a newly-allocated #GList with the values.
+ * Updating the number of a key that is already in @self doesn't change
+ * the tree, so several threads can update existing keys at once, as long
+ * as no thread adds or removes keys. Trees created with
+ * gw_radix_tree_new_concurrent() can also add and remove keys from any
+ * thread at the same time.
+ *
+ * That isn't the case while @self shares nodes with a copy, see
+ * gw_radix_tree_copy(): the first update of a key then copies the path
+ * to it, which changes the tree. Until each key to update has been
+ * updated once since the copy, only one thread at a time can update
+ * @self.
+ *
+ * gw_radix_tree_insert() and gw_radix_tree_upsert() can't be used on
+ * @self, and functions passing values as pointers, like
+ * gw_radix_tree_lookup() or the callbacks of gw_radix_tree_iter(), don't
+ * see the whole number on 32-bit systems. Copies of @self, and the results
+ * of set operations on it, hold numbers as well.
+ *
+ * @self must be empty, and can't have a destroy function, or be created
+ * with gw_radix_tree_new_set().
  *
  * Since: 0.1.0
  */
-GPtrArray*
-gw_radix_tree_get_values (GwRadixTree *self)
+void
+gw_radix_tree_enable_uint64_values (GwRadixTree *self)
 {
-  GPtrArray *result;
+  g_return_if_fail (self);
+  g_return_if_fail (self->size == 0);
+  g_return_if_fail (!self->destroy_func);
+  g_return_if_fail (!self->embed_keys);
+  g_return_if_fail (!self->frozen);
 
-  g_return_val_if_fail (self, NULL);
+  self->uint64_values = TRUE;
+}
 
-  result = g_ptr_array_new ();
+/**
+ * gw_radix_tree_count_prefix:
+ * @self: a #GwRadixTree with counts, see gw_radix_tree_enable_counts()
+ * @prefix: the prefix to count
+ * @prefix_length: length of @prefix, or -1 if it's NUL-terminated
+ *
+ * Counts the keys of @self that start with @prefix, without visiting
+ * them. This takes time proportional to the length of @prefix.
+ *
+ * Returns: the number of keys starting with @prefix
+ *
+ * Since: 0.1.0
+ */
+guint64
+gw_radix_tree_count_prefix (GwRadixTree *self,
+                            const gchar *prefix,
+                            gsize        prefix_length)
+{
+  g_return_val_if_fail (self, 0);
+  g_return_val_if_fail (self->counted, 0);
+  g_return_val_if_fail (prefix, 0);
 
-  gw_radix_tree_iter (self, get_values_cb, result);
+  if (prefix_length == -1)
+    prefix_length = strlen (prefix);
 
-  return result;
+  return count_prefix (DEREF (self->root),
+                       (const guchar*) prefix,
+                       prefix_length,
+                       self->compact_leaves);
 }
 
 /**
- * gw_radix_tree_iter:
- * @tree: the #GwRadixTree to be traversed
- * @callback: user-defined function to call on each value
- * @user_data:
- *
- * Traverse the tree calling @callback on each saved value.
+ * gw_radix_tree_rank:
+ * @self: a #GwRadixTree with counts, see gw_radix_tree_enable_counts()
+ * @key: the key to find the position of
+ * @key_length: length of @key, or -1 if it's NUL-terminated
  *
- * It iterates until @callback returns TR
+ * Counts the keys of @self that sort before @key in byte order, which is
+ * the position of @key among the keys of @self, or the position it would
+ * take if it was added. This takes time proportional to the length of
+ * @key.
  *
- * Returns: the same result as @callback.
+ * Returns: the number of keys smaller than @key
  *
  * Since: 0.1.0
  */
-gboolean
-gw_radix_tree_iter (GwRadixTree *self,
-                    RadixTreeCb  callback,
-                    gpointer     user_data)
+guint64
+gw_radix_tree_rank (GwRadixTree *self,
+                    const gchar *key,
+                    gsize        key_length)
 {
-  g_return_val_if_fail (self, FALSE);
+  g_return_val_if_fail (self, 0);
+  g_return_val_if_fail (self->counted, 0);
+  g_return_val_if_fail (key, 0);
 
-  return iter_recursive (self->root, callback, user_data);
+  if (key_length == -1)
+    key_length = strlen (key);
+
+  return count_keys_before (DEREF (self->root),
+                            (const guchar*) key,
+                            key_length,
+                            self->compact_leaves);
 }
 
 /**
- * gw_radix_tree_remove:
- * @tree: the #GwRadixTree
- * @key: the key to be removed. Must be UTF-8 valid.
- * @key_length: the length of @key, or -1
+ * gw_radix_tree_select:
+ * @self: a #GwRadixTree with counts, see gw_radix_tree_enable_counts()
+ * @index: the position of the key, in byte order
+ * @value: (out) (optional) (nullable) (transfer none): return location
+ *   for the value of the key
  *
- * Removes the given key from the tree. The key must be
- * a UTF-8 validated string.
+ * Finds the key at @index among the sorted keys of @self, which is the
+ * inverse of gw_radix_tree_rank(). This takes time proportional to the
+ * length of the key, so pages of keys can be reached directly, and keys
+ * can be sampled uniformly by picking @index at random below
+ * gw_radix_tree_get_size().
+ *
+ * Returns: (transfer full) (nullable): the key at @index, or %NULL if
+ * @index is past the last key
  *
  * Since: 0.1.0
  */
-void
-gw_radix_tree_remove (GwRadixTree *self,
-                      const gchar *key,
-                      gsize        key_length)
+gchar*
+gw_radix_tree_select (GwRadixTree *self,
+                      guint64      index,
+                      gpointer    *value)
 {
-  Leaf *removed;
+  LeafView view;
+  GString *path;
+  Leaf *l;
 
-  g_return_if_fail (self);
+  g_return_val_if_fail (self, NULL);
+  g_return_val_if_fail (self->counted, NULL);
 
-  removed = remove_recursive (self->root,
-                              &self->root,
-                              (guchar*) key,
-                              key_length == -1 ? strlen (key) : key_length,
-                              0);
+  if (index >= self->size)
+    return NULL;
 
-  if (removed)
-    {
-      if (self->destroy_func && removed->value)
-        self->destroy_func (removed->value);
+  path = self->compact_leaves ? g_string_new (NULL) : NULL;
+  l = leaf_view (select_leaf (DEREF (self->root), index, path), &view);
 
-      g_free (removed);
+  if (value)
+    *value = l->value;
 
-      self->size--;
-    }
+  if (!path)
+    return g_strndup ((const gchar*) LEAF_KEY (l), l->key_len);
+
+  leaf_path_key (path, l);
+
+  return g_string_free (path, FALSE);
 }
 
 /**
- * gw_radix_tree_steal:
- * @tree: the #GwRadixTree
- * @key: the key to be removed. Must be UTF-8 valid.
- * @key_length: the length of @key, or -1
+ * gw_radix_tree_get_stats:
+ * @self: a #GwRadixTree
+ * @stats: (out caller-allocates): return location for the statistics
  *
- * Removes the given key from the tree without calling the destroy
- * function if any.
+ * Walks @self and fills @stats with the number of nodes of each kind,
+ * the memory they take and how deep the keys are stored. This visits
+ * every node, so it's as expensive as iterating the tree.
+ *
+ * Nodes shared with copies of @self are counted as if they were only
+ * used by @self. The bookkeeping of the tree itself, and the unused
+ * space of arenas, aren't included in the total size.
  *
  * Since: 0.1.0
  */
 void
-gw_radix_tree_steal (GwRadixTree *self,
-                     const gchar *key,
-                     gsize        key_length)
+gw_radix_tree_get_stats (GwRadixTree      *self,
+                         GwRadixTreeStats *stats)
 {
-  Leaf *removed;
+  StatsCollector collector = { 0, };
 
   g_return_if_fail (self);
+  g_return_if_fail (stats);
 
-  removed = remove_recursive (self->root,
-                              &self->root,
-                              (guchar*) key,
-                              key_length == -1 ? strlen (key) : key_length,
-                              0);
+  *stats = (GwRadixTreeStats) { 0, };
 
-  if (removed)
+  collector.stats = stats;
+  collector.compact = self->compact_leaves;
+
+  if (self->frozen && self->frozen->n_bytes > 0)
     {
-      g_free (removed);
-      self->size--;
+      frozen_stats_recursive (&collector, self->frozen->data, self->frozen->root, 0);
+      stats->total_bytes = self->frozen->n_bytes;
     }
+  else if (self->root)
+    {
+      stats_recursive (&collector, DEREF (self->root), 0, 0);
+    }
+
+  if (stats->n_leaves > 0)
+    stats->average_depth = (gdouble) collector.depth_sum / stats->n_leaves;
+
+  stats->fill_node4 = fill_ratio (collector.n_children[NODE_4], stats->n_node4, 4);
+  stats->fill_node16 = fill_ratio (collector.n_children[NODE_16], stats->n_node16, 16);
+  stats->fill_node32 = fill_ratio (collector.n_children[NODE_32], stats->n_node32, 32);
+  stats->fill_node48 = fill_ratio (collector.n_children[NODE_48], stats->n_node48, 48);
+  stats->fill_node256 = fill_ratio (collector.n_children[NODE_256], stats->n_node256, 256);
 }
 
 /**
- * gw_radix_tree_clear:
- * @self: the #GwRadixTree to be cleared.
+ * gw_radix_tree_iter_init:
+ * @iter: an uninitialized #GwRadixTreeIter
+ * @tree: a #GwRadixTree
+ *
+ * Initializes a cursor over the keys of @tree, in ascending order. The
+ * cursor starts unpositioned: gw_radix_tree_iter_next() moves it to the
+ * first key, and gw_radix_tree_iter_prev() to the last one.
  *
- * Clear out the nodes from the tree.
+ * The iterator is stack-allocated and never allocates memory. It is
+ * invalidated when keys are added to or removed from @tree. Keys are
+ * handed out from the leaves, so trees created with
+ * gw_radix_tree_new_compact(), which don't store whole keys, can't be
+ * iterated this way. Neither can frozen trees, see gw_radix_tree_freeze().
+ *
+ * |[<!-- language="C" -->
+ * GwRadixTreeIter iter;
+ * const gchar *key;
+ *
+ * gw_radix_tree_iter_init (&iter, tree);
+ * gw_radix_tree_iter_seek (&iter, "mac", -1);
+ *
+ * while (gw_radix_tree_iter_next (&iter, &key, NULL, NULL) && strcmp (key, "mad") < 0)
+ *   {
+ *     // do something with key
+ *   }
+ * ]|
  *
  * Since: 0.1.0
  */
 void
-gw_radix_tree_clear (GwRadixTree *self)
+gw_radix_tree_iter_init (GwRadixTreeIter *iter,
+                         GwRadixTree     *tree)
 {
-  g_return_if_fail (self);
+  RealIter *ri;
+
+  g_return_if_fail (iter);
+  g_return_if_fail (tree);
+  g_return_if_fail (!tree->compact_leaves);
+  g_return_if_fail (!tree->frozen);
+
+  ri = (RealIter*) iter;
+  ri->tree = tree;
+  ri->leaf = NULL;
+  ri->stamp = tree->stamp;
+  ri->depth = 0;
+  ri->n_stacked = 0;
+  ri->pending = FALSE;
+}
 
-  destroy_node_recursive (self->root);
-  self->root = NULL;
-  self->size = 0;
+/**
+ * gw_radix_tree_iter_seek:
+ * @iter: an initialized #GwRadixTreeIter
+ * @key: the key to seek to
+ * @key_length: the length of @key, or -1
+ *
+ * Positions @iter right before the first key that is greater than or
+ * equal to @key, so that the next call to gw_radix_tree_iter_next()
+ * returns it, and gw_radix_tree_iter_prev() returns the last key
+ * smaller than @key.
+ *
+ * Returns: %TRUE if @key is in the tree, %FALSE otherwise.
+ *
+ * Since: 0.1.0
+ */
+gboolean
+gw_radix_tree_iter_seek (GwRadixTreeIter *iter,
+                         const gchar     *key,
+                         gsize            key_length)
+{
+  LeafView view;
+  RealIter *ri;
+
+  g_return_val_if_fail (iter, FALSE);
+  g_return_val_if_fail (key, FALSE);
+
+  ri = (RealIter*) iter;
+
+  g_return_val_if_fail (ri->stamp == ri->tree->stamp, FALSE);
+
+  if (key_length == -1)
+    key_length = strlen (key);
+
+  ri->depth = 0;
+  ri->n_stacked = 0;
+  ri->pending = TRUE;
+  ri->leaf = cursor_lower_bound (ri, (const guchar*) key, key_length);
+
+  return ri->leaf && leaf_matches (leaf_view (ri->leaf, &view), (const guchar*) key, key_length, 0);
 }
 
 /**
- * gw_radix_tree_get_size:
- * @self: the #GwRadixTree to count.
+ * gw_radix_tree_iter_next:
+ * @iter: an initialized #GwRadixTreeIter
+ * @key: (out) (optional) (transfer none): return location for the key
+ * @key_length: (out) (optional): return location for the length of the key
+ * @value: (out) (optional) (transfer none): return location for the value
  *
- * Retrieves the number of elements of @tree.
+ * Advances @iter to the next key in ascending order. When the end of the
+ * tree is reached, %FALSE is returned and @iter becomes unpositioned again.
  *
- * Returns: the number of elements.
+ * Returns: %FALSE if the end of the tree was reached, %TRUE otherwise.
  *
  * Since: 0.1.0
  */
-gint
-gw_radix_tree_get_size (GwRadixTree *self)
+gboolean
+gw_radix_tree_iter_next (GwRadixTreeIter  *iter,
+                         const gchar     **key,
+                         gsize            *key_length,
+                         gpointer         *value)
 {
-  g_return_val_if_fail (self, -1);
+  g_return_val_if_fail (iter, FALSE);
 
-  return self->size;
+  return cursor_move ((RealIter*) iter, 1, key, key_length, value);
+}
+
+/**
+ * gw_radix_tree_iter_prev:
+ * @iter: an initialized #GwRadixTreeIter
+ * @key: (out) (optional) (transfer none): return location for the key
+ * @key_length: (out) (optional): return location for the length of the key
+ * @value: (out) (optional) (transfer none): return location for the value
+ *
+ * Moves @iter to the previous key in ascending order. When the beginning
+ * of the tree is reached, %FALSE is returned and @iter becomes unpositioned
+ * again.
+ *
+ * Returns: %FALSE if the beginning of the tree was reached, %TRUE otherwise.
+ *
+ * Since: 0.1.0
+ */
+gboolean
+gw_radix_tree_iter_prev (GwRadixTreeIter  *iter,
+                         const gchar     **key,
+                         gsize            *key_length,
+                         gpointer         *value)
+{
+  g_return_val_if_fail (iter, FALSE);
+
+  return cursor_move ((RealIter*) iter, -1, key, key_length, value);
 }
@@ -30,6 +30,64 @@ typedef struct _GwRadixTree GwRadixTree;
 #define GW_RADIX_TREE_ITER_STOP     TRUE
 #define GW_RADIX_TREE_ITER_CONTINUE FALSE
 
+typedef struct
+{
+  /*< private >*/
+  gpointer            dummy1;
+  gpointer            dummy2;
+  guint               dummy3;
+  guint               dummy4;
+  guint               dummy5;
+  gboolean            dummy6;
+  gpointer            dummy7[32];
+  guint8              dummy8[32];
+} GwRadixTreeIter;
+
+/**
+ * GwRadixTreeStats:
+ * @n_node4: the number of nodes with up to 4 children
+ * @n_node16: the number of nodes with up to 16 children
+ * @n_node32: the number of nodes with up to 32 children
+ * @n_node48: the number of nodes with up to 48 children
+ * @n_node256: the number of nodes with up to 256 children
+ * @n_leaves: the number of leaves, one per key
+ * @n_embedded: the number of leaves whose key is stored in the pointer to
+ *   the leaf itself, see gw_radix_tree_new_set()
+ * @total_bytes: the memory taken by nodes and leaves
+ * @average_depth: the average number of nodes above a leaf
+ * @max_depth: the largest number of nodes above a leaf
+ * @n_compressed: the number of nodes with a compressed path
+ * @n_prefix_overflows: the number of compressed paths too long to be
+ *   stored in their node, which must be read from a leaf
+ * @fill_node4: the ratio of used child slots in 4-children nodes
+ * @fill_node16: the ratio of used child slots in 16-children nodes
+ * @fill_node32: the ratio of used child slots in 32-children nodes
+ * @fill_node48: the ratio of used child slots in 48-children nodes
+ * @fill_node256: the ratio of used child slots in 256-children nodes
+ *
+ * The shape of a #GwRadixTree, as reported by gw_radix_tree_get_stats().
+ */
+typedef struct
+{
+  guint64             n_node4;
+  guint64             n_node16;
+  guint64             n_node32;
+  guint64             n_node48;
+  guint64             n_node256;
+  guint64             n_leaves;
+  guint64             n_embedded;
+  guint64             total_bytes;
+  gdouble             average_depth;
+  guint               max_depth;
+  guint64             n_compressed;
+  guint64             n_prefix_overflows;
+  gdouble             fill_node4;
+  gdouble             fill_node16;
+  gdouble             fill_node32;
+  gdouble             fill_node48;
+  gdouble             fill_node256;
+} GwRadixTreeStats;
+
 /**
  * Returns %TRUE to stop, %FALSE to continue.
  */
@@ -38,18 +96,63 @@ typedef gboolean     (*RadixTreeCb)                               (const gchar
                                                                    gpointer           value,
                                                                    gpointer           user_data);
 
+/**
+ * Returns the new value of a key, given its current value, or %NULL
+ * when @found is %FALSE.
+ */
+typedef gpointer     (*RadixTreeUpdateCb)                         (gpointer           value,
+                                                                   gboolean           found,
+                                                                   gpointer           user_data);
+
+/**
+ * Returns the result of a key, as collected by gw_radix_tree_map_parallel().
+ */
+typedef gpointer     (*RadixTreeMapCb)                            (const gchar       *key,
+                                                                   gsize              key_length,
+                                                                   gpointer           value,
+                                                                   gpointer           user_data);
+
 GType                gw_radix_tree_get_type                      (void) G_GNUC_CONST;
 
 GwRadixTree*         gw_radix_tree_new                           (void);
 
+GwRadixTree*         gw_radix_tree_new_set                       (void);
+
 GwRadixTree*         gw_radix_tree_copy                          (GwRadixTree        *self);
 
+GwRadixTree*         gw_radix_tree_union                         (GwRadixTree        *a,
+                                                                  GwRadixTree        *b);
+
+GwRadixTree*         gw_radix_tree_intersect                     (GwRadixTree        *a,
+                                                                  GwRadixTree        *b);
+
+GwRadixTree*         gw_radix_tree_difference                    (GwRadixTree        *a,
+                                                                  GwRadixTree        *b);
+
 GwRadixTree*         gw_radix_tree_ref                           (GwRadixTree        *self);
 
 void                 gw_radix_tree_unref                         (GwRadixTree        *self);
 
 GwRadixTree*         gw_radix_tree_new_with_free_func            (GDestroyNotify      destroy_func);
 
+GwRadixTree*         gw_radix_tree_new_with_arena                (GDestroyNotify      destroy_func);
+
+GwRadixTree*         gw_radix_tree_new_compact                   (GDestroyNotify      destroy_func);
+
+GwRadixTree*         gw_radix_tree_new_from_sorted               (const gchar * const *keys,
+                                                                  const gsize        *key_lengths,
+                                                                  gpointer           *values,
+                                                                  gsize               n_keys,
+                                                                  GDestroyNotify      destroy_func);
+
+GwRadixTree*         gw_radix_tree_new_from_keys                 (const gchar * const *keys,
+                                                                  const gsize        *key_lengths,
+                                                                  gpointer           *values,
+                                                                  gsize               n_keys,
+                                                                  GDestroyNotify      destroy_func);
+
+GwRadixTree*         gw_radix_tree_new_concurrent                (GDestroyNotify      destroy_func);
+
 gboolean             gw_radix_tree_contains                      (GwRadixTree        *tree,
                                                                   const gchar        *key,
                                                                   gsize               key_length);
@@ -59,23 +162,152 @@ gpointer             gw_radix_tree_lookup                        (GwRadixTree
                                                                   gsize               key_length,
                                                                   gboolean           *found);
 
+void                 gw_radix_tree_lookup_many                   (GwRadixTree        *tree,
+                                                                  const gchar * const *keys,
+                                                                  const gsize        *key_lengths,
+                                                                  gsize               n_keys,
+                                                                  gpointer           *values,
+                                                                  gboolean           *found);
+
+gboolean             gw_radix_tree_longest_prefix                (GwRadixTree        *tree,
+                                                                  const gchar        *key,
+                                                                  gsize               key_length,
+                                                                  gsize              *prefix_length,
+                                                                  gpointer           *value);
+
 gboolean             gw_radix_tree_insert                        (GwRadixTree        *tree,
                                                                   const gchar        *key,
                                                                   gsize               key_length,
                                                                   gpointer            value);
 
+gboolean             gw_radix_tree_upsert                        (GwRadixTree        *tree,
+                                                                  const gchar        *key,
+                                                                  gsize               key_length,
+                                                                  RadixTreeUpdateCb   update,
+                                                                  gpointer            user_data);
+
+gboolean             gw_radix_tree_insert_uint64                 (GwRadixTree        *tree,
+                                                                  const gchar        *key,
+                                                                  gsize               key_length,
+                                                                  guint64             value);
+
+guint64              gw_radix_tree_lookup_uint64                 (GwRadixTree        *tree,
+                                                                  const gchar        *key,
+                                                                  gsize               key_length,
+                                                                  gboolean           *found);
+
+guint64              gw_radix_tree_add_uint64                    (GwRadixTree        *tree,
+                                                                  const gchar        *key,
+                                                                  gsize               key_length,
+                                                                  guint64             delta);
+
+gboolean             gw_radix_tree_compare_exchange_uint64       (GwRadixTree        *tree,
+                                                                  const gchar        *key,
+                                                                  gsize               key_length,
+                                                                  guint64            *expected,
+                                                                  guint64             desired);
+
 void                 gw_radix_tree_clear                         (GwRadixTree        *tree);
 
+gboolean             gw_radix_tree_freeze                        (GwRadixTree        *tree);
+
 gint                 gw_radix_tree_get_size                      (GwRadixTree        *tree);
 
+void                 gw_radix_tree_enable_counts                 (GwRadixTree        *tree);
+
+void                 gw_radix_tree_enable_uint64_values          (GwRadixTree        *tree);
+
+guint64              gw_radix_tree_count_prefix                  (GwRadixTree        *tree,
+                                                                  const gchar        *prefix,
+                                                                  gsize               prefix_length);
+
+guint64              gw_radix_tree_rank                          (GwRadixTree        *tree,
+                                                                  const gchar        *key,
+                                                                  gsize               key_length);
+
+gchar*               gw_radix_tree_select                        (GwRadixTree        *tree,
+                                                                  guint64             index,
+                                                                  gpointer           *value);
+
+void                 gw_radix_tree_get_stats                     (GwRadixTree        *tree,
+                                                                  GwRadixTreeStats   *stats);
+
 gboolean             gw_radix_tree_iter                          (GwRadixTree        *tree,
                                                                   RadixTreeCb         callback,
                                                                   gpointer            user_data);
 
+gboolean             gw_radix_tree_iter_prefix                   (GwRadixTree        *tree,
+                                                                  const gchar        *prefix,
+                                                                  gsize               prefix_length,
+                                                                  RadixTreeCb         callback,
+                                                                  gpointer            user_data);
+
+gboolean             gw_radix_tree_iter_prefixes_of              (GwRadixTree        *tree,
+                                                                  const gchar        *key,
+                                                                  gsize               key_length,
+                                                                  RadixTreeCb         callback,
+                                                                  gpointer            user_data);
+
+gboolean             gw_radix_tree_iter_reverse                  (GwRadixTree        *tree,
+                                                                  RadixTreeCb         callback,
+                                                                  gpointer            user_data);
+
+gboolean             gw_radix_tree_iter_reverse_from             (GwRadixTree        *tree,
+                                                                  const gchar        *key,
+                                                                  gsize               key_length,
+                                                                  RadixTreeCb         callback,
+                                                                  gpointer            user_data);
+
+gboolean             gw_radix_tree_foreach_parallel              (GwRadixTree        *tree,
+                                                                  RadixTreeCb         callback,
+                                                                  gpointer            user_data);
+
+GPtrArray*           gw_radix_tree_map_parallel                  (GwRadixTree        *tree,
+                                                                  RadixTreeMapCb      map,
+                                                                  gpointer            user_data);
+
+void                 gw_radix_tree_iter_init                     (GwRadixTreeIter    *iter,
+                                                                  GwRadixTree        *tree);
+
+gboolean             gw_radix_tree_iter_seek                     (GwRadixTreeIter    *iter,
+                                                                  const gchar        *key,
+                                                                  gsize               key_length);
+
+gboolean             gw_radix_tree_iter_next                     (GwRadixTreeIter    *iter,
+                                                                  const gchar       **key,
+                                                                  gsize              *key_length,
+                                                                  gpointer           *value);
+
+gboolean             gw_radix_tree_iter_prev                     (GwRadixTreeIter    *iter,
+                                                                  const gchar       **key,
+                                                                  gsize              *key_length,
+                                                                  gpointer           *value);
+
 GStrv                gw_radix_tree_get_keys                      (GwRadixTree        *tree);
 
+GStrv                gw_radix_tree_get_keys_with_prefix          (GwRadixTree        *tree,
+                                                                  const gchar        *prefix,
+                                                                  gsize               prefix_length);
+
 GPtrArray*           gw_radix_tree_get_values                    (GwRadixTree        *tree);
 
+GBytes*              gw_radix_tree_export_packed                 (GwRadixTree        *tree,
+                                                                  guint32           **offsets,
+                                                                  gpointer          **values);
+
+gboolean             gw_radix_tree_fuzzy_search                  (GwRadixTree        *tree,
+                                                                  const gchar        *word,
+                                                                  gsize               word_length,
+                                                                  guint               max_distance,
+                                                                  RadixTreeCb         callback,
+                                                                  gpointer            user_data);
+
+gboolean             gw_radix_tree_match_pattern                 (GwRadixTree        *tree,
+                                                                  const gchar        *pattern,
+                                                                  gsize               pattern_length,
+                                                                  RadixTreeCb         callback,
+                                                                  gpointer            user_data);
+
 void                 gw_radix_tree_remove                        (GwRadixTree        *tree,
                                                                   const gchar        *key,
                                                                   gsize               key_length);
@@ -84,6 +316,16 @@ void                 gw_radix_tree_steal                         (GwRadixTree
                                                                   const gchar        *key,
                                                                   gsize               key_length);
 
+guint64              gw_radix_tree_remove_prefix                 (GwRadixTree        *tree,
+                                                                  const gchar        *prefix,
+                                                                  gsize               prefix_length);
+
+guint64              gw_radix_tree_remove_range                  (GwRadixTree        *tree,
+                                                                  const gchar        *from,
+                                                                  gsize               from_length,
+                                                                  const gchar        *to,
+                                                                  gsize               to_length);
+
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (GwRadixTree, gw_radix_tree_unref)
 
@@ -16,6 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "config.h"
 #include "gwords.h"
 
 #include <time.h>
@@ -241,6 +242,2429 @@ radix_tree_get_values (void)
 
 /**************************************************************************************************/
 
+static gboolean
+prefix_iter_cb (const gchar *key,
+                gsize        key_length,
+                gpointer     value,
+                gpointer     user_data)
+{
+  guint *n_keys = user_data;
+
+  g_assert_true (g_str_has_prefix (key, "inter"));
+
+  (*n_keys)++;
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+static void
+radix_tree_prefix (void)
+{
+  g_autoptr (GwRadixTree) tree;
+  GStrv keys;
+  guint n_keys;
+  gint i;
+
+  const gchar* entries[] = {
+    "inter",
+    "interact",
+    "interaction",
+    "internationalization",
+    "internationalize",
+    "internet",
+    "interval",
+    "into",
+    "in",
+    "planet",
+    "plan",
+  };
+
+  tree = gw_radix_tree_new ();
+
+  for (i = 0; i < G_N_ELEMENTS (entries); i++)
+    gw_radix_tree_insert (tree, entries[i], -1, NULL);
+
+  n_keys = 0;
+  gw_radix_tree_iter_prefix (tree, "inter", -1, prefix_iter_cb, &n_keys);
+  g_assert_cmpuint (n_keys, ==, 7);
+
+  /* Prefixes ending inside a compressed path */
+  keys = gw_radix_tree_get_keys_with_prefix (tree, "internation", -1);
+  g_assert_cmpuint (g_strv_length (keys), ==, 2);
+  g_clear_pointer (&keys, g_strfreev);
+
+  keys = gw_radix_tree_get_keys_with_prefix (tree, "internationaliz", -1);
+  g_assert_cmpuint (g_strv_length (keys), ==, 2);
+  g_clear_pointer (&keys, g_strfreev);
+
+  keys = gw_radix_tree_get_keys_with_prefix (tree, "internationalizx", -1);
+  g_assert_cmpuint (g_strv_length (keys), ==, 0);
+  g_clear_pointer (&keys, g_strfreev);
+
+  keys = gw_radix_tree_get_keys_with_prefix (tree, "pla", -1);
+  g_assert_cmpuint (g_strv_length (keys), ==, 2);
+  g_clear_pointer (&keys, g_strfreev);
+
+  keys = gw_radix_tree_get_keys_with_prefix (tree, "planets", -1);
+  g_assert_cmpuint (g_strv_length (keys), ==, 0);
+  g_clear_pointer (&keys, g_strfreev);
+
+  keys = gw_radix_tree_get_keys_with_prefix (tree, "interaction", 2);
+  g_assert_cmpuint (g_strv_length (keys), ==, 9);
+  g_clear_pointer (&keys, g_strfreev);
+
+  keys = gw_radix_tree_get_keys_with_prefix (tree, "", -1);
+  g_assert_cmpuint (g_strv_length (keys), ==, G_N_ELEMENTS (entries));
+  g_clear_pointer (&keys, g_strfreev);
+}
+
+/**************************************************************************************************/
+
+static void
+radix_tree_cursor (void)
+{
+  g_autoptr (GwRadixTree) tree;
+  GwRadixTreeIter iter;
+  const gchar *key;
+  gsize key_length;
+  gint i;
+
+  const gchar* entries[] = {
+    "mab",
+    "mac",
+    "macabre",
+    "macaroni",
+    "machine",
+    "mad",
+    "madam",
+    "zebra",
+    "ção",
+  };
+
+  tree = gw_radix_tree_new ();
+
+  for (i = G_N_ELEMENTS (entries) - 1; i >= 0; i--)
+    gw_radix_tree_insert (tree, entries[i], -1, GINT_TO_POINTER (i));
+
+  /* Full scans in both directions */
+  gw_radix_tree_iter_init (&iter, tree);
+
+  for (i = 0; i < G_N_ELEMENTS (entries); i++)
+    {
+      gpointer value;
+
+      g_assert_true (gw_radix_tree_iter_next (&iter, &key, &key_length, &value));
+      g_assert_cmpstr (key, ==, entries[i]);
+      g_assert_cmpuint (key_length, ==, strlen (entries[i]));
+      g_assert_cmpint (GPOINTER_TO_INT (value), ==, i);
+    }
+
+  g_assert_false (gw_radix_tree_iter_next (&iter, &key, NULL, NULL));
+
+  for (i = G_N_ELEMENTS (entries) - 1; i >= 0; i--)
+    {
+      g_assert_true (gw_radix_tree_iter_prev (&iter, &key, NULL, NULL));
+      g_assert_cmpstr (key, ==, entries[i]);
+    }
+
+  g_assert_false (gw_radix_tree_iter_prev (&iter, &key, NULL, NULL));
+
+  /* Range scan between "mac" and "mad" */
+  g_assert_true (gw_radix_tree_iter_seek (&iter, "mac", -1));
+
+  for (i = 1; gw_radix_tree_iter_next (&iter, &key, NULL, NULL) && strcmp (key, "mad") < 0; i++)
+    g_assert_cmpstr (key, ==, entries[i]);
+
+  g_assert_cmpint (i, ==, 5);
+
+  /* Lower bound of a missing key */
+  g_assert_false (gw_radix_tree_iter_seek (&iter, "macb", -1));
+  g_assert_true (gw_radix_tree_iter_next (&iter, &key, NULL, NULL));
+  g_assert_cmpstr (key, ==, "machine");
+
+  g_assert_false (gw_radix_tree_iter_seek (&iter, "macb", -1));
+  g_assert_true (gw_radix_tree_iter_prev (&iter, &key, NULL, NULL));
+  g_assert_cmpstr (key, ==, "macaroni");
+
+  /* Past the end */
+  g_assert_false (gw_radix_tree_iter_seek (&iter, "ção!", -1));
+  g_assert_false (gw_radix_tree_iter_next (&iter, &key, NULL, NULL));
+
+  g_assert_false (gw_radix_tree_iter_seek (&iter, "ção!", -1));
+  g_assert_true (gw_radix_tree_iter_prev (&iter, &key, NULL, NULL));
+  g_assert_cmpstr (key, ==, "ção");
+}
+
+/**************************************************************************************************/
+
+static void
+count_destroy_cb (gpointer data)
+{
+  (*(guint*) data)++;
+}
+
+static gpointer
+unref_thread (gpointer data)
+{
+  gw_radix_tree_unref (data);
+
+  return NULL;
+}
+
+static void
+radix_tree_arena (void)
+{
+  g_autoptr (GwRadixTree) tree;
+  gchar key[20] = { '\0', };
+  guint n_destroyed;
+  gint i, j;
+
+  n_destroyed = 0;
+  tree = gw_radix_tree_new_with_arena (count_destroy_cb);
+
+  for (i = 0; i < 10000; i++)
+    {
+      g_snprintf (key, 20, "test%d", i);
+      gw_radix_tree_insert (tree, key, -1, &n_destroyed);
+    }
+
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, 10000);
+
+  /* Shrink nodes down, and grow them back from the free lists */
+  for (i = 0; i < 10000; i += 2)
+    {
+      g_snprintf (key, 20, "test%d", i);
+      gw_radix_tree_remove (tree, key, -1);
+    }
+
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, 5000);
+  g_assert_cmpuint (n_destroyed, ==, 5000);
+
+  for (i = 0; i < 10000; i++)
+    {
+      g_snprintf (key, 20, "test%d", i);
+      g_assert_true (gw_radix_tree_contains (tree, key, -1) == (i % 2 == 1));
+    }
+
+  for (i = 0; i < 10000; i += 2)
+    {
+      g_snprintf (key, 20, "test%d", i);
+      gw_radix_tree_insert (tree, key, -1, NULL);
+    }
+
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, 10000);
+
+  gw_radix_tree_clear (tree);
+
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, 0);
+  g_assert_cmpuint (n_destroyed, ==, 10000);
+  g_assert_false (gw_radix_tree_contains (tree, "test1", -1));
+
+  gw_radix_tree_insert (tree, "test1", -1, NULL);
+  g_assert_true (gw_radix_tree_contains (tree, "test1", -1));
+
+  /* Copies share the arena, and can be dropped while the tree allocates */
+  for (i = 0; i < 100; i++)
+    {
+      GThread *thread;
+
+      thread = g_thread_new ("unref", unref_thread, gw_radix_tree_copy (tree));
+
+      for (j = 0; j < 100; j++)
+        {
+          g_snprintf (key, 20, "copy%d", i * 100 + j);
+          gw_radix_tree_insert (tree, key, -1, NULL);
+        }
+
+      g_thread_join (thread);
+    }
+
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, 10001);
+}
+
+/**************************************************************************************************/
+
+static void
+radix_tree_copy (void)
+{
+  g_autoptr (GwRadixTree) tree;
+  g_autoptr (GwRadixTree) copy;
+  gchar key[20] = { '\0', };
+  guint n_destroyed;
+  gint i;
+
+  n_destroyed = 0;
+  tree = gw_radix_tree_new_with_free_func (count_destroy_cb);
+
+  for (i = 0; i < 1000; i++)
+    {
+      g_snprintf (key, 20, "test%d", i);
+      gw_radix_tree_insert (tree, key, -1, &n_destroyed);
+    }
+
+  copy = gw_radix_tree_copy (tree);
+
+  g_assert_cmpint (gw_radix_tree_get_size (copy), ==, 1000);
+
+  /* Changes to the original tree don't leak into the copy */
+  for (i = 0; i < 1000; i += 2)
+    {
+      g_snprintf (key, 20, "test%d", i);
+      gw_radix_tree_remove (tree, key, -1);
+    }
+
+  gw_radix_tree_insert (tree, "test1", -1, NULL);
+  gw_radix_tree_insert (tree, "test1000", -1, NULL);
+
+  /* Values are still alive in the copy */
+  g_assert_cmpuint (n_destroyed, ==, 0);
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, 501);
+
+  for (i = 0; i < 1000; i++)
+    {
+      gpointer value;
+      gboolean found;
+
+      g_snprintf (key, 20, "test%d", i);
+
+      value = gw_radix_tree_lookup (copy, key, -1, &found);
+      g_assert_true (found);
+      g_assert_true (value == &n_destroyed);
+
+      value = gw_radix_tree_lookup (tree, key, -1, &found);
+      g_assert_true (found == (i % 2 == 1));
+      g_assert_true (value == (i == 1 || !found ? NULL : &n_destroyed));
+    }
+
+  g_assert_false (gw_radix_tree_contains (copy, "test1000", -1));
+
+  /* The values are destroyed once the last tree drops them */
+  gw_radix_tree_clear (copy);
+  g_assert_cmpuint (n_destroyed, ==, 501);
+
+  gw_radix_tree_clear (tree);
+  g_assert_cmpuint (n_destroyed, ==, 1000);
+}
+
+/**************************************************************************************************/
+
+static void
+count_destroy_atomic_cb (gpointer data)
+{
+  g_atomic_int_inc ((gint*) data);
+}
+
+static gpointer
+concurrent_reader_thread (gpointer data)
+{
+  GwRadixTree *tree = data;
+  gchar key[20] = { '\0', };
+  gint i, pass;
+
+  for (pass = 0; pass < 20; pass++)
+    {
+      for (i = 0; i < 1000; i++)
+        {
+          g_snprintf (key, 20, "test%d", i);
+          g_assert_true (gw_radix_tree_contains (tree, key, -1));
+
+          /* Keys being inserted and removed by the writers */
+          g_snprintf (key, 20, "%d-%d", pass % 4, i);
+          gw_radix_tree_contains (tree, key, -1);
+        }
+    }
+
+  return NULL;
+}
+
+static gpointer
+concurrent_writer_thread (gpointer data)
+{
+  GwRadixTree *tree = ((gpointer*) data)[0];
+  gint writer = GPOINTER_TO_INT (((gpointer*) data)[1]);
+  gint *n_destroyed = ((gpointer*) data)[2];
+  gchar key[20] = { '\0', };
+  gint i;
+
+  for (i = 0; i < 2000; i++)
+    {
+      g_snprintf (key, 20, "%d-%d", writer, i);
+      g_assert_true (gw_radix_tree_insert (tree, key, -1, n_destroyed));
+    }
+
+  for (i = 0; i < 2000; i += 2)
+    {
+      g_snprintf (key, 20, "%d-%d", writer, i);
+      gw_radix_tree_remove (tree, key, -1);
+    }
+
+  return NULL;
+}
+
+static void
+radix_tree_concurrent (void)
+{
+  g_autoptr (GwRadixTree) tree;
+  gpointer writer_data[4][3];
+  GThread *threads[8];
+  gchar key[20] = { '\0', };
+  gint n_destroyed;
+  gint i;
+
+  n_destroyed = 0;
+  tree = gw_radix_tree_new_concurrent (count_destroy_atomic_cb);
+
+  for (i = 0; i < 1000; i++)
+    {
+      g_snprintf (key, 20, "test%d", i);
+      gw_radix_tree_insert (tree, key, -1, NULL);
+    }
+
+  for (i = 0; i < 4; i++)
+    {
+      writer_data[i][0] = tree;
+      writer_data[i][1] = GINT_TO_POINTER (i);
+      writer_data[i][2] = &n_destroyed;
+
+      threads[i] = g_thread_new ("writer", concurrent_writer_thread, writer_data[i]);
+      threads[i + 4] = g_thread_new ("reader", concurrent_reader_thread, tree);
+    }
+
+  for (i = 0; i < 8; i++)
+    g_thread_join (threads[i]);
+
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, 1000 + 4 * 1000);
+
+  for (i = 0; i < 2000; i++)
+    {
+      g_snprintf (key, 20, "3-%d", i);
+      g_assert_true (gw_radix_tree_contains (tree, key, -1) == (i % 2 == 1));
+    }
+
+  /* Removed values are destroyed at the latest when the tree is cleared */
+  gw_radix_tree_clear (tree);
+
+  g_assert_cmpint (n_destroyed, ==, 4 * 2000);
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, 0);
+
+  gw_radix_tree_insert (tree, "test1", -1, NULL);
+  g_assert_true (gw_radix_tree_contains (tree, "test1", -1));
+}
+
+/**************************************************************************************************/
+
+static gint
+compare_keys (gconstpointer a,
+              gconstpointer b)
+{
+  return strcmp (*(const gchar**) a, *(const gchar**) b);
+}
+
+static void
+radix_tree_from_sorted (void)
+{
+  g_autoptr (GwRadixTree) inserted;
+  g_autoptr (GwRadixTree) tree;
+  g_autoptr (GwRadixTree) nul_inserted;
+  g_autoptr (GwRadixTree) nul_tree;
+  g_autoptr (GPtrArray) keys;
+  g_autofree gpointer *values;
+  GwRadixTreeIter iter, inserted_iter;
+  const gchar *key, *inserted_key;
+  const gchar *nul_keys[] = { "a", "a\0" };
+  const gsize nul_key_lengths[] = { 1, 2 };
+  gsize key_length;
+  gpointer value;
+  guint i;
+
+  keys = g_ptr_array_new_with_free_func (g_free);
+  inserted = gw_radix_tree_new ();
+
+  /* Short keys, long shared prefixes, and every possible first byte */
+  g_ptr_array_add (keys, g_strdup (""));
+
+  for (i = 1; i < 256; i++)
+    g_ptr_array_add (keys, g_strdup_printf ("%c", i));
+
+  for (i = 0; i < 10000; i++)
+    g_ptr_array_add (keys, g_strdup_printf ("test%d", i));
+
+  for (i = 0; i < 20; i++)
+    g_ptr_array_add (keys, g_strdup_printf ("internationalization%d", i));
+
+  g_ptr_array_sort (keys, (GCompareFunc) compare_keys);
+
+  values = g_new (gpointer, keys->len);
+
+  for (i = 0; i < keys->len; i++)
+    {
+      values[i] = GUINT_TO_POINTER (i + 1);
+      gw_radix_tree_insert (inserted, g_ptr_array_index (keys, i), -1, values[i]);
+    }
+
+  tree = gw_radix_tree_new_from_sorted ((const gchar * const *) keys->pdata,
+                                        NULL,
+                                        values,
+                                        keys->len,
+                                        NULL);
+
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, keys->len);
+
+  /* Both trees hold the same keys, in the same order */
+  gw_radix_tree_iter_init (&iter, tree);
+  gw_radix_tree_iter_init (&inserted_iter, inserted);
+
+  while (gw_radix_tree_iter_next (&iter, &key, NULL, &value))
+    {
+      gpointer inserted_value;
+
+      g_assert_true (gw_radix_tree_iter_next (&inserted_iter, &inserted_key, NULL, &inserted_value));
+      g_assert_cmpstr (key, ==, inserted_key);
+      g_assert_true (value == inserted_value);
+    }
+
+  g_assert_false (gw_radix_tree_iter_next (&inserted_iter, NULL, NULL, NULL));
+
+  for (i = 0; i < keys->len; i++)
+    g_assert_true (gw_radix_tree_contains (tree, g_ptr_array_index (keys, i), -1));
+
+  g_assert_false (gw_radix_tree_contains (tree, "test", -1));
+  g_assert_false (gw_radix_tree_contains (tree, "internationalization", -1));
+
+  /* The tree can be modified afterwards */
+  gw_radix_tree_insert (tree, "internationalization", -1, NULL);
+  gw_radix_tree_remove (tree, "test1", -1);
+
+  g_assert_true (gw_radix_tree_contains (tree, "internationalization", -1));
+  g_assert_false (gw_radix_tree_contains (tree, "test1", -1));
+  g_assert_true (gw_radix_tree_contains (tree, "test10", -1));
+
+  /* A key can end where the next one goes on with a NUL byte */
+  nul_inserted = gw_radix_tree_new ();
+  gw_radix_tree_insert (nul_inserted, nul_keys[0], nul_key_lengths[0], NULL);
+  gw_radix_tree_insert (nul_inserted, nul_keys[1], nul_key_lengths[1], NULL);
+
+  nul_tree = gw_radix_tree_new_from_sorted (nul_keys, nul_key_lengths, NULL, 2, NULL);
+
+  g_assert_cmpint (gw_radix_tree_get_size (nul_tree), ==, gw_radix_tree_get_size (nul_inserted));
+  g_assert_true (gw_radix_tree_contains (nul_tree, "a", 1));
+
+  gw_radix_tree_iter_init (&iter, nul_tree);
+
+  for (i = 0; i < G_N_ELEMENTS (nul_keys); i++)
+    {
+      g_assert_true (gw_radix_tree_iter_next (&iter, &key, &key_length, NULL));
+      g_assert_cmpuint (key_length, ==, nul_key_lengths[i]);
+      g_assert_true (memcmp (key, nul_keys[i], key_length) == 0);
+    }
+
+  g_assert_false (gw_radix_tree_iter_next (&iter, NULL, NULL, NULL));
+}
+
+/**************************************************************************************************/
+
+static void
+radix_tree_from_keys (void)
+{
+  g_autoptr (GwRadixTree) inserted;
+  g_autoptr (GwRadixTree) tree;
+  g_autoptr (GPtrArray) keys;
+  GwRadixTreeIter iter, inserted_iter;
+  const gchar *key, *inserted_key;
+  const gchar *nul_keys[] = { "b", "a", "a\0" };
+  const gsize nul_key_lengths[] = { 1, 1, 2 };
+  gpointer value, inserted_value;
+  guint i;
+
+  keys = g_ptr_array_new_with_free_func (g_free);
+  inserted = gw_radix_tree_new ();
+
+  /* Enough keys to be built in parallel, in no particular order, with duplicates */
+  for (i = 0; i < 20000; i++)
+    g_ptr_array_add (keys, g_strdup_printf ("%c%u", "abcdefghij"[(i * 7) % 10], (i * 7919) % 15000));
+
+  g_ptr_array_add (keys, g_strdup ("z"));
+
+  for (i = 0; i < keys->len; i++)
+    gw_radix_tree_insert (inserted, g_ptr_array_index (keys, i), -1, GUINT_TO_POINTER (i + 1));
+
+  tree = gw_radix_tree_new_from_keys ((const gchar * const *) keys->pdata,
+                                      NULL,
+                                      (gpointer*) keys->pdata,
+                                      keys->len,
+                                      NULL);
+
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, gw_radix_tree_get_size (inserted));
+
+  gw_radix_tree_iter_init (&iter, tree);
+  gw_radix_tree_iter_init (&inserted_iter, inserted);
+
+  while (gw_radix_tree_iter_next (&iter, &key, NULL, &value))
+    {
+      g_assert_true (gw_radix_tree_iter_next (&inserted_iter, &inserted_key, NULL, &inserted_value));
+      g_assert_cmpstr (key, ==, inserted_key);
+
+      /* The last duplicate wins */
+      g_assert_true (value == g_ptr_array_index (keys, GPOINTER_TO_UINT (inserted_value) - 1));
+    }
+
+  g_assert_false (gw_radix_tree_iter_next (&inserted_iter, NULL, NULL, NULL));
+
+  /* Few keys are built in place */
+  g_clear_pointer (&tree, gw_radix_tree_unref);
+  tree = gw_radix_tree_new_from_keys ((const gchar * const *) keys->pdata, NULL, NULL, 3, NULL);
+
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, 3);
+
+  for (i = 0; i < 3; i++)
+    g_assert_true (gw_radix_tree_contains (tree, g_ptr_array_index (keys, i), -1));
+
+  g_assert_false (gw_radix_tree_contains (tree, "z", -1));
+
+  /* Keys with explicit lengths can go on with a NUL byte */
+  g_clear_pointer (&tree, gw_radix_tree_unref);
+  tree = gw_radix_tree_new_from_keys (nul_keys, nul_key_lengths, NULL, G_N_ELEMENTS (nul_keys), NULL);
+
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, 3);
+  g_assert_true (gw_radix_tree_contains (tree, "a", 1));
+  g_assert_true (gw_radix_tree_contains (tree, "b", 1));
+}
+
+/**************************************************************************************************/
+
+static void
+radix_tree_lookup_many (void)
+{
+  g_autoptr (GwRadixTree) tree;
+  g_autoptr (GPtrArray) keys;
+  g_autofree gboolean *found;
+  g_autofree gpointer *values;
+  g_autofree gsize *lengths;
+  guint i;
+
+  tree = gw_radix_tree_new ();
+  keys = g_ptr_array_new_with_free_func (g_free);
+
+  for (i = 0; i < 10000; i++)
+    {
+      gchar *key = g_strdup_printf ("test%u", i);
+
+      /* Every third key is missing */
+      if (i % 3 != 0)
+        gw_radix_tree_insert (tree, key, -1, GUINT_TO_POINTER (i + 1));
+
+      g_ptr_array_add (keys, key);
+    }
+
+  g_ptr_array_add (keys, g_strdup ("test"));
+  g_ptr_array_add (keys, g_strdup (""));
+
+  found = g_new (gboolean, keys->len);
+  values = g_new (gpointer, keys->len);
+  lengths = g_new (gsize, keys->len);
+
+  gw_radix_tree_lookup_many (tree,
+                             (const gchar * const *) keys->pdata,
+                             NULL,
+                             keys->len,
+                             values,
+                             found);
+
+  for (i = 0; i < 10000; i++)
+    {
+      g_assert_true (found[i] == (i % 3 != 0));
+      g_assert_true (values[i] == (found[i] ? GUINT_TO_POINTER (i + 1) : NULL));
+    }
+
+  g_assert_false (found[10000]);
+  g_assert_false (found[10001]);
+
+  /* Explicit lengths only look at a prefix of each key */
+  for (i = 0; i < keys->len; i++)
+    lengths[i] = MIN (strlen (g_ptr_array_index (keys, i)), 5);
+
+  gw_radix_tree_lookup_many (tree,
+                             (const gchar * const *) keys->pdata,
+                             lengths,
+                             keys->len,
+                             NULL,
+                             found);
+
+  for (i = 0; i < keys->len; i++)
+    g_assert_true (found[i] == gw_radix_tree_contains (tree, g_ptr_array_index (keys, i), lengths[i]));
+}
+
+/**************************************************************************************************/
+
+static guint
+reference_distance (const gchar *a,
+                    const gchar *b)
+{
+  g_autofree gunichar *s = NULL;
+  g_autofree gunichar *t = NULL;
+  g_autofree guint *row = NULL;
+  glong s_len, t_len, i, j;
+
+  s = g_utf8_to_ucs4_fast (a, -1, &s_len);
+  t = g_utf8_to_ucs4_fast (b, -1, &t_len);
+  row = g_new (guint, t_len + 1);
+
+  for (j = 0; j <= t_len; j++)
+    row[j] = j;
+
+  for (i = 1; i <= s_len; i++)
+    {
+      guint diagonal = row[0];
+
+      row[0] = i;
+
+      for (j = 1; j <= t_len; j++)
+        {
+          guint above = row[j];
+
+          row[j] = MIN (MIN (row[j], row[j - 1]) + 1, diagonal + (s[i - 1] == t[j - 1] ? 0 : 1));
+          diagonal = above;
+        }
+    }
+
+  return row[t_len];
+}
+
+static gboolean
+fuzzy_search_cb (const gchar *key,
+                 gsize        key_length,
+                 gpointer     value,
+                 gpointer     user_data)
+{
+  g_ptr_array_add (user_data, g_strndup (key, key_length));
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+static gboolean
+fuzzy_search_stop_cb (const gchar *key,
+                      gsize        key_length,
+                      gpointer     value,
+                      gpointer     user_data)
+{
+  fuzzy_search_cb (key, key_length, value, user_data);
+
+  return GW_RADIX_TREE_ITER_STOP;
+}
+
+static void
+radix_tree_fuzzy_search (void)
+{
+  g_autoptr (GwRadixTree) tree;
+  g_autoptr (GPtrArray) keys;
+  g_autoptr (GPtrArray) result;
+  guint i, j, distance;
+
+  const gchar* entries[] = {
+    "internationalisation",
+    "internationalization",
+    "internationally",
+    "music",
+    "musical",
+    "Tiếng Việt",
+    "Tiếng Viet",
+    "子犬",
+    "中文",
+    "",
+    NULL
+  };
+
+  const gchar* words[] = {
+    "test123",
+    "tset12",
+    "internationalisatoin",
+    "musik",
+    "Tieng Viet",
+    "子",
+    "",
+    NULL
+  };
+
+  tree = gw_radix_tree_new ();
+  keys = g_ptr_array_new_with_free_func (g_free);
+  result = g_ptr_array_new_with_free_func (g_free);
+
+  for (i = 0; i < 2000; i++)
+    g_ptr_array_add (keys, g_strdup_printf ("test%u", i));
+
+  for (i = 0; entries[i]; i++)
+    g_ptr_array_add (keys, g_strdup (entries[i]));
+
+  for (i = 0; i < keys->len; i++)
+    gw_radix_tree_insert (tree, g_ptr_array_index (keys, i), -1, NULL);
+
+  for (i = 0; words[i]; i++)
+    {
+      for (distance = 0; distance <= 3; distance++)
+        {
+          guint n_expected = 0;
+
+          g_ptr_array_set_size (result, 0);
+          gw_radix_tree_fuzzy_search (tree, words[i], -1, distance, fuzzy_search_cb, result);
+
+          for (j = 0; j < keys->len; j++)
+            {
+              if (reference_distance (words[i], g_ptr_array_index (keys, j)) <= distance)
+                n_expected++;
+            }
+
+          g_assert_cmpuint (result->len, ==, n_expected);
+
+          for (j = 0; j < result->len; j++)
+            g_assert_cmpuint (reference_distance (words[i], g_ptr_array_index (result, j)), <=, distance);
+
+          /* Keys are visited in order */
+          for (j = 1; j < result->len; j++)
+            g_assert_cmpint (strcmp (g_ptr_array_index (result, j - 1), g_ptr_array_index (result, j)), <, 0);
+        }
+    }
+
+  /* Stopping the search */
+  g_ptr_array_set_size (result, 0);
+
+  g_assert_true (gw_radix_tree_fuzzy_search (tree, "test1", -1, 1, fuzzy_search_stop_cb, result));
+  g_assert_cmpuint (result->len, ==, 1);
+}
+
+/**************************************************************************************************/
+
+static void
+radix_tree_stats (void)
+{
+  g_autoptr (GwRadixTree) tree;
+  GwRadixTreeStats stats;
+  gchar key[20];
+  guint i;
+
+  tree = gw_radix_tree_new ();
+
+  gw_radix_tree_get_stats (tree, &stats);
+  g_assert_cmpuint (stats.n_leaves, ==, 0);
+  g_assert_cmpuint (stats.total_bytes, ==, 0);
+
+  /* The keys share a path longer than what nodes can store */
+  gw_radix_tree_insert (tree, "internationalisation", -1, NULL);
+  gw_radix_tree_insert (tree, "internationalization", -1, NULL);
+
+  gw_radix_tree_get_stats (tree, &stats);
+  g_assert_cmpuint (stats.n_node4, ==, 1);
+  g_assert_cmpuint (stats.n_node16 + stats.n_node32 + stats.n_node48 + stats.n_node256, ==, 0);
+  g_assert_cmpuint (stats.n_leaves, ==, 2);
+  g_assert_cmpuint (stats.n_compressed, ==, 1);
+  g_assert_cmpuint (stats.n_prefix_overflows, ==, 1);
+  g_assert_cmpuint (stats.max_depth, ==, 1);
+  g_assert_cmpfloat (stats.average_depth, ==, 1.0);
+  g_assert_cmpfloat (stats.fill_node4, ==, 0.5);
+
+  for (i = 0; i < 1000; i++)
+    {
+      g_snprintf (key, sizeof (key), "test%u", i);
+      gw_radix_tree_insert (tree, key, -1, NULL);
+    }
+
+  gw_radix_tree_get_stats (tree, &stats);
+  g_assert_cmpuint (stats.n_leaves, ==, gw_radix_tree_get_size (tree));
+  g_assert_cmpuint (stats.n_node16, >, 0);
+  g_assert_cmpuint (stats.total_bytes, >, stats.n_leaves * 5);
+  g_assert_cmpuint (stats.max_depth, >=, 3);
+  g_assert_cmpfloat (stats.average_depth, <=, stats.max_depth);
+  g_assert_cmpfloat (stats.fill_node16, >, 0.0);
+  g_assert_cmpfloat (stats.fill_node16, <=, 1.0);
+}
+
+/**************************************************************************************************/
+
+static void
+radix_tree_node_growth (void)
+{
+  g_autoptr (GwRadixTree) tree;
+  GwRadixTreeStats stats;
+  gchar key[2] = { '\0', };
+  guint i, j;
+
+  tree = gw_radix_tree_new ();
+
+  /* Every key is a child of the root, in an order that isn't sorted */
+  for (i = 0; i < 48; i++)
+    {
+      key[0] = 0x20 + (i * 37) % 48;
+      gw_radix_tree_insert (tree, key, 1, GUINT_TO_POINTER (i + 1));
+
+      gw_radix_tree_get_stats (tree, &stats);
+
+      if (i < 16)
+        g_assert_cmpuint (stats.n_node32, ==, 0);
+      else if (i < 32)
+        g_assert_cmpuint (stats.n_node32, ==, 1);
+      else
+        g_assert_cmpuint (stats.n_node48, ==, 1);
+
+      for (j = 0; j <= i; j++)
+        {
+          key[0] = 0x20 + (j * 37) % 48;
+          g_assert_cmpuint (GPOINTER_TO_UINT (gw_radix_tree_lookup (tree, key, 1, NULL)), ==, j + 1);
+        }
+
+      key[0] = 0x7f;
+      g_assert_false (gw_radix_tree_contains (tree, key, 1));
+    }
+
+  /* Shrink back to a Node16 */
+  for (i = 0; i < 40; i++)
+    {
+      key[0] = 0x20 + (i * 37) % 48;
+      gw_radix_tree_remove (tree, key, 1);
+
+      gw_radix_tree_get_stats (tree, &stats);
+
+      if (i < 23)
+        g_assert_cmpuint (stats.n_node48, ==, 1);
+      else if (i < 35)
+        g_assert_cmpuint (stats.n_node32, ==, 1);
+      else
+        g_assert_cmpuint (stats.n_node16, ==, 1);
+
+      for (j = 0; j < 48; j++)
+        {
+          key[0] = 0x20 + (j * 37) % 48;
+          g_assert_true (gw_radix_tree_contains (tree, key, 1) == (j > i));
+        }
+    }
+}
+
+/**************************************************************************************************/
+
+static gpointer
+count_word_cb (gpointer value,
+               gboolean found,
+               gpointer user_data)
+{
+  g_assert_true (found == (value != NULL));
+
+  return GUINT_TO_POINTER (GPOINTER_TO_UINT (value) + 1);
+}
+
+static gpointer
+upsert_thread (gpointer data)
+{
+  GwRadixTree *tree = data;
+  gchar key[20] = { '\0', };
+  gint i;
+
+  for (i = 0; i < 4000; i++)
+    {
+      g_snprintf (key, 20, "word%d", i % 100);
+      gw_radix_tree_upsert (tree, key, -1, count_word_cb, NULL);
+    }
+
+  return NULL;
+}
+
+static void
+radix_tree_upsert (void)
+{
+  g_autoptr (GwRadixTree) concurrent;
+  g_autoptr (GwRadixTree) snapshot;
+  g_autoptr (GwRadixTree) tree;
+  GThread *threads[4];
+  gchar key[20] = { '\0', };
+  gint i;
+
+  tree = gw_radix_tree_new ();
+
+  for (i = 0; i < 1000; i++)
+    {
+      g_snprintf (key, 20, "word%d", i % 300);
+      g_assert_true (gw_radix_tree_upsert (tree, key, -1, count_word_cb, NULL) == (i < 300));
+    }
+
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, 300);
+
+  for (i = 0; i < 300; i++)
+    {
+      g_snprintf (key, 20, "word%d", i);
+      g_assert_cmpuint (GPOINTER_TO_UINT (gw_radix_tree_lookup (tree, key, -1, NULL)), ==, i < 100 ? 4 : 3);
+    }
+
+  /* Copies keep their own counters */
+  snapshot = gw_radix_tree_copy (tree);
+
+  gw_radix_tree_upsert (tree, "word0", -1, count_word_cb, NULL);
+
+  g_assert_cmpuint (GPOINTER_TO_UINT (gw_radix_tree_lookup (tree, "word0", -1, NULL)), ==, 5);
+  g_assert_cmpuint (GPOINTER_TO_UINT (gw_radix_tree_lookup (snapshot, "word0", -1, NULL)), ==, 4);
+
+  /* Updates of the same key from different threads aren't lost */
+  concurrent = gw_radix_tree_new_concurrent (NULL);
+
+  for (i = 0; i < 4; i++)
+    threads[i] = g_thread_new ("upsert", upsert_thread, concurrent);
+
+  for (i = 0; i < 4; i++)
+    g_thread_join (threads[i]);
+
+  g_assert_cmpint (gw_radix_tree_get_size (concurrent), ==, 100);
+
+  for (i = 0; i < 100; i++)
+    {
+      g_snprintf (key, 20, "word%d", i);
+      g_assert_cmpuint (GPOINTER_TO_UINT (gw_radix_tree_lookup (concurrent, key, -1, NULL)), ==, 4 * 40);
+    }
+}
+
+/**************************************************************************************************/
+
+static gboolean
+collect_lengths_cb (const gchar *key,
+                    gsize        key_length,
+                    gpointer     value,
+                    gpointer     user_data)
+{
+  GArray *lengths = user_data;
+  guint length = key_length;
+
+  g_assert_cmpuint (strlen (key), ==, key_length);
+  g_array_append_val (lengths, length);
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+static void
+radix_tree_longest_prefix (void)
+{
+  g_autoptr (GwRadixTree) concurrent;
+  g_autoptr (GwRadixTree) tree;
+  g_autoptr (GArray) lengths;
+  gsize prefix_len;
+  const gchar *keys[] = {
+    "a", "ab", "abc", "abcdefghijklmnop", "abcdefghijklmnopqrs", "b", "bcd", "compound",
+    "compoundword", "word", "wordsplitting", "x",
+  };
+  const gchar *inputs[] = {
+    "", "a", "abx", "abcdefghijklmnopqrst", "abcdefghijklmnoz", "abcdefghijklmnopq", "bc",
+    "bcdef", "compoundwords", "compoundwor", "wordsplit", "wordsplittings", "xyz", "y",
+  };
+  guint i;
+
+  tree = gw_radix_tree_new ();
+  concurrent = gw_radix_tree_new_concurrent (NULL);
+  lengths = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  for (i = 0; i < G_N_ELEMENTS (keys); i++)
+    {
+      gw_radix_tree_insert (tree, keys[i], -1, GUINT_TO_POINTER (i + 1));
+      gw_radix_tree_insert (concurrent, keys[i], -1, GUINT_TO_POINTER (i + 1));
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (inputs); i++)
+    {
+      gsize input_len, len, expected_len;
+      gpointer value, expected_value;
+      gboolean found, expected;
+      guint j, n_prefixes;
+
+      input_len = strlen (inputs[i]);
+      expected = FALSE;
+      expected_len = 0;
+      expected_value = NULL;
+      n_prefixes = 0;
+
+      /* Look every prefix up */
+      for (len = 0; len <= input_len; len++)
+        {
+          gboolean prefix_found;
+          gpointer prefix_value;
+
+          prefix_value = gw_radix_tree_lookup (tree, inputs[i], len, &prefix_found);
+
+          if (prefix_found)
+            {
+              expected = TRUE;
+              expected_len = len;
+              expected_value = prefix_value;
+              n_prefixes++;
+            }
+        }
+
+      found = gw_radix_tree_longest_prefix (tree, inputs[i], -1, &len, &value);
+
+      g_assert_true (found == expected);
+      g_assert_cmpuint (len, ==, expected_len);
+      g_assert_true (value == expected_value);
+
+      found = gw_radix_tree_longest_prefix (concurrent, inputs[i], -1, &len, &value);
+
+      g_assert_true (found == expected);
+      g_assert_cmpuint (len, ==, expected_len);
+      g_assert_true (value == expected_value);
+
+      /* All prefixes, shortest first */
+      g_array_set_size (lengths, 0);
+      gw_radix_tree_iter_prefixes_of (tree, inputs[i], -1, collect_lengths_cb, lengths);
+
+      g_assert_cmpuint (lengths->len, ==, n_prefixes);
+
+      for (j = 1; j < lengths->len; j++)
+        g_assert_cmpuint (g_array_index (lengths, guint, j - 1), <, g_array_index (lengths, guint, j));
+
+      if (expected)
+        g_assert_cmpuint (g_array_index (lengths, guint, lengths->len - 1), ==, expected_len);
+    }
+
+  /* Only the given length of the input is considered */
+  g_assert_true (gw_radix_tree_longest_prefix (tree, "abcdefghijklmnopqrstuvwxyz", 18, &prefix_len, NULL));
+  g_assert_cmpuint (prefix_len, ==, 16);
+}
+
+/**************************************************************************************************/
+
+static void
+check_set_operations (GwRadixTree *a,
+                      GwRadixTree *b,
+                      guint        n_keys,
+                      const gchar *format)
+{
+  g_autoptr (GwRadixTree) difference;
+  g_autoptr (GwRadixTree) intersection;
+  g_autoptr (GwRadixTree) union_;
+  gchar key[64] = { '\0', };
+  gint n_difference, n_intersection, n_union;
+  guint i;
+
+  union_ = gw_radix_tree_union (a, b);
+  intersection = gw_radix_tree_intersect (a, b);
+  difference = gw_radix_tree_difference (a, b);
+
+  n_union = n_intersection = n_difference = 0;
+
+  for (i = 0; i < n_keys; i++)
+    {
+      gboolean in_a, in_b, found;
+      gpointer value_a, value_b, value;
+
+      g_snprintf (key, sizeof (key), format, i);
+
+      value_a = gw_radix_tree_lookup (a, key, -1, &in_a);
+      value_b = gw_radix_tree_lookup (b, key, -1, &in_b);
+
+      /* Values come from the first tree */
+      value = gw_radix_tree_lookup (union_, key, -1, &found);
+      g_assert_true (found == (in_a || in_b));
+      g_assert_true (value == (in_a ? value_a : value_b));
+      n_union += found;
+
+      value = gw_radix_tree_lookup (intersection, key, -1, &found);
+      g_assert_true (found == (in_a && in_b));
+      g_assert_true (value == (found ? value_a : NULL));
+      n_intersection += found;
+
+      value = gw_radix_tree_lookup (difference, key, -1, &found);
+      g_assert_true (found == (in_a && !in_b));
+      g_assert_true (value == (found ? value_a : NULL));
+      n_difference += found;
+    }
+
+  g_assert_cmpint (gw_radix_tree_get_size (union_), ==, n_union);
+  g_assert_cmpint (gw_radix_tree_get_size (intersection), ==, n_intersection);
+  g_assert_cmpint (gw_radix_tree_get_size (difference), ==, n_difference);
+}
+
+static void
+radix_tree_set_operations (void)
+{
+  g_autoptr (GwRadixTree) empty;
+  g_autoptr (GwRadixTree) copy;
+  g_autoptr (GwRadixTree) a;
+  g_autoptr (GwRadixTree) b;
+  const gchar *formats[] = { "test%u", "averyveryverylongsharedprefix%u", "%u" };
+  gchar key[64] = { '\0', };
+  guint n_destroyed;
+  guint f, i;
+
+  empty = gw_radix_tree_new ();
+
+  for (f = 0; f < G_N_ELEMENTS (formats); f++)
+    {
+      g_autoptr (GwRadixTree) x = gw_radix_tree_new ();
+      g_autoptr (GwRadixTree) y = gw_radix_tree_new ();
+
+      for (i = 0; i < 3000; i++)
+        {
+          g_snprintf (key, sizeof (key), formats[f], i);
+
+          if (i % 2 == 0 || i < 500)
+            gw_radix_tree_insert (x, key, -1, GUINT_TO_POINTER (i + 1));
+
+          if (i % 3 == 0 || i > 2500)
+            gw_radix_tree_insert (y, key, -1, GUINT_TO_POINTER (i + 10000));
+        }
+
+      check_set_operations (x, y, 3000, formats[f]);
+      check_set_operations (y, x, 3000, formats[f]);
+      check_set_operations (x, x, 3000, formats[f]);
+      check_set_operations (x, empty, 3000, formats[f]);
+      check_set_operations (empty, y, 3000, formats[f]);
+    }
+
+  /* Keys from a tree in another arena are copied */
+  a = gw_radix_tree_new_with_arena (NULL);
+
+  for (i = 0; i < 3000; i += 7)
+    {
+      g_snprintf (key, sizeof (key), "test%u", i);
+      gw_radix_tree_insert (a, key, -1, GUINT_TO_POINTER (i + 1));
+    }
+
+  b = gw_radix_tree_new ();
+
+  for (i = 0; i < 3000; i += 5)
+    {
+      g_snprintf (key, sizeof (key), "test%u", i);
+      gw_radix_tree_insert (b, key, -1, GUINT_TO_POINTER (i + 1));
+    }
+
+  check_set_operations (a, b, 3000, "test%u");
+  check_set_operations (b, a, 3000, "test%u");
+
+  g_clear_pointer (&a, gw_radix_tree_unref);
+  g_clear_pointer (&b, gw_radix_tree_unref);
+
+  /* Trees sharing an arena share their values too */
+  n_destroyed = 0;
+  a = gw_radix_tree_new_with_arena (count_destroy_cb);
+
+  for (i = 0; i < 1000; i++)
+    {
+      g_snprintf (key, sizeof (key), "test%u", i);
+      gw_radix_tree_insert (a, key, -1, &n_destroyed);
+    }
+
+  copy = gw_radix_tree_copy (a);
+
+  for (i = 0; i < 1000; i += 2)
+    {
+      g_snprintf (key, sizeof (key), "test%u", i);
+      gw_radix_tree_remove (copy, key, -1);
+
+      g_snprintf (key, sizeof (key), "other%u", i);
+      gw_radix_tree_insert (copy, key, -1, &n_destroyed);
+    }
+
+  b = gw_radix_tree_intersect (a, copy);
+  g_assert_cmpint (gw_radix_tree_get_size (b), ==, 500);
+  g_assert_false (gw_radix_tree_contains (b, "test0", -1));
+  g_assert_true (gw_radix_tree_contains (b, "test1", -1));
+  g_clear_pointer (&b, gw_radix_tree_unref);
+
+  b = gw_radix_tree_difference (copy, a);
+  g_assert_cmpint (gw_radix_tree_get_size (b), ==, 500);
+  g_assert_false (gw_radix_tree_contains (b, "test1", -1));
+  g_assert_true (gw_radix_tree_contains (b, "other0", -1));
+  g_clear_pointer (&b, gw_radix_tree_unref);
+
+  g_assert_cmpuint (n_destroyed, ==, 0);
+
+  b = gw_radix_tree_union (a, copy);
+  g_assert_cmpint (gw_radix_tree_get_size (b), ==, 1500);
+
+  g_clear_pointer (&a, gw_radix_tree_unref);
+  g_clear_pointer (&copy, gw_radix_tree_unref);
+
+  g_assert_cmpint (gw_radix_tree_get_size (b), ==, 1500);
+  g_assert_true (gw_radix_tree_contains (b, "test0", -1));
+  g_assert_true (gw_radix_tree_contains (b, "other0", -1));
+
+  g_clear_pointer (&b, gw_radix_tree_unref);
+  g_assert_cmpuint (n_destroyed, ==, 1500);
+}
+
+/**************************************************************************************************/
+
+typedef struct
+{
+  gint                n_keys;
+  gint                sum;
+  const gchar        *stop_at;
+} ParallelData;
+
+static gboolean
+parallel_count_cb (const gchar *key,
+                   gsize        key_length,
+                   gpointer     value,
+                   gpointer     user_data)
+{
+  ParallelData *data = user_data;
+
+  g_atomic_int_inc (&data->n_keys);
+  g_atomic_int_add (&data->sum, GPOINTER_TO_INT (value));
+
+  return data->stop_at && strncmp (key, data->stop_at, key_length) == 0;
+}
+
+static gpointer
+parallel_dup_key_cb (const gchar *key,
+                     gsize        key_length,
+                     gpointer     value,
+                     gpointer     user_data)
+{
+  return g_strndup (key, key_length);
+}
+
+static void
+radix_tree_foreach_parallel (void)
+{
+  g_autoptr (GwRadixTree) tree;
+  g_autoptr (GPtrArray) results;
+  ParallelData data;
+  GStrv keys;
+  gchar key[20] = { '\0', };
+  gint expected_sum;
+  gint i;
+
+  tree = gw_radix_tree_new ();
+
+  /* Empty trees have nothing to split */
+  data = (ParallelData) { 0, };
+
+  g_assert_false (gw_radix_tree_foreach_parallel (tree, parallel_count_cb, &data));
+  g_assert_cmpint (data.n_keys, ==, 0);
+
+  results = gw_radix_tree_map_parallel (tree, parallel_dup_key_cb, NULL);
+  g_assert_cmpuint (results->len, ==, 0);
+  g_clear_pointer (&results, g_ptr_array_unref);
+
+  expected_sum = 0;
+
+  for (i = 0; i < 20000; i++)
+    {
+      g_snprintf (key, 20, "test%d", i);
+      gw_radix_tree_insert (tree, key, -1, GINT_TO_POINTER (i));
+      expected_sum += i;
+    }
+
+  gw_radix_tree_insert (tree, "a", -1, GINT_TO_POINTER (0));
+
+  data = (ParallelData) { 0, };
+
+  g_assert_false (gw_radix_tree_foreach_parallel (tree, parallel_count_cb, &data));
+  g_assert_cmpint (data.n_keys, ==, 20001);
+  g_assert_cmpint (data.sum, ==, expected_sum);
+
+  /* Stopping */
+  data = (ParallelData) { .stop_at = "test123" };
+
+  g_assert_true (gw_radix_tree_foreach_parallel (tree, parallel_count_cb, &data));
+  g_assert_cmpint (data.n_keys, <=, 20001);
+
+  /* Results come in key order */
+  results = gw_radix_tree_map_parallel (tree, parallel_dup_key_cb, NULL);
+  g_ptr_array_set_free_func (results, g_free);
+
+  keys = gw_radix_tree_get_keys (tree);
+
+  g_assert_cmpuint (results->len, ==, g_strv_length (keys));
+
+  for (i = 0; keys[i]; i++)
+    g_assert_cmpstr (g_ptr_array_index (results, i), ==, keys[i]);
+
+  g_clear_pointer (&keys, g_strfreev);
+}
+
+/**************************************************************************************************/
+
+static gboolean
+count_keys_cb (const gchar *key,
+               gsize        key_length,
+               gpointer     value,
+               gpointer     user_data)
+{
+  g_assert_cmpuint (strlen (key), ==, key_length);
+
+  (*(guint*) user_data)++;
+
+  return GW_RADIX_TREE_ITER_CONTINUE;
+}
+
+static void
+radix_tree_set (void)
+{
+  g_autoptr (GwRadixTree) intersection;
+  g_autoptr (GwRadixTree) tree;
+  g_autoptr (GwRadixTree) copy;
+  g_autoptr (GwRadixTree) set;
+  GwRadixTreeStats tree_stats, set_stats;
+  GwRadixTreeIter tree_iter, set_iter;
+  const gchar *tree_key, *set_key;
+  gchar key[20] = { '\0', };
+  GStrv tree_keys, set_keys;
+  guint n_tree, n_set;
+  guint i;
+
+  tree = gw_radix_tree_new ();
+  set = gw_radix_tree_new_set ();
+
+  /* Mix short keys, which are embedded, with long ones */
+  gw_radix_tree_insert (tree, "", -1, NULL);
+  gw_radix_tree_insert (set, "", -1, NULL);
+
+  for (i = 0; i < 3000; i++)
+    {
+      g_snprintf (key, sizeof (key), i % 3 ? "w%u" : "longword%u", i);
+      gw_radix_tree_insert (tree, key, -1, NULL);
+      gw_radix_tree_insert (set, key, -1, NULL);
+    }
+
+  gw_radix_tree_get_stats (tree, &tree_stats);
+  gw_radix_tree_get_stats (set, &set_stats);
+
+  g_assert_cmpuint (tree_stats.n_embedded, ==, 0);
+
+  /* Compressed pointers only have room for keys of up to 2 bytes */
+#ifdef GW_RADIX_TREE_COMPRESSED_POINTERS
+  g_assert_cmpuint (set_stats.n_embedded, ==, 7);
+#else
+  g_assert_cmpuint (set_stats.n_embedded, ==, 2001);
+#endif
+  g_assert_cmpuint (set_stats.n_leaves, ==, tree_stats.n_leaves);
+  g_assert_cmpuint (set_stats.total_bytes, <, tree_stats.total_bytes);
+
+  /* Removing half of the keys */
+  for (i = 0; i < 3000; i += 2)
+    {
+      g_snprintf (key, sizeof (key), i % 3 ? "w%u" : "longword%u", i);
+      gw_radix_tree_remove (tree, key, -1);
+      gw_radix_tree_remove (set, key, -1);
+    }
+
+  g_assert_cmpint (gw_radix_tree_get_size (set), ==, gw_radix_tree_get_size (tree));
+
+  for (i = 0; i < 3000; i++)
+    {
+      g_snprintf (key, sizeof (key), i % 3 ? "w%u" : "longword%u", i);
+      g_assert_true (gw_radix_tree_contains (set, key, -1) == (i % 2 == 1));
+    }
+
+  /* Keys come out the same, in the same order */
+  tree_keys = gw_radix_tree_get_keys (tree);
+  set_keys = gw_radix_tree_get_keys (set);
+
+  g_assert_cmpuint (g_strv_length (set_keys), ==, g_strv_length (tree_keys));
+
+  for (i = 0; tree_keys[i]; i++)
+    g_assert_cmpstr (set_keys[i], ==, tree_keys[i]);
+
+  g_clear_pointer (&tree_keys, g_strfreev);
+  g_clear_pointer (&set_keys, g_strfreev);
+
+  gw_radix_tree_iter_init (&tree_iter, tree);
+  gw_radix_tree_iter_init (&set_iter, set);
+
+  g_assert_true (gw_radix_tree_iter_seek (&set_iter, "w1", -1));
+  g_assert_true (gw_radix_tree_iter_seek (&tree_iter, "w1", -1));
+
+  while (gw_radix_tree_iter_next (&tree_iter, &tree_key, NULL, NULL))
+    {
+      g_assert_true (gw_radix_tree_iter_next (&set_iter, &set_key, NULL, NULL));
+      g_assert_cmpstr (set_key, ==, tree_key);
+    }
+
+  g_assert_false (gw_radix_tree_iter_next (&set_iter, NULL, NULL, NULL));
+  g_assert_true (gw_radix_tree_iter_prev (&set_iter, &set_key, NULL, NULL));
+  g_assert_cmpstr (set_key, ==, "w997");
+
+  n_tree = n_set = 0;
+  gw_radix_tree_fuzzy_search (tree, "w10", -1, 1, count_keys_cb, &n_tree);
+  gw_radix_tree_fuzzy_search (set, "w10", -1, 1, count_keys_cb, &n_set);
+
+  g_assert_cmpuint (n_set, >, 0);
+  g_assert_cmpuint (n_set, ==, n_tree);
+
+  n_tree = n_set = 0;
+  gw_radix_tree_iter_prefix (tree, "w1", -1, count_keys_cb, &n_tree);
+  gw_radix_tree_iter_prefix (set, "w1", -1, count_keys_cb, &n_set);
+
+  g_assert_cmpuint (n_set, ==, n_tree);
+
+  /* Values are still kept, outside of the pointer */
+  copy = gw_radix_tree_copy (set);
+
+  gw_radix_tree_insert (copy, "w1", -1, GUINT_TO_POINTER (1));
+  g_assert_true (gw_radix_tree_lookup (copy, "w1", -1, NULL) == GUINT_TO_POINTER (1));
+  g_assert_null (gw_radix_tree_lookup (set, "w1", -1, NULL));
+
+  gw_radix_tree_insert (copy, "w1", -1, NULL);
+  g_assert_true (gw_radix_tree_contains (copy, "w1", -1));
+  g_assert_null (gw_radix_tree_lookup (copy, "w1", -1, NULL));
+
+  gw_radix_tree_remove (copy, "w5", -1);
+  g_assert_false (gw_radix_tree_contains (copy, "w5", -1));
+  g_assert_true (gw_radix_tree_contains (set, "w5", -1));
+
+  intersection = gw_radix_tree_intersect (set, copy);
+  g_assert_cmpint (gw_radix_tree_get_size (intersection), ==, gw_radix_tree_get_size (set) - 1);
+  g_assert_true (gw_radix_tree_contains (intersection, "w1", -1));
+  g_assert_false (gw_radix_tree_contains (intersection, "w5", -1));
+}
+
+/**************************************************************************************************/
+
+static const gchar *compact_words[] = {
+  "desenvolvimento",
+  "inconstitucionalissimamente",
+  "inconstitucional",
+  "paralelepipedo",
+};
+
+static void
+radix_tree_compact (void)
+{
+  g_autoptr (GwRadixTree) compact;
+  g_autoptr (GwRadixTree) tree;
+  g_autoptr (GPtrArray) mapped;
+  GwRadixTreeStats tree_stats, compact_stats;
+  GStrv tree_keys, compact_keys;
+  gchar key[64] = { '\0', };
+  guint n_tree, n_compact;
+  gsize prefix_length;
+  gpointer value;
+  guint i;
+
+  tree = gw_radix_tree_new ();
+  compact = gw_radix_tree_new_compact (NULL);
+
+  /* Long words sharing long prefixes, and keys ending at inner nodes */
+  for (i = 0; i < 2000; i++)
+    {
+      g_snprintf (key, sizeof (key), "%s%u", compact_words[i % 4], i / 4);
+      gw_radix_tree_insert (tree, key, -1, GUINT_TO_POINTER (i + 1));
+      gw_radix_tree_insert (compact, key, -1, GUINT_TO_POINTER (i + 1));
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (compact_words); i++)
+    {
+      gw_radix_tree_insert (tree, compact_words[i], -1, NULL);
+      gw_radix_tree_insert (compact, compact_words[i], -1, NULL);
+    }
+
+  gw_radix_tree_get_stats (tree, &tree_stats);
+  gw_radix_tree_get_stats (compact, &compact_stats);
+
+  g_assert_cmpuint (compact_stats.n_leaves, ==, tree_stats.n_leaves);
+  g_assert_cmpuint (compact_stats.total_bytes, <, tree_stats.total_bytes);
+
+  for (i = 0; i < 2000; i++)
+    {
+      g_snprintf (key, sizeof (key), "%s%u", compact_words[i % 4], i / 4);
+      g_assert_true (gw_radix_tree_lookup (compact, key, -1, NULL) == GUINT_TO_POINTER (i + 1));
+    }
+
+  g_assert_false (gw_radix_tree_contains (compact, "inconstitucionalissima", -1));
+  g_assert_true (gw_radix_tree_contains (compact, "inconstitucional", -1));
+
+  /* Keys are rebuilt from the path down to their leaves */
+  tree_keys = gw_radix_tree_get_keys (tree);
+  compact_keys = gw_radix_tree_get_keys (compact);
+
+  g_assert_cmpuint (g_strv_length (compact_keys), ==, g_strv_length (tree_keys));
+
+  for (i = 0; tree_keys[i]; i++)
+    g_assert_cmpstr (compact_keys[i], ==, tree_keys[i]);
+
+  mapped = gw_radix_tree_map_parallel (compact, parallel_dup_key_cb, NULL);
+  g_ptr_array_set_free_func (mapped, g_free);
+
+  g_assert_cmpuint (mapped->len, ==, g_strv_length (tree_keys));
+
+  for (i = 0; tree_keys[i]; i++)
+    g_assert_cmpstr (g_ptr_array_index (mapped, i), ==, tree_keys[i]);
+
+  g_clear_pointer (&tree_keys, g_strfreev);
+  g_clear_pointer (&compact_keys, g_strfreev);
+
+  n_tree = n_compact = 0;
+  gw_radix_tree_iter_prefix (tree, "inconstitucionalissimamente1", -1, count_keys_cb, &n_tree);
+  gw_radix_tree_iter_prefix (compact, "inconstitucionalissimamente1", -1, count_keys_cb, &n_compact);
+
+  g_assert_cmpuint (n_compact, >, 0);
+  g_assert_cmpuint (n_compact, ==, n_tree);
+
+  n_tree = n_compact = 0;
+  gw_radix_tree_fuzzy_search (tree, "paralelepipedo12", -1, 1, count_keys_cb, &n_tree);
+  gw_radix_tree_fuzzy_search (compact, "paralelepipedo12", -1, 1, count_keys_cb, &n_compact);
+
+  g_assert_cmpuint (n_compact, >, 0);
+  g_assert_cmpuint (n_compact, ==, n_tree);
+
+  g_assert_true (gw_radix_tree_longest_prefix (compact, "desenvolvimentos", -1, &prefix_length, &value));
+  g_assert_cmpuint (prefix_length, ==, strlen ("desenvolvimento"));
+
+  /* Removing keys moves their siblings up */
+  for (i = 0; i < 2000; i += 2)
+    {
+      g_snprintf (key, sizeof (key), "%s%u", compact_words[i % 4], i / 4);
+      gw_radix_tree_remove (tree, key, -1);
+      gw_radix_tree_remove (compact, key, -1);
+    }
+
+  g_assert_cmpint (gw_radix_tree_get_size (compact), ==, gw_radix_tree_get_size (tree));
+
+  for (i = 0; i < 2000; i++)
+    {
+      g_snprintf (key, sizeof (key), "%s%u", compact_words[i % 4], i / 4);
+      g_assert_true (gw_radix_tree_contains (compact, key, -1) == (i % 2 == 1));
+    }
+
+  for (i = 1; i < 2000; i += 2)
+    {
+      g_snprintf (key, sizeof (key), "%s%u", compact_words[i % 4], i / 4);
+      gw_radix_tree_remove (compact, key, -1);
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (compact_words); i++)
+    {
+      g_assert_true (gw_radix_tree_contains (compact, compact_words[i], -1));
+      gw_radix_tree_remove (compact, compact_words[i], -1);
+    }
+
+  gw_radix_tree_get_stats (compact, &compact_stats);
+  g_assert_cmpuint (compact_stats.n_leaves, ==, 0);
+}
+
+/**************************************************************************************************/
+
+static void
+radix_tree_freeze (void)
+{
+  g_autoptr (GwRadixTree) frozen;
+  g_autoptr (GwRadixTree) copy;
+  g_autoptr (GwRadixTree) tree;
+  GwRadixTreeStats tree_stats, frozen_stats;
+  GStrv tree_keys, frozen_keys;
+  gchar key[64] = { '\0', };
+  const gchar *many[3];
+  gpointer values[3];
+  gboolean found[3];
+  guint n_tree, n_frozen;
+  gsize prefix_length;
+  gpointer value;
+  guint i;
+
+  tree = gw_radix_tree_new ();
+  frozen = gw_radix_tree_new_with_free_func (g_free);
+
+  for (i = 0; i < 2000; i++)
+    {
+      g_snprintf (key, sizeof (key), "%s%u", compact_words[i % 4], i / 4);
+      gw_radix_tree_insert (tree, key, -1, GUINT_TO_POINTER (i + 1));
+      gw_radix_tree_insert (frozen, key, -1, g_strdup (key));
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (compact_words); i++)
+    {
+      gw_radix_tree_insert (tree, compact_words[i], -1, NULL);
+      gw_radix_tree_insert (frozen, compact_words[i], -1, NULL);
+    }
+
+  gw_radix_tree_get_stats (tree, &tree_stats);
+
+  /* Nodes shared with a copy can't be moved */
+  copy = gw_radix_tree_copy (frozen);
+  g_assert_false (gw_radix_tree_freeze (frozen));
+  g_clear_pointer (&copy, gw_radix_tree_unref);
+
+  g_assert_true (gw_radix_tree_freeze (frozen));
+  g_assert_true (gw_radix_tree_freeze (frozen));
+
+  gw_radix_tree_get_stats (frozen, &frozen_stats);
+
+  g_assert_cmpuint (frozen_stats.n_leaves, ==, tree_stats.n_leaves);
+  g_assert_cmpuint (frozen_stats.n_prefix_overflows, ==, 0);
+
+  /* Compressed pointers already make nodes about as small as frozen ones */
+#ifndef GW_RADIX_TREE_COMPRESSED_POINTERS
+  g_assert_cmpuint (frozen_stats.total_bytes, <, tree_stats.total_bytes);
+#endif
+  g_assert_cmpint (gw_radix_tree_get_size (frozen), ==, gw_radix_tree_get_size (tree));
+
+  for (i = 0; i < 2000; i++)
+    {
+      g_snprintf (key, sizeof (key), "%s%u", compact_words[i % 4], i / 4);
+      g_assert_cmpstr (gw_radix_tree_lookup (frozen, key, -1, NULL), ==, key);
+    }
+
+  g_assert_false (gw_radix_tree_contains (frozen, "inconstitucionalissima", -1));
+  g_assert_false (gw_radix_tree_contains (frozen, "desenvolvimento5000", -1));
+  g_assert_true (gw_radix_tree_contains (frozen, "inconstitucional", -1));
+
+  many[0] = "paralelepipedo7";
+  many[1] = "paralelepiped";
+  many[2] = "paralelepipedo";
+
+  gw_radix_tree_lookup_many (frozen, many, NULL, 3, values, found);
+
+  g_assert_cmpstr (values[0], ==, "paralelepipedo7");
+  g_assert_true (found[0]);
+  g_assert_false (found[1]);
+  g_assert_true (found[2]);
+  g_assert_null (values[2]);
+
+  tree_keys = gw_radix_tree_get_keys (tree);
+  frozen_keys = gw_radix_tree_get_keys (frozen);
+
+  g_assert_cmpuint (g_strv_length (frozen_keys), ==, g_strv_length (tree_keys));
+
+  for (i = 0; tree_keys[i]; i++)
+    g_assert_cmpstr (frozen_keys[i], ==, tree_keys[i]);
+
+  g_clear_pointer (&tree_keys, g_strfreev);
+  g_clear_pointer (&frozen_keys, g_strfreev);
+
+  n_tree = n_frozen = 0;
+  gw_radix_tree_iter_prefix (tree, "inconstitucionalissimamente1", -1, count_keys_cb, &n_tree);
+  gw_radix_tree_iter_prefix (frozen, "inconstitucionalissimamente1", -1, count_keys_cb, &n_frozen);
+
+  g_assert_cmpuint (n_frozen, >, 0);
+  g_assert_cmpuint (n_frozen, ==, n_tree);
+
+  n_tree = n_frozen = 0;
+  gw_radix_tree_fuzzy_search (tree, "paralelepipedo12", -1, 1, count_keys_cb, &n_tree);
+  gw_radix_tree_fuzzy_search (frozen, "paralelepipedo12", -1, 1, count_keys_cb, &n_frozen);
+
+  g_assert_cmpuint (n_frozen, >, 0);
+  g_assert_cmpuint (n_frozen, ==, n_tree);
+
+  n_frozen = 0;
+  gw_radix_tree_foreach_parallel (frozen, count_keys_cb, &n_frozen);
+  g_assert_cmpuint (n_frozen, ==, tree_stats.n_leaves);
+
+  g_assert_true (gw_radix_tree_longest_prefix (frozen, "desenvolvimento12x", -1, &prefix_length, &value));
+  g_assert_cmpuint (prefix_length, ==, strlen ("desenvolvimento12"));
+  g_assert_cmpstr (value, ==, "desenvolvimento12");
+
+  /* Clearing gives back a tree that can be modified */
+  gw_radix_tree_clear (frozen);
+
+  g_assert_cmpint (gw_radix_tree_get_size (frozen), ==, 0);
+  g_assert_false (gw_radix_tree_contains (frozen, "desenvolvimento12", -1));
+
+  gw_radix_tree_insert (frozen, "desenvolvimento", -1, g_strdup ("desenvolvimento"));
+  g_assert_true (gw_radix_tree_contains (frozen, "desenvolvimento", -1));
+}
+
+/**************************************************************************************************/
+
+static void
+radix_tree_counts (void)
+{
+  const gchar *prefixes[] = { "desenvolvimento", "inconstitucional", "inconstitucionalissimamente1", "des", "p" };
+  g_autoptr (GwRadixTree) compact;
+  g_autoptr (GwRadixTree) copy;
+  g_autoptr (GwRadixTree) tree;
+  gchar key[64] = { '\0', };
+  GStrv keys;
+  gpointer value;
+  gchar *selected;
+  guint n_keys;
+  guint i;
+
+  tree = gw_radix_tree_new ();
+  compact = gw_radix_tree_new_compact (NULL);
+
+  for (i = 0; i < 2000; i++)
+    {
+      g_snprintf (key, sizeof (key), "%s%u", compact_words[i % 4], i / 4);
+      gw_radix_tree_insert (tree, key, -1, GUINT_TO_POINTER (i + 1));
+      gw_radix_tree_insert (compact, key, -1, GUINT_TO_POINTER (i + 1));
+    }
+
+  /* Counts of the existing keys are computed, and then kept updated */
+  gw_radix_tree_enable_counts (tree);
+  gw_radix_tree_enable_counts (compact);
+
+  for (i = 0; i < G_N_ELEMENTS (compact_words); i++)
+    {
+      gw_radix_tree_insert (tree, compact_words[i], -1, NULL);
+      gw_radix_tree_insert (compact, compact_words[i], -1, NULL);
+    }
+
+  g_assert_false (gw_radix_tree_insert (tree, compact_words[0], -1, NULL));
+
+  for (i = 1; i < 2000; i += 3)
+    {
+      g_snprintf (key, sizeof (key), "%s%u", compact_words[i % 4], i / 4);
+      gw_radix_tree_remove (tree, key, -1);
+      gw_radix_tree_remove (compact, key, -1);
+    }
+
+  g_assert_cmpuint (gw_radix_tree_count_prefix (tree, "", -1), ==, gw_radix_tree_get_size (tree));
+  g_assert_cmpuint (gw_radix_tree_count_prefix (tree, "inexistente", -1), ==, 0);
+  g_assert_cmpuint (gw_radix_tree_count_prefix (tree, "paralelepipedo498", -1), ==, 1);
+
+  for (i = 0; i < G_N_ELEMENTS (prefixes); i++)
+    {
+      n_keys = 0;
+      gw_radix_tree_iter_prefix (tree, prefixes[i], -1, count_keys_cb, &n_keys);
+
+      g_assert_cmpuint (n_keys, >, 0);
+      g_assert_cmpuint (gw_radix_tree_count_prefix (tree, prefixes[i], -1), ==, n_keys);
+      g_assert_cmpuint (gw_radix_tree_count_prefix (compact, prefixes[i], -1), ==, n_keys);
+    }
+
+  /* Ranks and selections match the sorted keys */
+  keys = gw_radix_tree_get_keys (tree);
+
+  for (i = 0; keys[i]; i++)
+    {
+      g_assert_cmpuint (gw_radix_tree_rank (tree, keys[i], -1), ==, i);
+      g_assert_cmpuint (gw_radix_tree_rank (compact, keys[i], -1), ==, i);
+
+      selected = gw_radix_tree_select (tree, i, &value);
+      g_assert_cmpstr (selected, ==, keys[i]);
+      g_assert_true (value == gw_radix_tree_lookup (tree, keys[i], -1, NULL));
+      g_free (selected);
+
+      selected = gw_radix_tree_select (compact, i, NULL);
+      g_assert_cmpstr (selected, ==, keys[i]);
+      g_free (selected);
+    }
+
+  g_assert_null (gw_radix_tree_select (tree, i, NULL));
+  g_assert_cmpuint (gw_radix_tree_rank (tree, "a", -1), ==, 0);
+  g_assert_cmpuint (gw_radix_tree_rank (tree, "z", -1), ==, i);
+  g_assert_cmpuint (gw_radix_tree_rank (tree, "desenvolvimento0x", -1), ==, gw_radix_tree_rank (tree, "desenvolvimento1", -1));
+
+  g_clear_pointer (&keys, g_strfreev);
+
+  /* Copies share the counts, and keep their own once modified */
+  copy = gw_radix_tree_copy (tree);
+
+  gw_radix_tree_remove (copy, "desenvolvimento", -1);
+  gw_radix_tree_insert (copy, "desenvolvimentos", -1, NULL);
+
+  g_assert_cmpuint (gw_radix_tree_count_prefix (copy, "desenvolvimento", -1), ==,
+                    gw_radix_tree_count_prefix (tree, "desenvolvimento", -1));
+  g_assert_cmpuint (gw_radix_tree_rank (copy, "desenvolvimentos", -1), ==,
+                    gw_radix_tree_rank (tree, "desenvolvimentos", -1) - 1);
+
+  selected = gw_radix_tree_select (copy, gw_radix_tree_rank (copy, "desenvolvimentos", -1), NULL);
+  g_assert_cmpstr (selected, ==, "desenvolvimentos");
+  g_free (selected);
+}
+
+/**************************************************************************************************/
+
+static void
+check_pattern (GwRadixTree  *tree,
+               const gchar  *pattern,
+               const gchar **expected)
+{
+  g_autoptr (GPtrArray) result;
+  guint i;
+
+  result = g_ptr_array_new_with_free_func (g_free);
+
+  gw_radix_tree_match_pattern (tree, pattern, -1, fuzzy_search_cb, result);
+
+  for (i = 0; expected[i]; i++)
+    {
+      g_assert_cmpuint (i, <, result->len);
+      g_assert_cmpstr (g_ptr_array_index (result, i), ==, expected[i]);
+    }
+
+  g_assert_cmpuint (result->len, ==, i);
+}
+
+static void
+radix_tree_match_pattern (void)
+{
+  g_autoptr (GwRadixTree) compact;
+  g_autoptr (GwRadixTree) tree;
+  g_autoptr (GPtrArray) result;
+  g_autoptr (GPtrArray) keys;
+  GwRadixTree *trees[2];
+  guint i, j, t;
+
+  const gchar* entries[] = {
+    "ação",
+    "canção",
+    "cão",
+    "c",
+    "cat",
+    "cats",
+    "coat",
+    "cut",
+    "c*t",
+    "[cut]",
+    "internationalisation",
+    "internationalization",
+    "",
+    NULL
+  };
+
+  const gchar* patterns[] = {
+    "*",
+    "",
+    "c*",
+    "c?t",
+    "c?t*",
+    "*ção",
+    "*a*",
+    "?",
+    "??",
+    "*t*s*",
+    "internationali?ation",
+    "international*",
+    NULL
+  };
+
+  tree = gw_radix_tree_new ();
+  compact = gw_radix_tree_new_compact (NULL);
+  keys = g_ptr_array_new_with_free_func (g_free);
+  result = g_ptr_array_new_with_free_func (g_free);
+
+  for (i = 0; i < 2000; i++)
+    g_ptr_array_add (keys, g_strdup_printf ("test%u", i));
+
+  for (i = 0; entries[i]; i++)
+    g_ptr_array_add (keys, g_strdup (entries[i]));
+
+  for (i = 0; i < keys->len; i++)
+    {
+      gw_radix_tree_insert (tree, g_ptr_array_index (keys, i), -1, NULL);
+      gw_radix_tree_insert (compact, g_ptr_array_index (keys, i), -1, NULL);
+    }
+
+  trees[0] = tree;
+  trees[1] = compact;
+
+  /* Patterns without classes match like g_pattern_match_simple() */
+  for (t = 0; t < G_N_ELEMENTS (trees); t++)
+    {
+      for (i = 0; patterns[i]; i++)
+        {
+          guint n_expected = 0;
+
+          g_ptr_array_set_size (result, 0);
+          gw_radix_tree_match_pattern (trees[t], patterns[i], -1, fuzzy_search_cb, result);
+
+          for (j = 0; j < keys->len; j++)
+            {
+              if (g_pattern_match_simple (patterns[i], g_ptr_array_index (keys, j)))
+                n_expected++;
+            }
+
+          g_assert_cmpuint (result->len, ==, n_expected);
+
+          for (j = 0; j < result->len; j++)
+            g_assert_true (g_pattern_match_simple (patterns[i], g_ptr_array_index (result, j)));
+
+          /* Keys are visited in order */
+          for (j = 1; j < result->len; j++)
+            g_assert_cmpint (strcmp (g_ptr_array_index (result, j - 1), g_ptr_array_index (result, j)), <, 0);
+        }
+    }
+
+  /* Classes, ranges and escapes */
+  check_pattern (tree, "c[aou]t", (const gchar*[]) { "cat", "cut", NULL });
+  check_pattern (tree, "c[!a]t", (const gchar*[]) { "c*t", "cut", NULL });
+  check_pattern (tree, "c[^*a-t]?", (const gchar*[]) { "cut", "cão", NULL });
+  check_pattern (tree, "[a-c]?[aã]*", (const gchar*[]) { "ação", "coat", NULL });
+  check_pattern (tree, "test1[0-2][]9]", (const gchar*[]) { "test109", "test119", "test129", NULL });
+  check_pattern (tree, "c\\*t", (const gchar*[]) { "c*t", NULL });
+  check_pattern (tree, "\\[cut]", (const gchar*[]) { "[cut]", NULL });
+  check_pattern (tree, "[cut", (const gchar*[]) { NULL });
+  check_pattern (tree, "[[]c*", (const gchar*[]) { "[cut]", NULL });
+
+  /* Frozen trees */
+  g_assert_true (gw_radix_tree_freeze (tree));
+
+  check_pattern (tree, "c?t*", (const gchar*[]) { "c*t", "cat", "cats", "cut", NULL });
+  check_pattern (tree, "*ção", (const gchar*[]) { "ação", "canção", NULL });
+  check_pattern (tree, "test199?", (const gchar*[]) { "test1990", "test1991", "test1992", "test1993", "test1994",
+                                                     "test1995", "test1996", "test1997", "test1998", "test1999", NULL });
+
+  /* Stopping the search */
+  g_ptr_array_set_size (result, 0);
+
+  g_assert_true (gw_radix_tree_match_pattern (compact, "test1*", -1, fuzzy_search_stop_cb, result));
+  g_assert_cmpuint (result->len, ==, 1);
+}
+
+/**************************************************************************************************/
+
+static void
+radix_tree_iter_reverse (void)
+{
+  g_autoptr (GwRadixTree) compact;
+  g_autoptr (GwRadixTree) frozen;
+  g_autoptr (GwRadixTree) tree;
+  g_autoptr (GwRadixTree) set;
+  g_autoptr (GPtrArray) result;
+  GwRadixTree *trees[4];
+  GStrv keys;
+  guint n_keys;
+  guint i, j, t;
+
+  const gchar* bounds[] = {
+    "",
+    "a",
+    "in",
+    "inter",
+    "interb",
+    "internationalis",
+    "internationalization",
+    "internationalizationz",
+    "internet",
+    "plan",
+    "planes",
+    "test1000",
+    "test1000a",
+    "test99",
+    "zzz",
+    NULL
+  };
+
+  tree = gw_radix_tree_new ();
+  compact = gw_radix_tree_new_compact (NULL);
+  set = gw_radix_tree_new_set ();
+  frozen = gw_radix_tree_new ();
+  result = g_ptr_array_new_with_free_func (g_free);
+
+  trees[0] = tree;
+  trees[1] = compact;
+  trees[2] = set;
+  trees[3] = frozen;
+
+  for (t = 0; t < G_N_ELEMENTS (trees); t++)
+    {
+      for (i = 0; i < 2000; i++)
+        {
+          g_autofree gchar *key = g_strdup_printf ("test%u", i);
+
+          gw_radix_tree_insert (trees[t], key, -1, NULL);
+        }
+
+      for (i = 0; bounds[i]; i++)
+        {
+          if (i % 3 != 0)
+            gw_radix_tree_insert (trees[t], bounds[i], -1, NULL);
+        }
+
+      gw_radix_tree_insert (trees[t], "internationalisation", -1, NULL);
+      gw_radix_tree_insert (trees[t], "internationalization", -1, NULL);
+    }
+
+  g_assert_true (gw_radix_tree_freeze (frozen));
+
+  keys = gw_radix_tree_get_keys (tree);
+  n_keys = g_strv_length (keys);
+
+  for (t = 0; t < G_N_ELEMENTS (trees); t++)
+    {
+      /* The whole tree, from the last key */
+      g_ptr_array_set_size (result, 0);
+      gw_radix_tree_iter_reverse (trees[t], fuzzy_search_cb, result);
+
+      g_assert_cmpuint (result->len, ==, n_keys);
+
+      for (j = 0; j < n_keys; j++)
+        g_assert_cmpstr (g_ptr_array_index (result, j), ==, keys[n_keys - j - 1]);
+
+      /* Keys up to a bound, which may or may not be in the tree */
+      for (i = 0; bounds[i]; i++)
+        {
+          guint n_expected = 0;
+
+          g_ptr_array_set_size (result, 0);
+          gw_radix_tree_iter_reverse_from (trees[t], bounds[i], -1, fuzzy_search_cb, result);
+
+          for (j = 0; j < n_keys; j++)
+            {
+              if (strcmp (keys[j], bounds[i]) <= 0)
+                n_expected++;
+            }
+
+          g_assert_cmpuint (result->len, ==, n_expected);
+
+          for (j = 0; j < result->len; j++)
+            g_assert_cmpstr (g_ptr_array_index (result, j), ==, keys[n_expected - j - 1]);
+        }
+
+      /* Stopping the scan */
+      g_ptr_array_set_size (result, 0);
+
+      g_assert_true (gw_radix_tree_iter_reverse_from (trees[t], "test4999", -1, fuzzy_search_stop_cb, result));
+      g_assert_cmpuint (result->len, ==, 1);
+      g_assert_cmpstr (g_ptr_array_index (result, 0), ==, "test499");
+    }
+
+  g_clear_pointer (&keys, g_strfreev);
+}
+
+/**************************************************************************************************/
+
+static void
+radix_tree_export_packed (void)
+{
+  g_autoptr (GwRadixTree) compact;
+  g_autoptr (GwRadixTree) empty;
+  g_autoptr (GwRadixTree) tree;
+  g_autoptr (GBytes) bytes;
+  g_autofree guint32 *offsets;
+  g_autofree gpointer *values;
+  GwRadixTree *trees[2];
+  const gchar *data;
+  GStrv keys;
+  gsize size;
+  guint n_keys;
+  guint i, t;
+
+  tree = gw_radix_tree_new ();
+  compact = gw_radix_tree_new_compact (NULL);
+  empty = gw_radix_tree_new ();
+
+  for (i = 0; i < 2000; i++)
+    {
+      g_autofree gchar *key = g_strdup_printf ("%s%u", compact_words[i % 4], i);
+
+      gw_radix_tree_insert (tree, key, -1, GUINT_TO_POINTER (i + 1));
+      gw_radix_tree_insert (compact, key, -1, GUINT_TO_POINTER (i + 1));
+    }
+
+  gw_radix_tree_insert (tree, "", -1, NULL);
+  gw_radix_tree_insert (compact, "", -1, NULL);
+
+  trees[0] = tree;
+  trees[1] = compact;
+
+  keys = gw_radix_tree_get_keys (tree);
+  n_keys = g_strv_length (keys);
+
+  for (t = 0; t < G_N_ELEMENTS (trees); t++)
+    {
+      bytes = gw_radix_tree_export_packed (trees[t], &offsets, &values);
+      data = g_bytes_get_data (bytes, &size);
+
+      g_assert_cmpuint (offsets[0], ==, 0);
+      g_assert_cmpuint (offsets[n_keys], ==, size);
+
+      for (i = 0; i < n_keys; i++)
+        {
+          g_assert_cmpuint (offsets[i + 1] - offsets[i] - 1, ==, strlen (keys[i]));
+          g_assert_cmpstr (data + offsets[i], ==, keys[i]);
+          g_assert_true (values[i] == gw_radix_tree_lookup (trees[t], keys[i], -1, NULL));
+        }
+
+      g_clear_pointer (&bytes, g_bytes_unref);
+      g_clear_pointer (&offsets, g_free);
+      g_clear_pointer (&values, g_free);
+    }
+
+  /* Frozen trees, and only the keys */
+  g_assert_true (gw_radix_tree_freeze (tree));
+
+  bytes = gw_radix_tree_export_packed (tree, NULL, NULL);
+  data = g_bytes_get_data (bytes, &size);
+
+  for (i = 0; i < n_keys; i++)
+    {
+      g_assert_cmpstr (data, ==, keys[i]);
+      data += strlen (data) + 1;
+    }
+
+  g_assert_true (data == (const gchar*) g_bytes_get_data (bytes, NULL) + size);
+  g_clear_pointer (&bytes, g_bytes_unref);
+
+  /* Empty trees */
+  bytes = gw_radix_tree_export_packed (empty, &offsets, &values);
+
+  g_assert_cmpuint (g_bytes_get_size (bytes), ==, 0);
+  g_assert_cmpuint (offsets[0], ==, 0);
+
+  g_clear_pointer (&keys, g_strfreev);
+}
+
+/**************************************************************************************************/
+
+static void
+radix_tree_remove_range (void)
+{
+  g_autoptr (GwRadixTree) compact;
+  g_autoptr (GwRadixTree) tree;
+  g_autoptr (GwRadixTree) copy;
+  gchar key[20] = { '\0', };
+  guint n_destroyed;
+  GStrv keys;
+  guint i;
+
+  n_destroyed = 0;
+  tree = gw_radix_tree_new_with_free_func (count_destroy_cb);
+
+  for (i = 0; i < 10000; i++)
+    {
+      g_snprintf (key, 20, "test%u", i);
+      gw_radix_tree_insert (tree, key, -1, &n_destroyed);
+    }
+
+  copy = gw_radix_tree_copy (tree);
+
+  /* test1, test10 to test19, and so on */
+  g_assert_cmpuint (gw_radix_tree_remove_prefix (tree, "test1", -1), ==, 1111);
+  g_assert_cmpuint (gw_radix_tree_remove_prefix (tree, "test1", -1), ==, 0);
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, 8889);
+
+  g_assert_false (gw_radix_tree_contains (tree, "test1", -1));
+  g_assert_false (gw_radix_tree_contains (tree, "test1999", -1));
+  g_assert_true (gw_radix_tree_contains (tree, "test2", -1));
+
+  /* Values are still alive in the copy */
+  g_assert_cmpuint (n_destroyed, ==, 0);
+  g_assert_cmpint (gw_radix_tree_get_size (copy), ==, 10000);
+  g_assert_true (gw_radix_tree_contains (copy, "test1999", -1));
+
+  g_clear_pointer (&copy, gw_radix_tree_unref);
+  g_assert_cmpuint (n_destroyed, ==, 1111);
+
+  /* The lower bound is included, and the upper bound isn't */
+  g_assert_cmpuint (gw_radix_tree_remove_range (tree, "test2", -1, "test3", -1), ==, 1111);
+  g_assert_true (gw_radix_tree_contains (tree, "test3", -1));
+
+  g_assert_cmpuint (gw_radix_tree_remove_range (tree, "test35", -1, "test36", -1), ==, 111);
+  g_assert_false (gw_radix_tree_contains (tree, "test3599", -1));
+  g_assert_true (gw_radix_tree_contains (tree, "test349", -1));
+  g_assert_true (gw_radix_tree_contains (tree, "test36", -1));
+
+  g_assert_cmpuint (gw_radix_tree_remove_range (tree, "test5", -1, "test4", -1), ==, 0);
+  g_assert_cmpuint (gw_radix_tree_remove_range (tree, NULL, -1, "test", -1), ==, 0);
+  g_assert_cmpuint (gw_radix_tree_remove_range (tree, "test9", -1, NULL, -1), ==, 1111);
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, 6556);
+  g_assert_cmpuint (n_destroyed, ==, 3444);
+
+  keys = gw_radix_tree_get_keys (tree);
+
+  for (i = 0; keys[i]; i++)
+    {
+      g_assert_false (g_str_has_prefix (keys[i], "test1"));
+      g_assert_false (g_str_has_prefix (keys[i], "test2"));
+      g_assert_false (g_str_has_prefix (keys[i], "test35"));
+      g_assert_false (g_str_has_prefix (keys[i], "test9"));
+    }
+
+  g_assert_cmpuint (i, ==, 6556);
+  g_clear_pointer (&keys, g_strfreev);
+
+  g_assert_cmpuint (gw_radix_tree_remove_prefix (tree, "", -1), ==, 6556);
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, 0);
+  g_assert_cmpuint (n_destroyed, ==, 10000);
+
+  gw_radix_tree_insert (tree, "test1", -1, NULL);
+  g_assert_true (gw_radix_tree_contains (tree, "test1", -1));
+
+  /* Compact trees keep their counts */
+  compact = gw_radix_tree_new_compact (NULL);
+  gw_radix_tree_enable_counts (compact);
+
+  for (i = 0; i < 2000; i++)
+    {
+      g_snprintf (key, 20, "%u", i);
+      gw_radix_tree_insert (compact, compact_words[i % 4], -1, NULL);
+      gw_radix_tree_insert (compact, key, -1, NULL);
+    }
+
+  g_assert_cmpint (gw_radix_tree_get_size (compact), ==, 2004);
+  g_assert_cmpuint (gw_radix_tree_remove_prefix (compact, "inconstitucional", -1), ==, 2);
+  g_assert_cmpuint (gw_radix_tree_remove_range (compact, "1", -1, "2", -1), ==, 1111);
+  g_assert_cmpuint (gw_radix_tree_count_prefix (compact, "", -1), ==, 891);
+  g_assert_cmpuint (gw_radix_tree_rank (compact, "paralelepipedo", -1), ==, 890);
+  g_assert_true (gw_radix_tree_contains (compact, "desenvolvimento", -1));
+  g_assert_false (gw_radix_tree_contains (compact, "inconstitucional", -1));
+  g_assert_false (gw_radix_tree_contains (compact, "1999", -1));
+}
+
+/**************************************************************************************************/
+
+static gpointer
+add_uint64_thread (gpointer data)
+{
+  GwRadixTree *tree = data;
+  gchar key[20] = { '\0', };
+  gint i;
+
+  for (i = 0; i < 4000; i++)
+    {
+      guint64 expected;
+
+      g_snprintf (key, 20, "word%d", i % 100);
+      gw_radix_tree_add_uint64 (tree, key, -1, 1);
+
+      /* And another one through a compare and exchange loop */
+      expected = gw_radix_tree_lookup_uint64 (tree, key, -1, NULL);
+
+      while (!gw_radix_tree_compare_exchange_uint64 (tree, key, -1, &expected, expected + 1))
+        ;
+    }
+
+  return NULL;
+}
+
+static gpointer
+add_remove_uint64_thread (gpointer data)
+{
+  GwRadixTree *tree = data;
+  gchar key[20] = { '\0', };
+  gint i;
+
+  for (i = 0; i < 4000; i++)
+    {
+      g_snprintf (key, 20, "key%d", i % 10);
+
+      if (i % 3 == 0)
+        gw_radix_tree_remove (tree, key, -1);
+      else
+        gw_radix_tree_add_uint64 (tree, key, -1, 1);
+    }
+
+  return NULL;
+}
+
+static void
+radix_tree_uint64_values (void)
+{
+  g_autoptr (GwRadixTree) concurrent;
+  g_autoptr (GwRadixTree) snapshot;
+  g_autoptr (GwRadixTree) tree;
+  GThread *threads[8];
+  gchar key[20] = { '\0', };
+  guint64 expected;
+  gboolean found;
+  gint i, t;
+
+  tree = gw_radix_tree_new ();
+  gw_radix_tree_enable_uint64_values (tree);
+
+  /* Numbers don't have to fit in a pointer */
+  g_assert_true (gw_radix_tree_insert_uint64 (tree, "max", -1, G_MAXUINT64));
+  g_assert_false (gw_radix_tree_insert_uint64 (tree, "max", -1, G_MAXUINT64 - 1));
+  g_assert_cmpuint (gw_radix_tree_lookup_uint64 (tree, "max", -1, &found), ==, G_MAXUINT64 - 1);
+  g_assert_true (found);
+
+  /* Missing keys count as zero */
+  g_assert_cmpuint (gw_radix_tree_lookup_uint64 (tree, "count", -1, &found), ==, 0);
+  g_assert_false (found);
+
+  g_assert_cmpuint (gw_radix_tree_add_uint64 (tree, "count", -1, 1), ==, 1);
+  g_assert_cmpuint (gw_radix_tree_add_uint64 (tree, "count", -1, G_GUINT64_CONSTANT (1) << 40), ==, (G_GUINT64_CONSTANT (1) << 40) + 1);
+  g_assert_cmpuint (gw_radix_tree_add_uint64 (tree, "count", -1, G_MAXUINT64), ==, G_GUINT64_CONSTANT (1) << 40);
+
+  expected = 1;
+  g_assert_false (gw_radix_tree_compare_exchange_uint64 (tree, "count", -1, &expected, 7));
+  g_assert_cmpuint (expected, ==, G_GUINT64_CONSTANT (1) << 40);
+  g_assert_true (gw_radix_tree_compare_exchange_uint64 (tree, "count", -1, &expected, 7));
+  g_assert_cmpuint (gw_radix_tree_lookup_uint64 (tree, "count", -1, NULL), ==, 7);
+
+  expected = 3;
+  g_assert_false (gw_radix_tree_compare_exchange_uint64 (tree, "other", -1, &expected, 7));
+  g_assert_cmpuint (expected, ==, 0);
+  g_assert_false (gw_radix_tree_contains (tree, "other", -1));
+  g_assert_true (gw_radix_tree_compare_exchange_uint64 (tree, "other", -1, &expected, 7));
+  g_assert_cmpuint (gw_radix_tree_lookup_uint64 (tree, "other", -1, NULL), ==, 7);
+
+  g_assert_cmpint (gw_radix_tree_get_size (tree), ==, 3);
+
+  /* Copies keep their own numbers */
+  snapshot = gw_radix_tree_copy (tree);
+
+  g_assert_cmpuint (gw_radix_tree_add_uint64 (tree, "max", -1, 1), ==, G_MAXUINT64);
+  g_assert_cmpuint (gw_radix_tree_add_uint64 (tree, "max", -1, 1), ==, 0);
+  g_assert_cmpuint (gw_radix_tree_lookup_uint64 (snapshot, "max", -1, NULL), ==, G_MAXUINT64 - 1);
+
+  g_clear_pointer (&snapshot, gw_radix_tree_unref);
+
+  /* Existing keys of any tree can be updated from several threads */
+  for (i = 0; i < 100; i++)
+    {
+      g_snprintf (key, 20, "word%d", i);
+      gw_radix_tree_insert_uint64 (tree, key, -1, 0);
+    }
+
+  concurrent = gw_radix_tree_new_concurrent (NULL);
+  gw_radix_tree_enable_uint64_values (concurrent);
+
+  for (t = 0; t < 2; t++)
+    {
+      GwRadixTree *target = t == 0 ? tree : concurrent;
+
+      for (i = 0; i < 4; i++)
+        threads[i] = g_thread_new ("add", add_uint64_thread, target);
+
+      for (i = 0; i < 4; i++)
+        g_thread_join (threads[i]);
+
+      for (i = 0; i < 100; i++)
+        {
+          g_snprintf (key, 20, "word%d", i);
+          g_assert_cmpuint (gw_radix_tree_lookup_uint64 (target, key, -1, NULL), ==, 4 * 40 * 2);
+        }
+    }
+
+  g_assert_cmpint (gw_radix_tree_get_size (concurrent), ==, 100);
+
+  /* Concurrent trees can also add and remove keys while they are updated */
+  for (i = 0; i < 8; i++)
+    threads[i] = g_thread_new ("add-remove", add_remove_uint64_thread, concurrent);
+
+  for (i = 0; i < 8; i++)
+    g_thread_join (threads[i]);
+
+  g_assert_cmpint (gw_radix_tree_get_size (concurrent), <=, 110);
+
+  for (i = 0; i < 10; i++)
+    {
+      g_snprintf (key, 20, "key%d", i);
+      gw_radix_tree_remove (concurrent, key, -1);
+      g_assert_cmpuint (gw_radix_tree_lookup_uint64 (concurrent, key, -1, &found), ==, 0);
+      g_assert_false (found);
+    }
+
+  g_assert_cmpint (gw_radix_tree_get_size (concurrent), ==, 100);
+
+  /* Keys shared with a copy must be updated once before using threads */
+  snapshot = gw_radix_tree_copy (tree);
+
+  for (i = 0; i < 100; i++)
+    {
+      g_snprintf (key, 20, "word%d", i);
+      g_assert_cmpuint (gw_radix_tree_add_uint64 (tree, key, -1, 0), ==, 4 * 40 * 2);
+    }
+
+  for (i = 0; i < 4; i++)
+    threads[i] = g_thread_new ("add", add_uint64_thread, tree);
+
+  for (i = 0; i < 4; i++)
+    g_thread_join (threads[i]);
+
+  for (i = 0; i < 100; i++)
+    {
+      g_snprintf (key, 20, "word%d", i);
+      g_assert_cmpuint (gw_radix_tree_lookup_uint64 (tree, key, -1, NULL), ==, 2 * 4 * 40 * 2);
+      g_assert_cmpuint (gw_radix_tree_lookup_uint64 (snapshot, key, -1, NULL), ==, 4 * 40 * 2);
+    }
+
+  g_clear_pointer (&snapshot, gw_radix_tree_unref);
+
+  /* Frozen trees can still be read */
+  g_assert_true (gw_radix_tree_freeze (tree));
+  g_assert_cmpuint (gw_radix_tree_lookup_uint64 (tree, "count", -1, NULL), ==, 7);
+  g_assert_cmpuint (gw_radix_tree_lookup_uint64 (tree, "word99", -1, NULL), ==, 2 * 4 * 40 * 2);
+}
+
+/**************************************************************************************************/
+
 gint
 main (gint   argc,
       gchar *argv[])
@@ -254,6 +2678,30 @@ main (gint   argc,
   g_test_add_func ("/radix-tree/utf8", radix_tree_utf8);
   g_test_add_func ("/radix-tree/get_keys", radix_tree_get_keys);
   g_test_add_func ("/radix-tree/get_values", radix_tree_get_values);
+  g_test_add_func ("/radix-tree/prefix", radix_tree_prefix);
+  g_test_add_func ("/radix-tree/cursor", radix_tree_cursor);
+  g_test_add_func ("/radix-tree/arena", radix_tree_arena);
+  g_test_add_func ("/radix-tree/copy", radix_tree_copy);
+  g_test_add_func ("/radix-tree/concurrent", radix_tree_concurrent);
+  g_test_add_func ("/radix-tree/from_sorted", radix_tree_from_sorted);
+  g_test_add_func ("/radix-tree/from_keys", radix_tree_from_keys);
+  g_test_add_func ("/radix-tree/lookup_many", radix_tree_lookup_many);
+  g_test_add_func ("/radix-tree/fuzzy_search", radix_tree_fuzzy_search);
+  g_test_add_func ("/radix-tree/stats", radix_tree_stats);
+  g_test_add_func ("/radix-tree/node_growth", radix_tree_node_growth);
+  g_test_add_func ("/radix-tree/upsert", radix_tree_upsert);
+  g_test_add_func ("/radix-tree/longest_prefix", radix_tree_longest_prefix);
+  g_test_add_func ("/radix-tree/set_operations", radix_tree_set_operations);
+  g_test_add_func ("/radix-tree/foreach_parallel", radix_tree_foreach_parallel);
+  g_test_add_func ("/radix-tree/set", radix_tree_set);
+  g_test_add_func ("/radix-tree/compact", radix_tree_compact);
+  g_test_add_func ("/radix-tree/freeze", radix_tree_freeze);
+  g_test_add_func ("/radix-tree/counts", radix_tree_counts);
+  g_test_add_func ("/radix-tree/match_pattern", radix_tree_match_pattern);
+  g_test_add_func ("/radix-tree/iter_reverse", radix_tree_iter_reverse);
+  g_test_add_func ("/radix-tree/export_packed", radix_tree_export_packed);
+  g_test_add_func ("/radix-tree/remove_range", radix_tree_remove_range);
+  g_test_add_func ("/radix-tree/uint64_values", radix_tree_uint64_values);
 
   return g_test_run ();
 }